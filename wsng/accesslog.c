@@ -0,0 +1,354 @@
+/*
+ * accesslog.c
+ *
+ *  The access log. A logger process is forked at startup, before anything
+ *  else, and keeps the read end of a pipe; every serving process inherits
+ *  the write end (close-on-exec, so cgi programs do not keep it open).
+ *
+ *  A serving process formats the line of each request into a buffer of its
+ *  own, and the buffer is written into the pipe when the process gets to it:
+ *  the event loop once per round of events, the fork mode after every
+ *  response. The pipe is non-blocking, and the buffer goes out in pieces of
+ *  at most PIPE_BUF bytes ending at a line end, which the kernel writes
+ *  whole or not at all, so the lines of different processes never mix; if
+ *  the pipe is full, the rest waits in the buffer for the next try. Once
+ *  the buffer is more than half full the logger is not keeping up, and only
+ *  every n-th request is logged ("log_overload n"; 0, the default, logs
+ *  none) until it drains. A full buffer drops lines; the drops are counted
+ *  for /server-status.
+ *
+ *  The logger reads as much as it can get and writes to the file when it
+ *  has a batch together or the pipe has been quiet for a moment. On SIGHUP
+ *  it reopens the file, so a log moved away for rotation is replaced with a
+ *  new one. It exits, after writing out everything, when the last writer
+ *  has closed the pipe.
+ */
+
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "accesslog.h"
+#include "stats.h"
+
+#define	LOG_BUFFER		65536		// a serving process's unsent lines
+#define	LOG_BATCH		(256 * 1024)	// the logger's writes
+#define	LOG_PIPE_SIZE	(1024 * 1024)
+#define	LOG_QUIET_MS	500			// write out a partial batch after this
+#define	LOG_LINE		(REQUEST_LINE_LEN + 2 * COND_LEN + 256)
+#define	LOG_FILE_MODE	0644
+#define	LOG_TIME_LEN	32
+
+static int log_fd = -1;			// the write end of the pipe, -1 if no log
+static pid_t logger = 0;
+static char buffer [LOG_BUFFER];
+static int buffered = 0;
+static enum log_format format = LOG_COMBINED;
+static int overload_sample = 0;	// log every n-th request when backed up
+static long skipped = 0;
+static volatile sig_atomic_t reopen = 0;
+
+/**
+ * open_log: opens the log file for appending
+ * returns: the descriptor, -1 on failure
+ */
+static int open_log (char *path) {
+	int fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+					LOG_FILE_MODE);
+	if (fd == -1)
+		perror (path);
+	return (fd);
+}
+
+static void handle_reopen (int sig) {
+	reopen = 1;
+}
+
+/**
+ * write_batch: writes the batch to the log file, all of it
+ */
+static void write_batch (int fd, char *batch, int *len) {
+	char *cp = batch;
+
+	while (*len > 0) {
+		ssize_t n = write (fd, cp, *len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror ("access log");
+			break; // the batch is lost; the next may fare better
+		}
+		cp += n;
+		*len -= n;
+	}
+	*len = 0;
+}
+
+/**
+ * run_logger: the logger process. Reads the pipe until every writer is
+ * gone, writing whenever a batch is full or the pipe goes quiet.
+ */
+static void run_logger (int in, int out, char *path) {
+	static char batch [LOG_BATCH];
+	int len = 0;
+	struct sigaction sa;
+
+	sigemptyset (&sa.sa_mask);
+	sa.sa_handler = &handle_reopen;
+	sa.sa_flags = 0; // interrupt poll to reopen right away
+	sigaction (SIGHUP, &sa, 0);
+	signal (SIGINT, SIG_IGN); // the log is written out to the end;
+	signal (SIGTERM, SIG_IGN); // the pipe closing is what stops us
+	signal (SIGCHLD, SIG_DFL);
+
+	for (;;) {
+		struct pollfd pfd = {in, POLLIN, 0};
+		int ready = poll (&pfd, 1, len > 0 ? LOG_QUIET_MS : -1);
+
+		if (reopen) {
+			reopen = 0;
+			write_batch (out, batch, &len);
+			int fd = open_log (path);
+			if (fd != -1) {
+				close (out);
+				out = fd;
+			}
+		}
+		if (ready == 0) { // quiet
+			write_batch (out, batch, &len);
+			continue;
+		}
+		if (ready == -1)
+			continue; // interrupted
+
+		ssize_t n = read (in, batch + len, LOG_BATCH - len);
+		if (n == 0) { // no writers left
+			write_batch (out, batch, &len);
+			exit (0);
+		}
+		if (n > 0 && (len += n) == LOG_BATCH)
+			write_batch (out, batch, &len);
+	}
+}
+
+/**
+ * access_log_start: opens the configured log file and starts the logger
+ * process writing to it; nothing is done if there is no log configured
+ * returns: 0 on success, -1 if the log cannot be had
+ */
+int access_log_start (struct server *config) {
+	int fds [2];
+
+	if (config->access_log [0] == '\0')
+		return (0);
+	int out = open_log (config->access_log);
+	if (out == -1)
+		return (-1);
+	if (pipe2 (fds, O_CLOEXEC) == -1) {
+		perror ("pipe");
+		close (out);
+		return (-1);
+	}
+	fcntl (fds [1], F_SETPIPE_SZ, LOG_PIPE_SIZE); // as far as allowed
+
+	switch (logger = fork ()) {
+		case -1:
+			perror ("fork");
+			close (fds [0]);
+			close (fds [1]);
+			close (out);
+			return (-1);
+
+		case 0:
+			close (fds [1]);
+			if (log_fd != -1) // the pipe of a logger this one replaces
+				close (log_fd);
+			if (config->socket != -1)
+				close (config->socket);
+			if (config->tls_socket != -1)
+				close (config->tls_socket);
+			run_logger (fds [0], out, config->access_log);
+		break;
+	}
+	close (fds [0]);
+	close (out);
+	fcntl (fds [1], F_SETFL, O_NONBLOCK);
+	log_fd = fds [1];
+	return (0);
+}
+
+/**
+ * access_log_restart: a reload's new access log file (or none, for ""):
+ * a logger is started for it, and the pipe of the one before is let go
+ * of, so that it exits once the serving processes of the configuration
+ * before have done the same
+ * returns: 0 on success, -1 if the new log cannot be had (the logger
+ * before is kept)
+ */
+int access_log_restart (struct server *config) {
+	int old_fd = log_fd;
+	pid_t old_logger = logger;
+
+	access_log_flush (); // the lines of the configuration before
+	if (config->access_log [0] == '\0')
+		log_fd = -1;
+	else if (access_log_start (config) == -1) {
+		logger = old_logger;
+		return (-1);
+	}
+	if (old_fd != -1)
+		close (old_fd);
+	return (0);
+}
+
+/**
+ * access_log_setup: the configured format, and what to do when the logger
+ * falls behind
+ */
+void access_log_setup (enum log_format log_format, int sample) {
+	format = log_format;
+	overload_sample = sample;
+}
+
+/**
+ * log_time: the time in the log's format, redone only when it changes
+ */
+static char *log_time (void) {
+	static time_t last = 0;
+	static char formatted [LOG_TIME_LEN];
+	time_t now = time (0);
+
+	if (now != last) {
+		strftime (formatted, LOG_TIME_LEN, "%d/%b/%Y:%H:%M:%S %z",
+					localtime (&now));
+		last = now;
+	}
+	return (formatted);
+}
+
+/**
+ * escape: copies the value for a quoted field, with quotes, backslashes
+ * and control characters escaped
+ * returns: the end of the copy
+ */
+static char *escape (char *to, char *value, char *end) {
+	for (; *value && to < end - 4; value ++) {
+		unsigned char c = *value;
+		if (c == '"' || c == '\\') {
+			*to ++ = '\\';
+			*to ++ = c;
+		} else if (c < ' ' || c == 0x7f)
+			to += sprintf (to, "\\x%02x", c);
+		else
+			*to ++ = c;
+	}
+	*to = '\0';
+	return (to);
+}
+
+/**
+ * access_log: adds the line of the request to this process's buffer
+ */
+void access_log (struct request *ctx) {
+	char line [LOG_LINE], request [REQUEST_LINE_LEN], host [INET6_ADDRSTRLEN];
+	char referer [COND_LEN], agent [COND_LEN], length [24] = "-";
+
+	if (log_fd == -1)
+		return;
+	if (buffered > LOG_BUFFER / 2 && // the logger is behind
+			(overload_sample == 0 || ++ skipped % overload_sample != 0)) {
+		stats_count (STAT_LOG_DROPPED, 1);
+		return;
+	}
+
+	if (client_address (ctx, host) == 0)
+		strcpy (host, "-");
+	if (ctx->sent_length > 0)
+		snprintf (length, sizeof (length), "%lld",
+					(long long) ctx->sent_length);
+	escape (request, ctx->request_line, request + sizeof (request));
+
+	int len;
+	if (format == LOG_COMMON)
+		len = snprintf (line, LOG_LINE, "%s - - [%s] \"%s\" %d %s\n",
+					host, log_time (), request, ctx->status, length);
+	else {
+		escape (referer, ctx->referer [0] ? ctx->referer : "-",
+				referer + sizeof (referer));
+		escape (agent, ctx->user_agent [0] ? ctx->user_agent : "-",
+				agent + sizeof (agent));
+		len = snprintf (line, LOG_LINE,
+					"%s - - [%s] \"%s\" %d %s \"%s\" \"%s\"\n", host,
+					log_time (), request, ctx->status, length, referer, agent);
+	}
+	if (len >= LOG_LINE) { // cut short, but still a line
+		len = LOG_LINE - 1;
+		line [len - 1] = '\n';
+	}
+	if (buffered + len > LOG_BUFFER) {
+		stats_count (STAT_LOG_DROPPED, 1);
+		return;
+	}
+	memcpy (buffer + buffered, line, len);
+	buffered += len;
+}
+
+/**
+ * access_log_flush: passes the buffered lines to the logger, as many as
+ * the pipe takes, in whole lines of at most PIPE_BUF bytes a write
+ */
+void access_log_flush (void) {
+	int sent = 0;
+
+	while (log_fd != -1 && sent < buffered) {
+		int len = buffered - sent;
+		if (len > PIPE_BUF) { // back up to the last line end that fits
+			len = PIPE_BUF;
+			while (len > 0 && buffer [sent + len - 1] != '\n')
+				len --;
+		}
+		ssize_t n = write (log_fd, buffer + sent, len);
+		if (n <= 0)
+			break; // full (or the logger is gone): try again later
+		sent += n;
+	}
+	memmove (buffer, buffer + sent, buffered - sent);
+	buffered -= sent;
+}
+
+/**
+ * access_log_child: forgets the lines inherited from the parent, which
+ * will send them itself
+ */
+void access_log_child (void) {
+	buffered = 0;
+}
+
+/**
+ * access_log_rotate: has the logger reopen the file
+ */
+void access_log_rotate (void) {
+	if (logger > 0)
+		kill (logger, SIGHUP);
+}
+
+/**
+ * access_log_stop: lets go of the pipe, so that the logger exits once the
+ * serving processes have done the same
+ */
+void access_log_stop (void) {
+	access_log_flush ();
+	if (log_fd != -1)
+		close (log_fd);
+	log_fd = -1;
+}
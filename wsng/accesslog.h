@@ -0,0 +1,30 @@
+/*
+ * accesslog.h
+ *
+ *  The access log, in the Common or Combined Log Format. Serving processes
+ *  never write the file themselves: they collect their lines in a buffer of
+ *  their own and pass them on through a non-blocking pipe to a logger
+ *  process, which writes them out in large batches.
+ */
+
+#ifndef ACCESSLOG_H_
+#define ACCESSLOG_H_
+
+#include "wsng.h"
+#include "process.h"
+
+enum log_format {
+	LOG_COMBINED,
+	LOG_COMMON
+};
+
+int access_log_start (struct server *config);
+int access_log_restart (struct server *config);
+void access_log_setup (enum log_format format, int overload_sample);
+void access_log (struct request *ctx);
+void access_log_flush (void);
+void access_log_child (void);
+void access_log_rotate (void);
+void access_log_stop (void);
+
+#endif /* ACCESSLOG_H_ */
@@ -0,0 +1,192 @@
+/*
+ * admission.c
+ *
+ *  The connection limits of a serving process. The process that accepts
+ *  the connections does the counting: the event loop charges a connection
+ *  when it accepts it and releases it when it closes it; the fork mode
+ *  server charges it before forking the child that serves it, and releases
+ *  it when the child is reaped, so that a child that dies does not leave
+ *  its connection counted. In the worker mode every worker has limits of
+ *  its own.
+ *
+ *  The connections of an address are counted in a table of counters
+ *  indexed by a hash of the address, so addresses that collide share a
+ *  limit; the table is small and needs no cleaning up.
+ *
+ *  A connection that is over a limit gets the 503 written into the socket
+ *  buffer as it is accepted, without waiting for the request, and is
+ *  closed. So does one that cannot be accepted for want of a descriptor:
+ *  a spare one is kept open for just that, since a connection left in the
+ *  listening queue would keep the socket readable and the loop spinning.
+ */
+
+#define _GNU_SOURCE // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+#include "stats.h"
+
+#define	ADDRESS_BITS	12
+#define	ADDRESS_SLOTS	(1 << ADDRESS_BITS)
+#define	DRAIN_LEN		4096
+
+struct child {
+	pid_t pid;		/* 0 if the entry is free */
+	int slot;		/* of the address it is charged to */
+};
+
+static int max_connections = 0;
+static int max_per_address = 0;	// 0: no limit
+static int open_connections = 0;
+static int per_address [ADDRESS_SLOTS];
+static struct child *children = 0;	// fork mode: one per open connection
+static int spare_fd = -1;
+static char busy [256];			// the canned response
+static int busy_len;
+
+/**
+ * admission_init: sets the limits of this serving process up from the
+ * configuration
+ * returns: 0 on success, -1 if out of memory
+ */
+int admission_init (struct server *config) {
+	max_connections = config->max_connections;
+	max_per_address = config->max_connections_per_ip;
+	open_connections = 0;
+	memset (per_address, 0, sizeof (per_address));
+	free (children);
+	children = calloc (max_connections, sizeof (struct child));
+	if (spare_fd == -1)
+		spare_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+	busy_len = snprintf (busy, sizeof (busy),
+			"HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\n"
+			"Connection: close\r\nContent-Length: 17\r\n"
+			"Content-type: text/plain\r\n\r\nServer too busy\r\n",
+			config->retry_after);
+	return (children != 0 ? 0 : -1);
+}
+
+/**
+ * shed: answers the freshly accepted connection with the 503 and closes
+ * it; what has already arrived of the request is read away first, or the
+ * close would reset the connection and the client might lose the answer
+ */
+static void shed (int fd) {
+	char drain [DRAIN_LEN];
+
+	send (fd, busy, busy_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	while (recv (fd, drain, DRAIN_LEN, MSG_DONTWAIT) > 0)
+		;
+	close (fd);
+	stats_count (STAT_SHED, 1);
+	stats_status (503);
+}
+
+/**
+ * admission_accept: accepts a connection (accept4 with the given flags);
+ * when the process is out of descriptors, the spare one is given up to
+ * accept the connection and shed it
+ * returns: the new socket, or -1 with errno set: ECONNABORTED if a
+ * connection was shed and the caller should go on accepting
+ */
+int admission_accept (int listen_fd, int flags) {
+	int fd = accept4 (listen_fd, NULL, NULL, flags);
+
+	if (fd == -1 && (errno == EMFILE || errno == ENFILE) && spare_fd != -1) {
+		close (spare_fd);
+		fd = accept (listen_fd, NULL, NULL);
+		int saved = fd != -1 ? ECONNABORTED : errno;
+		if (fd != -1)
+			shed (fd);
+		spare_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+		errno = saved;
+		return (-1);
+	}
+	return (fd);
+}
+
+/**
+ * address_slot: the counter of the connection's peer address
+ */
+static int address_slot (int fd) {
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof (peer);
+	unsigned int hash = 0;
+
+	if (max_per_address == 0 ||
+			getpeername (fd, (struct sockaddr *) &peer, &len) == -1)
+		return (0);
+	if (peer.ss_family == AF_INET)
+		hash = ((struct sockaddr_in *) &peer)->sin_addr.s_addr;
+	else if (peer.ss_family == AF_INET6) {
+		unsigned int *words =
+				(unsigned int *) &((struct sockaddr_in6 *) &peer)->sin6_addr;
+		hash = words [0] ^ words [1] ^ words [2] ^ words [3];
+	}
+	return ((hash * 2654435761u) >> (32 - ADDRESS_BITS));
+}
+
+/**
+ * admission_admit: charges an accepted connection to the limits, or sheds
+ * it if it is over one
+ * returns: the slot to release it from later, or -1 if it was shed (the
+ * socket is closed then)
+ */
+int admission_admit (int fd) {
+	int slot = address_slot (fd);
+
+	if (open_connections >= max_connections ||
+			(max_per_address > 0 && per_address [slot] >= max_per_address)) {
+		shed (fd);
+		return (-1);
+	}
+	open_connections ++;
+	per_address [slot] ++;
+	return (slot);
+}
+
+void admission_release (int slot) {
+	open_connections --;
+	per_address [slot] --;
+}
+
+/**
+ * admission_track: the fork mode's connection of the slot is served by
+ * the child pid, or by nobody if the fork failed (pid -1); it is released
+ * when the child is reaped
+ */
+void admission_track (pid_t pid, int slot) {
+	int idx;
+
+	for (idx = 0; pid > 0 && idx < max_connections; idx ++)
+		if (children [idx].pid == 0) {
+			children [idx].pid = pid;
+			children [idx].slot = slot;
+			return;
+		}
+	admission_release (slot);
+}
+
+/**
+ * admission_reaped: releases the connection of a child that is gone; run
+ * from the SIGCHLD handler, which the fork mode server keeps blocked while
+ * it counts
+ */
+void admission_reaped (pid_t pid) {
+	int idx;
+
+	for (idx = 0; children != 0 && idx < max_connections; idx ++)
+		if (children [idx].pid == pid) {
+			children [idx].pid = 0;
+			admission_release (children [idx].slot);
+			return;
+		}
+}
@@ -0,0 +1,24 @@
+/*
+ * admission.h
+ *
+ *  Limits on the connections a serving process takes on: how many it
+ *  keeps open at once, and how many of them may come from one address.
+ *  A connection over a limit is shed right where it is accepted, with a
+ *  canned 503 and no process forked or request read for it.
+ */
+
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+#include <sys/types.h>
+
+#include "wsng.h"
+
+int admission_init (struct server *config);
+int admission_accept (int listen_fd, int flags);
+int admission_admit (int fd);
+void admission_release (int slot);
+void admission_track (pid_t pid, int slot);
+void admission_reaped (pid_t pid);
+
+#endif /* ADMISSION_H_ */
@@ -0,0 +1,4 @@
+#!/bin/sh
+echo "Content-type: text/plain"
+echo
+echo "hello from $REQUEST_METHOD $QUERY_STRING"
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# run.sh: runs wsbench against wsng in each serving mode in turn, with the
+# fixture tree in bench/docroot, and prints one line per mode.
+#
+# Settings come from the environment:
+#	BENCH_MODES		the modes to compare (fork, prefork, event, prefork-event)
+#	BENCH_PORT		port for the server under test (18090)
+#	BENCH_CONNECTIONS	concurrent connections (16)
+#	BENCH_SECONDS	duration of each run (5)
+#	BENCH_WORKERS	worker processes for the pre-forked modes (4)
+#	BENCH_KEEPALIVE	"-k" for persistent connections, empty for one per request
+#	BENCH_MIX		the request mix, see wsbench.c
+#	BENCH_CONFIG	more config lines for the server (say, "file_pack on")
+#
+# Run it from the directory holding wsng and wsbench ("make bench" does).
+
+MODES=${BENCH_MODES:-"fork prefork event"}
+PORT=${BENCH_PORT:-18090}
+CONNECTIONS=${BENCH_CONNECTIONS:-16}
+SECONDS_EACH=${BENCH_SECONDS:-5}
+WORKERS=${BENCH_WORKERS:-4}
+KEEPALIVE=${BENCH_KEEPALIVE--k}
+ROOT=$(cd "$(dirname "$0")/docroot" && pwd)
+CONF=$(mktemp /tmp/wsbench.XXXXXX)
+trap 'rm -f $CONF' EXIT
+
+printf "%-14s %10s %8s %8s %8s %7s\n" mode req/s p50us p99us p999us errors
+for mode in $MODES; do
+	case $mode in
+	fork)			settings="mode fork" ;;
+	event)			settings="mode event" ;;
+	prefork)		settings="mode fork
+workers $WORKERS" ;;
+	prefork-event)	settings="mode event
+workers $WORKERS" ;;
+	*)	echo "unknown mode $mode" >&2; continue ;;
+	esac
+	cat > $CONF <<EOF
+port $PORT
+server_root $ROOT
+type DEFAULT text/plain
+$settings
+${BENCH_CONFIG:-}
+EOF
+	./wsng -c $CONF > /dev/null 2>&1 &
+	server=$!
+	sleep 1 # time to bind and, pre-forked, to start the workers
+
+	result=$(./wsbench -p $PORT -c $CONNECTIONS -d $SECONDS_EACH -t \
+				$KEEPALIVE ${BENCH_MIX:+-m "$BENCH_MIX"})
+	kill $server
+	wait $server 2> /dev/null
+	[ -n "$result" ] || result="- - - - failed"
+	set -- $result
+	printf "%-14s %10s %8s %8s %8s %7s\n" $mode $1 $2 $3 $4 $5
+done
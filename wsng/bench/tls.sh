@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# tls.sh: compares what HTTPS costs against plain HTTP, in each serving mode
+# in turn: full handshakes and resumed ones per second (openssl s_time, each
+# connection fetching one page), and the rate of one large transfer (curl)
+# over either port. The certificate is a throwaway self-signed one.
+#
+# Settings come from the environment:
+#	BENCH_MODES		the modes to compare (fork, event)
+#	BENCH_PORT		port for plain HTTP (18090); HTTPS is on the next one
+#	BENCH_SECONDS	duration of each handshake run (5)
+#	BENCH_SIZE		megabytes of the large transfer (64)
+#	BENCH_CONFIG	more config lines for the server (say, "tls_tickets off")
+#
+# Run it from the directory holding wsng ("make bench-tls" does).
+
+MODES=${BENCH_MODES:-"fork event"}
+PORT=${BENCH_PORT:-18090}
+TLS_PORT=$((PORT + 1))
+SECONDS_EACH=${BENCH_SECONDS:-5}
+SIZE=${BENCH_SIZE:-64}
+ROOT=$(mktemp -d /tmp/wsbench.XXXXXX)
+CONF=$ROOT/wsng.conf
+trap 'rm -rf $ROOT' EXIT
+
+cp "$(dirname "$0")"/docroot/*.html $ROOT/
+dd if=/dev/urandom of=$ROOT/large.bin bs=1048576 count=$SIZE 2> /dev/null
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	-keyout $ROOT/key.pem -out $ROOT/cert.pem 2> /dev/null || exit 1
+
+# handshakes: connections per second (real time) of an s_time run
+handshakes() {
+	openssl s_time -connect 127.0.0.1:$TLS_PORT -www /page.html \
+			-time $SECONDS_EACH $1 2> /dev/null |
+		awk '/real seconds/ { c = $1 } END { printf "%d", c / '$SECONDS_EACH' }'
+}
+
+# transfer: megabytes per second of fetching the large file
+transfer() {
+	curl -sk -o /dev/null -w '%{speed_download}' $1/large.bin |
+		awk '{ printf "%.0f", $1 / 1048576 }'
+}
+
+printf "%-8s %10s %10s %10s %10s\n" mode new/s resumed/s http-MB/s https-MB/s
+for mode in $MODES; do
+	cat > $CONF <<EOF
+port $PORT
+tls_port $TLS_PORT
+tls_certificate $ROOT/cert.pem
+tls_key $ROOT/key.pem
+server_root $ROOT
+type DEFAULT text/plain
+mode $mode
+${BENCH_CONFIG:-}
+EOF
+	./wsng -c $CONF > /dev/null 2>&1 &
+	server=$!
+	sleep 1
+
+	new=$(handshakes -new)
+	resumed=$(handshakes -reuse)
+	plain=$(transfer http://127.0.0.1:$PORT)
+	secure=$(transfer https://127.0.0.1:$TLS_PORT)
+	kill $server
+	wait $server 2> /dev/null
+	printf "%-8s %10s %10s %10s %10s\n" $mode ${new:--} ${resumed:--} \
+		${plain:--} ${secure:--}
+done
@@ -0,0 +1,345 @@
+/*
+ * cache.c
+ *
+ *  A bounded cache of what the handlers need to know about the files they
+ *  serve: the stat result (or the errno of a failed stat), the rendered
+ *  header lines, the open file for sendfile and, for files under a size
+ *  threshold, the whole body; for a directory, its listing. Entries live
+ *  in a fixed array allocated once; lookups go through a chained hash
+ *  table, and the least recently used entry is recycled when the array is
+ *  full.
+ *
+ *  Entries are invalidated through inotify watches on the directories that
+ *  hold them. A directory's listing survives changes to its entries, which
+ *  are passed on to it one by one. Where a watch cannot be had, an entry is
+ *  re-checked with stat once it is older than the revalidation interval.
+ *
+ *  The cache only makes sense in a long-lived process serving many
+ *  requests, so only the event loop turns it on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+
+#include "cache.h"
+#include "stats.h"
+
+#define	WATCH_EVENTS	(IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | \
+						 IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+						 IN_DELETE_SELF | IN_MOVE_SELF)
+
+static struct cache_entry *entries = 0;	// all of them, allocated once
+static int max_entries = 0;				// 0: the cache is off
+static int num_used = 0;
+static struct cache_entry **buckets = 0;
+static unsigned int bucket_mask = 0;
+static struct cache_entry *lru_head = 0, *lru_tail = 0;
+static off_t max_body_size = 0;
+static int revalidate_secs = 0;
+static int inotify_fd = -1;
+static long hits = 0, misses = 0;
+
+/**
+ * hash_path: FNV-1a over the path
+ */
+static unsigned int hash_path (char *path) {
+	unsigned int h = 2166136261u;
+	while (*path)
+		h = (h ^ (unsigned char) *path ++) * 16777619u;
+	return (h);
+}
+
+static void lru_remove (struct cache_entry *e) {
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+	e->prev = e->next = 0;
+}
+
+static void lru_push (struct cache_entry *e) {
+	e->next = lru_head;
+	e->prev = 0;
+	if (lru_head)
+		lru_head->prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+}
+
+static void hash_remove (struct cache_entry *e) {
+	struct cache_entry **link = &buckets [e->hash & bucket_mask];
+	while (*link != e)
+		link = &(*link)->hnext;
+	*link = e->hnext;
+}
+
+/**
+ * drop_contents: forgets everything derived from the file's contents
+ */
+static void drop_contents (struct cache_entry *e) {
+	if (e->fd != -1)
+		close (e->fd);
+	e->fd = -1;
+	free (e->body);
+	e->body = 0;
+	e->header [0] = 0;
+}
+
+static void drop_listing (struct cache_entry *e) {
+	listing_free (e->listing);
+	e->listing = 0;
+}
+
+/**
+ * watch: puts an inotify watch on what decides the entry's validity: a
+ * directory itself, or the directory holding anything else
+ * returns: the watch descriptor, or -1 if there is none
+ */
+static int watch (struct cache_entry *e) {
+	if (inotify_fd == -1)
+		return (-1);
+	if (e->err == 0 && S_ISDIR (e->info.st_mode))
+		return (inotify_add_watch (inotify_fd, e->path, WATCH_EVENTS));
+
+	char *slash = strrchr (e->path, '/');
+	if (slash == 0)
+		return (inotify_add_watch (inotify_fd, ".", WATCH_EVENTS));
+	*slash = 0;
+	int wd = inotify_add_watch (inotify_fd, e->path, WATCH_EVENTS);
+	*slash = '/';
+	return (wd);
+}
+
+/**
+ * fill: (re)reads the entry's metadata from the file system
+ */
+static void fill (struct cache_entry *e) {
+	drop_contents (e);
+	e->err = stat (e->path, &e->info) == -1 ? errno : 0;
+	if (e->err || !S_ISDIR (e->info.st_mode))
+		drop_listing (e);
+	e->checked = time (0);
+	e->wd = watch (e);
+}
+
+/**
+ * revalidate: for entries without a watch, re-stats the file and drops the
+ * cached contents if it is not the same file any more. A directory whose
+ * entries cannot be watched has all its rows re-rendered.
+ */
+static void revalidate (struct cache_entry *e) {
+	struct stat info;
+	int err = stat (e->path, &info) == -1 ? errno : 0;
+
+	if (err != e->err || (err == 0 &&
+			(info.st_ino != e->info.st_ino ||
+			 info.st_size != e->info.st_size ||
+			 info.st_mtim.tv_sec != e->info.st_mtim.tv_sec ||
+			 info.st_mtim.tv_nsec != e->info.st_mtim.tv_nsec))) {
+		drop_contents (e);
+		drop_listing (e);
+		e->err = err;
+		e->info = info;
+	} else if (e->listing != 0) {
+		listing_stale (e->listing);
+	}
+	e->checked = time (0);
+}
+
+/**
+ * cache_init: allocates a cache of the given number of entries, keeping
+ * bodies of files up to max_body bytes in memory. Entries that cannot be
+ * watched are re-checked after revalidate seconds. Since every cached
+ * file may be held open, the open file limit is raised as far as allowed.
+ * returns: 0 on success (or if entries is 0, which turns caching off),
+ * -1 if the memory could not be had
+ */
+int cache_init (int entries_wanted, off_t max_body, int revalidate) {
+	unsigned int size = 1;
+
+	if (entries_wanted <= 0)
+		return (0);
+	while (size < 2 * (unsigned int) entries_wanted)
+		size <<= 1;
+
+	entries = calloc (entries_wanted, sizeof (struct cache_entry));
+	buckets = calloc (size, sizeof (struct cache_entry *));
+	if (entries == 0 || buckets == 0) {
+		free (entries);
+		free (buckets);
+		return (-1);
+	}
+	bucket_mask = size - 1;
+	max_entries = entries_wanted;
+	max_body_size = max_body;
+	revalidate_secs = revalidate;
+	inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+
+	struct rlimit files;
+	if (getrlimit (RLIMIT_NOFILE, &files) == 0) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &files);
+	}
+	return (0);
+}
+
+/**
+ * cache_lookup: finds (or creates) the entry for the path, making sure its
+ * metadata is current.
+ * returns: the entry, or NULL if caching is off (or the path cannot be
+ * stored), in which case the caller goes to the file system itself
+ */
+struct cache_entry *cache_lookup (char *path) {
+	if (max_entries == 0)
+		return (0);
+
+	unsigned int h = hash_path (path);
+	struct cache_entry *e;
+	for (e = buckets [h & bucket_mask]; e != 0; e = e->hnext)
+		if (e->hash == h && !strcmp (e->path, path))
+			break;
+
+	if (e != 0) {
+		hits ++;
+		stats_count (STAT_CACHE_HITS, 1);
+		if (e->checked == 0) // invalidated by a watch
+			fill (e);
+		else if (e->wd == -1 && time (0) - e->checked >= revalidate_secs)
+			revalidate (e);
+		lru_remove (e);
+		lru_push (e);
+		return (e);
+	}
+
+	misses ++;
+	stats_count (STAT_CACHE_MISSES, 1);
+	char *key = strdup (path);
+	if (key == 0)
+		return (0);
+	if (num_used < max_entries) {
+		e = entries + num_used ++;
+		e->fd = -1;
+	} else { // recycle the least recently used one
+		e = lru_tail;
+		lru_remove (e);
+		hash_remove (e);
+		drop_contents (e);
+		drop_listing (e);
+		free (e->path);
+	}
+
+	e->path = key;
+	e->hash = h;
+	e->hnext = buckets [h & bucket_mask];
+	buckets [h & bucket_mask] = e;
+	lru_push (e);
+	fill (e);
+	return (e);
+}
+
+/**
+ * cache_open: the open file of a regular file entry, opened on first use.
+ * The descriptor stays owned by the cache; callers that need it beyond the
+ * current request dup it.
+ * returns: the descriptor, or -1 if the file cannot be opened
+ */
+int cache_open (struct cache_entry *e) {
+	if (e->fd == -1 && e->err == 0 && S_ISREG (e->info.st_mode))
+		e->fd = open (e->path, O_RDONLY | O_CLOEXEC);
+	return (e->fd);
+}
+
+/**
+ * cache_body: the contents of a small regular file, read on first use
+ * returns: the body (e->info.st_size bytes), or NULL if the file is too
+ * large (or empty) to be kept in memory, or cannot be read
+ */
+char *cache_body (struct cache_entry *e) {
+	if (e->body != 0 || e->err != 0 || !S_ISREG (e->info.st_mode) ||
+			e->info.st_size == 0 || e->info.st_size > max_body_size)
+		return (e->body);
+
+	int fd = open (e->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (0);
+	e->body = malloc (e->info.st_size);
+	if (e->body != 0 &&
+			read (fd, e->body, e->info.st_size) != e->info.st_size) {
+		free (e->body); // changed under us; the watch will tell
+		e->body = 0;
+	}
+	close (fd);
+	return (e->body);
+}
+
+/**
+ * cache_listing: the listing of a directory entry, scanned on first use
+ * returns: the listing, or NULL with errno set as by listing_scan
+ */
+struct listing *cache_listing (struct cache_entry *e) {
+	if (e->listing == 0)
+		e->listing = listing_scan (e->path);
+	return (e->listing);
+}
+
+/**
+ * cache_watch_fd: the inotify descriptor to wait on, -1 if there is none
+ */
+int cache_watch_fd (void) {
+	return (inotify_fd);
+}
+
+/**
+ * invalidate: marks every entry under the watch stale (or all of them if
+ * wd is -1, after a queue overflow); they are refetched on the next lookup.
+ * The listing of the watched directory itself is kept and told about the
+ * entry that changed, unless the event is about the directory as a whole.
+ */
+static void invalidate (int wd, struct inotify_event *ev) {
+	struct cache_entry *e;
+	for (e = lru_head; e != 0; e = e->next)
+		if (wd == -1 || e->wd == wd) {
+			if (e->listing != 0 && (wd == -1 || ev->len == 0 ||
+					listing_update (e->listing, ev->name,
+						ev->mask & (IN_DELETE | IN_MOVED_FROM)) == -1))
+				drop_listing (e);
+			drop_contents (e);
+			e->checked = 0;
+		}
+}
+
+/**
+ * cache_process_events: drains the pending inotify events
+ */
+void cache_process_events (void) {
+	char buf [4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read (inotify_fd, buf, sizeof (buf))) > 0) {
+		char *cp;
+		for (cp = buf; cp < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *) cp;
+			invalidate (ev->mask & IN_Q_OVERFLOW ? -1 : ev->wd, ev);
+			cp += sizeof (struct inotify_event) + ev->len;
+		}
+	}
+}
+
+/**
+ * cache_counts: lookups answered from the cache, and those that were not
+ */
+void cache_counts (long *hit_count, long *miss_count) {
+	*hit_count = hits;
+	*miss_count = misses;
+}
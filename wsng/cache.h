@@ -0,0 +1,44 @@
+/*
+ * cache.h
+ *
+ *  Bounded LRU cache of file metadata, open files and small file bodies,
+ *  keyed by the normalized path of the requested item
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "listing.h"
+
+#define	CACHED_HEADER_LEN	256
+
+struct cache_entry {
+	char *path;			/* the key: the item path after normalization */
+	unsigned int hash;
+	int err;			/* errno of a failed stat, 0 if info is valid */
+	struct stat info;
+	char header [CACHED_HEADER_LEN];	/* validator header lines for the
+							   file, rendered on first use; "" until then */
+	int fd;				/* the file kept open, or -1 */
+	char *body;			/* the whole file if it is small, or NULL */
+	struct listing *listing;	/* a directory's listing, once asked for */
+	time_t checked;		/* when info was last known to be current */
+	int wd;				/* inotify watch invalidating the entry, or -1 */
+	struct cache_entry *hnext;		/* hash chain */
+	struct cache_entry *prev, *next;	/* LRU list, most recent first */
+};
+
+int cache_init (int entries, off_t max_body, int revalidate);
+struct cache_entry *cache_lookup (char *path);
+int cache_open (struct cache_entry *e);
+char *cache_body (struct cache_entry *e);
+struct listing *cache_listing (struct cache_entry *e);
+int cache_watch_fd (void);
+void cache_process_events (void);
+void cache_counts (long *hits, long *misses);
+
+#endif /* CACHE_H_ */
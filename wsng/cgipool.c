@@ -0,0 +1,519 @@
+/*
+ * cgipool.c
+ *
+ *  Pools of persistent CGI workers (see cgipool.h for the protocol). Each
+ *  configured script gets a listening socket in the abstract Unix namespace
+ *  and the configured number of processes accepting on it; the serving
+ *  process restarts those that die.
+ *
+ *  The forked responders make one connection per request and wait for the
+ *  answer. The event loop keeps one connection (a channel) per worker
+ *  instead, sends each request down the least busy one and collects the
+ *  frames coming back as the channel becomes readable, so that requests to
+ *  a pool are multiplexed over a few long-lived connections.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+
+#include "cgipool.h"
+
+#define	POOL_BACKLOG	64
+#define	FRAME_LINE_LEN	64		// longest frame header line
+#define	TYPE_LEN		128
+#define	READ_CHUNK		16384
+#define	PARAMS_LEN		8192	// a whole request line fits
+
+struct cgi_pool {
+	char path [VALUE_LEN];		/* the script, as requests name it */
+	int size;
+	int listen_fd;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	pid_t *pids;
+	struct cgi_channel *channels;	/* size of them, for the event loop */
+	char content_type [TYPE_LEN];	/* of the last answer, "" until one */
+};
+
+struct cgi_channel {
+	struct cgi_pool *pool;
+	int fd;				/* -1 while not connected */
+	char *in;			/* received, not yet parsed */
+	size_t in_len;
+	size_t in_size;
+	struct cgi_reply *replies;	/* outstanding */
+	int outstanding;
+};
+
+static struct cgi_pool *pools = 0;
+static int num_pools = 0;
+static struct cgi_channel *channels = 0;	// all pools' channels, together
+static int num_channels = 0;
+static int epoll_fd = -1;
+static int next_id = 1;
+static int timeout = 0;		// seconds a forked responder waits for a worker
+
+/**
+ * spawn: starts the worker for the slot of the pool, with the listening
+ * socket as its fd 0. The worker dies with the serving process.
+ */
+static void spawn (struct cgi_pool *pool, int slot) {
+	pid_t pid = fork ();
+
+	if (pid == 0) {
+		sigset_t none;
+		sigemptyset (&none);
+		sigprocmask (SIG_SETMASK, &none, 0);
+		signal (SIGPIPE, SIG_DFL); // the event loop ignores it
+		prctl (PR_SET_PDEATHSIG, SIGTERM);
+		dup2 (pool->listen_fd, 0);
+		execl (pool->path, pool->path, (char *) 0);
+		perror (pool->path);
+		_exit (1);
+	}
+	if (pid == -1)
+		perror ("fork");
+	pool->pids [slot] = pid;
+}
+
+/**
+ * cgi_pools_start: sets up the pools of the configuration, each with its
+ * listening socket and workers
+ * returns: 0 on success, -1 if a pool could not be set up
+ */
+int cgi_pools_start (struct server *config) {
+	int idx, slot, chan = 0;
+
+	timeout = config->cgi_timeout;
+	if (config->num_cgi_pools == 0)
+		return (0);
+	pools = calloc (config->num_cgi_pools, sizeof (struct cgi_pool));
+	for (idx = 0; idx < config->num_cgi_pools; idx ++)
+		num_channels += config->cgi_pools [idx].size;
+	channels = calloc (num_channels, sizeof (struct cgi_channel));
+	if (pools == 0 || channels == 0) {
+		perror ("cgi pools");
+		return (-1);
+	}
+
+	for (idx = 0; idx < config->num_cgi_pools; idx ++) {
+		struct cgi_pool *pool = pools + idx;
+		strcpy (pool->path, config->cgi_pools [idx].path);
+		pool->size = config->cgi_pools [idx].size;
+		pool->pids = calloc (pool->size, sizeof (pid_t));
+		pool->channels = channels + chan;
+		for (slot = 0; slot < pool->size; slot ++, chan ++) {
+			channels [chan].pool = pool;
+			channels [chan].fd = -1;
+		}
+
+		pool->addr.sun_family = AF_UNIX;
+		snprintf (pool->addr.sun_path + 1, sizeof (pool->addr.sun_path) - 1,
+					"wsng-cgi-%d-%d", (int) getpid (), idx); // abstract
+		pool->addr_len = offsetof (struct sockaddr_un, sun_path) + 1 +
+							strlen (pool->addr.sun_path + 1);
+		pool->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (pool->pids == 0 || pool->listen_fd == -1 ||
+				bind (pool->listen_fd, (struct sockaddr *) &pool->addr,
+						pool->addr_len) == -1 ||
+				listen (pool->listen_fd, POOL_BACKLOG) == -1) {
+			perror (pool->path);
+			return (-1);
+		}
+		num_pools ++;
+		for (slot = 0; slot < pool->size; slot ++)
+			spawn (pool, slot);
+	}
+	return (0);
+}
+
+/**
+ * cgi_pools_check: restarts the workers that have exited (the SIGCHLD
+ * handler has reaped them already)
+ */
+void cgi_pools_check (void) {
+	int idx, slot;
+
+	for (idx = 0; idx < num_pools; idx ++)
+		for (slot = 0; slot < pools [idx].size; slot ++) {
+			pid_t pid = pools [idx].pids [slot];
+			if (pid <= 0 || (kill (pid, 0) == -1 && errno == ESRCH))
+				spawn (pools + idx, slot);
+		}
+}
+
+/**
+ * cgi_pools_stop: terminates all the workers
+ */
+void cgi_pools_stop (void) {
+	int idx, slot;
+
+	for (idx = 0; idx < num_pools; idx ++) {
+		for (slot = 0; slot < pools [idx].size; slot ++)
+			if (pools [idx].pids [slot] > 0)
+				kill (pools [idx].pids [slot], SIGTERM);
+		close (pools [idx].listen_fd);
+	}
+	num_pools = 0;
+}
+
+/**
+ * cgi_pool_find: the pool running the script, if there is one
+ */
+struct cgi_pool *cgi_pool_find (char *prog) {
+	int idx;
+	for (idx = 0; idx < num_pools; idx ++)
+		if (!strcmp (pools [idx].path, prog))
+			return (pools + idx);
+	return (0);
+}
+
+/**
+ * cgi_pool_content_type: the Content-type the script answered with last
+ * time, or NULL if it has not answered yet
+ */
+char *cgi_pool_content_type (struct cgi_pool *pool) {
+	return (pool->content_type [0] ? pool->content_type : 0);
+}
+
+/**
+ * cgi_pool_learn_type: remembers the Content-type line among the header
+ * lines of a CGI output, for answering HEAD requests without the script
+ */
+void cgi_pool_learn_type (struct cgi_pool *pool, char *output, size_t len) {
+	char *line = output, *end = output + len;
+
+	while (line < end && *line != '\r' && *line != '\n') {
+		char *eol = memchr (line, '\n', end - line);
+		if (eol == 0)
+			break;
+		if (!strncasecmp (line, "Content-type:", 13)) {
+			char *value = line + 13 + strspn (line + 13, " \t");
+			int vlen = eol - value;
+			if (vlen > 0 && value [vlen - 1] == '\r')
+				vlen --;
+			if (vlen < TYPE_LEN)
+				snprintf (pool->content_type, TYPE_LEN, "%.*s", vlen, value);
+			break;
+		}
+		line = eol + 1;
+	}
+}
+
+/**
+ * send_request: the PARAMS frame and the (so far always empty) STDIN
+ * frame for a request
+ * returns: 0 on success, -1 if the frames could not be sent in full
+ */
+static int send_request (int fd, int id, struct cgi_pool *pool,
+							char *method, char *query) {
+	char params [PARAMS_LEN];
+	char frames [PARAMS_LEN + 2 * FRAME_LINE_LEN];
+	int plen = snprintf (params, sizeof (params),
+					"REQUEST_METHOD=%s\nQUERY_STRING=%s\nSCRIPT_NAME=/%s\n",
+					method, query ? query : "", pool->path);
+	if (plen >= (int) sizeof (params))
+		return (-1);
+	int len = snprintf (frames, sizeof (frames), "PARAMS %d %d\n%sSTDIN %d 0\n",
+						id, plen, params, id);
+	char *cp = frames;
+
+	while (len > 0) {
+		ssize_t n = send (fd, cp, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		cp += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/**
+ * frame_header: parses the frame header line at the start of the buffer
+ * returns: the length of the line, 0 if it is not complete yet, -1 if it
+ * is malformed
+ */
+static int frame_header (char *buf, size_t len, char *type, int *id,
+							long *flen) {
+	char line [FRAME_LINE_LEN];
+	char *eol = memchr (buf, '\n', len < FRAME_LINE_LEN ? len : FRAME_LINE_LEN);
+
+	if (eol == 0)
+		return (len < FRAME_LINE_LEN ? 0 : -1);
+	memcpy (line, buf, eol - buf);
+	line [eol - buf] = 0;
+	if (sscanf (line, "%7s %d %ld", type, id, flen) != 3 || *flen < 0)
+		return (-1);
+	return (eol - buf + 1);
+}
+
+/**
+ * cgi_call: runs a request on the pool and waits for its whole output, but
+ * no longer than the cgi timeout for any one step of it: connecting to a
+ * pool whose backlog is full, sending the request, or the next of the
+ * answer
+ * returns: 0 with the output in *out (malloc'ed), -1 on failure, with errno
+ * EAGAIN if the worker took too long
+ */
+int cgi_call (struct cgi_pool *pool, char *method, char *query,
+				char **out, size_t *out_len) {
+	struct timeval limit = {timeout, 0};
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+	setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof (limit));
+	setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof (limit));
+	if (connect (fd, (struct sockaddr *) &pool->addr, pool->addr_len) == -1 ||
+			send_request (fd, 1, pool, method, query) == -1) {
+		close (fd);
+		return (-1);
+	}
+
+	FILE *in = fdopen (fd, "r");
+	FILE *fp = open_memstream (out, out_len);
+	char line [FRAME_LINE_LEN], type [8];
+	int id, ret = -1, err = 0;
+	long flen;
+
+	while (in != 0 && fp != 0 && fgets (line, FRAME_LINE_LEN, in) != 0 &&
+			frame_header (line, strlen (line), type, &id, &flen) > 0) {
+		if (!strcmp (type, "END")) {
+			ret = 0;
+			break;
+		}
+		char buf [READ_CHUNK];
+		while (flen > 0) {
+			size_t want = flen < READ_CHUNK ? flen : READ_CHUNK;
+			if (fread (buf, 1, want, in) != want)
+				break;
+			if (!strcmp (type, "STDOUT") && id == 1)
+				fwrite (buf, 1, want, fp);
+			flen -= want;
+		}
+		if (flen > 0)
+			break;
+	}
+	if (ret == -1)
+		err = errno; // the cleanup is not to hide a timeout
+	in ? fclose (in) : close (fd);
+	if (fp != 0)
+		fclose (fp);
+	if (ret == -1 && fp != 0)
+		free (*out);
+	if (ret == 0)
+		cgi_pool_learn_type (pool, *out, *out_len);
+	errno = err;
+	return (ret);
+}
+
+/**
+ * cgi_pools_attach: the epoll set the event loop's channels are added to
+ */
+void cgi_pools_attach (int epfd) {
+	epoll_fd = epfd;
+}
+
+/**
+ * cgi_is_channel: whether an epoll event is for one of the channels
+ */
+int cgi_is_channel (void *ptr) {
+	return (channels != 0 && (struct cgi_channel *) ptr >= channels &&
+				(struct cgi_channel *) ptr < channels + num_channels);
+}
+
+/**
+ * connect_channel: opens the channel's connection to its pool, and adds it
+ * to the event loop's epoll set. The connect does not wait for a full
+ * backlog; after it, the socket blocks for writing, so that a request is
+ * never left half sent, while reads only take what is there.
+ * returns: 0 on success, -1 if the pool does not accept it now
+ */
+static int connect_channel (struct cgi_channel *ch) {
+	struct epoll_event ev;
+
+	ch->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ch->fd == -1)
+		return (-1);
+	ev.events = EPOLLIN;
+	ev.data.ptr = ch;
+	if (connect (ch->fd, (struct sockaddr *) &ch->pool->addr,
+					ch->pool->addr_len) == -1 ||
+			epoll_ctl (epoll_fd, EPOLL_CTL_ADD, ch->fd, &ev) == -1) {
+		close (ch->fd);
+		ch->fd = -1;
+		return (-1);
+	}
+	fcntl (ch->fd, F_SETFL, fcntl (ch->fd, F_GETFL) & ~O_NONBLOCK);
+	return (0);
+}
+
+/**
+ * cgi_submit: sends a request down the least busy channel of the pool,
+ * connecting it first if need be. The output is collected as it arrives;
+ * cgi_channel_ready hands the reply over when it is complete.
+ * returns: the reply, or NULL if the request could not be sent
+ */
+struct cgi_reply *cgi_submit (struct cgi_pool *pool, char *method,
+								char *query) {
+	struct cgi_channel *ch = 0;
+	int idx;
+
+	for (idx = 0; idx < pool->size; idx ++) {
+		struct cgi_channel *c = pool->channels + idx;
+		if ((c->fd != -1 || connect_channel (c) == 0) &&
+				(ch == 0 || c->outstanding < ch->outstanding))
+			ch = c;
+	}
+	if (ch == 0)
+		return (0);
+
+	struct cgi_reply *reply = calloc (1, sizeof (struct cgi_reply));
+	if (reply == 0)
+		return (0);
+	reply->out_fp = open_memstream (&reply->out, &reply->out_len);
+	reply->id = next_id;
+	next_id = next_id == 1000000000 ? 1 : next_id + 1;
+	if (reply->out_fp == 0 ||
+			send_request (ch->fd, reply->id, pool, method, query) == -1) {
+		cgi_reply_free (reply);
+		return (0);
+	}
+	reply->pool = pool;
+	reply->channel = ch;
+	reply->next = ch->replies;
+	ch->replies = reply;
+	ch->outstanding ++;
+	return (reply);
+}
+
+/**
+ * unlink_reply: takes the reply off its channel
+ */
+static void unlink_reply (struct cgi_reply *reply) {
+	struct cgi_channel *ch = reply->channel;
+	struct cgi_reply **link = &ch->replies;
+
+	while (*link != reply)
+		link = &(*link)->next;
+	*link = reply->next;
+	ch->outstanding --;
+}
+
+/**
+ * cgi_cancel: gives up on a reply that is still outstanding (its worker
+ * took too long): it is released, and whatever the worker still sends for
+ * it is dropped
+ */
+void cgi_cancel (struct cgi_reply *reply) {
+	unlink_reply (reply);
+	cgi_reply_free (reply);
+}
+
+/**
+ * finish_reply: takes the reply off its channel and hands it over
+ */
+static void finish_reply (struct cgi_reply *reply,
+							void (*done) (struct cgi_reply *)) {
+	unlink_reply (reply);
+	fclose (reply->out_fp);
+	reply->out_fp = 0;
+	if (!reply->failed)
+		cgi_pool_learn_type (reply->pool, reply->out, reply->out_len);
+	done (reply);
+}
+
+/**
+ * close_channel: the worker went away (or spoke nonsense); whatever was
+ * outstanding on the channel fails
+ */
+static void close_channel (struct cgi_channel *ch,
+							void (*done) (struct cgi_reply *)) {
+	close (ch->fd); // also takes it out of the epoll set
+	ch->fd = -1;
+	ch->in_len = 0;
+	while (ch->replies != 0) {
+		ch->replies->failed = 1;
+		finish_reply (ch->replies, done);
+	}
+}
+
+/**
+ * cgi_channel_ready: reads what the worker sent and dispatches the
+ * complete frames: output is added to its reply, and finished replies are
+ * passed to done, which takes them over
+ */
+void cgi_channel_ready (struct cgi_channel *ch,
+						void (*done) (struct cgi_reply *)) {
+	if (ch->in_size - ch->in_len < READ_CHUNK) {
+		char *bigger = realloc (ch->in, ch->in_size + READ_CHUNK);
+		if (bigger == 0) {
+			close_channel (ch, done);
+			return;
+		}
+		ch->in = bigger;
+		ch->in_size += READ_CHUNK;
+	}
+	ssize_t n = recv (ch->fd, ch->in + ch->in_len, ch->in_size - ch->in_len,
+						MSG_DONTWAIT);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		close_channel (ch, done);
+		return;
+	}
+	ch->in_len += n;
+
+	size_t used = 0;
+	for (;;) {
+		char type [8];
+		int id;
+		long flen;
+		int hlen = frame_header (ch->in + used, ch->in_len - used,
+									type, &id, &flen);
+		if (hlen == -1) {
+			close_channel (ch, done);
+			return;
+		}
+		if (hlen == 0)
+			break;
+
+		int is_end = !strcmp (type, "END");
+		if (!is_end && ch->in_len - used - hlen < (size_t) flen)
+			break; // the payload is not all here yet
+		struct cgi_reply *reply;
+		for (reply = ch->replies; reply != 0; reply = reply->next)
+			if (reply->id == id)
+				break;
+		if (reply != 0 && !strcmp (type, "STDOUT"))
+			fwrite (ch->in + used + hlen, 1, flen, reply->out_fp);
+		used += hlen + (is_end ? 0 : flen);
+		if (reply != 0 && is_end)
+			finish_reply (reply, done);
+	}
+	memmove (ch->in, ch->in + used, ch->in_len - used);
+	ch->in_len -= used;
+}
+
+/**
+ * cgi_reply_free: releases a reply and its output
+ */
+void cgi_reply_free (struct cgi_reply *reply) {
+	if (reply->out_fp != 0)
+		fclose (reply->out_fp);
+	free (reply->out);
+	free (reply);
+}
@@ -0,0 +1,70 @@
+/*
+ * cgipool.h
+ *
+ *  Persistent CGI workers. A script configured with "cgi_pool" is started
+ *  once, as a pool of processes accepting on a listening Unix socket handed
+ *  to them as fd 0 (as FastCGI does), and requests reach it as frames over
+ *  connections to that socket instead of a fork and exec each. A frame is
+ *  a line "<TYPE> <id> <length>\n" followed by length bytes:
+ *
+ *	  server -> worker
+ *		PARAMS id len	NAME=VALUE lines: REQUEST_METHOD, QUERY_STRING,
+ *						SCRIPT_NAME
+ *		STDIN id len	request body; an empty one ends it
+ *	  worker -> server
+ *		STDOUT id len	the CGI output: header lines, empty line, body
+ *		END id status	the request is finished (no payload)
+ *
+ *  The ids let several requests be outstanding on one connection; a worker
+ *  may answer them in any order. The STDIN frame is always empty so far: a
+ *  request with a body runs the script forked, as a plain CGI with the body
+ *  on its stdin, so a pooled script has to work either way. cgiworker.c is
+ *  a minimal worker doing both. A reply that takes longer than the cgi
+ *  timeout is answered with a 504.
+ */
+
+#ifndef CGIPOOL_H_
+#define CGIPOOL_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "wsng.h"
+
+struct cgi_pool;
+struct cgi_channel;
+
+/*
+ * a request sent to a pool from the event loop, and its output as it comes
+ */
+struct cgi_reply {
+	int id;
+	struct cgi_pool *pool;
+	struct cgi_channel *channel;
+	void *owner;		/* the waiting connection, NULL once it is gone */
+	char *out;			/* the CGI output so far */
+	size_t out_len;
+	FILE *out_fp;		/* a memory stream onto out */
+	int failed;			/* the worker went away without finishing */
+	struct cgi_reply *next;		/* outstanding on the same channel */
+};
+
+int cgi_pools_start (struct server *config);
+void cgi_pools_check (void);
+void cgi_pools_stop (void);
+struct cgi_pool *cgi_pool_find (char *prog);
+char *cgi_pool_content_type (struct cgi_pool *pool);
+void cgi_pool_learn_type (struct cgi_pool *pool, char *output, size_t len);
+int cgi_call (struct cgi_pool *pool, char *method, char *query,
+				char **out, size_t *out_len);
+
+void cgi_pools_attach (int epfd);
+struct cgi_reply *cgi_submit (struct cgi_pool *pool, char *method,
+								char *query);
+int cgi_is_channel (void *ptr);
+void cgi_channel_ready (struct cgi_channel *ch,
+						void (*done) (struct cgi_reply *));
+void cgi_cancel (struct cgi_reply *reply);
+void cgi_reply_free (struct cgi_reply *reply);
+
+#endif /* CGIPOOL_H_ */
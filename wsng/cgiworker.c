@@ -0,0 +1,211 @@
+/*
+ * cgiworker.c
+ *
+ *  A minimal worker for a cgi pool, and the reference for its frames (see
+ *  cgipool.h). Copied under the server root as, say, worker.cgi and named
+ *  in a line "cgi_pool worker.cgi 4", it answers every request with a short
+ *  text page of its pid and the request's parameters.
+ *
+ *  A worker is started with the pool's listening Unix socket as fd 0, and
+ *  accepts on it: each serving process connects once per request (fork
+ *  mode) or keeps a connection per worker (event loop), so a worker has to
+ *  serve several connections at a time. Each one carries frames, a line
+ *  "<TYPE> <id> <length>\n" followed by length bytes:
+ *
+ *	  PARAMS 7 54\n		REQUEST_METHOD=GET\nQUERY_STRING=a=1\nSCRIPT_NAME=/x\n
+ *	  STDIN 7 0\n		the empty STDIN frame: the request is complete
+ *
+ *  and the answer to request 7 is the CGI output in STDOUT frames, as many
+ *  as the worker likes, and then the END frame, which has no payload:
+ *
+ *	  STDOUT 7 40\n		Content-type: text/plain\n\nhello, world\n...
+ *	  END 7 0\n
+ *
+ *  Requests may be answered in any order, but the frames of one request
+ *  arrive together. The server measures the output and adds the framing
+ *  of the response itself. A request with a body is not sent to the pool:
+ *  the server runs the same program forked, as a plain CGI, with nothing
+ *  on fd 0 to accept on, and this program answers it that way then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define	MAX_CONNS	64			/* served at once, the listening socket first */
+#define	BUF_LEN		16384		/* of a connection's unparsed input */
+#define	LINE_LEN	64			/* longest frame header line */
+#define	PAGE_LEN	10240
+
+struct conn {
+	char in [BUF_LEN];
+	size_t in_len;
+	char params [BUF_LEN];	/* of the request whose STDIN is next */
+};
+
+static struct pollfd fds [MAX_CONNS];
+static struct conn *conns [MAX_CONNS];
+static int num_fds = 1;
+
+/**
+ * page: the answer to a request, header and body, into the buffer
+ * returns: its length
+ */
+static int page (char *buf, char *method, char *query, char *script) {
+	int len = snprintf (buf, PAGE_LEN, "Content-type: text/plain\n\n"
+						"worker %d\nREQUEST_METHOD=%s\nQUERY_STRING=%s\n"
+						"SCRIPT_NAME=%s\n", (int) getpid (), method ? method : "",
+						query ? query : "", script ? script : "");
+	return (len < PAGE_LEN ? len : PAGE_LEN - 1);
+}
+
+/**
+ * write_all: writes out the buffer, picking up after partial writes
+ * returns: 0 on success, -1 on error
+ */
+static int write_all (int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write (fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		buf += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/**
+ * answer: sends the STDOUT and END frames of request id, from its PARAMS
+ * (whose lines are cut apart)
+ * returns: 0 on success, -1 if the connection failed
+ */
+static int answer (int fd, int id, char *params) {
+	char out [LINE_LEN + PAGE_LEN + LINE_LEN], body [PAGE_LEN];
+	char *method = 0, *query = 0, *script = 0, *line, *eol;
+
+	for (line = params; (eol = strchr (line, '\n')) != 0; line = eol + 1) {
+		*eol = 0;
+		if (!strncmp (line, "REQUEST_METHOD=", 15))
+			method = line + 15;
+		else if (!strncmp (line, "QUERY_STRING=", 13))
+			query = line + 13;
+		else if (!strncmp (line, "SCRIPT_NAME=", 12))
+			script = line + 12;
+	}
+	int blen = page (body, method, query, script);
+	int len = snprintf (out, sizeof (out), "STDOUT %d %d\n%.*sEND %d 0\n",
+						id, blen, blen, body, id);
+
+	return (write_all (fd, out, len));
+}
+
+/**
+ * take_frames: goes through the complete frames the connection has in,
+ * answering each request as its STDIN frame comes
+ * returns: 0, -1 if the connection is to be closed
+ */
+static int take_frames (int fd, struct conn *c) {
+	size_t used = 0;
+
+	for (;;) {
+		char line [LINE_LEN], type [8];
+		char *eol = memchr (c->in + used, '\n', c->in_len - used);
+		int id;
+		long flen;
+
+		if (eol == 0)
+			break;
+		if (eol - (c->in + used) >= LINE_LEN)
+			return (-1);
+		memcpy (line, c->in + used, eol - (c->in + used));
+		line [eol - (c->in + used)] = 0;
+		if (sscanf (line, "%7s %d %ld", type, &id, &flen) != 3 || flen < 0 ||
+				flen >= BUF_LEN - LINE_LEN)
+			return (-1);
+		if (c->in + c->in_len - (eol + 1) < flen)
+			break; // the payload is not all here yet
+		if (!strcmp (type, "PARAMS")) {
+			memcpy (c->params, eol + 1, flen);
+			c->params [flen] = 0;
+		} else if (!strcmp (type, "STDIN") && flen == 0 &&
+				answer (fd, id, c->params) == -1)
+			return (-1);
+		used = eol + 1 + flen - c->in;
+	}
+	memmove (c->in, c->in + used, c->in_len - used);
+	c->in_len -= used;
+	return (c->in_len < BUF_LEN ? 0 : -1);
+}
+
+/**
+ * serve_pool: accepts connections on fd 0 and answers the requests coming
+ * in on them, for as long as the server keeps the worker
+ */
+static void serve_pool (void) {
+	int idx;
+
+	fds [0].fd = 0;
+	for (;;) {
+		fds [0].events = num_fds < MAX_CONNS ? POLLIN : 0;
+		if (poll (fds, num_fds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			exit (1);
+		}
+		for (idx = num_fds - 1; idx > 0; idx --) {
+			struct conn *c = conns [idx];
+			ssize_t n = 0;
+			if (fds [idx].revents == 0)
+				continue;
+			if (fds [idx].revents & (POLLIN | POLLHUP | POLLERR))
+				n = read (fds [idx].fd, c->in + c->in_len,
+							BUF_LEN - c->in_len);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n > 0) {
+				c->in_len += n;
+				if (take_frames (fds [idx].fd, c) == 0)
+					continue;
+			}
+			close (fds [idx].fd); // gone, or speaking nonsense
+			free (c);
+			num_fds --;
+			fds [idx] = fds [num_fds];
+			conns [idx] = conns [num_fds];
+		}
+		if (fds [0].revents & POLLIN) {
+			int fd = accept (0, 0, 0);
+			struct conn *c = fd == -1 ? 0 : calloc (1, sizeof (struct conn));
+			if (c == 0) {
+				if (fd != -1)
+					close (fd);
+				continue;
+			}
+			fds [num_fds].fd = fd;
+			fds [num_fds].events = POLLIN;
+			conns [num_fds ++] = c;
+		}
+	}
+}
+
+/**
+ * main: a worker if fd 0 is a listening socket, else a plain CGI
+ */
+int main (void) {
+	int listening = 0;
+	socklen_t len = sizeof (listening);
+	char body [PAGE_LEN];
+
+	if (getsockopt (0, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 &&
+			listening)
+		serve_pool ();
+	fwrite (body, 1, page (body, getenv ("REQUEST_METHOD"),
+				getenv ("QUERY_STRING"), getenv ("SCRIPT_NAME")), stdout);
+	return (0);
+}
@@ -0,0 +1,138 @@
+/*
+ * compress.c
+ *
+ *  Content encodings. Static files may have precompressed siblings
+ *  (foo.html.br, foo.html.gz) that are sent instead of them to clients
+ *  accepting the encoding; generated bodies of the allowed content types
+ *  and of at least the minimum size may be gzipped on the fly, through a
+ *  streaming deflate writing into a stdio stream.
+ *
+ *  The settings are taken from the configuration when it is loaded, like
+ *  the content types.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+#define	TYPES_LEN		512
+#define	GZIP_CHUNK		16384
+#define	GZIP_WINDOW		(15 + 16)	// the largest window, with a gzip wrapper
+#define	GZIP_MEMLEVEL	8
+
+static int precompressed = 0;	// look for .br and .gz siblings
+static int dynamic = 0;			// gzip generated bodies
+static long min_size = 0;
+static char types [TYPES_LEN];	// blank separated allowlist
+
+struct gzip_writer {
+	z_stream z;
+	FILE *out;
+};
+
+/**
+ * compress_setup: the configured encoding settings
+ */
+void compress_setup (int use_precompressed, int use_dynamic, long min_length,
+						char *allowed_types) {
+	precompressed = use_precompressed;
+	dynamic = use_dynamic;
+	min_size = min_length;
+	snprintf (types, TYPES_LEN, "%s", allowed_types);
+}
+
+int use_precompressed (void) {
+	return (precompressed);
+}
+
+int compress_dynamic (void) {
+	return (dynamic);
+}
+
+/**
+ * compressible: whether a generated body of the type and length is worth
+ * compressing: its type is in the allowlist (ignoring parameters such as a
+ * charset) and it is not too short
+ */
+int compressible (char *content_type, off_t length) {
+	size_t len = strcspn (content_type, "; \t");
+	char *cp = types;
+
+	if (!dynamic || length < min_size)
+		return (0);
+	while (*(cp += strspn (cp, " \t")) != 0) {
+		size_t tlen = strcspn (cp, " \t");
+		if (tlen == len && !strncasecmp (cp, content_type, len))
+			return (1);
+		cp += tlen;
+	}
+	return (0);
+}
+
+/**
+ * deflate_out: runs deflate over the pending input, writing out whatever
+ * it produces
+ * returns: 0 on success, -1 on error
+ */
+static int deflate_out (struct gzip_writer *w, int flush) {
+	unsigned char chunk [GZIP_CHUNK];
+	int ret;
+
+	do {
+		w->z.next_out = chunk;
+		w->z.avail_out = GZIP_CHUNK;
+		ret = deflate (&w->z, flush);
+		if (ret == Z_STREAM_ERROR)
+			return (-1);
+		size_t have = GZIP_CHUNK - w->z.avail_out;
+		if (have > 0 && fwrite (chunk, 1, have, w->out) != have)
+			return (-1);
+	} while (w->z.avail_out == 0);
+	return (flush == Z_FINISH && ret != Z_STREAM_END ? -1 : 0);
+}
+
+/**
+ * gzip_start: a writer compressing into the stream
+ * returns: the writer, or NULL if out of memory
+ */
+struct gzip_writer *gzip_start (FILE *out) {
+	struct gzip_writer *w = calloc (1, sizeof (struct gzip_writer));
+
+	if (w == 0)
+		return (0);
+	if (deflateInit2 (&w->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW,
+						GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free (w);
+		return (0);
+	}
+	w->out = out;
+	return (w);
+}
+
+/**
+ * gzip_write: compresses the next piece of the body
+ * returns: 0 on success, -1 on error
+ */
+int gzip_write (struct gzip_writer *w, const void *data, size_t len) {
+	w->z.next_in = (unsigned char *) data;
+	w->z.avail_in = len;
+	return (deflate_out (w, Z_NO_FLUSH));
+}
+
+/**
+ * gzip_finish: ends the compressed stream and releases the writer (the
+ * output stream stays open)
+ * returns: 0 on success, -1 on error
+ */
+int gzip_finish (struct gzip_writer *w) {
+	w->z.next_in = 0;
+	w->z.avail_in = 0;
+	int ret = deflate_out (w, Z_FINISH);
+	deflateEnd (&w->z);
+	free (w);
+	return (ret);
+}
@@ -0,0 +1,27 @@
+/*
+ * compress.h
+ *
+ *  Content encodings: which ones the server may use, and gzip compression
+ *  of generated bodies
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define	ACCEPT_GZIP	1	/* bits of struct request's accept_encoding */
+#define	ACCEPT_BR	2
+
+void compress_setup (int precompressed, int dynamic, long min_size,
+						char *types);
+int use_precompressed (void);
+int compressible (char *content_type, off_t length);
+int compress_dynamic (void);
+
+struct gzip_writer *gzip_start (FILE *out);
+int gzip_write (struct gzip_writer *w, const void *data, size_t len);
+int gzip_finish (struct gzip_writer *w);
+
+#endif /* COMPRESS_H_ */
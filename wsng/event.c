@@ -0,0 +1,1761 @@
+/*
+ * event.c
+ *
+ *  The event loop serving mode: one process, non-blocking sockets and an
+ *  edge-triggered epoll set. Requests are accumulated incrementally in a
+ *  per-connection buffer, which the request parser goes through as the
+ *  bytes come in; once the header is complete, the request is run
+ *  through the usual handlers with the response going into memory, and the
+ *  loop then drains that memory (and the file body, if any, by sendfile,
+ *  or the packed file, straight from the pack) into the socket as it
+ *  becomes writable. Connections are persistent if
+ *  the client and the response allow it; pipelined requests wait in the
+ *  buffer behind the one being answered. Only cgi requests still fork,
+ *  unless the script has a pool of persistent workers: then the request is
+ *  sent to the pool and the connection waits for the reply to come back
+ *  through the loop like any other event. A proxied request goes out to
+ *  its upstream on a pooled connection, which joins the epoll set while the
+ *  response is relayed the way a cgi's output is. Connections over the
+ *  limits are shed as they are accepted. One to the HTTPS port does its
+ *  TLS handshake in the epoll set first, and is then served on its socket
+ *  like any other if the kernel encrypts it; else the loop reads and
+ *  writes it through its TLS session, the response going out a record at
+ *  a time from a stage buffer. Only a request with a body, which a forked
+ *  child may take over, has it go on through a relay process.
+ *
+ *  Every connection has one deadline on a timer wheel, for the state it is
+ *  in: the keep-alive timeout between requests, the header timeout from
+ *  the first byte of a request (so that a header trickling in slowly does
+ *  not keep it open), and the body and send timeouts from the last bytes
+ *  that moved, or (for a proxied request) the upstream's bytes. A
+ *  connection past its deadline is closed; one whose upstream has not
+ *  started the response by then gets a 504 first.
+ *
+ *  With "io_uring on", the same connections are driven by completions
+ *  instead: a multishot accept, a multishot receive per connection into
+ *  buffers the kernel picks, sends and splices for the response, all
+ *  submitted in batches with the wait for the next completions. The other
+ *  descriptors (the cache's, the cgi pools', the HTTPS socket and the
+ *  connections on it the loop does the TLS of) stay in the epoll set,
+ *  which the ring polls. Without
+ *  io_uring in the kernel the loop runs on epoll.
+ *
+ *  On SIGHUP the loop hands its listening sockets over to a successor (see
+ *  reload.h) and, once that is serving, stops the way a worker does on
+ *  SIGTERM: its connections finish on the configuration they started with.
+ */
+
+#define _GNU_SOURCE // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#include "event.h"
+#include "process.h"
+#include "read.h"
+#include "cache.h"
+#include "cgipool.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "admission.h"
+#include "pack.h"
+#include "uring.h"
+#include "timer.h"
+#include "proxy.h"
+#include "tls.h"
+#include "reload.h"
+
+#define	MAX_EVENTS	64
+#define	STOP_CHECK_MS	1000
+#define	RING_ENTRIES	1024
+#define	RING_BUFFERS	512		/* provided receive buffers, */
+#define	RING_BUFFER_LEN	4096	/* of this size each */
+#define	SPILL_MAX	65536		/* received data kept beyond the buffer */
+#define	PIPE_CHUNK	65536		/* of a file body spliced at a time */
+#define	RELAY_LEN	65536		/* most of a cgi's output in one chunk */
+#define	TICK_MS		100			/* of the timer wheel */
+#define	TLS_RECORD	16384		/* of a response staged for TLS at a time */
+
+enum conn_state {
+	HANDSHAKE,	/* of TLS, on a connection to the HTTPS port */
+	READING,	/* accumulating the request header */
+	WAITING,	/* for the reply of a cgi pool */
+	STREAMING,	/* relaying a forked cgi's output (or an upstream's
+					response) as it comes */
+	WRITING,	/* draining the response */
+	DONE		/* response sent or connection broken; to be closed */
+};
+
+/*
+ * what a connection's deadline is for
+ */
+enum timeout {
+	NO_TIMEOUT,		/* waiting for a forked cgi: the client is not to blame */
+	TIMEOUT_IDLE,
+	TIMEOUT_HEADER,
+	TIMEOUT_BODY,	/* of a request body that is skipped */
+	TIMEOUT_SEND,
+	TIMEOUT_UPSTREAM,	/* of a proxied request's upstream */
+	TIMEOUT_CGI		/* of the reply of a cgi pool */
+};
+
+static const enum stats_counter timeout_counters [] = {
+	0, STAT_TIMEOUT_IDLE, STAT_TIMEOUT_HEADER, STAT_TIMEOUT_BODY,
+	STAT_TIMEOUT_SEND, STAT_TIMEOUT_UPSTREAM, STAT_TIMEOUT_UPSTREAM
+};
+
+/*
+ * what an io_uring operation was for, kept in the low bits of its user
+ * data; the rest is the connection it was for, if any
+ */
+enum ring_op {
+	OP_ACCEPT,
+	OP_RECV,
+	OP_SENDMSG,		/* the in-memory part of the response */
+	OP_SEND,		/* the in-memory lines of a body part */
+	OP_SPLICE_IN,	/* a chunk of the file body into the pipe */
+	OP_SPLICE_OUT,	/* and out of it into the socket */
+	OP_POLL,		/* the epoll set of the other descriptors */
+	OP_CANCEL
+};
+#define	OP_MASK	7ULL
+
+struct connection {
+	int fd;
+	int slot;			/* its charge to the connection limits */
+	enum conn_state state;
+	struct tls_session *tls;	/* its TLS, if the loop does it (the
+								   handshake, and unless the kernel takes
+								   over, the rest), or NULL */
+	char client [INET6_ADDRSTRLEN];	/* told by its TLS relay, or "" */
+	char *stage;		/* of the response, to go out through the TLS */
+	size_t stage_len;
+	size_t stage_off;	/* how much of the stage is sent */
+	char in [MAX_RQ_LEN];	/* the request as received so far, possibly
+							   followed by pipelined ones */
+	int in_len;
+	struct http_parser parser;	/* of the request at the front of in */
+	long long discard;	/* request body bytes still to be skipped */
+	int requests;		/* served on this connection so far */
+	int keep_alive;		/* whether to read another request after this */
+	long long progress;	/* bytes received and sent on it so far */
+	struct timer timer;	/* its deadline, */
+	enum timeout timeout;	/* what for, */
+	long long timed;	/* and the request or progress it was set at */
+	char *out;			/* response header (and generated body) */
+	size_t out_len;
+	size_t out_off;		/* how much of out is already sent */
+	char *packed;		/* or a packed file to send after it, */
+	size_t packed_len;	/* out_off going on into it */
+	struct file_pack *pack;		/* which is held until it is sent */
+	int body_fd;		/* file body to send after out, or -1 */
+	struct body_segment body [MAX_SEGMENTS];	/* the parts of it to send */
+	int body_parts;
+	int part;			/* the one being sent */
+	size_t prefix_off;	/* how much of its in-memory lines is sent */
+	struct cgi_reply *cgi;		/* the pooled cgi call waited for */
+	struct request *waiting;	/* the context of the request waiting */
+	int cgi_out;		/* a forked cgi's output being relayed, or -1 */
+	int cgi_ready;		/* there may be more of it to read */
+	char *relay;		/* what has come of it, to go out as one chunk */
+	size_t relay_len;
+	struct proxy_call *proxy;	/* or the upstream call being relayed */
+	struct timespec started;	/* when the request's header was complete */
+	struct timespec clock;		/* when the response was ready to send */
+	struct connection *prev, *next;	/* all open connections */
+	/* with io_uring: */
+	int ops;			/* operations in flight for it */
+	int closed;			/* it is to be freed once they are all done */
+	int receiving;		/* its multishot receive is armed */
+	int throttled;		/* which has been cancelled, the spill being full */
+	int sending;		/* a send or splice is in flight */
+	int eof;			/* the peer has closed its side (or reset it) */
+	int claimed;		/* a request body has taken over what is received */
+	char *spill;		/* what has been received beyond the room in in */
+	int spill_len;
+	struct msghdr msg;	/* of the sendmsg in flight */
+	struct iovec iov [2];
+	int pipe [2];		/* the file body is spliced through it */
+	size_t piped;		/* how much of it is in the pipe */
+};
+
+static struct server *config;	// the settings the loop was started with
+static char cache_events;		// epoll marker for the cache's inotify fd
+static char tls_events;			// and for the HTTPS listening socket
+static int tls_fd = -1;
+static int epoll_fd = -1;
+static struct uring *ring = 0;	// if the loop runs on io_uring
+static struct connection *buried = 0;	// closed, to be freed after the round
+static int accepting = 0;		// the ring's accept is armed
+static struct connection *connections = 0;
+static int num_connections = 0;
+static struct timer_wheel timers;
+
+/**
+ * new_connection: allocates the bookkeeping for a freshly accepted socket
+ */
+static struct connection *new_connection (int fd, int slot) {
+	struct connection *conn = calloc (1, sizeof (struct connection));
+	if (conn == 0)
+		return (0);
+	conn->fd = fd;
+	conn->slot = slot;
+	conn->state = READING;
+	parser_init (&conn->parser);
+	conn->body_fd = -1;
+	conn->pipe [0] = conn->pipe [1] = -1;
+	conn->cgi_out = -1;
+	conn->next = connections;
+	if (connections)
+		connections->prev = conn;
+	connections = conn;
+	num_connections ++;
+	stats_count (STAT_CONNECTIONS, 1);
+	stats_count (STAT_ACTIVE, 1);
+	return (conn);
+}
+
+static unsigned long long ring_data (struct connection *conn,
+										enum ring_op op) {
+	return ((unsigned long long) (unsigned long) conn | op);
+}
+
+/**
+ * free_connection: releases the socket, the pending body file and the
+ * response buffer
+ */
+static void free_connection (struct connection *conn) {
+	tls_close (conn->tls);
+	close (conn->fd);
+	if (conn->body_fd != -1)
+		close (conn->body_fd);
+	free_body (conn->body, conn->body_parts);
+	free (conn->out);
+	pack_release (conn->pack);
+	free (conn->waiting);
+	free (conn->spill);
+	free (conn->stage);
+	if (conn->pipe [0] != -1) {
+		close (conn->pipe [0]);
+		close (conn->pipe [1]);
+	}
+	free (conn);
+}
+
+/**
+ * bury: a closed connection is freed once the round of events is handled,
+ * as others of the round (its socket's and its cgi's output) may still
+ * name it; they skip it, as it is closed
+ */
+static void bury (struct connection *conn) {
+	conn->next = buried;
+	buried = conn;
+}
+
+static void free_buried (void) {
+	while (buried != 0) {
+		struct connection *conn = buried;
+		buried = conn->next;
+		free_connection (conn);
+	}
+}
+
+/**
+ * relay_tag: the epoll data of a connection's cgi output (or upstream
+ * connection): the connection, with the low bit set to tell it from the
+ * socket's
+ */
+static void *relay_tag (struct connection *conn) {
+	return ((void *) ((unsigned long) conn | 1));
+}
+
+/**
+ * tls_tag: the epoll data of the socket of a connection the loop does the
+ * TLS of (the io_uring loop too polls it through the epoll set): the
+ * connection, with the second bit set
+ */
+static void *tls_tag (struct connection *conn) {
+	return ((void *) ((unsigned long) conn | 2));
+}
+
+/**
+ * stop_relay: the cgi's output is done with: out of the epoll set, closed;
+ * or the upstream's, whose connection goes back to the pool if the
+ * response is complete
+ */
+static void stop_relay (struct connection *conn) {
+	if (conn->proxy != 0) {
+		epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->proxy->fd, 0);
+		proxy_end (conn->proxy, conn->proxy->state == REPLY_DONE);
+		conn->proxy = 0;
+	}
+	if (conn->cgi_out == -1)
+		return;
+	epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->cgi_out, 0);
+	close (conn->cgi_out);
+	conn->cgi_out = -1;
+	free (conn->relay);
+	conn->relay = 0;
+	conn->relay_len = 0;
+}
+
+/**
+ * close_connection: takes the connection out of the loop, and frees it
+ * (after the round) unless io_uring operations are still in flight for it:
+ * those have to complete first (its receive is cancelled, and a send is
+ * woken up by shutting the socket down), and the last completion frees it.
+ * The socket is taken out of the epoll set explicitly: closing it would not
+ * do that while a forked child (a cgi, or one between fork and exec) still
+ * has it open, and its events would keep coming.
+ */
+static void close_connection (struct connection *conn) {
+	stop_relay (conn);
+	timer_cancel (&conn->timer);
+	if (ring == 0 || conn->tls != 0)
+		epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+	else {
+		if (conn->receiving && !conn->throttled)
+			uring_cancel (ring, ring_data (conn, OP_RECV),
+							ring_data (0, OP_CANCEL));
+		if (conn->sending)
+			shutdown (conn->fd, SHUT_RDWR);
+	}
+	if (conn->cgi != 0) // the reply is dropped when it comes
+		conn->cgi->owner = 0;
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		connections = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	admission_release (conn->slot);
+	num_connections --;
+	stats_count (STAT_ACTIVE, -1);
+	conn->closed = 1;
+	if (conn->ops == 0)
+		bury (conn);
+}
+
+/**
+ * consume_input: drops the first len bytes of the input buffer (a request
+ * that has been dealt with), moving whatever was pipelined after it to the
+ * front
+ */
+static void consume_input (struct connection *conn, int len) {
+	memmove (conn->in, conn->in + len, conn->in_len - len);
+	conn->in_len -= len;
+}
+
+/**
+ * claim_received: for a request with a body on the io_uring loop, which a
+ * cgi may take over together with the socket: the receive is cancelled
+ * there and then, and what it received before, in completions not yet
+ * handled, is added to the spill, so that all of the body is either in
+ * the buffer and the spill or still in the socket. The completions then
+ * only give their buffers back. The connection ends with this request.
+ */
+static void claim_received (struct connection *conn) {
+	struct io_uring_cqe *cqe;
+	unsigned int n;
+
+	if (conn->receiving)
+		uring_cancel_now (ring, ring_data (conn, OP_RECV));
+	for (n = 0; (cqe = uring_cqe_at (ring, n)) != 0; n ++) {
+		if (cqe->user_data != ring_data (conn, OP_RECV) ||
+				!(cqe->flags & IORING_CQE_F_BUFFER) || cqe->res <= 0)
+			continue;
+		char *spill = realloc (conn->spill, conn->spill_len + cqe->res);
+		if (spill == 0)
+			break;
+		memcpy (spill + conn->spill_len,
+				uring_buffer (ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT),
+				cqe->res);
+		conn->spill = spill;
+		conn->spill_len += cqe->res;
+	}
+	conn->claimed = 1;
+}
+
+/**
+ * start_relay: the request has forked a cgi whose output the connection
+ * relays: its pipe goes into the epoll set (which the io_uring loop polls
+ * too), and the context waits for the header lines to come
+ * returns: -1 if it cannot be relayed
+ */
+static int start_relay (struct connection *conn, struct request *ctx) {
+	struct epoll_event ev;
+
+	conn->cgi_out = ctx->cgi_out;
+	conn->cgi_ready = 1;
+	conn->relay = malloc (RELAY_LEN);
+	conn->waiting = malloc (sizeof (struct request));
+	if (conn->relay == 0 || conn->waiting == 0)
+		return (-1);
+	*conn->waiting = *ctx;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = relay_tag (conn);
+	return (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, conn->cgi_out, &ev));
+}
+
+/**
+ * watch_upstream: the connection of the proxied request goes into the
+ * epoll set, to be relayed as it can be written to and read from
+ * returns: -1 if it cannot be added
+ */
+static int watch_upstream (struct connection *conn) {
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = relay_tag (conn);
+	return (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, conn->proxy->fd, &ev));
+}
+
+/**
+ * start_proxy: the request has a call to an upstream, whose response the
+ * connection relays; the context waits for its header
+ * returns: -1 if it cannot be relayed
+ */
+static int start_proxy (struct connection *conn, struct request *ctx) {
+	conn->proxy = ctx->proxy;
+	conn->cgi_ready = 1;
+	conn->waiting = malloc (sizeof (struct request));
+	if (conn->waiting == 0)
+		return (-1);
+	*conn->waiting = *ctx;
+	return (watch_upstream (conn));
+}
+
+/**
+ * hand_over_tls: the connection goes on without the loop doing its TLS,
+ * on the descriptor tls_serve leaves: the socket, if the kernel encrypts
+ * it, or the pair of a relay forked for it. It goes into the epoll set in
+ * the socket's place (or gets its receive, on the io_uring loop); the
+ * socket is out of the set before that, as a relay is forked with it.
+ * returns: -1 if it cannot go on
+ */
+static int hand_over_tls (struct connection *conn) {
+	struct epoll_event ev;
+
+	epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+	int fd = tls_serve (conn->tls, conn->client);
+	conn->tls = 0;
+	if (fd == -1)
+		return (-1);
+	conn->fd = fd;
+	if (ring != 0) {
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+		return (0);
+	}
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	return (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+/**
+ * run_request: passes the request at the front of the buffer to the
+ * regular request processing, collecting the response in memory; if it is
+ * not complete (malformed, or too long for the buffer), it is answered
+ * with a 400 and the connection closed after that. A request passed on to
+ * a cgi pool leaves the connection waiting for the reply instead, and a
+ * forked cgi whose output is relayed (or an upstream's response) has it
+ * streaming. A request with a body on a connection the loop does the TLS
+ * of hands the connection over to a relay first, as a child forked for
+ * the request reads the body from the socket and answers there. Returns
+ * -1 if the connection was handed over to a forked child (cgi) and should
+ * be dropped; the part of a request body that has already been received
+ * goes with it.
+ */
+static int run_request (struct connection *conn, int complete) {
+	struct request ctx;
+	char *received = 0;
+
+	init_request (&ctx, conn->fd, 1);
+	ctx.client = conn->client [0] ? conn->client : 0;
+	stats_clock (&ctx.clock);
+	conn->started = ctx.clock;
+	if (complete)
+		request_from_header (&conn->parser, conn->in, &ctx);
+	else
+		keep_request_line (conn->in, conn->in_len, &ctx);
+	stats_phase (PHASE_PARSE, &ctx.clock);
+	ctx.body_timeout = config->body_timeout;
+	if (config->keepalive_timeout == 0 ||
+			++ conn->requests >= config->keepalive_requests)
+		ctx.keep_alive = 0;
+
+	if (complete && (ctx.content_length > 0 || ctx.chunked)) {
+		if (conn->tls != 0) { // a child forked for it may read the socket
+			if (hand_over_tls (conn) == -1)
+				return (-1);
+			ctx.sock = conn->fd;
+			ctx.client = conn->client [0] ? conn->client : 0;
+		}
+		if (ring != 0) {
+			claim_received (conn);
+			ctx.keep_alive = 0;
+		}
+		ctx.received = conn->in + conn->parser.length;
+		ctx.received_len = conn->in_len - conn->parser.length;
+		if (conn->spill_len > 0 &&
+				(received = malloc (ctx.received_len + conn->spill_len))) {
+			memcpy (received, ctx.received, ctx.received_len);
+			memcpy (received + ctx.received_len, conn->spill,
+					conn->spill_len);
+			ctx.received = received;
+			ctx.received_len += conn->spill_len;
+		}
+	}
+
+	FILE *fp = open_memstream (&conn->out, &conn->out_len);
+	if (fp == 0) {
+		free (received);
+		return (-1);
+	}
+	process_request (fp, &ctx);
+	fclose (fp);
+	free (received);
+	conn->clock = ctx.clock;
+	conn->packed = ctx.packed;
+	conn->packed_len = ctx.packed_len;
+	conn->pack = ctx.pack;
+
+	if (ctx.detached)
+		return (-1);
+	if (ctx.cgi_out != -1 && start_relay (conn, &ctx) == -1)
+		return (-1);
+	if (ctx.proxy != 0 && start_proxy (conn, &ctx) == -1)
+		return (-1);
+	if (ctx.cgi != 0) {
+		conn->waiting = malloc (sizeof (struct request));
+		if (conn->waiting == 0) {
+			ctx.cgi->owner = 0;
+			return (-1);
+		}
+		*conn->waiting = ctx;
+		conn->cgi = ctx.cgi;
+		conn->cgi->owner = conn;
+	}
+
+	consume_input (conn, complete ? conn->parser.length : conn->in_len);
+	parser_init (&conn->parser);
+	conn->discard = ctx.content_length;
+	conn->keep_alive = ctx.keep_alive;
+	conn->body_fd = ctx.body_fd;
+	memcpy (conn->body, ctx.body, sizeof (ctx.body));
+	conn->body_parts = ctx.body_parts;
+	conn->part = 0;
+	conn->prefix_off = 0;
+	conn->out_off = 0;
+	conn->state = ctx.cgi != 0 ? WAITING :
+					ctx.cgi_out != -1 || ctx.proxy != 0 ? STREAMING : WRITING;
+	return (0);
+}
+
+/**
+ * skip_body: drops the body of the previous request from the front of the
+ * buffer as far as it has arrived.
+ * returns: not-0 while there is more of it to come
+ */
+static int skip_body (struct connection *conn) {
+	int len;
+
+	if (conn->discard < 0) // the parser refuses those; never move backwards
+		conn->discard = 0;
+	len = conn->discard < conn->in_len ? conn->discard : conn->in_len;
+
+	consume_input (conn, len);
+	conn->discard -= len;
+	return (conn->discard > 0);
+}
+
+/**
+ * on_handshake: goes on with the TLS handshake of a connection to the
+ * HTTPS port; once it is done, the connection is served on its socket:
+ * by the kernel's TLS if it has taken over, else by the loop's, through
+ * the session, with the socket staying in the epoll set as it is
+ * returns: -1 if the handshake failed
+ */
+static int on_handshake (struct connection *conn) {
+	int done = tls_handshake (conn->tls);
+
+	if (done <= 0)
+		return (done);
+	conn->state = READING;
+	return (tls_kernel (conn->tls) ? hand_over_tls (conn) : 0);
+}
+
+/**
+ * on_readable: runs the next request if its header is already buffered
+ * (pipelined behind the previous one); otherwise drains the socket into the
+ * request buffer (edge-triggered, so until EAGAIN), parsing what comes,
+ * until the header is complete.
+ * returns: -1 if the connection should be dropped right away
+ */
+static int on_readable (struct connection *conn) {
+	while (conn->state == READING) {
+		if (!skip_body (conn)) {
+			switch (parse_request (&conn->parser, conn->in, conn->in_len)) {
+				case PARSE_DONE:
+					return (run_request (conn, 1));
+				case PARSE_ERROR:
+					return (run_request (conn, 0));
+				case PARSE_MORE:
+					if (conn->in_len == MAX_RQ_LEN - 1)
+						return (run_request (conn, 0));
+				break;
+			}
+		}
+
+		ssize_t n = conn->tls ? tls_read (conn->tls, conn->in + conn->in_len,
+										MAX_RQ_LEN - 1 - conn->in_len) :
+							read (conn->fd, conn->in + conn->in_len,
+									MAX_RQ_LEN - 1 - conn->in_len);
+		if (n == 0)
+			return (-1); // peer closed; between requests that's normal
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+
+		conn->in_len += n;
+		conn->progress += n;
+	}
+	return (0);
+}
+
+/**
+ * finish_response: the response is out; either wait for the next request
+ * on the connection or close it
+ */
+static void finish_response (struct connection *conn) {
+	if (conn->body_fd != -1) {
+		close (conn->body_fd);
+		conn->body_fd = -1;
+	}
+	free_body (conn->body, conn->body_parts);
+	conn->body_parts = 0;
+	free (conn->out);
+	conn->out = 0;
+	conn->out_len = conn->out_off = 0;
+	pack_release (conn->pack);
+	conn->pack = 0;
+	conn->packed = 0;
+	conn->packed_len = 0;
+	stats_phase (PHASE_SEND, &conn->clock);
+	stats_phase (PHASE_TOTAL, &conn->started);
+	conn->state = conn->keep_alive ? READING : DONE;
+}
+
+/**
+ * all_sent: everything of the response there is has been sent: it is
+ * finished, unless it is a cgi's that is still coming
+ * returns: 1
+ */
+static int all_sent (struct connection *conn) {
+	if (conn->state == STREAMING)
+		conn->out_len = conn->out_off = 0;
+	else
+		finish_response (conn);
+	return (1);
+}
+
+/**
+ * send_more: sends on the connection, reporting whether to go on
+ * returns: the number of bytes sent, or -1 if the socket is full (or the
+ * connection broken, in which case it is marked DONE)
+ */
+static ssize_t send_more (struct connection *conn, ssize_t n) {
+	if (n < 0 && errno != EAGAIN && errno != EINTR)
+		conn->state = DONE;
+	if (n == 0) { // file shrank under us; nothing sensible to add
+		conn->state = DONE;
+		n = -1;
+	}
+	if (n > 0) {
+		stats_count (STAT_BYTES_SENT, n);
+		conn->progress += n;
+	}
+	return (n);
+}
+
+/**
+ * unsent: the iovecs of what is left of the in-memory part of the response
+ * and of the packed file after it
+ * returns: how many there are
+ */
+static int unsent (struct connection *conn, struct iovec *iov) {
+	int count = 0;
+
+	if (conn->out_off < conn->out_len) {
+		iov [count].iov_base = conn->out + conn->out_off;
+		iov [count ++].iov_len = conn->out_len - conn->out_off;
+	}
+	size_t packed_off = conn->out_off > conn->out_len ?
+						conn->out_off - conn->out_len : 0;
+	if (packed_off < conn->packed_len) {
+		iov [count].iov_base = conn->packed + packed_off;
+		iov [count ++].iov_len = conn->packed_len - packed_off;
+	}
+	return (count);
+}
+
+/**
+ * on_writable: sends as much of the pending response as the socket takes,
+ * first the in-memory part (with a packed file after it, both in one
+ * call), then the parts of the file body: for each one, its in-memory
+ * lines (only multipart bodies have them) and its range of the file.
+ * Everything but the last piece is sent with MSG_MORE, so the kernel can
+ * fill the segments; file ranges go out with sendfile, straight from the
+ * page cache.
+ * returns: not-0 if the response (as far as there is one) has been sent
+ */
+static int on_writable (struct connection *conn) {
+	int parts = conn->body_fd != -1 ? conn->body_parts : 0;
+	struct iovec iov [2];
+	struct msghdr msg;
+	ssize_t n;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	while ((msg.msg_iovlen = unsent (conn, iov)) > 0) {
+		n = send_more (conn, sendmsg (conn->fd, &msg, parts ? MSG_MORE : 0));
+		if (n < 0)
+			return (0);
+		conn->out_off += n;
+	}
+
+	for (; conn->part < parts; conn->part ++, conn->prefix_off = 0) {
+		struct body_segment *seg = conn->body + conn->part;
+		int more = (seg->len > 0 || conn->part + 1 < parts) ? MSG_MORE : 0;
+		while (conn->prefix_off < seg->prefix_len) {
+			n = send_more (conn, send (conn->fd,
+							seg->prefix + conn->prefix_off,
+							seg->prefix_len - conn->prefix_off, more));
+			if (n < 0)
+				return (0);
+			conn->prefix_off += n;
+		}
+		while (seg->len > 0) {
+			n = send_more (conn, sendfile (conn->fd, conn->body_fd,
+											&seg->off, seg->len));
+			if (n < 0)
+				return (0);
+			seg->len -= n;
+		}
+	}
+
+	return (all_sent (conn));
+}
+
+/**
+ * fill_stage: copies the next of the response into the (empty) stage, up
+ * to a record's worth: of the in-memory part and the packed file after it,
+ * then of the parts of the file body, their in-memory lines and their
+ * ranges of the file
+ * returns: -1 if out of memory, or the file cannot be read
+ */
+static int fill_stage (struct connection *conn) {
+	int parts = conn->body_fd != -1 ? conn->body_parts : 0;
+	struct iovec iov [2];
+	int count = unsent (conn, iov), idx;
+	size_t len;
+
+	if (conn->stage == 0 && (conn->stage = malloc (TLS_RECORD)) == 0)
+		return (-1);
+	for (idx = 0; idx < count && conn->stage_len < TLS_RECORD; idx ++) {
+		len = TLS_RECORD - conn->stage_len;
+		if (len > iov [idx].iov_len)
+			len = iov [idx].iov_len;
+		memcpy (conn->stage + conn->stage_len, iov [idx].iov_base, len);
+		conn->stage_len += len;
+		conn->out_off += len;
+	}
+
+	while (conn->part < parts && conn->stage_len < TLS_RECORD) {
+		struct body_segment *seg = conn->body + conn->part;
+		len = TLS_RECORD - conn->stage_len;
+		if (conn->prefix_off < seg->prefix_len) {
+			if (len > seg->prefix_len - conn->prefix_off)
+				len = seg->prefix_len - conn->prefix_off;
+			memcpy (conn->stage + conn->stage_len,
+					seg->prefix + conn->prefix_off, len);
+			conn->prefix_off += len;
+		} else if (seg->len > 0) {
+			ssize_t n = pread (conn->body_fd, conn->stage + conn->stage_len,
+								seg->len < len ? seg->len : len, seg->off);
+			if (n <= 0) // the file shrank under us, or cannot be read
+				return (-1);
+			seg->off += n;
+			seg->len -= n;
+			len = n;
+		} else {
+			conn->part ++;
+			conn->prefix_off = 0;
+			continue;
+		}
+		conn->stage_len += len;
+	}
+	return (0);
+}
+
+/**
+ * tls_writable: on_writable for a connection the loop does the TLS of:
+ * the response goes through the stage, which is filled a record at a time
+ * and written through the session; what the socket does not take stays
+ * there, as a TLS write has to be retried with the same bytes
+ * returns: not-0 if the response (as far as there is one) has been sent
+ */
+static int tls_writable (struct connection *conn) {
+	for (;;) {
+		if (conn->stage_off == conn->stage_len) {
+			conn->stage_off = conn->stage_len = 0;
+			if (fill_stage (conn) == -1) {
+				conn->state = DONE;
+				return (0);
+			}
+			if (conn->stage_len == 0)
+				return (all_sent (conn));
+		}
+		ssize_t n = send_more (conn, tls_write (conn->tls,
+								conn->stage + conn->stage_off,
+								conn->stage_len - conn->stage_off));
+		if (n < 0)
+			return (0);
+		conn->stage_off += n;
+	}
+}
+
+/**
+ * take_spill: moves what the buffer has room for from the spill into it
+ * returns: the number of bytes moved
+ */
+static int take_spill (struct connection *conn) {
+	int len = MAX_RQ_LEN - 1 - conn->in_len;
+
+	if (len > conn->spill_len)
+		len = conn->spill_len;
+	memcpy (conn->in + conn->in_len, conn->spill, len);
+	conn->in_len += len;
+	memmove (conn->spill, conn->spill + len, conn->spill_len - len);
+	conn->spill_len -= len;
+	return (len);
+}
+
+/**
+ * arm_receive: makes sure the connection's multishot receive is armed,
+ * unless the spill is full
+ * returns: -1 if it cannot be submitted
+ */
+static int arm_receive (struct connection *conn) {
+	if (conn->receiving || conn->spill_len >= SPILL_MAX)
+		return (0);
+	if (uring_recv (ring, conn->fd, ring_data (conn, OP_RECV)) == -1)
+		return (-1);
+	conn->receiving = 1;
+	conn->ops ++;
+	return (0);
+}
+
+/**
+ * ring_readable: on_readable for the io_uring loop: the data has already
+ * been received into the buffer (or the spill behind it) by the completions
+ * of the connection's receive, so this only runs the next request once its
+ * header is complete, and otherwise has the receive armed
+ * returns: -1 if the connection should be dropped right away
+ */
+static int ring_readable (struct connection *conn) {
+	while (conn->state == READING) {
+		if (!skip_body (conn)) {
+			switch (parse_request (&conn->parser, conn->in, conn->in_len)) {
+				case PARSE_DONE:
+					return (run_request (conn, 1));
+				case PARSE_ERROR:
+					return (run_request (conn, 0));
+				case PARSE_MORE:
+					if (conn->in_len == MAX_RQ_LEN - 1)
+						return (run_request (conn, 0));
+				break;
+			}
+		}
+
+		if (take_spill (conn) > 0)
+			continue;
+		if (conn->eof)
+			return (-1);
+		return (arm_receive (conn));
+	}
+	return (0);
+}
+
+/**
+ * submitted: the connection has a send in flight, if it could be submitted
+ */
+static int submitted (struct connection *conn, int ret) {
+	if (ret == -1)
+		conn->state = DONE;
+	else {
+		conn->sending = 1;
+		conn->ops ++;
+	}
+	return (0);
+}
+
+/**
+ * ring_writable: on_writable for the io_uring loop: submits the next piece
+ * of the response, unless one is in flight (its completion moves the
+ * connection on). The in-memory part, with a packed file after it, goes in
+ * one sendmsg, and the in-memory lines of the body parts with send; the
+ * file ranges are spliced through the connection's pipe a chunk at a time,
+ * from the file into the pipe and from the pipe into the socket.
+ * returns: not-0 if the response (as far as there is one) has been sent
+ */
+static int ring_writable (struct connection *conn) {
+	int parts = conn->body_fd != -1 ? conn->body_parts : 0;
+
+	if (conn->sending)
+		return (0);
+	if ((conn->msg.msg_iovlen = unsent (conn, conn->iov)) > 0) {
+		conn->msg.msg_iov = conn->iov;
+		return (submitted (conn, uring_sendmsg (ring, conn->fd, &conn->msg,
+						parts ? MSG_MORE : 0, ring_data (conn, OP_SENDMSG))));
+	}
+
+	for (; conn->part < parts; conn->part ++, conn->prefix_off = 0) {
+		struct body_segment *seg = conn->body + conn->part;
+		int more = (seg->len > 0 || conn->part + 1 < parts);
+		if (conn->prefix_off < seg->prefix_len)
+			return (submitted (conn, uring_send (ring, conn->fd,
+							seg->prefix + conn->prefix_off,
+							seg->prefix_len - conn->prefix_off,
+							more ? MSG_MORE : 0, ring_data (conn, OP_SEND))));
+		if (conn->piped > 0)
+			return (submitted (conn, uring_splice (ring, conn->pipe [0], -1,
+							conn->fd, conn->piped, more ? SPLICE_F_MORE : 0,
+							ring_data (conn, OP_SPLICE_OUT))));
+		if (seg->len > 0) {
+			if (conn->pipe [0] == -1 && pipe2 (conn->pipe, O_CLOEXEC) == -1)
+				return (submitted (conn, -1));
+			return (submitted (conn, uring_splice (ring, conn->body_fd,
+							seg->off, conn->pipe [1],
+							seg->len < PIPE_CHUNK ? seg->len : PIPE_CHUNK, 0,
+							ring_data (conn, OP_SPLICE_IN))));
+		}
+	}
+
+	return (all_sent (conn));
+}
+
+/**
+ * append_out: adds len bytes to the in-memory response, behind what is
+ * still to be sent of it
+ * returns: 0 on success, -1 if out of memory
+ */
+static int append_out (struct connection *conn, char *data, size_t len) {
+	char *out = realloc (conn->out, conn->out_len + len);
+
+	if (out == 0)
+		return (-1);
+	memcpy (out + conn->out_len, data, len);
+	conn->out = out;
+	conn->out_len += len;
+	return (0);
+}
+
+/**
+ * relay_header: the response header, once the header lines of the cgi's
+ * output are in (or there is no more room to wait for them); what they
+ * took is dropped from the relay buffer
+ * returns: -1 if out of memory
+ */
+static int relay_header (struct connection *conn, int at_end) {
+	char *head;
+	size_t head_len;
+	FILE *fp = open_memstream (&head, &head_len);
+
+	if (fp == 0)
+		return (-1);
+	int used = cgi_stream_header (conn->waiting, fp, conn->relay,
+						conn->relay_len, at_end || conn->relay_len == RELAY_LEN);
+	fclose (fp);
+	int ret = used == -1 ? 0 : append_out (conn, head, head_len);
+	free (head);
+	if (used == -1 || ret == -1)
+		return (ret);
+
+	conn->keep_alive = conn->waiting->keep_alive;
+	free (conn->waiting);
+	conn->waiting = 0;
+	memmove (conn->relay, conn->relay + used, conn->relay_len - used);
+	conn->relay_len -= used;
+	stats_clock (&conn->clock); // the wait is not part of sending
+	return (0);
+}
+
+/**
+ * relay_cgi: reads what the cgi has written, as much as there is up to a
+ * chunk's worth, and adds it to the response: the header, once all of the
+ * cgi's header lines are in, then the rest as one chunk, so that a cgi
+ * writing little at a time still goes out in large pieces. At the end of
+ * the output comes the last chunk, and the response is finished as any
+ * other. Only called while no send is in flight, as the response buffer
+ * may move.
+ * returns: -1 if the response cannot go on
+ */
+static int relay_cgi (struct connection *conn) {
+	int at_end = 0;
+	char size [32];
+
+	while (conn->relay_len < RELAY_LEN) {
+		ssize_t n = read (conn->cgi_out, conn->relay + conn->relay_len,
+							RELAY_LEN - conn->relay_len);
+		if (n > 0)
+			conn->relay_len += n;
+		else if (n == -1 && errno == EAGAIN) {
+			conn->cgi_ready = 0;
+			break;
+		} else if (n == 0 || errno != EINTR) {
+			at_end = 1;
+			break;
+		}
+	}
+	if (conn->waiting != 0 && relay_header (conn, at_end) == -1)
+		return (-1);
+	if (conn->waiting != 0) // the header lines are not all in yet
+		return (0);
+
+	if (conn->relay_len > 0) {
+		int len = snprintf (size, sizeof (size), "%zx\r\n", conn->relay_len);
+		if (append_out (conn, size, len) == -1 ||
+				append_out (conn, conn->relay, conn->relay_len) == -1 ||
+				append_out (conn, "\r\n", 2) == -1)
+			return (-1);
+		conn->relay_len = 0;
+	}
+	if (at_end) {
+		if (append_out (conn, "0\r\n\r\n", 5) == -1)
+			return (-1);
+		stop_relay (conn);
+		conn->state = WRITING;
+	}
+	return (0);
+}
+
+/**
+ * gateway_error: the upstream (or the cgi pool) failed the waiting request
+ * before its response started; it is answered with a 502, or a 504 if it
+ * took too long, and the call is over
+ * returns: -1 if out of memory
+ */
+static int gateway_error (struct connection *conn, int timed_out) {
+	char *out;
+	size_t len;
+	FILE *fp = open_memstream (&out, &len);
+
+	if (fp == 0)
+		return (-1);
+	bad_gateway (conn->waiting, fp, timed_out);
+	fclose (fp);
+	int ret = append_out (conn, out, len);
+	free (out);
+	conn->keep_alive = conn->waiting->keep_alive;
+	free (conn->waiting);
+	conn->waiting = 0;
+	stop_relay (conn);
+	stats_clock (&conn->clock);
+	conn->state = WRITING;
+	return (ret);
+}
+
+/**
+ * retry_proxy: the upstream's connection failed before any of the
+ * response came; the request goes out again on another (proxy_retry), or
+ * is answered with a 502 if there is nothing left to try
+ * returns: -1 if the response cannot go on
+ */
+static int retry_proxy (struct connection *conn) {
+	epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->proxy->fd, 0);
+	if (proxy_retry (conn->proxy) == -1)
+		return (gateway_error (conn, 0));
+	conn->cgi_ready = 1;
+	return (watch_upstream (conn));
+}
+
+/**
+ * relay_proxy: moves a proxied request along: sends what is left of its
+ * header upstream, then reads what has come of the response, up to a
+ * buffer's worth, and adds it to the response as its framing goes. The
+ * request is logged once the header is through; once the response is
+ * complete, the upstream's connection goes back to the pool and the
+ * response is finished as any other. Only called while no send is in
+ * flight, as the response buffer may move.
+ * returns: -1 if the response cannot go on
+ */
+static int relay_proxy (struct connection *conn) {
+	static char buf [RELAY_LEN];
+	struct proxy_call *call = conn->proxy;
+	int sent = proxy_send (call);
+	ssize_t n = -1;
+	char *out;
+	size_t len;
+
+	if (sent == 1)
+		while ((n = read (call->fd, buf, RELAY_LEN)) == -1 && errno == EINTR)
+			;
+	if (sent == 0 || (n == -1 && errno == EAGAIN)) {
+		conn->cgi_ready = 0;
+		return (0);
+	}
+	if (n <= 0 && call->received == 0)
+		return (retry_proxy (conn));
+	if (n > 0)
+		conn->progress += n;
+
+	FILE *fp = open_memstream (&out, &len);
+	if (fp == 0)
+		return (-1);
+	int ret = proxy_relay (call, conn->waiting, buf, n > 0 ? n : 0, fp);
+	fclose (fp);
+	if (ret != -1 && append_out (conn, out, len) == -1)
+		ret = -1;
+	free (out);
+	if (ret == -1 && call->state == REPLY_HEADER)
+		return (gateway_error (conn, 0));
+	if (ret == -1)
+		return (-1);
+
+	if (conn->waiting != 0 && call->state != REPLY_HEADER) {
+		conn->keep_alive = conn->waiting->keep_alive;
+		access_log (conn->waiting);
+		free (conn->waiting);
+		conn->waiting = 0;
+		stats_clock (&conn->clock); // the wait is not part of sending
+	}
+	if (ret == 1) {
+		stop_relay (conn);
+		conn->state = WRITING;
+	}
+	return (0);
+}
+
+/**
+ * ticks: the monotonic clock, in ticks of the timer wheel
+ */
+static unsigned long ticks (void) {
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec * (1000 / TICK_MS) + now.tv_nsec / (TICK_MS * 1000000));
+}
+
+/**
+ * watch: sets the connection's deadline for the state it has been left
+ * in, unless it is the one already set: while it waits for the next
+ * request, the keep-alive timeout; once a byte of one has come, the header
+ * timeout, which is not put off by more bytes; while it skips a request
+ * body or sends the response, the body or send timeout from the last bytes
+ * that moved; while it waits for an upstream, the proxy timeout likewise;
+ * while it waits for a cgi pool, the cgi timeout from when the request was
+ * sent. None while a forked cgi is to be waited for.
+ */
+static void watch (struct connection *conn) {
+	enum timeout timeout = NO_TIMEOUT;
+	long long mark = conn->progress;
+	int seconds = 0;
+
+	if (conn->state == READING && conn->discard > 0) {
+		timeout = TIMEOUT_BODY;
+		seconds = config->body_timeout;
+	} else if (conn->state == READING || conn->state == HANDSHAKE) {
+		timeout = conn->in_len == 0 && conn->requests > 0 ?
+					TIMEOUT_IDLE : TIMEOUT_HEADER;
+		seconds = timeout == TIMEOUT_IDLE ? config->keepalive_timeout :
+					config->header_timeout;
+		mark = conn->requests;
+	} else if (conn->state == WRITING ||
+			(conn->state == STREAMING && conn->out_off < conn->out_len)) {
+		timeout = TIMEOUT_SEND;
+		seconds = config->send_timeout;
+	} else if (conn->state == STREAMING && conn->proxy != 0) {
+		timeout = TIMEOUT_UPSTREAM;
+		seconds = config->proxy_timeout;
+	} else if (conn->state == WAITING) {
+		timeout = TIMEOUT_CGI;
+		seconds = config->cgi_timeout;
+		mark = conn->requests;
+	}
+
+	if (timeout == conn->timeout && mark == conn->timed)
+		return;
+	conn->timeout = timeout;
+	conn->timed = mark;
+	if (timeout == NO_TIMEOUT || seconds == 0)
+		timer_cancel (&conn->timer);
+	else
+		timer_set (&timers, &conn->timer,
+					ticks () + seconds * (1000 / TICK_MS));
+}
+
+static int serve (struct connection *conn);
+
+/**
+ * timed_out: a connection's deadline has passed; it is closed, unless
+ * it is an upstream's that has not started the response, or a cgi pool's
+ * that has not answered (its reply is given up on): then the response is
+ * a 504
+ */
+static void timed_out (struct timer *timer) {
+	struct connection *conn = (struct connection *)
+				((char *) timer - offsetof (struct connection, timer));
+
+	stats_count (timeout_counters [conn->timeout], 1);
+	if (conn->timeout == TIMEOUT_CGI && conn->cgi != 0) {
+		cgi_cancel (conn->cgi);
+		conn->cgi = 0;
+		if (gateway_error (conn, 1) == 0 && serve (conn) == 0)
+			return;
+	}
+	if (conn->timeout == TIMEOUT_UPSTREAM && conn->waiting != 0 &&
+			gateway_error (conn, 1) == 0 && serve (conn) == 0)
+		return;
+	close_connection (conn);
+}
+
+/**
+ * serve: moves a connection along as far as it goes without blocking:
+ * finishes its TLS handshake, reads and runs a request, sends the response (relaying a cgi's output
+ * while there is room for it), and then goes on with the next request if
+ * one is pipelined behind it. Its deadline is then set for where it stopped.
+ * returns: -1 if the connection is done and should be closed
+ */
+static int serve (struct connection *conn) {
+	int again;
+
+	do {
+		again = 0;
+		if (conn->state == HANDSHAKE && on_handshake (conn) == -1)
+			return (-1);
+		if (conn->state == READING && (ring && conn->tls == 0 ?
+				ring_readable (conn) : on_readable (conn)) == -1)
+			return (-1);
+		if (conn->state == STREAMING && conn->cgi_ready && !conn->sending &&
+				conn->out_len - conn->out_off < RELAY_LEN &&
+				(conn->proxy ? relay_proxy (conn) : relay_cgi (conn)) == -1)
+			return (-1);
+		if ((conn->state == WRITING || conn->state == STREAMING) &&
+				(conn->tls ? tls_writable (conn) : ring ?
+				ring_writable (conn) : on_writable (conn)))
+			again = (conn->state == READING ||
+						(conn->state == STREAMING && conn->cgi_ready));
+	} while (again);
+
+	if (conn->state == DONE)
+		return (-1);
+	watch (conn);
+	return (0);
+}
+
+/**
+ * cgi_done: the reply of a cgi pool is complete; the waiting connection
+ * gets its response and is moved along (or the reply is dropped, if the
+ * connection is gone)
+ */
+static void cgi_done (struct cgi_reply *reply) {
+	struct connection *conn = reply->owner;
+
+	if (conn != 0) {
+		free (conn->out);
+		FILE *fp = open_memstream (&conn->out, &conn->out_len);
+		if (fp != 0) {
+			finish_cgi (conn->waiting, fp, reply);
+			fclose (fp);
+		}
+		conn->keep_alive = fp != 0 && conn->waiting->keep_alive;
+		free (conn->waiting);
+		conn->waiting = 0;
+		conn->cgi = 0;
+		conn->out_off = 0;
+		stats_clock (&conn->clock); // the wait is not part of sending
+		conn->state = fp != 0 ? WRITING : DONE;
+		if (serve (conn) == -1)
+			close_connection (conn);
+	}
+	cgi_reply_free (reply);
+}
+
+/**
+ * add_connection: starts serving an accepted socket (charged to the slot
+ * of the connection limits): adds it to the epoll set, or arms its receive.
+ * One from the HTTPS port starts with its handshake, in the epoll set.
+ */
+static void add_connection (int fd, int slot, int tls) {
+	struct connection *conn = new_connection (fd, slot);
+	struct epoll_event ev;
+
+	if (conn == 0) {
+		perror ("connection");
+		admission_release (slot);
+		close (fd);
+		return;
+	}
+	if (tls && (conn->tls = tls_open (fd)) == 0) {
+		close_connection (conn);
+		return;
+	}
+	if (tls)
+		conn->state = HANDSHAKE;
+	watch (conn);
+	if (ring != 0 && !tls) {
+		if (arm_receive (conn) == -1) {
+			perror ("io_uring");
+			close_connection (conn);
+		}
+		return;
+	}
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = tls ? tls_tag (conn) : conn;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror ("epoll_ctl");
+		close_connection (conn);
+	}
+}
+
+/**
+ * accept_all: accepts every pending connection on the (non-blocking)
+ * listening socket, or the HTTPS one, and starts serving it, unless it is
+ * over the connection limits (then it is shed as it is accepted). The
+ * io_uring loop's sockets are left blocking: the ring waits for them
+ * itself; but not during a handshake.
+ */
+static void accept_all (int listen_fd) {
+	int tls = listen_fd == tls_fd;
+
+	for (;;) {
+		int fd = admission_accept (listen_fd, ring && !tls ? SOCK_CLOEXEC :
+											SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EINTR &&
+									errno != ECONNABORTED)
+				perror ("accept");
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		int slot = admission_admit (fd);
+		if (slot != -1)
+			add_connection (fd, slot, tls);
+	}
+}
+
+/**
+ * stop_tls: a stopping loop takes the connections already queued on the
+ * HTTPS socket, and closes it
+ */
+static void stop_tls (void) {
+	if (tls_fd == -1)
+		return;
+	accept_all (tls_fd);
+	close (tls_fd);
+	tls_fd = -1;
+}
+
+/**
+ * other_event: handles an event of the epoll set that is not a connection's
+ * socket: the file cache's inotify descriptor, the HTTPS listening socket,
+ * a cgi pool's channel or the output of a cgi (or an upstream's connection)
+ * being relayed, or the socket of a connection the loop does TLS on
+ * returns: not-0 if it was one of those
+ */
+static int other_event (void *ptr) {
+	if (ptr == &cache_events) {
+		cache_process_events ();
+		return (1);
+	}
+	if (ptr == &tls_events) {
+		accept_all (tls_fd);
+		return (1);
+	}
+	if ((unsigned long) ptr & 2) { // a connection the loop does TLS on
+		struct connection *conn =
+				(struct connection *) ((unsigned long) ptr & ~2UL);
+		if (!conn->closed && serve (conn) == -1)
+			close_connection (conn);
+		return (1);
+	}
+	if ((unsigned long) ptr & 1) { // a relayed cgi's output
+		struct connection *conn =
+				(struct connection *) ((unsigned long) ptr & ~1UL);
+		conn->cgi_ready = 1;
+		if (!conn->closed && serve (conn) == -1)
+			close_connection (conn);
+		return (1);
+	}
+	if (cgi_is_channel (ptr)) {
+		cgi_channel_ready (ptr, cgi_done);
+		return (1);
+	}
+	return (0);
+}
+
+/**
+ * ring_received: a completion of a connection's receive. The data is
+ * copied out of the provided buffer, which goes back to the kernel right
+ * away: into the request buffer as far as it has room, the rest into the
+ * spill; once the spill is full, the receive is cancelled until the
+ * connection catches up. The receive ends when the peer closes or resets
+ * the connection, and also when it is cancelled, or the kernel runs out of
+ * buffers (then it is armed again when the connection needs more).
+ */
+static void ring_received (struct connection *conn, struct io_uring_cqe *cqe) {
+	int res = cqe->res;
+
+	if ((cqe->flags & IORING_CQE_F_BUFFER) && conn->claimed)
+		uring_buffer_return (ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	else if (cqe->flags & IORING_CQE_F_BUFFER) {
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char *data = uring_buffer (ring, bid);
+		int len = conn->spill_len > 0 ? 0 : MAX_RQ_LEN - 1 - conn->in_len;
+		if (len > res)
+			len = res;
+		memcpy (conn->in + conn->in_len, data, len);
+		conn->in_len += len;
+		if (res > len) {
+			char *spill = realloc (conn->spill, conn->spill_len + res - len);
+			if (spill == 0)
+				conn->state = DONE;
+			else {
+				memcpy (spill + conn->spill_len, data + len, res - len);
+				conn->spill = spill;
+				conn->spill_len += res - len;
+			}
+		}
+		uring_buffer_return (ring, bid);
+		conn->progress += res;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		conn->receiving = conn->throttled = 0;
+	if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED))
+		conn->eof = 1;
+
+	if (conn->receiving && !conn->throttled &&
+			conn->spill_len >= SPILL_MAX) {
+		uring_cancel (ring, ring_data (conn, OP_RECV),
+						ring_data (0, OP_CANCEL));
+		conn->throttled = 1;
+	}
+	if ((conn->state == READING || conn->state == DONE) && serve (conn) == -1)
+		close_connection (conn);
+}
+
+/**
+ * ring_sent: a completion of a send or a splice; the connection goes on
+ * with the rest of the response
+ */
+static void ring_sent (struct connection *conn, enum ring_op op, int res) {
+	struct body_segment *seg = conn->body + conn->part;
+	ssize_t n = res;
+
+	conn->sending = 0;
+	if (res < 0)
+		errno = -res;
+	if (op == OP_SPLICE_IN) {
+		if (res > 0) {
+			seg->off += res;
+			seg->len -= res;
+			conn->piped = res;
+		} else if (res == 0 || (errno != EAGAIN && errno != EINTR))
+			conn->state = DONE; // file shrank, or cannot be read
+	} else if ((n = send_more (conn, res < 0 ? -1 : n)) > 0) {
+		if (op == OP_SENDMSG)
+			conn->out_off += n;
+		else if (op == OP_SEND)
+			conn->prefix_off += n;
+		else
+			conn->piped -= n;
+	}
+	if (serve (conn) == -1)
+		close_connection (conn);
+}
+
+/**
+ * ring_accepted: a completion of the multishot accept; it is armed again
+ * if it ended. When the process is out of descriptors, the pending
+ * connections are shed by accept_all.
+ */
+static void ring_accepted (int res, int more, int listen_fd) {
+	if (res >= 0) {
+		int slot = admission_admit (res);
+		if (slot != -1)
+			add_connection (res, slot, 0);
+	} else if (res == -EMFILE || res == -ENFILE)
+		accept_all (listen_fd);
+	if (!more && (accepting = listen_fd != -1) &&
+			uring_accept (ring, listen_fd, ring_data (0, OP_ACCEPT)) == -1) {
+		accepting = 0;
+		perror ("io_uring accept");
+	}
+}
+
+/**
+ * ring_other_events: the epoll set of the other descriptors (the cache's,
+ * the cgi pools', the HTTPS socket's and the handshakes') is polled through
+ * the ring; when it is readable, all of its events are handled
+ */
+static void ring_other_events (int epfd, int more) {
+	struct epoll_event events [MAX_EVENTS];
+	int nready, idx;
+
+	do {
+		nready = epoll_wait (epfd, events, MAX_EVENTS, 0);
+		for (idx = 0; idx < nready; idx ++)
+			other_event (events [idx].data.ptr);
+	} while (nready == MAX_EVENTS);
+	if (!more && uring_poll (ring, epfd, ring_data (0, OP_POLL)) == -1)
+		perror ("io_uring poll");
+}
+
+/**
+ * ring_complete: dispatches a completion. The completions of a closed
+ * connection only return their buffers; the last one frees it.
+ */
+static void ring_complete (struct io_uring_cqe *cqe, int listen_fd, int epfd) {
+	struct connection *conn =
+			(struct connection *) (unsigned long) (cqe->user_data & ~OP_MASK);
+	enum ring_op op = cqe->user_data & OP_MASK;
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (op == OP_ACCEPT)
+		ring_accepted (cqe->res, more, listen_fd);
+	else if (op == OP_POLL)
+		ring_other_events (epfd, more);
+	if (conn == 0)
+		return;
+
+	if (!more)
+		conn->ops --;
+	if (conn->closed) {
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			uring_buffer_return (ring,
+							cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (conn->ops == 0)
+			bury (conn);
+	} else if (op == OP_RECV)
+		ring_received (conn, cqe);
+	else
+		ring_sent (conn, op, cqe->res);
+}
+
+/**
+ * loop_done: the last connection of a stopping loop is finished
+ * returns: the exit code for the process
+ */
+static int loop_done (void) {
+	long hits, misses;
+
+	cache_counts (&hits, &misses);
+	if (hits + misses > 0)
+		fprintf (stderr, "file cache: %ld hits, %ld misses (%ld%%)\n",
+				hits, misses, 100 * hits / (hits + misses));
+	cgi_pools_stop ();
+	access_log_stop ();
+	return (0);
+}
+
+/**
+ * ring_loop: the loop on io_uring. The listening socket has a multishot
+ * accept, every connection a multishot receive into the provided buffers,
+ * and the epoll set of the other descriptors a multishot poll; the loop
+ * submits what the completions of a round call for and waits for the next
+ * ones in the same system call.
+ * returns: the exit code for the process
+ */
+static int ring_loop (int listen_fd, int epfd) {
+	time_t last_sweep = time (0);
+	struct io_uring_cqe *cqe;
+
+	if (uring_accept (ring, listen_fd, ring_data (0, OP_ACCEPT)) == -1 ||
+			uring_poll (ring, epfd, ring_data (0, OP_POLL)) == -1) {
+		perror ("io_uring");
+		return (1);
+	}
+	accepting = 1;
+
+	for (;;) {
+		if (repack_files) {
+			repack_files = 0;
+			pack_build (config);
+		}
+		if (reload_server) {
+			reload_server = 0;
+			if (reload_start (config) == 0)
+				stop_serving = 1; // the successor takes the new ones
+		}
+		if (stop_serving && listen_fd != -1) {
+			if (uring_cancel (ring, ring_data (0, OP_ACCEPT),
+								ring_data (0, OP_CANCEL)) == -1)
+				accepting = 0;
+			accept_all (listen_fd);
+			close (listen_fd);
+			listen_fd = -1;
+			stop_tls ();
+		}
+		// the accept's last completion, after the cancel, may yet bring
+		// connections it took
+		if (listen_fd == -1 && num_connections == 0 && !accepting)
+			return (loop_done ());
+
+		if (uring_wait (ring, STOP_CHECK_MS) == -1 && errno != ETIME &&
+				errno != EINTR && errno != EBUSY) {
+			perror ("io_uring_enter");
+			return (1);
+		}
+		while ((cqe = uring_cqe (ring)) != 0) {
+			struct io_uring_cqe done = *cqe;
+			uring_cqe_seen (ring); // copied, so the slot can be reused
+			ring_complete (&done, listen_fd, epfd);
+		}
+		timer_advance (&timers, ticks (), timed_out);
+		free_buried ();
+
+		access_log_flush ();
+		if (time (0) != last_sweep) {
+			cgi_pools_check ();
+			last_sweep = time (0);
+		}
+	}
+}
+
+/**
+ * event_loop: serves all connections on the configured listening socket
+ * from this process. When asked to stop (a worker getting SIGTERM, or a
+ * server whose successor has taken over), takes the connections already
+ * queued, closes the listening socket and returns once the last connection
+ * is finished.
+ * returns: the exit code for the process
+ */
+int event_loop (struct server *settings) {
+	struct epoll_event events [MAX_EVENTS];
+	struct epoll_event ev;
+	int listen_fd = settings->socket;
+	time_t last_sweep = time (0);
+
+	config = settings;
+	timer_init (&timers, ticks ());
+	signal (SIGPIPE, SIG_IGN); // a vanished client must not kill the loop
+
+	int epfd = epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror ("epoll_create1");
+		return (1);
+	}
+
+	if (config->io_uring) {
+		ring = uring_open (RING_ENTRIES);
+		if (ring != 0 &&
+				uring_buffers (ring, RING_BUFFERS, RING_BUFFER_LEN) == -1) {
+			uring_close (ring);
+			ring = 0;
+		}
+		if (ring == 0)
+			fprintf (stderr, "No io_uring (%s), using epoll\n",
+							strerror (errno));
+	}
+
+	fcntl (listen_fd, F_SETFL, fcntl (listen_fd, F_GETFL) | O_NONBLOCK);
+	fcntl (listen_fd, F_SETFD, FD_CLOEXEC); // cgi children don't need it
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = 0; // the listening socket is the only one without a conn
+	if (ring == 0 && epoll_ctl (epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		perror ("epoll_ctl");
+		return (1);
+	}
+	if ((tls_fd = settings->tls_socket) != -1) { // polled on either loop
+		fcntl (tls_fd, F_SETFL, fcntl (tls_fd, F_GETFL) | O_NONBLOCK);
+		fcntl (tls_fd, F_SETFD, FD_CLOEXEC);
+		ev.data.ptr = &tls_events;
+		if (epoll_ctl (epfd, EPOLL_CTL_ADD, tls_fd, &ev) == -1) {
+			perror ("epoll_ctl");
+			return (1);
+		}
+	}
+
+	if (admission_init (config) == -1) {
+		perror ("connection limits");
+		return (1);
+	}
+	if (cache_init (config->cache_entries, config->cache_max_file,
+						config->cache_revalidate) == -1)
+		fprintf (stderr, "No memory for the file cache, running without\n");
+	if (cgi_pools_start (config) == -1)
+		return (1);
+	cgi_pools_attach (epfd);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &cache_events;
+	if (cache_watch_fd () != -1)
+		epoll_ctl (epfd, EPOLL_CTL_ADD, cache_watch_fd (), &ev);
+	if (ring != 0)
+		return (ring_loop (listen_fd, epfd));
+
+	for (;;) {
+		if (repack_files) {
+			repack_files = 0;
+			pack_build (config);
+		}
+		if (reload_server) {
+			reload_server = 0;
+			if (reload_start (config) == 0)
+				stop_serving = 1; // the successor takes the new ones
+		}
+		if (stop_serving && listen_fd != -1) {
+			accept_all (listen_fd);
+			close (listen_fd);
+			listen_fd = -1;
+			stop_tls ();
+		}
+		if (listen_fd == -1 && num_connections == 0)
+			return (loop_done ());
+
+		int nready = epoll_wait (epfd, events, MAX_EVENTS, STOP_CHECK_MS);
+		if (nready == -1) {
+			if (errno == EINTR) // SIGCHLD from a finished cgi, or SIGTERM
+				continue;
+			perror ("epoll_wait");
+			return (1);
+		}
+
+		int idx;
+		for (idx = 0; idx < nready; idx ++) {
+			struct connection *conn = events [idx].data.ptr;
+			if (conn == 0) {
+				accept_all (listen_fd);
+				continue;
+			}
+			if (other_event (events [idx].data.ptr) || conn->closed)
+				continue;
+
+			if ((events [idx].events & (EPOLLERR | EPOLLHUP)) ||
+									serve (conn) == -1)
+				close_connection (conn);
+		}
+		timer_advance (&timers, ticks (), timed_out);
+		free_buried ();
+
+		access_log_flush ();
+		if (time (0) != last_sweep) {
+			cgi_pools_check ();
+			last_sweep = time (0);
+		}
+	}
+}
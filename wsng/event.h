@@ -0,0 +1,15 @@
+/*
+ * event.h
+ *
+ *  Single-process, edge-triggered epoll driver for the server: all
+ *  connections are multiplexed by one loop instead of a child per request
+ */
+
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include "wsng.h"
+
+int event_loop (struct server *config);
+
+#endif /* EVENT_H_ */
@@ -0,0 +1,374 @@
+/*
+ * listing.c
+ *
+ *  Directory listings. A single pass of readdir both looks for the index
+ *  files and collects the names; the names are sorted once, and each one
+ *  gets its table row rendered from an fstatat relative to the directory,
+ *  which saves resolving the whole path again for every entry.
+ *
+ *  The rows are kept apart rather than as one page: the file cache holds
+ *  on to the listing of a directory, and when inotify reports a change to
+ *  one of its entries, only that row is added, dropped or marked for
+ *  re-rendering. The page goes out as an iovec of the pieces, or gzipped;
+ *  the compressed page is kept until the next change.
+ */
+
+#define _GNU_SOURCE	// for asprintf
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "listing.h"
+#include "process.h"
+#include "compress.h"
+
+#define	INITIAL_ROWS	32
+#define	GZIP_BATCH		64	// pieces handed to deflate per round
+
+static const char LISTING_TAIL [] = "</table>\r\n</body>\r\n</html>\r\n";
+
+/**
+ * index_kind: which index file the name is, if any
+ */
+static enum dir_index index_kind (char *name) {
+	if (!strcasecmp (name, "index.html"))
+		return (INDEX_HTML);
+	if (!strcasecmp (name, "index.cgi"))
+		return (INDEX_CGI);
+	return (NO_INDEX);
+}
+
+static int compare_rows (const void *a, const void *b) {
+	return (strcoll (((struct listing_row *) a)->name,
+						((struct listing_row *) b)->name));
+}
+
+/**
+ * find_row: binary search for the name among the sorted rows
+ * returns: its index if it is there; otherwise -1 - the index where it
+ * would be inserted
+ */
+static int find_row (struct listing *l, char *name) {
+	int low = 0, high = l->num_rows;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int cmp = strcoll (name, l->rows [mid].name);
+		if (cmp == 0)
+			return (mid);
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return (-1 - low);
+}
+
+static void drop_gzip (struct listing *l) {
+	free (l->gzip);
+	l->gzip = 0;
+	l->gzip_len = 0;
+}
+
+/**
+ * insert_row: a new, not yet rendered row for the name at the index
+ * returns: 0 on success, -1 if out of memory
+ */
+static int insert_row (struct listing *l, int idx, char *name) {
+	if (l->num_rows == l->max_rows) {
+		int more = l->max_rows ? 2 * l->max_rows : INITIAL_ROWS;
+		struct listing_row *rows = realloc (l->rows,
+								more * sizeof (struct listing_row));
+		if (rows == 0)
+			return (-1);
+		l->rows = rows;
+		l->max_rows = more;
+	}
+	char *copy = strdup (name);
+	if (copy == 0)
+		return (-1);
+
+	memmove (l->rows + idx + 1, l->rows + idx,
+				(l->num_rows - idx) * sizeof (struct listing_row));
+	l->rows [idx].name = copy;
+	l->rows [idx].html = 0;
+	l->rows [idx].len = 0;
+	l->num_rows ++;
+	l->stale_rows ++;
+	drop_gzip (l);
+	return (0);
+}
+
+/**
+ * listing_scan: reads the directory once. If it holds index.html (or,
+ * failing that, index.cgi) that is all the listing records; otherwise it
+ * gets a row for every entry, none of them rendered yet.
+ * returns: the listing, or NULL with errno set: that of opendir, EACCES if
+ * the directory cannot be read, ENOMEM
+ */
+struct listing *listing_scan (char *dir) {
+	DIR *dir_ptr = opendir (dir);
+	if (dir_ptr == 0) // either not there, or wrong permissions
+		return (0);
+
+	struct listing *l = calloc (1, sizeof (struct listing));
+	struct dirent *dir_entry;
+	int seen = 0;
+
+	errno = 0;
+	while (l != 0 && (dir_entry = readdir (dir_ptr)) != 0) {
+		char *entry_name = dir_entry->d_name;
+		enum dir_index kind = index_kind (entry_name);
+		seen ++;
+		if (kind != NO_INDEX) {
+			if (l->index == NO_INDEX || kind < l->index)
+				l->index = kind; // index.html wins over index.cgi
+		} else if (strcmp (entry_name, ".") && strcmp (entry_name, "..") &&
+						insert_row (l, l->num_rows, entry_name) == -1) {
+			listing_free (l);
+			l = 0;
+			errno = ENOMEM;
+		}
+	}
+	closedir (dir_ptr);
+	if (l != 0 && seen == 0) { // not even "."; listing not permitted
+		listing_free (l);
+		errno = EACCES;
+		return (0);
+	}
+	if (l == 0)
+		return (0);
+
+	if (l->index != NO_INDEX) { // the rows will not be needed
+		int idx;
+		for (idx = 0; idx < l->num_rows; idx ++)
+			free (l->rows [idx].name);
+		l->num_rows = l->stale_rows = 0;
+	} else {
+		qsort (l->rows, l->num_rows, sizeof (struct listing_row),
+				compare_rows);
+	}
+	return (l);
+}
+
+/**
+ * render_head: the HTML head, the header row of the table and the
+ * "Parent Directory" line, unless we are already at top level
+ */
+static char *render_head (char *dir, int *len) {
+	char *head;
+	char parent [PATH_MAX + 64] = "";
+
+	if (strcmp (dir, ".")) {
+		char *last_sep = strrchr (dir, '/');
+		if (last_sep != 0)
+			snprintf (parent, sizeof (parent),
+					"<a href=\"/%.*s\">Parent Directory</a>\r\n",
+					(int) (last_sep - dir), dir);
+		else
+			strcpy (parent, "<a href=\".\">Parent Directory</a>\r\n");
+	}
+	*len = asprintf (&head,
+			"<html>\r\n<head>\r\n"
+			"<title>\r\nIndex of /%s\r\n</title>\r\n"
+			"</head>\r\n\r\n<body>\r\n"
+			"<h1>Index of /%s</h1>\r\n"
+			"<table>\r\n"
+			"<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>"
+			"<tr><th colspan=3><hr></th></tr>"
+			"<tr><td valign=top>%s</td></tr>\r\n",
+			dir, dir, parent);
+	return (*len == -1 ? 0 : head);
+}
+
+/**
+ * render_row: the table row for one entry: its link and, if it can be
+ * stat'ed, its time of modification and size
+ */
+static char *render_row (char *dir, int dir_fd, char *entry_name, int *len) {
+	char *row;
+	char link [2 * PATH_MAX];
+	char details [MAXDATELEN + 32] = "";
+	struct stat stats;
+
+	strcmp (dir, ".") ?
+		snprintf (link, sizeof (link), "<a href=\"/%s/%s\">%s</a>",
+						dir, entry_name, entry_name) :
+		snprintf (link, sizeof (link), "<a href=\"/%s\">%s</a>",
+						entry_name, entry_name);
+
+	if (dir_fd != -1 &&
+			!fstatat (dir_fd, entry_name, &stats, AT_SYMLINK_NOFOLLOW)) {
+		char time [MAXDATELEN];
+		format_time (stats.st_mtim.tv_sec, time);
+		if (S_ISDIR (stats.st_mode))
+			snprintf (details, sizeof (details), "%s</td><td>-", time);
+		else
+			snprintf (details, sizeof (details), "%s</td><td>%ld",
+						time, (long) stats.st_size);
+	}
+	*len = asprintf (&row,
+			"<tr><td valign=top>%s</td><td>\r\n%s</td></tr>\r\n",
+			link, details);
+	return (*len == -1 ? 0 : row);
+}
+
+/**
+ * listing_render: renders the head and whatever rows are not rendered yet;
+ * the page names the directory as shown (its path as the client knows it,
+ * which differs under a virtual host)
+ * returns: 0 if the whole page is ready, -1 if out of memory
+ */
+int listing_render (struct listing *l, char *dir, char *shown) {
+	if (l->head == 0 && (l->head = render_head (shown, &l->head_len)) == 0)
+		return (-1);
+	if (l->stale_rows == 0)
+		return (0);
+
+	int dir_fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int idx;
+	for (idx = 0; idx < l->num_rows && l->stale_rows > 0; idx ++) {
+		struct listing_row *row = l->rows + idx;
+		if (row->html != 0)
+			continue;
+		if ((row->html = render_row (shown, dir_fd, row->name,
+										&row->len)) == 0)
+			break;
+		l->stale_rows --;
+	}
+	if (dir_fd != -1)
+		close (dir_fd);
+	return (l->stale_rows == 0 ? 0 : -1);
+}
+
+static void mark_stale (struct listing_row *row, struct listing *l) {
+	if (row->html != 0) {
+		free (row->html);
+		row->html = 0;
+		l->stale_rows ++;
+	}
+	drop_gzip (l);
+}
+
+/**
+ * listing_update: takes note of a change to one entry of the directory:
+ * it is gone, or it is new or changed, and its row is re-rendered next time
+ * returns: 0 if the listing is still good, -1 if the directory has to be
+ * scanned again (an index file came or went, or memory ran out)
+ */
+int listing_update (struct listing *l, char *name, int gone) {
+	if (index_kind (name) != NO_INDEX)
+		return (-1);
+	if (l->index != NO_INDEX)
+		return (0); // only the index file matters then
+
+	int idx = find_row (l, name);
+	if (idx < 0)
+		return (gone ? 0 : insert_row (l, -1 - idx, name));
+
+	struct listing_row *row = l->rows + idx;
+	mark_stale (row, l);
+	if (gone) {
+		free (row->name);
+		l->stale_rows --;
+		l->num_rows --;
+		memmove (row, row + 1, (l->num_rows - idx) *
+									sizeof (struct listing_row));
+	}
+	return (0);
+}
+
+/**
+ * listing_stale: marks every row for re-rendering, for when changes to the
+ * entries cannot be watched
+ */
+void listing_stale (struct listing *l) {
+	int idx;
+	for (idx = 0; idx < l->num_rows; idx ++)
+		mark_stale (l->rows + idx, l);
+}
+
+/**
+ * listing_length: the length of the rendered page
+ */
+off_t listing_length (struct listing *l) {
+	off_t len = l->head_len + sizeof (LISTING_TAIL) - 1;
+	int idx;
+	for (idx = 0; idx < l->num_rows; idx ++)
+		len += l->rows [idx].len;
+	return (len);
+}
+
+/**
+ * listing_gzip: compresses the rendered page, unless that is done already
+ * returns: 0 if l->gzip holds the compressed page, -1 on failure
+ */
+int listing_gzip (struct listing *l) {
+	struct iovec iov [GZIP_BATCH];
+	int from = 0, count, idx;
+
+	if (l->gzip != 0)
+		return (0);
+	FILE *out = open_memstream (&l->gzip, &l->gzip_len);
+	if (out == 0)
+		return (-1);
+	struct gzip_writer *w = gzip_start (out);
+	int ret = w == 0 ? -1 : 0;
+	while (ret == 0 && (count = listing_iov (l, iov, GZIP_BATCH, from)) > 0) {
+		for (idx = 0; ret == 0 && idx < count; idx ++)
+			ret = gzip_write (w, iov [idx].iov_base, iov [idx].iov_len);
+		from += count;
+	}
+	if (w != 0 && gzip_finish (w) == -1)
+		ret = -1;
+	fclose (out);
+	if (ret == -1)
+		drop_gzip (l);
+	return (ret);
+}
+
+/**
+ * listing_iov: points up to max_iov iovecs at the pieces of the rendered
+ * page (the head, the rows, the tail), starting from piece number from
+ * returns: the number of iovecs filled, 0 past the last piece
+ */
+int listing_iov (struct listing *l, struct iovec *iov, int max_iov, int from) {
+	int filled = 0;
+
+	for (; filled < max_iov && from <= l->num_rows + 1; from ++, filled ++) {
+		if (from == 0) {
+			iov [filled].iov_base = l->head;
+			iov [filled].iov_len = l->head_len;
+		} else if (from <= l->num_rows) {
+			iov [filled].iov_base = l->rows [from - 1].html;
+			iov [filled].iov_len = l->rows [from - 1].len;
+		} else {
+			iov [filled].iov_base = (char *) LISTING_TAIL;
+			iov [filled].iov_len = sizeof (LISTING_TAIL) - 1;
+		}
+	}
+	return (filled);
+}
+
+void listing_free (struct listing *l) {
+	int idx;
+
+	if (l == 0)
+		return;
+	for (idx = 0; idx < l->num_rows; idx ++) {
+		free (l->rows [idx].name);
+		free (l->rows [idx].html);
+	}
+	free (l->rows);
+	free (l->head);
+	free (l->gzip);
+	free (l);
+}
@@ -0,0 +1,45 @@
+/*
+ * listing.h
+ *
+ *  Directory listings: one pass over the directory finds the index file or
+ *  collects the entries, and the listing page is kept as separately
+ *  rendered rows, so that a change to one entry re-renders only its row
+ */
+
+#ifndef LISTING_H_
+#define LISTING_H_
+
+#include <sys/uio.h>
+
+enum dir_index {
+	NO_INDEX, INDEX_HTML, INDEX_CGI
+};
+
+struct listing_row {
+	char *name;			/* the directory entry */
+	char *html;			/* its table row, or NULL if it must be re-rendered */
+	int len;
+};
+
+struct listing {
+	enum dir_index index;	/* if there is an index file, no rows are kept */
+	char *head;				/* everything up to the first entry's row */
+	int head_len;
+	struct listing_row *rows;	/* in alphabetical order */
+	int num_rows;
+	int max_rows;
+	int stale_rows;			/* rows with html == NULL */
+	char *gzip;				/* the page gzipped, once asked for */
+	size_t gzip_len;
+};
+
+struct listing *listing_scan (char *dir);
+int listing_render (struct listing *l, char *dir, char *shown);
+int listing_update (struct listing *l, char *name, int gone);
+void listing_stale (struct listing *l);
+off_t listing_length (struct listing *l);
+int listing_gzip (struct listing *l);
+int listing_iov (struct listing *l, struct iovec *iov, int max_iov, int from);
+void listing_free (struct listing *l);
+
+#endif /* LISTING_H_ */
@@ -0,0 +1,177 @@
+/*
+ * mimetypes.c
+ *
+ *  Content types by file extension. The table is built at startup from
+ *  the built-in types, any mime.types style files and the "type" lines of
+ *  the configuration; after that it is only read. Lookups hash the
+ *  extension case-insensitively and probe linearly; they never allocate,
+ *  and an unknown extension simply gets the default type.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "mimetypes.h"
+#include "read.h"
+
+#define	INITIAL_SLOTS	64	// a power of 2
+
+/**
+ * hash_ext: FNV-1a over the lower-cased extension
+ */
+static unsigned int hash_ext (char *ext) {
+	unsigned int h = 2166136261u;
+	while (*ext)
+		h = (h ^ (unsigned char) tolower ((unsigned char) *ext ++)) *
+															16777619u;
+	return (h);
+}
+
+/**
+ * find_slot: the slot holding the extension, or the free slot where it
+ * would go
+ */
+static struct mime_entry *find_slot (struct mime_table *table, char *ext) {
+	unsigned int idx = hash_ext (ext) & table->mask;
+
+	while (table->slots [idx].ext != 0 &&
+					strcasecmp (table->slots [idx].ext, ext))
+		idx = (idx + 1) & table->mask;
+	return (table->slots + idx);
+}
+
+/**
+ * grow: doubles the number of slots, re-inserting every entry
+ * returns: 0 on success, -1 if out of memory (the table is unchanged)
+ */
+static int grow (struct mime_table *table) {
+	struct mime_table bigger = *table;
+	unsigned int idx;
+
+	bigger.mask = table->mask * 2 + 1;
+	bigger.slots = calloc (bigger.mask + 1, sizeof (struct mime_entry));
+	if (bigger.slots == 0)
+		return (-1);
+	for (idx = 0; idx <= table->mask; idx ++)
+		if (table->slots [idx].ext != 0)
+			*find_slot (&bigger, table->slots [idx].ext) =
+												table->slots [idx];
+	free (table->slots);
+	*table = bigger;
+	return (0);
+}
+
+/**
+ * mime_new: an empty table, with text/plain as the default type
+ * returns: the table, or NULL if out of memory
+ */
+struct mime_table *mime_new (void) {
+	struct mime_table *table = calloc (1, sizeof (struct mime_table));
+	if (table == 0)
+		return (0);
+	table->mask = INITIAL_SLOTS - 1;
+	table->slots = calloc (INITIAL_SLOTS, sizeof (struct mime_entry));
+	table->default_type = strdup ("text/plain");
+	if (table->slots == 0 || table->default_type == 0) {
+		mime_free (table);
+		return (0);
+	}
+	return (table);
+}
+
+/**
+ * mime_free: releases the table and all the strings in it
+ */
+void mime_free (struct mime_table *table) {
+	unsigned int idx;
+
+	if (table == 0)
+		return;
+	if (table->slots != 0)
+		for (idx = 0; idx <= table->mask; idx ++) {
+			free (table->slots [idx].ext);
+			free (table->slots [idx].type);
+		}
+	free (table->slots);
+	free (table->default_type);
+	free (table);
+}
+
+/**
+ * mime_set: maps the extension to the type, replacing an earlier mapping.
+ * The table is kept at most half full, so probe sequences stay short.
+ * returns: 0 on success, -1 if out of memory
+ */
+int mime_set (struct mime_table *table, char *ext, char *type) {
+	if ((table->used + 1) * 2 > table->mask + 1 && grow (table) == -1)
+		return (-1);
+
+	char *type_copy = strdup (type);
+	if (type_copy == 0)
+		return (-1);
+
+	struct mime_entry *slot = find_slot (table, ext);
+	if (slot->ext == 0) {
+		char *cp;
+		if ((slot->ext = strdup (ext)) == 0) {
+			free (type_copy);
+			return (-1);
+		}
+		for (cp = slot->ext; *cp; cp ++)
+			*cp = tolower ((unsigned char) *cp);
+		table->used ++;
+	}
+	free (slot->type);
+	slot->type = type_copy;
+	return (0);
+}
+
+/**
+ * mime_set_default: the type for extensions that are not in the table
+ * returns: 0 on success, -1 if out of memory
+ */
+int mime_set_default (struct mime_table *table, char *type) {
+	char *type_copy = strdup (type);
+	if (type_copy == 0)
+		return (-1);
+	free (table->default_type);
+	table->default_type = type_copy;
+	return (0);
+}
+
+/**
+ * mime_load_file: adds the mappings of a mime.types style file: lines of
+ * a type followed by its extensions, # starting a comment
+ * returns: 0 on success, -1 if the file cannot be read or memory runs out
+ */
+int mime_load_file (struct mime_table *table, char *path) {
+	FILE *fp = fopen (path, "r");
+	char line [LINELEN];
+	int ret = 0;
+
+	if (fp == 0)
+		return (-1);
+	while (ret == 0 && readline (line, LINELEN, fp) != 0) {
+		char *save;
+		char *type = strtok_r (line, " \t\r\n", &save);
+		char *ext;
+		if (type == 0 || *type == '#')
+			continue;
+		while (ret == 0 && (ext = strtok_r (0, " \t\r\n", &save)) != 0 &&
+															*ext != '#')
+			ret = mime_set (table, ext, type);
+	}
+	fclose (fp);
+	return (ret);
+}
+
+/**
+ * mime_lookup: the type for the extension, or the default type
+ */
+char *mime_lookup (struct mime_table *table, char *ext) {
+	struct mime_entry *slot = find_slot (table, ext);
+	return (slot->ext != 0 ? slot->type : table->default_type);
+}
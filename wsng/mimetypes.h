@@ -0,0 +1,31 @@
+/*
+ * mimetypes.h
+ *
+ *  The mapping of file extensions to content types: an open-addressing
+ *  hash table, filled while the configuration is read and only looked up
+ *  afterwards. Extensions are compared case-insensitively.
+ */
+
+#ifndef MIMETYPES_H_
+#define MIMETYPES_H_
+
+struct mime_entry {
+	char *ext;		/* lower-case extension, NULL for a free slot */
+	char *type;		/* the Content-type for it */
+};
+
+struct mime_table {
+	struct mime_entry *slots;
+	unsigned int mask;		/* number of slots - 1; a power of 2 */
+	unsigned int used;
+	char *default_type;		/* for extensions not in the table */
+};
+
+struct mime_table *mime_new (void);
+void mime_free (struct mime_table *table);
+int mime_set (struct mime_table *table, char *ext, char *type);
+int mime_set_default (struct mime_table *table, char *type);
+int mime_load_file (struct mime_table *table, char *path);
+char *mime_lookup (struct mime_table *table, char *ext);
+
+#endif /* MIMETYPES_H_ */
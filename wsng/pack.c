@@ -0,0 +1,319 @@
+/*
+ * pack.c
+ *
+ *  The file pack. It is built by walking the server root twice: the first
+ *  pass picks the regular files small enough to pack (cgi scripts are not
+ *  content) and renders their header lines, so that the size of the whole
+ *  is known; the second reads every file into its place in one anonymous
+ *  mapping, which is then made read-only. A file that changes between the
+ *  passes is left out rather than packed half old and half new.
+ *
+ *  Each entry starts on a cache line; the mapping starts on a huge page
+ *  boundary and is offered to the kernel for huge pages, so a large pack
+ *  costs few TLB entries. Forked responders and workers share the mapping
+ *  with the process that built it.
+ *
+ *  A pack is replaced as a whole: the new one is built next to the old
+ *  one and then takes its place for new requests. A response that is still
+ *  sending from the old pack holds a reference to it, and the old pack is
+ *  unmapped when the last of those is done. The pack is not kept up to date
+ *  with the files in between: a changed file is served as it was when the
+ *  pack was built until the next rebuild.
+ */
+
+#define _GNU_SOURCE // nftw, MAP_ANONYMOUS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pack.h"
+#include "process.h"
+
+#define	PACK_ALIGN	64				/* every entry starts on a cache line */
+#define	HUGE_PAGE	(2 << 20)
+#define	PACK_HEADER_LEN	512		/* longest header lines an entry may have */
+#define	WALK_DIRS	16				/* directories nftw keeps open */
+
+#define	ALIGNED(n, to)	(((size_t) (n) + (to) - 1) & ~((size_t) (to) - 1))
+
+char *find_content_type (char *);
+
+struct file_pack {
+	int refs;		/* the current pack's own, and one per response */
+	char *blob;
+	size_t mapped;
+	struct pack_entry *entries;
+	int count;
+	struct pack_entry **index;	/* open addressing, by path hash */
+	unsigned int mask;
+};
+
+static struct file_pack *current_pack = 0;
+
+/*
+ * what the first pass gathers: the files to pack, their header lines
+ * (malloc'ed until they are copied into the pack) and the space they need
+ */
+static struct {
+	struct pack_entry *entries;
+	int count;
+	int room;
+	size_t total;
+	long max_file;
+	long max_total;
+} walk;
+
+/**
+ * hash_path: FNV-1a over the path
+ */
+static unsigned int hash_path (char *path) {
+	unsigned int h = 2166136261u;
+	while (*path)
+		h = (h ^ (unsigned char) *path ++) * 16777619u;
+	return (h);
+}
+
+/**
+ * gather: the nftw callback of the first pass; takes the file on if it is
+ * to be packed and there is still room in the pack for it
+ * returns: 0 to go on with the walk, -1 if out of memory
+ */
+static int gather (const char *fpath, const struct stat *sb, int flag,
+					struct FTW *ftw) {
+	char *path = (char *) fpath + 2; // past the "./"
+	char lines [PACK_HEADER_LEN];
+	int validators_len;
+
+	if (flag != FTW_F || !S_ISREG (sb->st_mode) ||
+			sb->st_size > walk.max_file || is_cgi (path))
+		return (0);
+	int len = entity_header (lines, PACK_HEADER_LEN, (struct stat *) sb,
+						find_content_type (file_type (path)), &validators_len);
+	size_t size = ALIGNED (len + sb->st_size, PACK_ALIGN);
+	if (len == -1 || walk.total + size > walk.max_total)
+		return (0);
+
+	if (walk.count == walk.room) {
+		int room = walk.room ? 2 * walk.room : 256;
+		struct pack_entry *more =
+				realloc (walk.entries, room * sizeof (struct pack_entry));
+		if (more == 0)
+			return (-1);
+		walk.entries = more;
+		walk.room = room;
+	}
+	struct pack_entry *e = walk.entries + walk.count;
+	e->path = strdup (path);
+	e->header = strdup (lines);
+	if (e->path == 0 || e->header == 0) {
+		free (e->path);
+		free (e->header);
+		return (-1);
+	}
+	e->hash = hash_path (e->path);
+	e->info = *sb;
+	e->header_len = len;
+	e->validators_len = validators_len;
+	walk.count ++;
+	walk.total += size;
+	return (0);
+}
+
+/**
+ * read_body: the second pass for one file: reads it into its place in the
+ * pack and checks that it is still the file the header lines describe
+ * returns: 0 if it is packed, -1 if it is to be left out
+ */
+static int read_body (struct pack_entry *e, char *body) {
+	struct stat now;
+	off_t done = 0;
+	int fd = open (e->path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return (-1);
+	while (done < e->info.st_size) {
+		ssize_t n = read (fd, body + done, e->info.st_size - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	int changed = fstat (fd, &now) == -1 || done != e->info.st_size ||
+				now.st_size != e->info.st_size ||
+				now.st_mtim.tv_sec != e->info.st_mtim.tv_sec ||
+				now.st_mtim.tv_nsec != e->info.st_mtim.tv_nsec;
+	close (fd);
+	return (changed ? -1 : 0);
+}
+
+/**
+ * map_pack: an anonymous mapping of len bytes (a multiple of HUGE_PAGE)
+ * starting on a huge page boundary: a larger one is mapped and trimmed
+ * returns: the mapping, or NULL if there is no memory for it
+ */
+static char *map_pack (size_t len) {
+	size_t span = len + HUGE_PAGE;
+	char *p = mmap (0, span, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return (0);
+
+	char *start = (char *) ALIGNED ((uintptr_t) p, HUGE_PAGE);
+	if (start > p)
+		munmap (p, start - p);
+	if (p + span > start + len)
+		munmap (start + len, p + span - (start + len));
+	madvise (start, len, MADV_HUGEPAGE); // only a hint; THP may be off
+	return (start);
+}
+
+static void destroy_pack (struct file_pack *pack) {
+	int idx;
+
+	for (idx = 0; idx < pack->count; idx ++)
+		free (pack->entries [idx].path);
+	free (pack->entries);
+	free (pack->index);
+	if (pack->blob != 0)
+		munmap (pack->blob, pack->mapped);
+	free (pack);
+}
+
+/**
+ * fill_pack: the second pass: lays the gathered files out in the mapping
+ * and indexes the ones that made it
+ * returns: 0 on success, -1 if out of memory
+ */
+static int fill_pack (struct file_pack *pack) {
+	size_t off = 0;
+	unsigned int size = 16;
+	int idx;
+
+	pack->mapped = ALIGNED (walk.total ? walk.total : 1, HUGE_PAGE);
+	if ((pack->blob = map_pack (pack->mapped)) == 0)
+		return (-1);
+	for (idx = 0; idx < walk.count; idx ++) {
+		struct pack_entry *e = walk.entries + idx;
+		char *lines = e->header;
+
+		e->header = pack->blob + off;
+		e->body = e->header + e->header_len;
+		memcpy (e->header, lines, e->header_len);
+		free (lines);
+		if (read_body (e, e->body) == -1) {
+			free (e->path);
+			continue;
+		}
+		pack->entries [pack->count ++] = *e;
+		off += ALIGNED (e->header_len + e->info.st_size, PACK_ALIGN);
+	}
+	walk.count = 0; // everything is the pack's now
+	mprotect (pack->blob, pack->mapped, PROT_READ);
+
+	while (size < 2 * (unsigned int) pack->count)
+		size *= 2;
+	pack->index = calloc (size, sizeof (struct pack_entry *));
+	if (pack->index == 0)
+		return (-1);
+	pack->mask = size - 1;
+	for (idx = 0; idx < pack->count; idx ++) {
+		struct pack_entry *e = pack->entries + idx;
+		unsigned int slot = e->hash & pack->mask;
+		while (pack->index [slot] != 0)
+			slot = (slot + 1) & pack->mask;
+		pack->index [slot] = e;
+	}
+	return (0);
+}
+
+/**
+ * build_pack: packs the files under the current directory (the server
+ * root) within the configured limits
+ * returns: the new pack, or NULL if it could not be built
+ */
+static struct file_pack *build_pack (struct server *config) {
+	struct file_pack *pack = calloc (1, sizeof (struct file_pack));
+	int idx, ret = -1;
+
+	memset (&walk, 0, sizeof (walk));
+	walk.max_file = config->file_pack_max_file;
+	walk.max_total = config->file_pack_size;
+	if (pack != 0 && nftw (".", gather, WALK_DIRS, FTW_PHYS) == 0) {
+		pack->refs = 1;
+		pack->entries = calloc (walk.count + 1, sizeof (struct pack_entry));
+		ret = pack->entries != 0 ? fill_pack (pack) : -1;
+	}
+
+	for (idx = 0; idx < walk.count; idx ++) { // left over on failure
+		free (walk.entries [idx].path);
+		free (walk.entries [idx].header);
+	}
+	free (walk.entries);
+	if (ret == -1 && pack != 0) {
+		destroy_pack (pack);
+		pack = 0;
+	}
+	return (pack);
+}
+
+/**
+ * pack_build: builds the file pack of the server root, if it is on, and
+ * puts it in the place of the current one (which goes away once the
+ * responses sending from it are done). If the new pack cannot be built,
+ * there is none: the files are served from the disk.
+ * returns: 0 on success (or if the pack is off), -1 on failure
+ */
+int pack_build (struct server *config) {
+	struct file_pack *pack = 0;
+
+	if (config->file_pack) {
+		pack = build_pack (config);
+		if (pack == 0)
+			perror ("file pack");
+		else
+			fprintf (stderr, "file pack: %d files, %ld kB\n", pack->count,
+						(long) (pack->mapped >> 10));
+	}
+	pack_release (current_pack);
+	current_pack = pack;
+	return (config->file_pack && pack == 0 ? -1 : 0);
+}
+
+/**
+ * pack_lookup: the packed file at the path (relative to the root)
+ * returns: its entry, or NULL if it is not in the pack (or there is none)
+ */
+struct pack_entry *pack_lookup (char *path) {
+	struct file_pack *pack = current_pack;
+	struct pack_entry *e;
+
+	if (pack == 0)
+		return (0);
+	unsigned int h = hash_path (path);
+	unsigned int slot = h & pack->mask;
+	for (; (e = pack->index [slot]) != 0; slot = (slot + 1) & pack->mask)
+		if (e->hash == h && !strcmp (e->path, path))
+			return (e);
+	return (0);
+}
+
+/**
+ * pack_hold: a reference to the current pack, for a response that goes on
+ * sending from it after the request has been processed
+ * returns: the pack, to be given to pack_release when done
+ */
+struct file_pack *pack_hold (void) {
+	if (current_pack != 0)
+		current_pack->refs ++;
+	return (current_pack);
+}
+
+void pack_release (struct file_pack *pack) {
+	if (pack != 0 && -- pack->refs == 0)
+		destroy_pack (pack);
+}
@@ -0,0 +1,35 @@
+/*
+ * pack.h
+ *
+ *  The file pack: the small files under the server root read once into a
+ *  single read-only mapping, each laid out as the header lines describing
+ *  it followed by its body, with an index by path. A plain GET of a packed
+ *  file is answered from the mapping alone, with no open or stat.
+ */
+
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "wsng.h"
+
+struct pack_entry {
+	char *path;			/* relative to the root, as requests name it */
+	unsigned int hash;
+	struct stat info;	/* as it was when packed */
+	char *header;		/* the entity header lines, the body right after */
+	int header_len;
+	int validators_len;	/* how much of the header the validator lines are */
+	char *body;
+};
+
+struct file_pack;
+
+int pack_build (struct server *config);
+struct pack_entry *pack_lookup (char *path);
+struct file_pack *pack_hold (void);
+void pack_release (struct file_pack *pack);
+
+#endif /* PACK_H_ */
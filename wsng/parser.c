@@ -0,0 +1,324 @@
+/*
+ * parser.c
+ *
+ *  The request parser. Every byte of the header is looked at once, as it
+ *  arrives: the parser keeps its state and position between calls, and
+ *  records the parts of the request as spans of the buffer. Only when the
+ *  header is complete are the spans made into strings, by putting a NUL at
+ *  the end of each (always on a delimiter: a blank, a colon or a line end),
+ *  so nothing is copied and nothing allocated.
+ *
+ *  It is lenient where the old line-by-line reading was: empty lines before
+ *  the request line are skipped, a bare "\n" ends a line as well as "\r\n",
+ *  a request line without a version is an HTTP/0.9 request and ends the
+ *  header by itself, and header lines it cannot make sense of (no colon, an
+ *  obsolete continuation, more of them than it records) are passed over.
+ *  A malformed request line or version, or a lone "\r", is an error.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+
+enum parser_state {
+	S_START,			/* before the request line */
+	S_METHOD,
+	S_BEFORE_TARGET,
+	S_TARGET,
+	S_BEFORE_VERSION,
+	S_VERSION,
+	S_AFTER_VERSION,
+	S_HEADER_START,		/* at the beginning of a header line */
+	S_NAME,
+	S_BEFORE_VALUE,
+	S_VALUE,
+	S_SKIP_LINE,		/* a header line that is ignored */
+	S_CR,				/* a "\r" was seen, the "\n" must follow */
+	S_DONE
+};
+
+/**
+ * is_token: whether the character may be part of a method or a header name
+ * (a "tchar" of RFC 7230)
+ */
+static int is_token (unsigned char c) {
+	return (isalnum (c) || (c != '\0' && strchr ("!#$%&'*+-.^_`|~", c)));
+}
+
+static int is_ctl (unsigned char c) {
+	return (c < ' ' || c == 0x7f);
+}
+
+void parser_init (struct http_parser *p) {
+	memset (p, 0, sizeof (struct http_parser));
+	p->state = S_START;
+}
+
+/**
+ * line_end: the line ends at the "\r" or "\n" just seen; the state after
+ * it is next
+ */
+static void line_end (struct http_parser *p, char c, int next) {
+	if (c == '\r') {
+		p->state = S_CR;
+		p->after_cr = next;
+	} else
+		p->state = next;
+}
+
+/**
+ * parse_version: checks the version span ("HTTP/" digit "." digit) and
+ * takes its numbers
+ * returns: 0 if it is one, -1 if not
+ */
+static int parse_version (struct http_parser *p, char *buf) {
+	char *cp = buf + p->version.off;
+
+	if (p->version.len != 8 || strncmp (cp, "HTTP/", 5) ||
+			!isdigit (cp [5]) || cp [6] != '.' || !isdigit (cp [7]))
+		return (-1);
+	p->major = cp [5] - '0';
+	p->minor = cp [7] - '0';
+	return (0);
+}
+
+/**
+ * parse_request: goes on through the buffer, which holds len bytes of the
+ * request now, from where the previous call stopped
+ * returns: PARSE_DONE once the header is complete (its length is then in
+ * p->length), PARSE_MORE while it is not, PARSE_ERROR if it is malformed
+ */
+enum parse_result parse_request (struct http_parser *p, char *buf, int len) {
+	for (; p->pos < len; p->pos ++) {
+		int pos = p->pos;
+		unsigned char c = buf [pos];
+		int eol = (c == '\r' || c == '\n');
+		struct span *name = p->name + p->headers;
+		struct span *value = p->value + p->headers;
+
+		switch (p->state) {
+			case S_START:
+				if (eol)
+					break; // stray line ends before a request are allowed
+				if (!is_token (c))
+					return (PARSE_ERROR);
+				p->method.off = pos;
+				p->state = S_METHOD;
+			break;
+
+			case S_METHOD:
+				if (c == ' ') {
+					p->method.len = pos - p->method.off;
+					p->state = S_BEFORE_TARGET;
+				} else if (!is_token (c))
+					return (PARSE_ERROR);
+			break;
+
+			case S_BEFORE_TARGET:
+				if (c == ' ')
+					break;
+				if (is_ctl (c))
+					return (PARSE_ERROR);
+				p->target.off = pos;
+				p->state = S_TARGET;
+			break;
+
+			case S_TARGET:
+				if (c == ' ') {
+					p->target.len = pos - p->target.off;
+					p->state = S_BEFORE_VERSION;
+				} else if (eol) { // HTTP/0.9: the request line is all
+					p->target.len = pos - p->target.off;
+					p->version.off = pos;
+					line_end (p, c, S_DONE);
+				} else if (is_ctl (c))
+					return (PARSE_ERROR);
+			break;
+
+			case S_BEFORE_VERSION:
+				if (c == ' ')
+					break;
+				if (eol) {
+					p->version.off = pos;
+					line_end (p, c, S_DONE);
+				} else {
+					p->version.off = pos;
+					p->state = S_VERSION;
+				}
+			break;
+
+			case S_VERSION:
+				if (c != ' ' && !eol)
+					break;
+				p->version.len = pos - p->version.off;
+				if (parse_version (p, buf) == -1)
+					return (PARSE_ERROR);
+				if (eol)
+					line_end (p, c, S_HEADER_START);
+				else
+					p->state = S_AFTER_VERSION;
+			break;
+
+			case S_AFTER_VERSION:
+				if (eol)
+					line_end (p, c, S_HEADER_START);
+				else if (c != ' ')
+					return (PARSE_ERROR);
+			break;
+
+			case S_HEADER_START:
+				if (eol)
+					line_end (p, c, S_DONE); // the empty line
+				else if (p->headers == MAX_HEADERS || !is_token (c))
+					p->state = S_SKIP_LINE;
+				else {
+					name->off = pos;
+					p->state = S_NAME;
+				}
+			break;
+
+			case S_NAME:
+				if (c == ':') {
+					name->len = pos - name->off;
+					p->state = S_BEFORE_VALUE;
+				} else if (eol)
+					line_end (p, c, S_HEADER_START);
+				else if (!is_token (c))
+					p->state = S_SKIP_LINE;
+			break;
+
+			case S_BEFORE_VALUE:
+				if (c == ' ' || c == '\t')
+					break;
+				value->off = pos;
+				value->len = 0;
+				if (eol) {
+					p->headers ++;
+					line_end (p, c, S_HEADER_START);
+				} else {
+					value->len = 1;
+					p->state = S_VALUE;
+				}
+			break;
+
+			case S_VALUE:
+				if (eol) { // the trailing blanks are not counted in
+					p->headers ++;
+					line_end (p, c, S_HEADER_START);
+				} else if (c != ' ' && c != '\t')
+					value->len = pos + 1 - value->off;
+			break;
+
+			case S_SKIP_LINE:
+				if (eol)
+					line_end (p, c, S_HEADER_START);
+			break;
+
+			case S_CR:
+				if (c != '\n')
+					return (PARSE_ERROR);
+				p->state = p->after_cr;
+			break;
+		}
+
+		if (p->state == S_DONE) {
+			p->length = ++ p->pos;
+			return (PARSE_DONE);
+		}
+	}
+	return (PARSE_MORE);
+}
+
+/**
+ * parser_terminate: makes the spans of a complete header into strings in
+ * place
+ */
+void parser_terminate (struct http_parser *p, char *buf) {
+	int idx;
+
+	buf [p->method.off + p->method.len] = '\0';
+	buf [p->target.off + p->target.len] = '\0';
+	buf [p->version.off + p->version.len] = '\0';
+	for (idx = 0; idx < p->headers; idx ++) {
+		buf [p->name [idx].off + p->name [idx].len] = '\0';
+		buf [p->value [idx].off + p->value [idx].len] = '\0';
+	}
+}
+
+static int hex_value (unsigned char c) {
+	if (isdigit (c))
+		return (c - '0');
+	c = tolower (c);
+	return (c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1);
+}
+
+/**
+ * normalize_target: turns the request target into the path of the item
+ * relative to the server root, in place: the scheme and host of an
+ * absolute URI are dropped, the path is percent-decoded and its dot
+ * segments are resolved (".." never goes above the root), the leading '/'
+ * is stripped, and an empty path becomes ".". A query is kept after the
+ * path as it came.
+ * returns: 0, or -1 if the target is not acceptable (not a path, or one
+ * with an encoded NUL or '/', or a bad escape)
+ */
+int normalize_target (char *target) {
+	char *query = strchr (target, '?');
+	char *end = query ? query : target + strlen (target);
+	char *path = target, *r, *w;
+
+	if (!strncasecmp (path, "http://", 7) ||
+			!strncasecmp (path, "https://", 8)) {
+		path = strchr (path, ':') + 3;
+		while (path < end && *path != '/')
+			path ++;
+	} else if (*path != '/')
+		return (-1);
+
+	for (r = path, w = target; r < end; ) {
+		char *segment;
+
+		while (r < end && *r == '/')
+			r ++;
+		if (r == end)
+			break;
+		segment = w;
+		if (w > target)
+			*w ++ = '/';
+		char *start = w;
+		for (; r < end && *r != '/'; r ++) {
+			int c = (unsigned char) *r;
+			if (c == '%') {
+				int high = r + 2 < end ? hex_value (r [1]) : -1;
+				int low = high != -1 ? hex_value (r [2]) : -1;
+				if (low == -1)
+					return (-1);
+				c = high * 16 + low;
+				if (c == '\0' || c == '/')
+					return (-1);
+				r += 2;
+			}
+			*w ++ = c;
+		}
+
+		if (w - start == 1 && start [0] == '.')
+			w = segment;
+		else if (w - start == 2 && start [0] == '.' && start [1] == '.') {
+			w = segment; // and the one before it goes as well
+			while (w > target && w [-1] != '/')
+				w --;
+			if (w > target)
+				w --;
+		}
+	}
+
+	if (w == target)
+		*w ++ = '.';
+	if (query)
+		memmove (w, query, strlen (query) + 1);
+	else
+		*w = '\0';
+	return (0);
+}
@@ -0,0 +1,48 @@
+/*
+ * parser.h
+ *
+ *  The request parser: a state machine run over the buffer the request is
+ *  received into, which records where the method, the target, the version
+ *  and the header fields are instead of copying them out. It takes the
+ *  buffer as far as it has arrived and picks up where it left off when
+ *  more comes, so a header split across any number of reads is scanned only
+ *  once.
+ */
+
+#ifndef PARSER_H_
+#define PARSER_H_
+
+#define	MAX_HEADERS	64	/* header fields recorded; the rest are skipped */
+
+/*
+ * a piece of the buffer, by offset, so that it stays valid when the buffer
+ * is moved
+ */
+struct span {
+	int off;
+	int len;
+};
+
+enum parse_result {
+	PARSE_MORE,		/* the header is not complete yet */
+	PARSE_DONE,		/* it is, and the parser's fields describe it */
+	PARSE_ERROR		/* it is malformed */
+};
+
+struct http_parser {
+	int state;
+	int pos;		/* how much of the buffer has been parsed */
+	int after_cr;	/* the state to go to once the line end is complete */
+	struct span method, target, version;	/* no version: HTTP/0.9 */
+	int major, minor;	/* the version's numbers */
+	struct span name [MAX_HEADERS], value [MAX_HEADERS];
+	int headers;
+	int length;		/* of the whole header, once it is complete */
+};
+
+void parser_init (struct http_parser *p);
+enum parse_result parse_request (struct http_parser *p, char *buf, int len);
+void parser_terminate (struct http_parser *p, char *buf);
+int normalize_target (char *target);
+
+#endif /* PARSER_H_ */
@@ -5,69 +5,61 @@
  *      Author: Yuri
  */
 
+#define _GNU_SOURCE // asprintf
+
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
-#include <dirent.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "process.h"
 #include "read.h"
+#include "parser.h"
+#include "cache.h"
+#include "listing.h"
+#include "compress.h"
+#include "cgipool.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "pack.h"
+#include "vhost.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "socklib.h"
 
 char *find_content_type (char *);
+struct vhost *find_vhost (char *);
 
-/*
- * modify_argument
- *  purpose: many roles
- *		security - remove all ".." components in paths
- *		cleaning - if arg is "/" convert to "."
- *  returns: pointer to modified string
- *     args: array containing arg and length of that array
- */
-
-char *modify_argument (char *arg, int len) {
-	char *nexttoken;
-	char *copy = malloc (len);
-
-	if (copy == 0) {
-		fprintf (stderr, "can't malloc");
-		exit (1);
-	}
-
-	/* remove all ".." components from path */
-	/* by tokeninzing on "/" and rebuilding */
-	/* the string without the ".." items	*/
-
-	*copy = '\0';
-
-	nexttoken = strtok (arg, "/");
-	while (nexttoken != 0) {
-		if (strcmp (nexttoken, "..") != 0) {
-			if (*copy)
-				strcat (copy, "/");
-			strcat (copy, nexttoken);
-		}
-		nexttoken = strtok (0, "/");
-	}
-	strcpy (arg, copy);
-	free (copy);
-
-	/* the array is now cleaned up */
-	/* handle a special case       */
-
-	if (strcmp (arg, "") == 0)
-		strcpy (arg, ".");
-	return arg;
-}
+static struct request *current; // context of the request being processed
 
 enum http_codes {
 	OK = 200,
+	PARTIAL_CONTENT = 206,
+	NOT_MODIFIED = 304,
 	BAD_REQUEST = 400,
 	NOT_ALLOWED = 403,
 	NOT_FOUND = 404,
+	METHOD_NOT_ALLOWED = 405,
+	LENGTH_REQUIRED = 411,
+	RANGE_NOT_SATISFIABLE = 416,
+	TOO_MANY_REQUESTS = 429,
 	SERVER_ERROR = 500,
-	NOT_IMPLEMENTED = 501
+	NOT_IMPLEMENTED = 501,
+	BAD_GATEWAY = 502,
+	GATEWAY_TIMEOUT = 504
 };
 
 struct http_status {
@@ -87,6 +79,15 @@ static const struct http_status STATUS_OK =
 
 static const struct http_status STATUS_NOT_FOUND = E_NOT_FOUND;
 
+static const struct http_status STATUS_PARTIAL =
+	{PARTIAL_CONTENT, "Partial Content", 0};
+
+static const struct http_status STATUS_NOT_MODIFIED =
+	{NOT_MODIFIED, "Not Modified", 0};
+
+static const struct http_status STATUS_NO_RANGE =
+	{RANGE_NOT_SATISFIABLE, "Requested Range Not Satisfiable", 0};
+
 static const struct http_status status_codes [] = {
 		{BAD_REQUEST, "Bad Request",
 				"\r\nI cannot understand your request\r\n"},
@@ -95,6 +96,16 @@ static const struct http_status status_codes [] = {
 		{NOT_ALLOWED, "Not Allowed",
 				"You are not allowed to access the item you requested: %s\r\n"},
 		E_NOT_FOUND,
+		{METHOD_NOT_ALLOWED, "Method Not Allowed",
+				"The item you requested: %s\r\ntakes no request body\r\n"},
+		{LENGTH_REQUIRED, "Length Required",
+				"The item you requested: %s\r\ntakes a body of a told length\r\n"},
+		{TOO_MANY_REQUESTS, "Too Many Requests",
+				"You have asked for: %s\r\ntoo often; try again later\r\n"},
+		{BAD_GATEWAY, "Bad Gateway",
+				"The server behind this one did not answer\r\n"},
+		{GATEWAY_TIMEOUT, "Gateway Timeout",
+				"The server behind this one did not answer in time\r\n"},
 		{0, 0, 0}
 };
 
@@ -113,7 +124,6 @@ static const struct http_status *get_status_format (enum http_codes code) {
 }
 
 #define TIME_FORMAT "%a, %e %b %Y %H:%M:%S GMT"
-#define MAXDATELEN 40
 
 /**
  * format_time: prints a "web time" version of the incoming time_t
@@ -124,10 +134,19 @@ void format_time (time_t timeval, char *formatted_time) {
 }
 
 /**
- * format_current_time: prints a "web time" version of the current time
+ * format_current_time: prints a "web time" version of the current time;
+ * the formatting is only redone when the second changes
  */
 void format_current_time (char *formatted_time) {
-	format_time (time (0), formatted_time);
+	static time_t last = 0;
+	static char last_formatted [MAXDATELEN];
+	time_t now = time (0);
+
+	if (now != last) {
+		format_time (now, last_formatted);
+		last = now;
+	}
+	strcpy (formatted_time, last_formatted);
 }
 
 #define SERVER_NAME "wsng"
@@ -135,33 +154,105 @@ void format_current_time (char *formatted_time) {
 #define CONTENT_TYPE_STRING "Content-type:"
 
 /**
- * header: forms an HTTP header corresponding to the incoming status code
- * (contained in the struct http_status), adds the Content-type line (and the
- * required empty string after it) is specified. The header contains the
- * current time in the web time format and the name/version of the server
+ * status_lines: the part of the header that changes from response to
+ * response: the status, the time, and whether the connection stays open
+ * (a body of unknown length can only be ended by closing it)
  */
-void header (FILE *fp, const struct http_status *format, char *content_type) {
+static void status_lines (FILE *fp, const struct http_status *format,
+							off_t length) {
 	fprintf (fp, "HTTP/1.1 %d %s\r\n", format->code, format->code_string);
+	stats_status (format->code);
+	current->status = format->code;
 	char time [MAXDATELEN];
 	format_current_time (time);
 	fprintf (fp, "Date: %s\r\n", time);
 	fprintf (fp, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
+	if (length < 0 && !current->head)
+		current->keep_alive = 0;
+	fprintf (fp, "Connection: %s\r\n",
+					current->keep_alive ? "keep-alive" : "close");
+	if (current->vary)
+		fprintf (fp, "Vary: Accept-Encoding\r\n");
+	if (format->code == METHOD_NOT_ALLOWED)
+		fprintf (fp, "Allow: GET, HEAD\r\n");
+	if (format->code == TOO_MANY_REQUESTS)
+		fprintf (fp, "Retry-After: %d\r\n", current->retry_after);
+}
+
+/**
+ * entity_lines: the part of the header describing the body, which is the
+ * same every time a given file is sent
+ */
+static void entity_lines (FILE *fp, char *content_type, off_t length) {
+	if (current->content_encoding)
+		fprintf (fp, "Content-Encoding: %s\r\n", current->content_encoding);
+	if (length >= 0)
+		fprintf (fp, "Content-Length: %lld\r\n", (long long) length);
+	current->sent_length = current->head ? -1 : length;
+	fprintf (fp, "%s %s\r\n", CONTENT_TYPE_STRING, content_type);
+}
+
+/**
+ * sized_header: forms an HTTP header corresponding to the incoming status
+ * code (contained in the struct http_status), adds the Content-type line (and
+ * the required empty string after it) is specified, preceded by the
+ * Content-Length line if the length of the body is known (not negative).
+ * The header contains the current time in the web time format and the
+ * name/version of the server, and tells whether the connection stays open:
+ * a body of unknown length can only be ended by closing it.
+ */
+void sized_header (FILE *fp, const struct http_status *format,
+						char *content_type, off_t length) {
+	status_lines (fp, format, length);
 	if (content_type) {
-		fprintf (fp, "%s %s\r\n", CONTENT_TYPE_STRING, content_type);
+		entity_lines (fp, content_type, length);
 		fprintf (fp, "\r\n");
 	}
 }
 
+/**
+ * header: the header for a body of unknown length
+ */
+void header (FILE *fp, const struct http_status *format, char *content_type) {
+	sized_header (fp, format, content_type, -1);
+}
+
+/**
+ * shown_path: the path of an item as the client knows it: without the
+ * root of the virtual host it is under
+ */
+static char *shown_path (char *item) {
+	if (current == 0 || current->vhost == 0 || item == 0)
+		return (item);
+	size_t len = strlen (current->vhost->root);
+	if (strncmp (item, current->vhost->root, len))
+		return (item);
+	return (item [len] == '/' ? item + len + 1 : item [len] ? item : ".");
+}
+
+/**
+ * content_type_of: the content type for the extension, the virtual host's
+ * own if it has one
+ */
+static char *content_type_of (char *extension) {
+	char *type = current->vhost != 0 ?
+					vhost_content_type (current->vhost, extension) : 0;
+	return (type != 0 ? type : find_content_type (extension));
+}
+
 /**
  * a handler for success/error response; forms a correct header corresponding
  * to the specified status code (or a 500 general error if the specific
- * format is not defined), and adds the message if supplied in plain text
+ * format is not defined), and adds the message if supplied in plain text,
+ * unless the request is a HEAD
  */
 void do_status (char *item, FILE *fp, enum http_codes status) {
 	const struct http_status *format = get_status_format (status);
+	item = shown_path (item);
+	int len = format->msg_fmt ? snprintf (0, 0, format->msg_fmt, item) : 0;
 
-	header (fp, format, "text/plain");
-	if (format->msg_fmt)
+	sized_header (fp, format, "text/plain", len);
+	if (format->msg_fmt && (current == 0 || !current->head))
 		fprintf (fp, format->msg_fmt, item);
 	fflush (fp);
 }
@@ -170,18 +261,34 @@ char *file_type (char *f)
 /* returns 'extension' of file */
 {
 	char *cp;
-	if ( f != 0 && (cp = strrchr (f, '.')) != 0)
+	if ( f != 0 && (cp = strrchr (f, '.')) != 0 && strchr (cp, '/') == 0)
 		return cp + 1;
 	return "";
 }
 
+/**
+ * stat through the file cache, if it is on; same return and errno as stat
+ */
+static int file_stat (char *f, struct stat *info) {
+	struct cache_entry *e = cache_lookup (f);
+
+	if (e == 0)
+		return (stat (f, info));
+	if (e->err) {
+		errno = e->err;
+		return (-1);
+	}
+	*info = e->info;
+	return (0);
+}
+
 /**
  * checks if the file at the specified path is a directory; returns 0 if it
  * is not, not-0 if it is
  */
 int isadir (char *f) {
 	struct stat info;
-	return (stat (f, &info) != -1 && S_ISDIR (info.st_mode));
+	return (file_stat (f, &info) != -1 && S_ISDIR (info.st_mode));
 }
 
 /**
@@ -191,7 +298,7 @@ int isadir (char *f) {
 int not_exist (char *f) {
 	struct stat info;
 
-	return (stat (f, &info) == -1 && errno == ENOENT);
+	return (file_stat (f, &info) == -1 && errno == ENOENT);
 }
 
 /**
@@ -201,15 +308,503 @@ int is_cgi (char *f) {
 	return (strncmp (file_type (f), "cgi", 3) == 0);
 }
 
+/**
+ * cgi_header_end: where the header lines of a cgi's output end, past the
+ * empty line after them
+ * returns: the start of the body, or NULL if the empty line is not there
+ */
+static char *cgi_header_end (char *output, size_t len) {
+	char *line = output, *end = output + len, *eol;
+
+	for (; (eol = memchr (line, '\n', end - line)) != 0; line = eol + 1)
+		if (eol == line || (eol == line + 1 && *line == '\r'))
+			return (eol + 1);
+	return (0);
+}
+
+static const char *framing_fields [] = {
+		"Content-Length", "Transfer-Encoding", "Connection", "Keep-Alive",
+		"Proxy-Connection", "TE", "Trailer", "Upgrade", 0
+};
+
+/**
+ * framing_field: whether the header line of a cgi's output is one of those
+ * that frame the message or concern only the connection, which are the
+ * server's to say
+ */
+static int framing_field (char *line, int llen) {
+	const char **name;
+
+	for (name = framing_fields; *name != 0; name ++) {
+		int len = strlen (*name);
+		if (llen > len && line [len] == ':' && !strncasecmp (line, *name, len))
+			return (1);
+	}
+	return (0);
+}
+
+/**
+ * cgi_header: the response header for a cgi's output with the len bytes at
+ * output for header lines: those lines (a "Status:" line setting the
+ * status) followed by the Content-Length of the body, or, for a negative
+ * length, the chunked framing it comes in; the script's own framing lines
+ * are left out, the server having measured or chunked the body itself. The
+ * Status is looked for first, as the status line goes before all the
+ * others.
+ */
+static void cgi_header (FILE *fp, char *output, size_t len, off_t length) {
+	struct http_status status = STATUS_OK;
+	char code_string [LINELEN];
+	char *line, *eol, *end = output + len;
+	int pass;
+
+	for (pass = 0; pass < 2; pass ++) {
+		if (pass == 1) // a chunked body is delimited as well as a sized one
+			status_lines (fp, &status, length < 0 ? 0 : length);
+		for (line = output; line < end && *line != '\r' && *line != '\n';
+										line = eol ? eol + 1 : end) {
+			eol = memchr (line, '\n', end - line);
+			int llen = (eol ? eol : end) - line;
+			if (llen > 0 && line [llen - 1] == '\r')
+				llen --;
+			int is_status = !strncasecmp (line, "Status:", 7);
+			int code;
+			if (pass == 0 && is_status && llen < LINELEN &&
+					sscanf (line + 7, "%d %[^\r\n]", &code, code_string) == 2) {
+				status.code = code;
+				status.code_string = code_string;
+			} else if (pass == 1 && !is_status && !framing_field (line, llen))
+				fprintf (fp, "%.*s\r\n", llen, line);
+		}
+	}
+	if (length < 0)
+		fprintf (fp, "Transfer-Encoding: chunked\r\n\r\n");
+	else
+		fprintf (fp, "Content-Length: %lld\r\n\r\n", (long long) length);
+	current->sent_length = current->head ? -1 : length;
+}
+
+/**
+ * cgi_response: turns the whole output of a pooled cgi into a response:
+ * its header lines followed by a Content-Length, so that the connection
+ * can stay open, and its body
+ */
+static void cgi_response (FILE *fp, char *output, size_t len) {
+	char *body = cgi_header_end (output, len);
+
+	if (body == 0) // all of it is header lines
+		body = output + len;
+	cgi_header (fp, output, body - output, output + len - body);
+	if (!current->head)
+		fwrite (body, 1, output + len - body, fp);
+}
+
+/**
+ * exec_pooled: runs the request on the script's pool of persistent
+ * workers. The forked responder waits for the output (a 504 if the worker
+ * takes too long); the event loop only sends the request and leaves the
+ * reply in the context, to be answered with finish_cgi once it is complete.
+ */
+static void exec_pooled (struct cgi_pool *pool, FILE *fp, char *method,
+							char *query) {
+	char *output;
+	size_t len;
+
+	if (current->deferred) {
+		if ((current->cgi = cgi_submit (pool, method, query)) == 0)
+			do_status ("", fp, SERVER_ERROR);
+		return;
+	}
+	if (cgi_call (pool, method, query, &output, &len) == -1) {
+		if (errno == EAGAIN)
+			stats_count (STAT_TIMEOUT_UPSTREAM, 1);
+		do_status ("", fp, errno == EAGAIN ? GATEWAY_TIMEOUT : SERVER_ERROR);
+		return;
+	}
+	cgi_response (fp, output, len);
+	free (output);
+	fflush (fp);
+}
+
+/**
+ * finish_cgi: the event loop's end of exec_pooled: the response to the
+ * request in the context, from the reply of the pool
+ */
+void finish_cgi (struct request *ctx, FILE *fp, struct cgi_reply *reply) {
+	current = ctx;
+	if (reply->failed)
+		do_status ("", fp, SERVER_ERROR);
+	else
+		cgi_response (fp, reply->out, reply->out_len);
+	access_log (ctx);
+}
+
+/**
+ * writev_all: writes out the iovecs, picking up after partial writes
+ * returns: 0 on success, -1 on error
+ */
+static int writev_all (int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t n = writev (fd, iov, count);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return (-1);
+		for (; count > 0 && (size_t) n >= iov->iov_len; iov ++, count --)
+			n -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return (0);
+}
+
+#define COPY_BUF_LEN 65536
+#define	CHUNK_LINE_LEN	256		/* longest chunk size or trailer line taken */
+
+/*
+ * where a request body is read from: what came in with the header first,
+ * then the connection
+ */
+struct body_source {
+	char *pending;
+	size_t pending_len;
+	FILE *in;
+	int dropping;	/* the reader is gone; the rest is read and dropped, so
+						that the client gets to the response */
+};
+
+static int source_getc (struct body_source *src) {
+	if (src->pending_len > 0) {
+		src->pending_len --;
+		return ((unsigned char) *src->pending ++);
+	}
+	return (getc (src->in));
+}
+
+/**
+ * source_copy: passes the next len bytes of the body on to the descriptor;
+ * the writes block while the reader is behind, and so does the reading
+ * from the client
+ * returns: 0 on success, -1 if the client went away first
+ */
+static int source_copy (struct body_source *src, long long len, int to) {
+	char buf [COPY_BUF_LEN];
+
+	while (len > 0) {
+		size_t got = len < COPY_BUF_LEN ? len : COPY_BUF_LEN;
+		char *cp = buf;
+		if (src->pending_len > 0) {
+			if (got > src->pending_len)
+				got = src->pending_len;
+			cp = src->pending;
+			src->pending += got;
+			src->pending_len -= got;
+		} else if ((got = fread (buf, 1, got, src->in)) == 0)
+			return (-1);
+		len -= got;
+		while (got > 0 && !src->dropping) {
+			ssize_t n = write (to, cp, got);
+			if (n < 0) {
+				src->dropping = 1;
+				break;
+			}
+			cp += n;
+			got -= n;
+		}
+	}
+	return (0);
+}
+
+/**
+ * source_line: reads a line of the chunked framing (a chunk size, or a
+ * trailer field) into buf, without its end
+ * returns: 0 on success, -1 at the end of the input or for a line too long
+ */
+static int source_line (struct body_source *src, char *buf, int len) {
+	int n = 0, c;
+
+	while ((c = source_getc (src)) != EOF && c != '\n') {
+		if (n == len - 1)
+			return (-1);
+		buf [n ++] = c;
+	}
+	if (c == EOF)
+		return (-1);
+	if (n > 0 && buf [n - 1] == '\r')
+		n --;
+	buf [n] = '\0';
+	return (0);
+}
+
+/**
+ * copy_chunked: passes a chunked body on to the descriptor without its
+ * framing: the chunks, then the trailer (which is dropped)
+ * returns: 0 on success, -1 if the client went away first, or the framing
+ * is not right
+ */
+static int copy_chunked (struct body_source *src, int to) {
+	char line [CHUNK_LINE_LEN];
+	char *end;
+
+	for (;;) {
+		if (source_line (src, line, CHUNK_LINE_LEN) == -1)
+			return (-1);
+		long long size = strtoll (line, &end, 16);
+		if (end == line || size < 0 ||
+				(*end != '\0' && *end != ';' && *end != ' ' && *end != '\t'))
+			return (-1);
+		if (size == 0)
+			break;
+		if (source_copy (src, size, to) == -1 ||
+				source_line (src, line, CHUNK_LINE_LEN) == -1 || *line)
+			return (-1);
+	}
+	do {
+		if (source_line (src, line, CHUNK_LINE_LEN) == -1)
+			return (-1);
+	} while (*line);
+	return (0);
+}
+
+/**
+ * feed_body: streams the request body into the cgi's stdin as it comes,
+ * through the pipe: the client is read from no faster than the cgi reads
+ * the body, and none of it is held beyond the copy buffer. What the cgi
+ * does not read is still read to the end.
+ * returns: 0 on success, -1 if the body did not come in full
+ */
+static int feed_body (int to) {
+	struct body_source src = {current->received, current->received_len,
+								current->in, 0};
+
+	if (src.in == 0 && (src.in = fdopen (dup (current->sock), "r")) == 0)
+		return (-1);
+	if (current->chunked)
+		return (copy_chunked (&src, to));
+	return (source_copy (&src, current->content_length, to));
+}
+
+/**
+ * close_inherited: for a child of the event loop that lives on with one of
+ * its connections (the one feeding a cgi its body, a TLS relay): closes
+ * what it has of the loop's (every one of those is close-on-exec), but for
+ * the descriptor to keep, so that it does not keep other connections open
+ */
+void close_inherited (int keep) {
+	DIR *dir = opendir ("/proc/self/fd");
+	struct dirent *entry;
+
+	if (dir == 0)
+		return;
+	while ((entry = readdir (dir)) != 0) {
+		int fd = atoi (entry->d_name);
+		if (fd > 2 && fd != keep && fd != dirfd (dir) &&
+				(fcntl (fd, F_GETFD) & FD_CLOEXEC))
+			close (fd);
+	}
+	closedir (dir);
+}
+
+/**
+ * detach: for the event loop, forks the process that answers the request
+ * by itself from here on: the child owns the socket, in blocking mode, with
+ * the body timeout on its reads if a body is to come, and fp is made its
+ * stream; the parent is no longer to answer the connection
+ * returns: 0 in the child, 1 in the parent, -1 if the fork failed
+ */
+static int detach (FILE **fp, int body) {
+	struct timeval stalled = {current->body_timeout, 0};
+
+	switch (fork ()) {
+		case -1:
+			return (-1);
+
+		case 0:
+			fcntl (current->sock, F_SETFL,
+					fcntl (current->sock, F_GETFL) & ~O_NONBLOCK);
+			if (body)
+				setsockopt (current->sock, SOL_SOCKET, SO_RCVTIMEO,
+							&stalled, sizeof (stalled));
+			signal (SIGPIPE, SIG_DFL); // the loop ignores it
+			if ((*fp = fdopen (current->sock, "w")) == 0)
+				exit (1);
+			return (0);
+
+		default:
+			current->detached = 1;
+			return (1);
+	}
+}
+
+/**
+ * cgi_environment: what the cgi learns of the request besides its body
+ */
+static void cgi_environment (char *method, char *query, int body) {
+	setenv ("REQUEST_METHOD", method, 1);
+	setenv ("QUERY_STRING", query != 0 ? query : "", 1);
+	if (body && !current->chunked) { // a chunked body is read to its end
+		char length [32];
+		snprintf (length, sizeof (length), "%lld", current->content_length);
+		setenv ("CONTENT_LENGTH", length, 1);
+	}
+	if (body && *current->content_type)
+		setenv ("CONTENT_TYPE", current->content_type, 1);
+}
+
+/**
+ * write_chunk: one chunk of a chunked body, in one writev; an empty one
+ * is the last
+ * returns: 0 on success, -1 if the connection is broken
+ */
+static int write_chunk (int fd, char *data, size_t len) {
+	char size [32];
+	struct iovec iov [3];
+
+	iov [0].iov_base = size;
+	iov [0].iov_len = snprintf (size, sizeof (size), "%zx\r\n", len);
+	iov [1].iov_base = data;
+	iov [1].iov_len = len;
+	iov [2].iov_base = "\r\n";
+	iov [2].iov_len = 2;
+	return (writev_all (fd, iov, 3));
+}
+
+/**
+ * relay_chunked: the forked responder's end of a streamed cgi: the output
+ * comes through the (non-blocking) pipe, the header lines first, which
+ * make the response header, then the body, which goes out in chunks of
+ * whatever has come while the last one was being sent, up to the copy
+ * buffer: a cgi writing a line at a time still fills the segments.
+ * returns: 0 if the whole response went out, -1 if the connection broke
+ */
+static int relay_chunked (FILE *fp, int from) {
+	char buf [COPY_BUF_LEN];
+	struct pollfd more = {from, POLLIN, 0};
+	char *body = 0;
+	size_t len = 0;
+	ssize_t n;
+
+	// up to a full buffer (or all of the output) with no end is all header
+	while (body == 0 && len < COPY_BUF_LEN &&
+			(n = read (from, buf + len, COPY_BUF_LEN - len)) != 0) {
+		if (n > 0)
+			body = cgi_header_end (buf, len += n);
+		else if (errno == EAGAIN)
+			poll (&more, 1, -1);
+		else if (errno != EINTR)
+			break;
+	}
+	if (body == 0)
+		body = buf + len;
+	cgi_header (fp, buf, body - buf, -1);
+	if (fflush (fp) == EOF)
+		return (-1);
+	len -= body - buf;
+	memmove (buf, body, len);
+
+	for (;;) {
+		n = read (from, buf + len, COPY_BUF_LEN - len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n > 0)
+			len += n;
+		if (len > 0 && (n <= 0 || len == COPY_BUF_LEN)) {
+			if (write_chunk (fileno (fp), buf, len) == -1)
+				return (-1);
+			len = 0;
+		}
+		if (n == 0 || (n == -1 && errno != EAGAIN))
+			break;
+		if (n == -1)
+			poll (&more, 1, -1);
+	}
+	return (write_chunk (fileno (fp), 0, 0));
+}
+
+/**
+ * exec_streamed: runs the cgi with its output going into a pipe rather
+ * than the socket, to be relayed as a chunked body, so that the connection
+ * can stay open: the forked responder relays it itself, the event loop
+ * gets the pipe in the context and relays the output as it comes. The
+ * responder reaps its cgis itself: a SIGCHLD would cut short the timed
+ * read of the next request.
+ */
+static void exec_streamed (char *prog, FILE *fp, char *method, char *query,
+							int out [2]) {
+	if (!current->deferred) {
+		signal (SIGCHLD, SIG_DFL);
+		while (waitpid (-1, 0, WNOHANG) > 0)
+			; // the ones that ended since the last
+	}
+	pid_t pid = fork ();
+
+	if (pid == 0) { // the cgi; the connection is not its own
+		close (current->sock);
+		close (fileno (fp));
+		signal (SIGPIPE, SIG_DFL);
+		dup2 (out [1], 1);
+		dup2 (out [1], 2);
+		cgi_environment (method, query, 0);
+		execl (prog, prog, (char *) 0);
+		perror (prog);
+		exit (1);
+	}
+	close (out [1]);
+	if (pid == -1) {
+		close (out [0]);
+		do_status (prog, fp, SERVER_ERROR);
+		return;
+	}
+	fcntl (out [0], F_SETFL, fcntl (out [0], F_GETFL) | O_NONBLOCK);
+	if (current->deferred) {
+		current->cgi_out = out [0];
+		return;
+	}
+	if (relay_chunked (fp, out [0]) == -1)
+		current->keep_alive = 0;
+	close (out [0]);
+}
+
+/**
+ * cgi_stream_header: the event loop's end of exec_streamed: the response
+ * header for the output of the cgi that has come so far, once its header
+ * lines are all in, or at_end (the output ended, or there is no more room
+ * for it, before the empty line)
+ * returns: how much of the output the header lines took, or -1 if they are
+ * not all in yet
+ */
+int cgi_stream_header (struct request *ctx, FILE *fp, char *output,
+						size_t len, int at_end) {
+	char *body = cgi_header_end (output, len);
+
+	if (body == 0 && !at_end)
+		return (-1);
+	if (body == 0)
+		body = output + len;
+	current = ctx;
+	cgi_header (fp, output, body - output, -1);
+	access_log (ctx);
+	return (body - output);
+}
+
 /**
  * handler for a cgi script/program. Tries to read the program at the
  * specified file path, checks if it is executable, sets the minimum
  * required environment for its execution (including parsing the
  * optional query string after '?' on the path), forms and prints the correct
  * HTTP header, then if the program exists and is executable, redirects its
- * stdout/stderr to the incoming socket and passes control to it.
+ * stdout/stderr to the incoming socket and passes control to it. A request
+ * body goes to the program's stdin through a pipe, fed by the process that
+ * would otherwise have become the program, which forks it instead; so it
+ * does for a pooled script, whose workers are not streamed bodies to.
+ * Without a body, on a connection that is to stay open, the output of an
+ * HTTP/1.1 client's cgi is relayed in chunks instead (exec_streamed).
  */
 void do_exec_method (char *prog, FILE *fp, char *method) {
+	int body = current->content_length > 0 || current->chunked;
+	int body_pipe [2], out_pipe [2];
 	char *cp;
 	if ((cp = strrchr (prog, '?')) != 0)
 		*cp = 0; // otherwise we wouldn't find the file
@@ -220,21 +815,85 @@ void do_exec_method (char *prog, FILE *fp, char *method) {
 		return;
 	}
 
+	struct cgi_pool *pool = body ? 0 : cgi_pool_find (prog);
+	if (pool != 0) {
+		exec_pooled (pool, fp, method, cp ? cp + 1 : 0);
+		return;
+	}
+	if (!body && current->keep_alive && current->version >= 11 &&
+			pipe2 (out_pipe, O_CLOEXEC) == 0) {
+		exec_streamed (prog, fp, method, cp ? cp + 1 : 0, out_pipe);
+		return;
+	}
+	if (body && pipe (body_pipe) == -1) {
+		do_status (prog, fp, SERVER_ERROR);
+		return;
+	}
+
+	if (current->deferred) { // event loop: the cgi gets a process of its own
+		int forked = detach (&fp, body);
+		if (forked == -1)
+			do_status (prog, fp, SERVER_ERROR);
+		if (forked != 0 && body) {
+			close (body_pipe [0]);
+			close (body_pipe [1]);
+		}
+		if (forked != 0)
+			return;
+	}
+
+	if (body && current->expect_continue)
+		fprintf (fp, "HTTP/1.1 100 Continue\r\n\r\n");
 	header (fp, &STATUS_OK, 0); // we can execute; status is 200
 						// Content-type expected to be set by the prog
 	fflush (fp);
 
-	setenv ("REQUEST_METHOD", method, 1);
-	if (cp != 0) // there were arguments after "?"; pass them down
-		setenv ("QUERY_STRING", cp + 1, 1);
-	else
-		setenv ("QUERY_STRING", "", 1);
+	if (body) { // this process feeds the body to the cgi, forked off here
+		pid_t pid = fork ();
+		if (pid != 0) {
+			close (body_pipe [0]);
+			signal (SIGPIPE, SIG_IGN); // the cgi need not read all of it
+			current->keep_alive = 0; // the rest of the connection is the cgi's
+			if (current->deferred) { // logged now, as the loop's log goes too
+				access_log_child ();
+				access_log (current);
+				access_log_flush ();
+				close_inherited (current->sock);
+			}
+			errno = 0;
+			if (pid != -1 && feed_body (body_pipe [1]) == -1 &&
+					errno == EAGAIN) // the client stalled past the timeout
+				stats_count (STAT_TIMEOUT_BODY, 1);
+			close (body_pipe [1]);
+			if (!current->deferred)
+				return; // the responder logs it and ends the connection
+			exit (0);
+		}
+		signal (SIGPIPE, SIG_DFL);
+		dup2 (body_pipe [0], 0);
+		close (body_pipe [0]);
+		close (body_pipe [1]);
+	}
 
+	// the arguments after "?", if there were any, are passed down
+	cgi_environment (method, cp ? cp + 1 : 0, body);
+
+	if (!body) { // else the feeding process accounts for the connection
+		if (!current->deferred) // the connection ends with the cgi, unseen
+			stats_count (STAT_ACTIVE, -1);
+		else
+			access_log_child (); // the loop sends what it has logged so far
+		access_log (current); // this is as much as we'll know of the response
+		access_log_flush ();
+	}
 	int fd = fileno (fp);
 	dup2 (fd, 1); // close stdout and redirect to socket
 	dup2 (fd, 2); // close stderr and redirect to socket
 	execl (prog, prog, (char *) 0);
 	perror (prog);
+	if (current->deferred || body) // nobody to return to in the forked child
+		exit (1);
+	stats_count (STAT_ACTIVE, 1); // the responder goes on after all
 }
 
 /**
@@ -242,31 +901,696 @@ void do_exec_method (char *prog, FILE *fp, char *method) {
  * struct request_handler
  */
 void do_exec (char *prog, FILE *fp, enum http_codes status) {
-	do_exec_method (prog, fp, "GET");
+	do_exec_method (prog, fp, current->method);
+}
+
+/**
+ * read_upstream: the next of the upstream's response, into the buffer
+ * returns: the bytes read, 0 at its end, -1 on an error or a timeout (which
+ * is counted)
+ */
+static ssize_t read_upstream (int fd, char *buf) {
+	ssize_t n;
+
+	do
+		n = read (fd, buf, COPY_BUF_LEN);
+	while (n == -1 && errno == EINTR);
+	if (n == -1 && errno == EAGAIN)
+		stats_count (STAT_TIMEOUT_UPSTREAM, 1);
+	return (n);
+}
+
+/**
+ * forward: the blocking end of a proxied request: the request goes to the
+ * upstream, its body streamed after it as it comes, and the response comes
+ * back through the copy buffer as it arrives. A request without a body is
+ * sent again if its connection fails before the response starts (the
+ * upstream went down, or closed the pooled connection meanwhile); one with
+ * a body goes out once, on a connection of its own. A response cut short
+ * can only be told by the connection closing after it.
+ */
+static void forward (char *item, FILE *fp, int body) {
+	char buf [COPY_BUF_LEN];
+	struct proxy_call *call = proxy_call (current->route, current, item,
+									PROXY_BLOCKING | (body ? PROXY_FRESH : 0));
+	ssize_t n = -1;
+	int ret;
+
+	while (call != 0) {
+		if (proxy_send (call) == 1 && body) {
+			if (current->expect_continue) {
+				fprintf (fp, "HTTP/1.1 100 Continue\r\n\r\n");
+				fflush (fp);
+			}
+			void (*pipe_handler) (int) = signal (SIGPIPE, SIG_IGN);
+			errno = 0;
+			ret = feed_body (call->fd);
+			signal (SIGPIPE, pipe_handler);
+			if (ret == -1) { // the client's end; there is nobody to answer
+				if (errno == EAGAIN)
+					stats_count (STAT_TIMEOUT_BODY, 1);
+				current->keep_alive = 0;
+				proxy_end (call, 0);
+				return;
+			}
+			current->content_length = 0; // not to be skipped anymore
+		}
+		if (call->request_off == call->request_len &&
+				(n = read_upstream (call->fd, buf)) > 0)
+			break;
+		if (body || proxy_retry (call) == -1)
+			break;
+	}
+	if (call == 0 || n <= 0) {
+		do_status (item, fp, n == -1 && errno == EAGAIN ? GATEWAY_TIMEOUT :
+															BAD_GATEWAY);
+		if (call != 0)
+			proxy_end (call, 0);
+		return;
+	}
+
+	while ((ret = proxy_relay (call, current, buf, n, fp)) == 0) {
+		fflush (fp);
+		if ((n = read_upstream (call->fd, buf)) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+	if (ret == -1 && call->state == REPLY_HEADER)
+		do_status (item, fp, n == -1 && errno == EAGAIN ? GATEWAY_TIMEOUT :
+															BAD_GATEWAY);
+	else if (ret == -1)
+		current->keep_alive = 0;
+	fflush (fp);
+	proxy_end (call, ret == 1);
+}
+
+/**
+ * handler for a request under a proxy prefix. The event loop gets the call
+ * in the context, to relay the response as the upstream sends it; but a
+ * request with a body gets a process of its own, which streams the body up
+ * and the response back, as the forked responder does itself. A chunked
+ * body is refused, as it is not passed on.
+ */
+void do_proxy (char *item, FILE *fp, enum http_codes status) {
+	int body = current->content_length > 0;
+
+	if (current->chunked) {
+		do_status (item, fp, LENGTH_REQUIRED);
+		return;
+	}
+	if (current->deferred && !body) {
+		current->proxy = proxy_call (current->route, current, item, 0);
+		if (current->proxy == 0)
+			do_status (item, fp, BAD_GATEWAY);
+		return;
+	}
+	if (current->deferred) {
+		int forked = detach (&fp, body);
+		if (forked == -1)
+			do_status (item, fp, SERVER_ERROR);
+		if (forked != 0)
+			return;
+		access_log_child (); // the loop sends what it has logged so far
+		close_inherited (current->sock);
+		current->keep_alive = 0; // the connection ends with the child
+	}
+	forward (item, fp, body);
+	if (current->deferred) {
+		access_log (current);
+		access_log_flush ();
+		exit (0);
+	}
+}
+
+/**
+ * bad_gateway: the event loop's answer to a proxied request whose upstream
+ * failed it before the response came: it could not be had, or took too
+ * long (as a cgi pool can, too)
+ */
+void bad_gateway (struct request *ctx, FILE *fp, int timed_out) {
+	current = ctx;
+	do_status (0, fp, timed_out ? GATEWAY_TIMEOUT : BAD_GATEWAY);
+	access_log (ctx);
+}
+
+/**
+ * copy_fd: the fallback for what sendfile cannot do (pipes, devices);
+ * copies until EOF, or until len bytes if len is not negative, through one
+ * large buffer.
+ * returns: 0 on success, -1 on a read or write error
+ */
+static int copy_fd (int from, int to, off_t len) {
+	char buf [COPY_BUF_LEN];
+
+	while (len != 0) {
+		size_t want = (len > 0 && len < COPY_BUF_LEN) ? len : COPY_BUF_LEN;
+		ssize_t got = read (from, buf, want);
+		if (got <= 0)
+			return (got == 0 && len < 0 ? 0 : -1);
+		char *cp = buf;
+		while (got > 0) {
+			ssize_t n = write (to, cp, got);
+			if (n < 0)
+				return (-1);
+			cp += n;
+			got -= n;
+		}
+		if (len > 0)
+			len -= cp - buf;
+	}
+	return (0);
+}
+
+/**
+ * send_file_body: sends len bytes of the file from offset off to the
+ * socket, without copying them through user space if the kernel allows
+ * returns: 0 on success, -1 on error
+ */
+static int send_file_body (int sock, int fd, off_t off, off_t len) {
+	off_t end = off + len;
+
+	while (off < end) {
+		ssize_t n = sendfile (sock, fd, &off, end - off);
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+				off == end - len && lseek (fd, off, SEEK_SET) != -1)
+			return (copy_fd (fd, sock, len)); // fs without sendfile
+		if (n <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/**
+ * free_body: releases the in-memory pieces of a planned body
+ */
+void free_body (struct body_segment *body, int parts) {
+	int idx;
+	for (idx = 0; idx < parts; idx ++) {
+		free (body [idx].prefix);
+		body [idx].prefix = 0;
+	}
+}
+
+/**
+ * send_segments: sends the planned body of the current request from the
+ * open file, each part's in-memory lines followed by its range of the file.
+ * A body cut short (the client went away, or stalled past the send timeout)
+ * ends the connection.
+ * returns: 0 on success, -1 on error
+ */
+static int send_segments (int sock, int fd) {
+	int idx, ret = 0;
+
+	for (idx = 0; ret == 0 && idx < current->body_parts; idx ++) {
+		struct body_segment *seg = current->body + idx;
+		char *cp = seg->prefix;
+		size_t left = seg->prefix_len;
+		while (ret == 0 && left > 0) {
+			ssize_t n = send (sock, cp, left, MSG_MORE);
+			if (n < 0)
+				ret = -1;
+			else {
+				cp += n;
+				left -= n;
+			}
+		}
+		if (ret == 0 && seg->len > 0)
+			ret = send_file_body (sock, fd, seg->off, seg->len);
+	}
+	if (ret == -1) {
+		current->keep_alive = 0;
+		if (errno == EAGAIN)
+			stats_count (STAT_TIMEOUT_SEND, 1);
+	}
+	free_body (current->body, current->body_parts);
+	return (ret);
+}
+
+/**
+ * validator_lines: the header lines that let a client revalidate the file
+ * or ask for parts of it: Last-Modified, an ETag made of the inode, the
+ * size and the time of modification, and Accept-Ranges
+ */
+static void validator_lines (char *buf, size_t len, struct stat *info) {
+	char time [MAXDATELEN];
+
+	format_time (info->st_mtim.tv_sec, time);
+	snprintf (buf, len, "Last-Modified: %s\r\n"
+				"ETag: \"%lx-%llx-%lx\"\r\nAccept-Ranges: bytes\r\n", time,
+				(unsigned long) info->st_ino,
+				(unsigned long long) info->st_size,
+				(unsigned long) info->st_mtim.tv_sec);
+}
+
+/**
+ * entity_header: the header lines of a whole regular file that stay the
+ * same from response to response (the validators, Content-Length and the
+ * content type, and the empty line ending the header), for the file pack
+ * to keep with the file
+ * returns: their length, with the validators' part of it in
+ * validators_len, or -1 if they do not fit the buffer
+ */
+int entity_header (char *buf, size_t len, struct stat *info, char *type,
+					int *validators_len) {
+	validator_lines (buf, len, info);
+	*validators_len = strlen (buf);
+	int n = snprintf (buf + *validators_len, len - *validators_len,
+				"Content-Length: %lld\r\n%s %s\r\n\r\n",
+				(long long) info->st_size, CONTENT_TYPE_STRING, type);
+	return (*validators_len + n < len ? *validators_len + n : -1);
+}
+
+/**
+ * etag_in: whether the ETag in the validator lines is among the ones in the
+ * header value (or the value is "*"). Weak tags never match.
+ */
+static int etag_in (char *value, char *validators) {
+	char *tag = strstr (validators, "ETag: ") + strlen ("ETag: ");
+	size_t len = strchr (tag, '\r') - tag;
+	char *cp;
+
+	if (!strcmp (value, "*"))
+		return (1);
+	for (cp = strstr (value, "\""); cp != 0; cp = strstr (cp + 1, "\""))
+		if (!strncmp (cp, tag, len) && (cp == value || cp [-1] != '/'))
+			return (1);
+	return (0);
+}
+
+/**
+ * not_modified: whether a conditional GET may be answered with a 304;
+ * If-None-Match, if present, takes precedence over If-Modified-Since
+ */
+static int not_modified (struct stat *info, char *validators) {
+	if (current->if_none_match [0])
+		return (etag_in (current->if_none_match, validators));
+	return (current->if_modified_since != -1 &&
+				info->st_mtim.tv_sec <= current->if_modified_since);
+}
+
+/**
+ * parse_ranges: the byte ranges of the Range header that fall within a
+ * file of the given size, with suffix and open-ended ranges resolved
+ * returns: the number of ranges, -1 if none of them is satisfiable, 0 if
+ * the header is not understood (or asks for too many ranges), in which
+ * case the whole file is sent
+ */
+static int parse_ranges (char *spec, off_t size, off_t *off, off_t *len) {
+	int count = 0, seen = 0;
+	char *cp = spec;
+
+	if (strncasecmp (cp, "bytes=", 6))
+		return (0);
+	for (cp += 6; *cp; ) {
+		long long first = -1, last = -1;
+		char *end;
+		cp += strspn (cp, " \t");
+		if (*cp != '-') {
+			first = strtoll (cp, &end, 10);
+			if (end == cp || first < 0)
+				return (0);
+			cp = end;
+		}
+		if (*cp ++ != '-')
+			return (0);
+		cp += strspn (cp, " \t");
+		if (*cp >= '0' && *cp <= '9') {
+			last = strtoll (cp, &end, 10);
+			cp = end;
+		} else if (first == -1) // "-" alone
+			return (0);
+		cp += strspn (cp, " \t");
+		if (*cp != ',' && *cp != 0)
+			return (0);
+		if (*cp == ',')
+			cp ++;
+		if (++ seen > MAX_RANGES)
+			return (0);
+
+		if (first == -1) { // the last so many bytes
+			if (last == 0 || size == 0)
+				continue;
+			first = last < size ? size - last : 0;
+			last = size - 1;
+		} else if (first >= size || (last != -1 && last < first)) {
+			if (last != -1 && last < first)
+				return (0); // invalid, so the whole header is ignored
+			continue;
+		} else if (last == -1 || last >= size)
+			last = size - 1;
+		off [count] = first;
+		len [count ++] = last - first + 1;
+	}
+	return (count > 0 ? count : (seen > 0 ? -1 : 0));
+}
+
+/**
+ * range_requested: the ranges to send, if there is a Range header and an
+ * If-Range (if any) still matches the file
+ */
+static int range_requested (struct stat *info, char *validators,
+							off_t *off, off_t *len) {
+	char *cond = current->if_range;
+
+	if (current->range [0] == 0)
+		return (0);
+	if (cond [0] == '"' || !strncmp (cond, "W/", 2)) {
+		if (!etag_in (cond, validators))
+			return (0);
+	} else if (cond [0] && parse_http_date (cond) != info->st_mtim.tv_sec)
+		return (0);
+	return (parse_ranges (current->range, info->st_size, off, len));
+}
+
+/**
+ * multipart_body: plans a multipart/byteranges body, one part per range,
+ * each with its boundary and header lines in memory in front of it
+ * returns: the length of the whole body, or -1 if out of memory
+ */
+static off_t multipart_body (int count, off_t *off, off_t *len, off_t size,
+								char *type, char *boundary) {
+	struct body_segment *seg = current->body;
+	off_t total = 0;
+	int idx, n;
+
+	for (idx = 0; idx < count; idx ++, seg ++) {
+		n = asprintf (&seg->prefix, "\r\n--%s\r\n%s %s\r\n"
+				"Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				boundary, CONTENT_TYPE_STRING, type, (long long) off [idx],
+				(long long) (off [idx] + len [idx] - 1), (long long) size);
+		seg->off = off [idx];
+		seg->len = len [idx];
+		current->body_parts ++;
+		if (n == -1)
+			break;
+		seg->prefix_len = n;
+		total += n + len [idx];
+	}
+	if (idx < count || (n = asprintf (&seg->prefix, "\r\n--%s--\r\n",
+											boundary)) == -1) {
+		seg->prefix = 0;
+		free_body (current->body, current->body_parts);
+		current->body_parts = 0;
+		return (-1);
+	}
+	seg->prefix_len = n;
+	seg->off = seg->len = 0;
+	current->body_parts ++;
+	return (total + n);
+}
+
+/**
+ * body_to_send: whether the body planned in current->body goes out; for a
+ * HEAD it does not, and the plan is dropped
+ */
+static int body_to_send (void) {
+	if (!current->head)
+		return (1);
+	free_body (current->body, current->body_parts);
+	current->body_parts = 0;
+	return (0);
+}
+
+/**
+ * entity_response: writes the header for sending a regular file and plans
+ * its body in current->body: all of it (200), a single range (206) or
+ * several as a multipart/byteranges body (206). A conditional request for
+ * an unchanged file gets a 304, and a Range none of which is within the
+ * file a 416; neither has a body. A HEAD gets the same header as the GET
+ * would, and no body.
+ * returns: not-0 if there is a body to send
+ */
+static int entity_response (FILE *fp, struct stat *info, char *type,
+							char *validators) {
+	off_t off [MAX_RANGES], len [MAX_RANGES];
+	off_t size = info->st_size;
+	int count;
+
+	current->body_parts = 0;
+	if (not_modified (info, validators)) {
+		status_lines (fp, &STATUS_NOT_MODIFIED, 0);
+		fprintf (fp, "%s\r\n", validators);
+		return (0);
+	}
+
+	count = range_requested (info, validators, off, len);
+	if (count == -1) {
+		status_lines (fp, &STATUS_NO_RANGE, 0);
+		fprintf (fp, "Content-Range: bytes */%lld\r\n", (long long) size);
+		current->content_encoding = 0;
+		entity_lines (fp, "text/plain", 0);
+		fprintf (fp, "\r\n");
+		return (0);
+	}
+
+	if (count > 1) {
+		char boundary [32];
+		snprintf (boundary, sizeof (boundary), "wsng%08lx%08lx",
+					(unsigned long) info->st_ino, (unsigned long) time (0));
+		off_t total = multipart_body (count, off, len, size, type, boundary);
+		if (total != -1) {
+			char multipart [64];
+			snprintf (multipart, sizeof (multipart),
+						"multipart/byteranges; boundary=%s", boundary);
+			status_lines (fp, &STATUS_PARTIAL, total);
+			fprintf (fp, "%s", validators);
+			entity_lines (fp, multipart, total);
+			fprintf (fp, "\r\n");
+			return (body_to_send ());
+		}
+		count = 0; // out of memory; send it all
+	}
+
+	if (count == 1) {
+		status_lines (fp, &STATUS_PARTIAL, len [0]);
+		fprintf (fp, "%sContent-Range: bytes %lld-%lld/%lld\r\n", validators,
+				(long long) off [0], (long long) (off [0] + len [0] - 1),
+				(long long) size);
+	} else {
+		off [0] = 0;
+		len [0] = size;
+		status_lines (fp, &STATUS_OK, size);
+		fprintf (fp, "%s", validators);
+	}
+	entity_lines (fp, type, len [0]);
+	fprintf (fp, "\r\n");
+	memset (current->body, 0, sizeof (struct body_segment));
+	current->body [0].off = off [0];
+	current->body [0].len = len [0];
+	current->body_parts = 1;
+	return (len [0] > 0 && body_to_send ());
+}
+
+static const struct precompressed_sibling {
+	int accept;		/* the ACCEPT_ bit for the encoding */
+	char *suffix;
+	char *encoding;
+} siblings [] = {
+		{ACCEPT_BR, ".br", "br"}, // preferred: smaller
+		{ACCEPT_GZIP, ".gz", "gzip"},
+		{0, 0, 0}
+};
+
+/**
+ * precompressed: looks for the file's precompressed siblings. Where there
+ * is one, the response varies with Accept-Encoding; if the client takes
+ * its encoding, it is to be sent instead of the file.
+ * returns: the path of the file to send (the sibling, or the file itself)
+ */
+static char *precompressed (char *f, char *sibling) {
+	const struct precompressed_sibling *s;
+	char *chosen = f;
+	char candidate [PATH_MAX];
+	struct stat info;
+
+	for (s = siblings; s->suffix != 0; s ++) {
+		if (snprintf (candidate, PATH_MAX, "%s%s", f, s->suffix) >= PATH_MAX ||
+				file_stat (candidate, &info) == -1 || !S_ISREG (info.st_mode))
+			continue;
+		current->vary = 1;
+		if (chosen == f && (current->accept_encoding & s->accept)) {
+			current->content_encoding = s->encoding;
+			chosen = strcpy (sibling, candidate);
+		}
+	}
+	return (chosen);
+}
+
+/**
+ * write_segments: the planned parts of a body that is in memory, into the
+ * stream
+ */
+static void write_segments (char *body, FILE *fpsock) {
+	int idx;
+
+	for (idx = 0; idx < current->body_parts; idx ++) {
+		struct body_segment *seg = current->body + idx;
+		fwrite (seg->prefix, 1, seg->prefix_len, fpsock);
+		fwrite (body + seg->off, 1, seg->len, fpsock);
+	}
+	free_body (current->body, current->body_parts);
+	current->body_parts = 0;
+}
+
+/**
+ * do_cat from the file cache: the validator header lines are rendered once
+ * per file; a small file's body is copied from memory, a larger one is sent
+ * from the cached open file (the event loop gets a dup of it, as the cache
+ * may close its own while the body is still going out).
+ * returns: 0 if the response was sent, -1 if the caller should fall back to
+ * opening the file itself
+ */
+static int cat_cached (struct cache_entry *e, char *content, FILE *fpsock) {
+	if (e->header [0] == 0)
+		validator_lines (e->header, CACHED_HEADER_LEN, &e->info);
+
+	char *body = cache_body (e);
+	int fd = body ? -1 : cache_open (e);
+	if (body == 0 && fd == -1)
+		return (-1);
+
+	if (!entity_response (fpsock, &e->info, content, e->header))
+		return (0);
+	if (body != 0) {
+		write_segments (body, fpsock);
+	} else if (current->deferred) {
+		current->body_fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+	} else {
+		fflush (fpsock);
+		send_segments (fileno (fpsock), fd);
+	}
+	return (0);
+}
+
+#define	STATUS_LINES_LEN	512
+
+/**
+ * do_cat from the file pack. A plain request for the whole file is answered
+ * with the status lines followed by the entry as it lies in the pack, its
+ * header lines and body together: the forked responder writes them with
+ * one writev, and the event loop is left the entry to send after the
+ * status lines (holding the pack until it is sent). Conditional and range
+ * requests, HEADs and a precompressed sibling go through entity_response
+ * like any other file, with the body copied from the pack.
+ */
+static void cat_packed (struct pack_entry *p, char *content, FILE *fpsock) {
+	off_t size = p->info.st_size;
+
+	stats_count (STAT_PACK_HITS, 1);
+	if (!current->head && current->range [0] == 0 &&
+			current->if_none_match [0] == 0 &&
+			current->if_modified_since == -1 &&
+			current->content_encoding == 0) {
+		char lines [STATUS_LINES_LEN];
+		FILE *lp = current->deferred ? fpsock :
+					fmemopen (lines, STATUS_LINES_LEN, "w");
+		if (lp != 0) {
+			status_lines (lp, &STATUS_OK, size);
+			current->sent_length = size;
+			if (current->deferred) {
+				current->packed = p->header;
+				current->packed_len = p->header_len + size;
+				current->pack = pack_hold ();
+				return;
+			}
+			struct iovec iov [2] = {{lines, ftell (lp)},
+									{p->header, p->header_len + size}};
+			fclose (lp);
+			fflush (fpsock);
+			writev_all (fileno (fpsock), iov, 2);
+			return;
+		}
+	}
+
+	char validators [CACHED_HEADER_LEN];
+	snprintf (validators, CACHED_HEADER_LEN, "%.*s", p->validators_len,
+				p->header);
+	if (entity_response (fpsock, &p->info, content, validators))
+		write_segments (p->body, fpsock);
 }
 
 /**
  * handler for dumping the contents of the file into the socket, setting the
  * content type according to its extension. The incoming status is ignored.
  * if the file cannot be found or opened, prints a 404 header; otherwise,
- * sends over the file contents under the 200 header
+ * sends over the file contents under the 200 header.
+ * Regular files get a Content-Length and validators, and may be asked for
+ * conditionally or in ranges; their bodies go out with sendfile (the event
+ * loop is left the open file to send from). The socket is corked meanwhile,
+ * so that the header and the start of the body share a segment. Anything
+ * else (a fifo, a device) is copied through a large buffer until EOF by a
+ * forked responder; the event loop, which must not wait on one, opens it
+ * without blocking and refuses it with a 403.
+ * A precompressed sibling of the file is sent instead if the client takes
+ * its encoding. Files in the file pack are sent from it, without opening
+ * them.
  */
-void do_cat (char *f, FILE *fpsock, enum http_codes status) {
-	char *extension = file_type (f); // find file type
-	char *content = find_content_type (extension); // content type or default
-	FILE *fpfile;
-	int c;
+void do_cat (char *item, FILE *fpsock, enum http_codes status) {
+	char *extension = file_type (item); // find file type
+	char *content = content_type_of (extension); // content type or default
+	char sibling [PATH_MAX];
+	char *f = use_precompressed () ? precompressed (item, sibling) : item;
+
+	// the pack has the global content types in its header lines
+	struct pack_entry *p = current->vhost == 0 ||
+					current->vhost->types == 0 ? pack_lookup (f) : 0;
+	if (p != 0) {
+		cat_packed (p, content, fpsock);
+		return;
+	}
+
+	struct cache_entry *e = cache_lookup (f);
+	if (e != 0 && e->err == 0 && S_ISREG (e->info.st_mode) &&
+								cat_cached (e, content, fpsock) == 0)
+		return;
 
-	fpfile = fopen (f, "r");
-	if (fpfile != 0) {
+	struct stat info;
+	int fd = open (f, O_RDONLY | O_CLOEXEC |
+						(current->deferred ? O_NONBLOCK : 0));
+
+	if (fd == -1 || fstat (fd, &info) == -1) {
+		if (fd != -1)
+			close (fd);
+		do_status (f, fpsock, NOT_FOUND);
+		return;
+	}
+
+	if (!S_ISREG (info.st_mode) && current->deferred) {
+		close (fd);
+		do_status (f, fpsock, NOT_ALLOWED);
+		return;
+	}
+	if (!S_ISREG (info.st_mode)) {
 		header (fpsock, &STATUS_OK, content);
-		while ( (c = getc(fpfile)) != EOF)
-			putc(c, fpsock); // pump characters
-		fclose (fpfile);
 		fflush (fpsock);
-	} else {
-		do_status (f, fpsock, NOT_FOUND);
+		if (!current->head)
+			copy_fd (fd, fileno (fpsock), -1);
+		close (fd);
+		return;
+	}
+
+	char validators [CACHED_HEADER_LEN];
+	validator_lines (validators, CACHED_HEADER_LEN, &info);
+	if (current->deferred) {
+		if (entity_response (fpsock, &info, content, validators))
+			current->body_fd = fd; // the event loop sends and closes it
+		else
+			close (fd);
+		return;
+	}
+
+	int sock = fileno (fpsock);
+	int cork = 1;
+	setsockopt (sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
+	if (entity_response (fpsock, &info, content, validators)) {
+		fflush (fpsock);
+		send_segments (sock, fd);
 	}
+	fflush (fpsock);
+	cork = 0; // pushes out whatever is left
+	setsockopt (sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
+	close (fd);
 }
 
 /**
@@ -294,195 +1618,157 @@ static int read_cgi_content_type (char *filepath, char *type) {
 }
 
 /**
- * a handler for the HEAD request; executes cgi scripts to find their type,
- * otherwise just prints the 200 OK header with the content type determined by
- * file type
+ * pooled_cgi: the pool running the cgi item, if any; the item loses its
+ * "?arguments", which are pointed to by query (NULL if there are none)
+ */
+static struct cgi_pool *pooled_cgi (char *item, char **query) {
+	char *cp = strrchr (item, '?');
+	if (cp != 0)
+		*cp = 0;
+	*query = cp ? cp + 1 : 0;
+	return (cgi_pool_find (item));
+}
+
+/**
+ * a handler for the HEAD request for a cgi script; executes it to find its
+ * type (pooled ones are not run again once their type is known). Other
+ * items are answered by the GET handlers, which leave out the body.
  */
 void do_head (char *item, FILE *fp, enum http_codes status) {
 	char *content_type;
+	char cgitype [LINELEN];
+	struct cgi_pool *pool;
+	char *query;
 
 	if (not_exist (item)){
-		header (fp, &STATUS_NOT_FOUND, 0);
-	} else if (is_cgi (item)) {
+		header (fp, &STATUS_NOT_FOUND, "text/plain");
+		return;
+	} else if ((pool = pooled_cgi (item, &query)) != 0) {
+		// the type it answered with last time, or ask it
+		if ((content_type = cgi_pool_content_type (pool)) == 0) {
+			exec_pooled (pool, fp, "HEAD", query);
+			return;
+		}
+	} else {
 		// this should have sufficed:
 		/* do_exec_method (item, fp, "HEAD"); */
 		// but the test example cgis don't respect this, so:
-		char cgitype [LINELEN];
 		if (read_cgi_content_type (item, cgitype)) {
-			header (fp, &GENERAL_ERROR, 0); // cgi didn't say what type it is
-			return;
+			header (fp, &GENERAL_ERROR, "text/plain"); // cgi didn't say
+			return;									// what type it is
 		} else
 			content_type = cgitype;
-	} else {
-		char *extension = file_type (item);
-		content_type = find_content_type (extension);
 	}
 
 	header (fp, &STATUS_OK, content_type);
 	fflush (fp);
 }
 
+#define IOV_BATCH 1024	// IOV_MAX on Linux
+
 /**
- * for a given directory, check first if it exists and is capable of being
- * read/executed; if so, tries to find a file with the name "index.html" in
- * it. If there is, prints it out into the socket with the content type
- * text/html. If there isn't, tries the same for a file with the name
- * "index.cgi" - printing its output into the socket if found.
- * Returns: 0 if the directory is accessible and does not contain index files,
- * or not-0 if there should be no further processing done on it (either
- * it is not accessible, or an index file has already been handles)
+ * send_listing: the rendered listing page under a 200 header. The forked
+ * responder hands the header and the rows to writev, up to IOV_BATCH pieces
+ * at a time; the event loop has them copied into its response buffer.
+ * Clients taking gzip get the compressed page, if compression is on. A HEAD
+ * gets the header alone.
  */
-int check_access_and_index (char *dir, FILE *fp) {
-	struct dirent dir_entry;
-	struct dirent *dir_flag = 0;
-	int has_html = 0;
-	int has_cgi = 0;
-	int ret = 0;
-
-	DIR *dir_ptr = opendir (dir);
-	if (dir_ptr == 0) { // either not there, or wrong permissions
-		do_status (dir, fp, errno == EACCES? NOT_ALLOWED : NOT_FOUND);
-							// either 404 or 403
-		return (1);
-	}
-	if (readdir_r (dir_ptr, &dir_entry, &dir_flag) ||
-							dir_flag == 0) { // listing not permitted
-		do_status (dir, fp, NOT_ALLOWED);
-		closedir  (dir_ptr);
-		return (1);
+static void send_listing (struct listing *l, FILE *sock_fp) {
+	struct iovec iov [IOV_BATCH];
+	int from = 0, count;
+	off_t length = listing_length (l);
+
+	if (compressible ("text/html", length)) {
+		current->vary = 1;
+		if ((current->accept_encoding & ACCEPT_GZIP) &&
+											listing_gzip (l) == 0) {
+			current->content_encoding = "gzip";
+			sized_header (sock_fp, &STATUS_OK, "text/html", l->gzip_len);
+			if (!current->head)
+				fwrite (l->gzip, 1, l->gzip_len, sock_fp);
+			return;
+		}
 	}
 
-	do { // we don't care for the order of entries here
-		char *entry_name = dir_entry.d_name;
-		if (!strcasecmp (entry_name, "index.html"))
-			has_html = 1;
-		else if (!strcasecmp (entry_name, "index.cgi"))
-			has_cgi = 1;
-	} while (!readdir_r (dir_ptr, &dir_entry, &dir_flag) && dir_flag != 0);
-
-	char index_file [PATH_MAX];
-	if (has_html) { // found "index.html"
-		snprintf (index_file, PATH_MAX, "%s/%s", dir, "index.html");
-		do_cat (index_file, fp, OK); // write it out
-		ret = 1;
-	} else if (has_cgi) { // found "index.cgi"
-		snprintf (index_file, PATH_MAX, "%s/%s", dir, "index.cgi");
-		do_exec (index_file, fp, OK); // execute it
-		ret = 1;
-	}
-	closedir (dir_ptr);
-	return (ret);
-}
-
-/**
- * forms and prints a correct HTML header and the start of the directory
- * listing table
- */
-void ls_header (FILE *fp, char *dir) {
-	header (fp, &STATUS_OK, "text/html");
-	fprintf (fp, "<html>\r\n<head>\r\n");
-	fprintf (fp, "<title>\r\nIndex of /%s\r\n</title>\r\n", dir);
-	fprintf (fp, "</head>\r\n\r\n<body>\r\n");
-	fprintf (fp, "<h1>Index of /%s</h1>\r\n", dir);
-	fprintf (fp, "<table>\r\n");
-	fprintf (fp, "<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>");
-	fprintf (fp, "<tr><th colspan=3><hr></th></tr>");
-}
+	if (current->head) {
+		sized_header (sock_fp, &STATUS_OK, "text/html", length);
+		return;
+	}
 
-/**
- * forms and prints a "Parent Directory" line in the directory listing,
- * including name and hgref tag, unless we are already at top level
- */
-void print_parent_dir (char *dir, struct dirent *e, FILE *fp, int is_top) {
-	if (!is_top) {
-		char *last_sep = strrchr (dir, '/');
-		if (last_sep != 0) {
-			*last_sep = 0;
-			fprintf (fp, "<a href=\"/%s\">Parent Directory</a>\r\n", dir);
-			*last_sep = '/';
-		} else {
-			fprintf (fp, "<a href=\".\">Parent Directory</a>\r\n");
+	if (current->deferred) {
+		sized_header (sock_fp, &STATUS_OK, "text/html", length);
+		while ((count = listing_iov (l, iov, IOV_BATCH, from)) > 0) {
+			int idx;
+			for (idx = 0; idx < count; idx ++)
+				fwrite (iov [idx].iov_base, 1, iov [idx].iov_len, sock_fp);
+			from += count;
 		}
+		return;
 	}
-}
 
-#define LONGEST_LONG_STR_SIZE ((CHAR_BIT * sizeof (long) - 1) / 3 + 2)
-
-/**
- * forms and prints the HTML line in the directory listing table for a
- * directory entry.
- */
-void print_one_entry (char *dir, struct dirent *dir_entry,
-						FILE *fp, int is_top) {
-	char *entry_name = dir_entry->d_name;
-	if (strcmp (entry_name, ".") && strcmp (entry_name, "..")) {
-		(!is_top) ?
-		fprintf (fp, "<a href=\"/%s/%s\">%s</a></td><td>\r\n",
-						dir, entry_name, entry_name) :
-		fprintf (fp, "<a href=\"/%s\">%s</a></td><td>\r\n",
-						entry_name, entry_name);
-
-		char fname [MAXNAMLEN];
-		snprintf (fname, MAXNAMLEN, "%s/%s", dir, entry_name);
-		struct stat stats;
-		if (!lstat (fname, &stats)) {
-			char time [MAXDATELEN];
-			format_time (stats.st_mtim.tv_sec, time);
-			fprintf (fp, "%s</td><td>", time);
-			if (S_ISDIR (stats.st_mode)) {
-				fprintf (fp, "-");
-			} else {
-				char size [LONGEST_LONG_STR_SIZE];
-				snprintf (size, LONGEST_LONG_STR_SIZE, "%ld", stats.st_size);
-				fprintf (fp, "%s", size);
-			}
-		}
-		fprintf (fp, "</td></tr>\r\n");
+	char *head;
+	size_t head_len;
+	FILE *hp = open_memstream (&head, &head_len);
+	if (hp == 0) {
+		do_status ("", sock_fp, SERVER_ERROR);
+		return;
 	}
+	sized_header (hp, &STATUS_OK, "text/html", length);
+	fclose (hp);
+	fflush (sock_fp);
+
+	iov [0].iov_base = head;
+	iov [0].iov_len = head_len;
+	count = 1 + listing_iov (l, iov + 1, IOV_BATCH - 1, 0);
+	while (count > 0 && writev_all (fileno (sock_fp), iov, count) == 0) {
+		from += count - (from == 0);
+		count = listing_iov (l, iov, IOV_BATCH, from);
+	}
+	free (head);
 }
 
 /**
- * a <tr><td>XXX</td/tr> bracket around a function that prints out a line
- * in the directory listing
+ * handler for a directory: serves its index file if there is one, else
+ * lists it. Both are found out by a single scan of the directory; with the
+ * file cache on, the scan is kept and only the rows of entries reported
+ * changed are rendered again.
  */
-void print_one_ls_line (void f (char *, struct dirent *, FILE *, int),
-		char *dir, struct dirent *dir_entry, FILE *fp, int is_top) {
-	fprintf (fp, "<tr><td valign=top>");
-	f (dir, dir_entry, fp, is_top);
-	fprintf (fp, "</td></tr>\r\n");
-}
-
-void do_ls (char *dir, FILE *fp, enum http_codes status) {
-	if (check_access_and_index (dir, fp))// cannot list or there's an index file
-		return; // either way, no listing required
-
-	int is_top = !strcmp (dir, ".");
+void do_ls (char *dir, FILE *sock_fp, enum http_codes status) {
+	struct cache_entry *e = cache_lookup (dir);
+	struct listing *l = e != 0 ? cache_listing (e) : listing_scan (dir);
 
-	ls_header (fp, dir); // HEAD and header row of the table
-	print_one_ls_line (print_parent_dir, dir, 0, fp, is_top);
+	if (l == 0) { // either not there, or wrong permissions
+		do_status (dir, sock_fp, errno == EACCES? NOT_ALLOWED : NOT_FOUND);
+		return;							// either 404 or 403
+	}
 
-	struct dirent **entries;
-    int num_entries = scandir (dir, &entries, 0, alphasort);
-    					// for the alphabetical listing
-    // To do first all the directories and then all the files, would need
-    // to create 2 filter functions that check an entry for being or not being
-    // a directory, and call scandir with each
-    int entry_idx;
-	for (entry_idx = 0; entry_idx < num_entries; entry_idx ++) {
-    	struct dirent *dir_entry = entries [entry_idx];
-    	print_one_ls_line (print_one_entry, dir, dir_entry, fp, is_top);
-		free (dir_entry); // scandir allocates each entry
-		entries [entry_idx] = 0;
+	enum dir_index index = l->index;
+	if (index != NO_INDEX) {
+		if (e == 0) // the cache may be recycling the entry from here on
+			listing_free (l);
+		char index_file [PATH_MAX];
+		snprintf (index_file, PATH_MAX, "%s/%s", dir,
+					index == INDEX_HTML ? "index.html" : "index.cgi");
+		if (index == INDEX_HTML)
+			do_cat (index_file, sock_fp, OK); // write it out
+		else if (current->head)
+			do_head (index_file, sock_fp, OK); // find out its type
+		else
+			do_exec (index_file, sock_fp, OK); // execute it
+		return;
 	}
-	free (entries); // scandir allocates the table
-	entries = 0;
 
-	fprintf (fp, "</table>\r\n</body>\r\n</html>\r\n"); // close the tags
-	fflush (fp);
+	if (listing_render (l, dir, shown_path (dir)) == -1)
+		do_status (dir, sock_fp, SERVER_ERROR);
+	else
+		send_listing (l, sock_fp);
+	if (e == 0)
+		listing_free (l);
+	fflush (sock_fp);
 }
 
 enum reqtype {
-	NONE, LS, HEAD, CGI, CAT, ERR, UNIMP
+	NONE, LS, HEAD, CGI, CAT, ERR, UNIMP, PROXY
 };
 
 static struct request_handler {
@@ -495,6 +1781,7 @@ static struct request_handler {
 		{CAT, do_cat},
 		{ERR, do_status},
 		{UNIMP, do_status},
+		{PROXY, do_proxy},
 		{NONE, 0}
 };
 
@@ -508,9 +1795,19 @@ enum reqtype get_reqtype_and_status (char *cmd, char *item,
 										enum http_codes *status) {
 	*status = OK;
 
-	if (!strcmp (cmd, "HEAD"))
-		return (HEAD);
-	else if (strcmp (cmd, "GET")) { // only handles HEAD and GET
+	if (current->route != 0) // whatever the method, the upstream's to say
+		return (PROXY);
+	else if (!strcmp (cmd, "HEAD") && is_cgi (item))
+		return (HEAD); // not run, as a GET would; asked for its type
+
+	else if (!strcmp (cmd, "POST") || !strcmp (cmd, "PUT")) {
+		if (is_cgi (item)) // a request body is for a cgi to take
+			return (CGI);
+		*status = METHOD_NOT_ALLOWED;
+		return (ERR);
+	}
+	else if (strcmp (cmd, "GET") && strcmp (cmd, "HEAD")) {
+		// otherwise only handles HEAD, like a GET without the body, and GET
 		*status = NOT_IMPLEMENTED;
 		return (UNIMP);
 	}
@@ -527,6 +1824,42 @@ enum reqtype get_reqtype_and_status (char *cmd, char *item,
 		return (CAT);
 }
 
+#define	STATUS_PAGE	"server-status"
+
+/**
+ * is_status_page: whether the item is the statistics page, with or
+ * without a query
+ */
+static int is_status_page (char *item) {
+	int len = strlen (STATUS_PAGE);
+	return (!strncmp (item, STATUS_PAGE, len) &&
+				(item [len] == '\0' || item [len] == '?'));
+}
+
+/**
+ * do_server_status: the statistics of all the serving processes, as plain
+ * text, or as JSON if the query says so ("/server-status?json")
+ */
+static void do_server_status (char *item, FILE *fp) {
+	char *query = strchr (item, '?');
+	int json = query != 0 && !strcmp (query + 1, "json");
+	char *report = 0;
+	size_t len = 0;
+	FILE *rp = open_memstream (&report, &len);
+
+	if (rp == 0) {
+		do_status (item, fp, SERVER_ERROR);
+		return;
+	}
+	stats_report (rp, json);
+	fclose (rp);
+	sized_header (fp, &STATUS_OK, json ? "application/json" : "text/plain",
+					len);
+	if (!current->head)
+		fwrite (report, 1, len, fp);
+	free (report);
+}
+
 /**
  * find the correct handler for this request type
  */
@@ -540,35 +1873,127 @@ struct request_handler *get_handler (enum reqtype type) {
 }
 
 /**
- * top-level function to read the HTTP request from the file pointer attached
- * to the socket, act on it and write the HTTP response back into the socket.
+ * init_request: the context for a new request on the socket; deferred is
+ * set by the event loop, which sends file bodies itself
+ */
+void init_request (struct request *ctx, int sock, int deferred) {
+	memset (ctx, 0, sizeof (struct request));
+	ctx->sock = sock;
+	ctx->deferred = deferred;
+	ctx->body_fd = -1;
+	ctx->cgi_out = -1;
+	ctx->if_modified_since = -1;
+	ctx->sent_length = -1;
+}
+
+/**
+ * client_address: the numeric address of the client, into buf (of
+ * INET6_ADDRSTRLEN bytes): the one the context was given, or the peer's of
+ * the socket
+ * returns: buf, or NULL if the client has none
+ */
+char *client_address (struct request *ctx, char *buf) {
+	if (ctx->client != 0)
+		return (strcpy (buf, ctx->client));
+	return (peer_address (ctx->sock, buf));
+}
+
+/**
+ * request_vhost: the virtual host the request names: by the authority of
+ * an absolute target, or else by its Host header
+ * returns: the host, or NULL if it is served from the server root
+ */
+static struct vhost *request_vhost (struct request *ctx) {
+	char authority [COND_LEN];
+	char *name = ctx->target;
+	int len = 0;
+
+	if (!strncasecmp (name, "http://", 7) ||
+			!strncasecmp (name, "https://", 8)) {
+		name = strchr (name, ':') + 3;
+		while (name [len] != '\0' && name [len] != '/' && name [len] != '?' &&
+				len < COND_LEN - 1)
+			len ++;
+		snprintf (authority, sizeof (authority), "%.*s", len, name);
+		return (find_vhost (authority));
+	}
+	return (find_vhost (ctx->host));
+}
+
+/**
+ * vhost_path: the path of the item under the virtual host's root, into buf
+ * returns: buf, or NULL if it would be too long
  */
-void process_request (char *rq, FILE *fp) {
-	char cmd[MAX_RQ_LEN], arg[MAX_RQ_LEN];
-	char *item, *modify_argument ();
+static char *vhost_path (struct vhost *host, char *item, char *buf) {
+	int len = strcmp (item, ".") ?
+				snprintf (buf, PATH_MAX, "%s/%s", host->root, item) :
+				snprintf (buf, PATH_MAX, "%s", host->root);
+	return (len < PATH_MAX ? buf : 0);
+}
 
-	if (sscanf (rq, "%s%s", cmd, arg) != 2) { // 2 arguments required
+/**
+ * top-level function to act on the request parsed into the context and
+ * write the HTTP response into the file pointer attached to the socket.
+ * The context tells the handlers which socket they are serving and whether
+ * the caller (the event loop) sends the file bodies itself. The request is
+ * logged once its response is known. A request for a virtual host has its
+ * path put under the host's root; one under a proxy prefix goes to the
+ * proxy's upstream instead, whatever host it is for. A request over a rate
+ * limit is refused before it is looked at any further.
+ */
+void process_request (FILE *fp, struct request *ctx) {
+	char *item = ctx->target;
+	char path [PATH_MAX];
+
+	current = ctx;
+	stats_count (STAT_REQUESTS, 1);
+
+	if (ctx->method != 0)
+		ctx->vhost = request_vhost (ctx);
+	// the target is resolved into a path in place; ".." stays under the root
+	if (ctx->method == 0 || normalize_target (item) == -1 ||
+			((ctx->route = proxy_match (item)) == 0 && ctx->vhost != 0 &&
+			(item = vhost_path (ctx->vhost, item, path)) == 0)) {
 		do_status (0, fp, BAD_REQUEST); // 400; cannot do anything else
+		access_log (ctx);
 		return;
 	}
 
-	item = modify_argument (arg, MAX_RQ_LEN); // handle ".." entries in path
+	ctx->head = !strcmp (ctx->method, "HEAD");
+	if (ctx->chunked) // there is no skipping a body nobody takes, unread
+		ctx->keep_alive = 0;
+	stats_phase (PHASE_NORMALIZE, &ctx->clock);
+
+	// charged by the path asked for, before the host's root is put on it
+	if ((ctx->retry_after = ratelimit_check (ctx->target, ctx->client,
+											ctx->sock, &ctx->clock)) > 0) {
+		do_status (item, fp, TOO_MANY_REQUESTS); // 429
+		access_log (ctx);
+		return;
+	}
 
 	enum http_codes status;
 
 	// determine the type of this request
-	enum reqtype request_type = get_reqtype_and_status (cmd, item, &status);
+	enum reqtype request_type = get_reqtype_and_status (ctx->method, item, &status);
 
 	// determine the handler for this request
 	struct request_handler *handler = get_handler (request_type);
 
-	if (handler != 0) { // found the handler; pass the file path and status
+	// the status page is the server's, whichever host is named
+	if (stats_endpoint () && is_status_page (ctx->target)) {
+		do_server_status (ctx->target, fp);
+	} else if (handler != 0) { // found the handler; pass the path and status
 		handler->handle (item, fp, status);
 	} else {
 		do_status (item, fp, SERVER_ERROR); // HTTP 500
 	}
 
 	fflush (fp);
+	stats_phase (PHASE_DISPATCH, &ctx->clock);
+	if (!ctx->detached && ctx->cgi == 0 && ctx->cgi_out == -1 &&
+			ctx->proxy == 0)		// else logged when it is answered
+		access_log (ctx);
 }
 
 
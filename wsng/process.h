@@ -11,9 +11,106 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
-void process_request (char *rq, FILE *fp);
-char * modify_argument (char *arg, int len);
-void respond (int fd);
+#define	MAX_RANGES		16		/* more than this, and the whole file is sent */
+#define	MAX_SEGMENTS	(MAX_RANGES + 1)	/* the ranges, and the last boundary */
+#define	COND_LEN		256		/* longest conditional header value kept */
+#define	REQUEST_LINE_LEN	1024	/* of the request line kept for the log */
+
+struct cgi_reply;
+struct file_pack;
+struct vhost;
+struct http_parser;
+struct proxy_route;
+struct proxy_call;
+
+/*
+ * a piece of a file body: bytes from memory (a multipart boundary and the
+ * part's header lines), then a range of the file
+ */
+struct body_segment {
+	char *prefix;		/* malloc'ed, or NULL */
+	size_t prefix_len;
+	off_t off;			/* the range of the file */
+	off_t len;
+};
+
+/*
+ * per-request context shared between the connection drivers (the forked
+ * responder and the event loop) and the handlers
+ */
+struct request {
+	char *method;	/* of the request, NULL if it could not be parsed */
+	char *target;	/* made into the item's path; both point into the
+						buffer the request was received in */
+	struct http_parser *fields;	/* the parsed header, its fields left in */
+	char *header;		/* place in that buffer, for a proxy to pass on */
+	int sock;		/* the socket the request came in on */
+	char *client;	/* the client's address, if the socket is a TLS relay's
+						and cannot tell it, else NULL */
+	int deferred;	/* if set, static file bodies are left to the caller */
+	int detached;	/* set when a handler forked a child owning the socket */
+	int body_fd;	/* deferred body: open file, or -1 if there is none */
+	char *packed;	/* or a packed file's header lines and body, sent from */
+	size_t packed_len;	/* the pack, which is held meanwhile */
+	struct file_pack *pack;
+	struct body_segment body [MAX_SEGMENTS];	/* what to send of it */
+	int body_parts;
+	int head;		/* a HEAD request: the response has no body */
+	int keep_alive;	/* requested by the client, cleared if the response
+						cannot be delimited without closing */
+	int version;	/* of HTTP the client speaks, as 10 * major + minor */
+	char host [COND_LEN];	/* the Host header, "" if there is none */
+	struct vhost *vhost;	/* the virtual host it names, or NULL */
+	long long content_length;	/* of the request body, to be skipped
+									unless a cgi takes it */
+	int chunked;		/* the body comes in chunks, its length untold */
+	int expect_continue;	/* the client waits for a 100 before the body */
+	char content_type [COND_LEN];	/* of the body, "" if not told */
+	FILE *in;			/* the forked responder's request stream, which
+							the rest of a body is read from */
+	char *received;		/* the event loop: as much of the body as came in
+							with the header, or NULL */
+	size_t received_len;
+	int body_timeout;	/* and the seconds the rest may stall, 0: no limit */
+	char range [COND_LEN];		/* the Range header, "" if there is none */
+	char if_range [COND_LEN];
+	char if_none_match [COND_LEN];
+	time_t if_modified_since;	/* -1 if there is none */
+	int accept_encoding;	/* ACCEPT_ bits of the encodings the client takes */
+	int vary;				/* the response depends on Accept-Encoding */
+	char *content_encoding;	/* of the body being sent, NULL for identity */
+	struct cgi_reply *cgi;	/* a pooled cgi call the event loop waits for */
+	int cgi_out;		/* or the output of a forked one it relays, or -1 */
+	struct proxy_route *route;	/* the proxy the request goes to, or NULL */
+	struct proxy_call *proxy;	/* the event loop's call to it, to relay */
+	struct timespec clock;	/* when the phase being timed began */
+	char request_line [REQUEST_LINE_LEN];	/* for the access log: */
+	char referer [COND_LEN];
+	char user_agent [COND_LEN];
+	int status;				/* of the response */
+	int retry_after;		/* seconds, when it is refused for a rate limit */
+	off_t sent_length;		/* of its body, -1 if not known */
+};
+
+#define MAXDATELEN 40
+
+void init_request (struct request *ctx, int sock, int deferred);
+char *client_address (struct request *ctx, char *buf);
+void close_inherited (int keep);
+void process_request (FILE *fp, struct request *ctx);
+void free_body (struct body_segment *body, int parts);
+void finish_cgi (struct request *ctx, FILE *fp, struct cgi_reply *reply);
+void bad_gateway (struct request *ctx, FILE *fp, int timed_out);
+int cgi_stream_header (struct request *ctx, FILE *fp, char *output,
+						size_t len, int at_end);
+void format_time (time_t timeval, char *formatted_time);
+char *file_type (char *f);
+int is_cgi (char *f);
+int entity_header (char *buf, size_t len, struct stat *info, char *type,
+					int *validators_len);
 
 #endif /* PROCESS_H_ */
@@ -0,0 +1,835 @@
+/*
+ * proxy.c
+ *
+ *  The reverse proxy (see proxy.h). The request goes to the upstream as
+ *  the client sent it, but for the fields that are only about the
+ *  connection: the path normalized (and encoded again), HTTP/1.1 with a
+ *  persistent connection whatever the client speaks, and the client's
+ *  address added to X-Forwarded-For. The response header comes back with
+ *  the same treatment and the server's own Connection line; its body goes
+ *  through as it is, but for a chunked one to an HTTP/1.0 client, which
+ *  gets the data only and the connection closed after it.
+ *
+ *  Requests of a route go to its upstreams in turn, skipping those that
+ *  are down; if all of them are, they are tried all the same. A connection
+ *  from the pool that the upstream has closed meanwhile is found out as it
+ *  is taken, or as the request on it fails before any of the response has
+ *  come: then the request goes out again on a new connection. A connect
+ *  that fails marks the upstream down and moves on to the next one.
+ */
+
+#define _GNU_SOURCE // strcasestr
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "proxy.h"
+#include "process.h"
+#include "parser.h"
+#include "socklib.h"
+#include "stats.h"
+
+#define	CHECK_TIMEOUT_MS	2000	/* for an upstream to answer a probe */
+#define	CHECK_REQUEST_LEN	(VALUE_LEN + 128)
+
+/*
+ * what all the processes know of an upstream
+ */
+struct upstream_health {
+	volatile int down;
+};
+
+struct upstream {
+	char *name;			/* host:port, as configured */
+	struct sockaddr_in addr;
+	struct upstream_health *health;	/* in the shared mapping */
+	int *idle;			/* this process's connections to it not in use */
+	int num_idle;
+	struct upstream *next;
+};
+
+struct proxy_route {
+	char *prefix;		/* of the items it takes, without the '/'s around */
+	size_t len;
+	struct upstream **upstreams;
+	int count;
+	unsigned int turn;	/* of the upstream the next request goes to */
+	struct proxy_route *next;
+};
+
+struct proxy_table {
+	struct proxy_route *routes;
+	struct upstream *upstreams;
+	int num_upstreams;
+	struct upstream_health *health;	/* shared; one for each upstream */
+	pid_t checker;
+	int pool;			/* idle connections kept for each upstream */
+	int timeout;		/* seconds to wait for an upstream */
+	int check_interval;	/* seconds between health checks, 0: none */
+	char *check_path;	/* requested by them, NULL: a connect only */
+};
+
+static struct proxy_table *installed = 0;	// the one requests are routed by
+
+/*
+ * the fields that are about one connection, not the request or response
+ */
+static const char *hop_by_hop [] = {
+	"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+	"Transfer-Encoding", "Upgrade", "Expect", 0
+};
+
+/**
+ * proxy_new: a table with no routes
+ * returns: the table, or NULL if out of memory
+ */
+struct proxy_table *proxy_new (void) {
+	return (calloc (1, sizeof (struct proxy_table)));
+}
+
+/**
+ * proxy_free: stops the table's checker, closes its idle connections and
+ * releases it
+ */
+void proxy_free (struct proxy_table *table) {
+	if (table == 0)
+		return;
+	if (table->checker > 0)
+		kill (table->checker, SIGTERM);
+	if (table->health != 0)
+		munmap (table->health,
+				table->num_upstreams * sizeof (struct upstream_health));
+	while (table->routes != 0) {
+		struct proxy_route *route = table->routes;
+		table->routes = route->next;
+		free (route->prefix);
+		free (route->upstreams);
+		free (route);
+	}
+	while (table->upstreams != 0) {
+		struct upstream *u = table->upstreams;
+		table->upstreams = u->next;
+		while (u->num_idle > 0)
+			close (u->idle [-- u->num_idle]);
+		free (u->idle);
+		free (u->name);
+		free (u);
+	}
+	free (table->check_path);
+	free (table);
+}
+
+/**
+ * find_upstream: the upstream going by the name ("host:port"), resolved
+ * and added to the table the first time it is named
+ * returns: the upstream, or NULL if the name cannot be resolved
+ */
+static struct upstream *find_upstream (struct proxy_table *table,
+										char *name) {
+	struct upstream *u;
+	char host [VALUE_LEN];
+	char *colon = strrchr (name, ':');
+
+	for (u = table->upstreams; u != 0; u = u->next)
+		if (!strcmp (u->name, name))
+			return (u);
+	if (colon == 0 || colon == name || colon - name >= VALUE_LEN ||
+			atoi (colon + 1) <= 0)
+		return (0);
+	snprintf (host, sizeof (host), "%.*s", (int) (colon - name), name);
+	if ((u = calloc (1, sizeof (struct upstream))) == 0 ||
+			(u->name = strdup (name)) == 0 ||
+			resolve_server (host, atoi (colon + 1), &u->addr) == -1) {
+		if (u != 0)
+			free (u->name);
+		free (u);
+		return (0);
+	}
+	u->next = table->upstreams;
+	table->upstreams = u;
+	table->num_upstreams ++;
+	return (u);
+}
+
+/**
+ * proxy_add: has the requests under the prefix go to the upstream too
+ * returns: 0 on success, -1 if the upstream is not "host:port" of a host
+ * that resolves, or out of memory
+ */
+int proxy_add (struct proxy_table *table, char *prefix, char *name) {
+	struct upstream *u = find_upstream (table, name);
+	struct proxy_route *route;
+	size_t len;
+
+	if (u == 0)
+		return (-1);
+	while (*prefix == '/')
+		prefix ++;
+	for (len = strlen (prefix); len > 0 && prefix [len - 1] == '/'; len --)
+		;
+	for (route = table->routes; route != 0; route = route->next)
+		if (route->len == len && !strncmp (route->prefix, prefix, len))
+			break;
+	if (route == 0) {
+		if ((route = calloc (1, sizeof (struct proxy_route))) == 0 ||
+				(route->prefix = strndup (prefix, len)) == 0) {
+			free (route);
+			return (-1);
+		}
+		route->len = len;
+		route->next = table->routes;
+		table->routes = route;
+	}
+	struct upstream **more = realloc (route->upstreams,
+							(route->count + 1) * sizeof (struct upstream *));
+	if (more == 0)
+		return (-1);
+	route->upstreams = more;
+	route->upstreams [route->count ++] = u;
+	return (0);
+}
+
+/**
+ * set_down: records whether the upstream is down, for all the processes,
+ * and reports it when that changes
+ */
+static void set_down (struct upstream *u, int down) {
+	if (u->health->down == down)
+		return;
+	u->health->down = down;
+	fprintf (stderr, "upstream %s is %s\n", u->name, down ? "down" : "up");
+}
+
+/**
+ * probe: whether the upstream takes a connection within the check
+ * timeout, and, if there is a check path, answers a request for it with a
+ * success or a redirection
+ */
+static int probe (struct proxy_table *table, struct upstream *u) {
+	int fd = connect_to_address (&u->addr, 1);
+	struct pollfd pfd = {fd, POLLOUT, 0};
+	char buf [CHECK_REQUEST_LEN];
+	int error = 0, status = 0;
+	socklen_t len = sizeof (error);
+
+	if (fd == -1)
+		return (0);
+	int up = poll (&pfd, 1, CHECK_TIMEOUT_MS) == 1 &&
+				getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+				error == 0;
+	if (up && table->check_path != 0) {
+		int n = snprintf (buf, sizeof (buf), "GET %s HTTP/1.0\r\n"
+							"Host: %s\r\n\r\n", table->check_path, u->name);
+		pfd.events = POLLIN;
+		if (send (fd, buf, n, MSG_NOSIGNAL) == n &&
+				poll (&pfd, 1, CHECK_TIMEOUT_MS) == 1 &&
+				(n = recv (fd, buf, sizeof (buf) - 1, 0)) > 0) {
+			buf [n] = '\0';
+			sscanf (buf, "HTTP/%*d.%*d %d", &status);
+		}
+		up = status >= 200 && status < 400;
+	}
+	close (fd);
+	return (up);
+}
+
+/**
+ * run_checker: the checker process: probes every upstream of the table in
+ * each interval, for as long as the process that started it lives
+ */
+static void run_checker (struct proxy_table *table) {
+	struct upstream *u;
+
+	for (;;) {
+		for (u = table->upstreams; u != 0; u = u->next)
+			set_down (u, !probe (table, u));
+		sleep (table->check_interval);
+	}
+}
+
+/**
+ * start_checker: forks the checker process of the table
+ * returns: 0 on success, -1 if it could not be forked
+ */
+static int start_checker (struct proxy_table *table, int sock) {
+	pid_t parent = getpid ();
+	sigset_t none;
+
+	switch (table->checker = fork ()) {
+		case -1:
+			perror ("fork");
+			return (-1);
+
+		case 0:
+			sigemptyset (&none);
+			sigprocmask (SIG_SETMASK, &none, 0); // the master blocks signals
+			signal (SIGCHLD, SIG_DFL);
+			signal (SIGHUP, SIG_DFL);
+			prctl (PR_SET_PDEATHSIG, SIGTERM);
+			if (getppid () != parent)
+				_exit (0);
+			if (sock != -1)
+				close (sock);
+			run_checker (table);
+	}
+	return (0);
+}
+
+/**
+ * proxy_prepare: readies the table with the proxy settings of the
+ * configuration: its health is mapped for all the processes forked from
+ * now on, and its checker is started. Nothing in effect changes yet; a
+ * table that is not installed after all is released with proxy_free,
+ * which stops the checker again.
+ * returns: 0 on success, -1 if the table cannot be set up
+ */
+int proxy_prepare (struct proxy_table *table, struct server *config) {
+	struct upstream *u;
+	int idx = 0;
+
+	table->pool = config->proxy_pool;
+	table->timeout = config->proxy_timeout;
+	table->check_interval = config->proxy_check_interval;
+	if (config->proxy_check_path [0] != '\0' &&
+			(table->check_path = strdup (config->proxy_check_path)) == 0)
+		return (-1);
+	if (table->num_upstreams > 0) {
+		void *region = mmap (0, table->num_upstreams *
+								sizeof (struct upstream_health),
+								PROT_READ | PROT_WRITE,
+								MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED) {
+			perror ("proxy");
+			return (-1);
+		}
+		table->health = region;
+	}
+	for (u = table->upstreams; u != 0; u = u->next) {
+		u->health = table->health + idx ++;
+		if (table->pool > 0 &&
+				(u->idle = calloc (table->pool, sizeof (int))) == 0)
+			return (-1);
+	}
+	if (table->num_upstreams > 0 && table->check_interval > 0 &&
+			start_checker (table, config->socket) == -1)
+		return (-1);
+	return (0);
+}
+
+/**
+ * proxy_install: makes the prepared table the one requests are routed by;
+ * the table in effect before is released
+ */
+void proxy_install (struct proxy_table *table) {
+	proxy_free (installed);
+	installed = table;
+}
+
+/**
+ * proxy_stop: stops the checker, for a server that is going away
+ */
+void proxy_stop (void) {
+	if (installed != 0 && installed->checker > 0)
+		kill (installed->checker, SIGTERM);
+}
+
+/**
+ * proxy_match: the route of the longest prefix the item (a normalized
+ * path, with its query) is under
+ * returns: the route, or NULL if the item is not proxied
+ */
+struct proxy_route *proxy_match (char *item) {
+	struct proxy_route *route, *best = 0;
+
+	if (installed == 0)
+		return (0);
+	for (route = installed->routes; route != 0; route = route->next)
+		if ((route->len == 0 || (!strncmp (item, route->prefix, route->len) &&
+				(item [route->len] == '\0' || item [route->len] == '/' ||
+				item [route->len] == '?'))) &&
+				(best == 0 || route->len > best->len))
+			best = route;
+	return (best);
+}
+
+/**
+ * pick: the route's next upstream in turn that is not down, or just the
+ * next if they all are
+ */
+static struct upstream *pick (struct proxy_route *route) {
+	int n;
+
+	for (n = 0; n < route->count; n ++) {
+		struct upstream *u = route->upstreams [route->turn ++ % route->count];
+		if (!u->health->down)
+			return (u);
+	}
+	return (route->upstreams [route->turn ++ % route->count]);
+}
+
+/**
+ * failed: a connect to the upstream failed; it is down until a health
+ * check finds it up (without health checks, nothing is marked)
+ */
+static void failed (struct upstream *u) {
+	if (installed->check_interval > 0)
+		set_down (u, 1);
+}
+
+/**
+ * take_idle: a connection to the upstream from the pool, the one used
+ * last first; those the upstream has closed meanwhile are dropped
+ * returns: the connection, or -1 if there is none
+ */
+static int take_idle (struct upstream *u) {
+	char c;
+
+	while (u->num_idle > 0) {
+		int fd = u->idle [-- u->num_idle];
+		if (recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+				errno == EAGAIN)
+			return (fd);
+		close (fd);
+	}
+	return (-1);
+}
+
+/**
+ * open_connection: a connection to the call's upstream, from the pool
+ * unless a fresh one is asked for; a new blocking one is waited for until
+ * it is connected, and gets the proxy timeout on its reads and writes
+ * returns: 0 on success, -1 if the connect failed
+ */
+static int open_connection (struct proxy_call *call, int fresh) {
+	struct timeval tv = {installed->timeout, 0};
+	struct pollfd pfd = {-1, POLLOUT, 0};
+	int error = 0;
+	socklen_t len = sizeof (error);
+
+	call->fd = fresh ? -1 : take_idle (call->upstream);
+	call->reused = call->fd != -1;
+	if (call->reused)
+		return (0);
+	if ((call->fd = connect_to_address (&call->upstream->addr, 1)) == -1)
+		return (-1);
+	if (!(call->flags & PROXY_BLOCKING))
+		return (0);
+	pfd.fd = call->fd;
+	if (poll (&pfd, 1, installed->timeout > 0 ? installed->timeout * 1000 :
+												-1) != 1 ||
+			getsockopt (call->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+			error != 0) {
+		close (call->fd);
+		call->fd = -1;
+		return (-1);
+	}
+	fcntl (call->fd, F_SETFL, fcntl (call->fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt (call->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	setsockopt (call->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	return (0);
+}
+
+/**
+ * connect_call: a connection for the call, to its upstream or, as long as
+ * connects fail, to the next ones of the route
+ * returns: 0 on success, -1 once every upstream has been tried
+ */
+static int connect_call (struct proxy_call *call, int fresh) {
+	while (open_connection (call, fresh) == -1) {
+		failed (call->upstream);
+		if (++ call->tries >= call->route->count)
+			return (-1);
+		call->upstream = pick (call->route);
+	}
+	return (0);
+}
+
+/**
+ * encode_path: the path part of the item as a request target again: with
+ * the leading '/', and what cannot stand in a path percent-encoded; the
+ * query goes as it came
+ */
+static void encode_path (FILE *fp, char *item) {
+	char *query = strchr (item, '?');
+	char *end = query ? query : item + strlen (item);
+
+	putc ('/', fp);
+	if (end - item == 1 && *item == '.')
+		item = end;
+	for (; item < end; item ++) {
+		unsigned char c = *item;
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+				(c >= '0' && c <= '9') || strchr ("-._~!$&'()*+,;=:@/", c))
+			putc (c, fp);
+		else
+			fprintf (fp, "%%%02X", c);
+	}
+	if (query != 0)
+		fputs (query, fp);
+}
+
+/**
+ * is_hop_by_hop: whether the field is about the connection only: one of
+ * those that always are, or one the Connection field names
+ */
+static int is_hop_by_hop (char *name, char *connection) {
+	size_t len = strlen (name);
+	int idx;
+
+	for (idx = 0; hop_by_hop [idx] != 0; idx ++)
+		if (!strcasecmp (name, hop_by_hop [idx]))
+			return (1);
+	while (connection != 0 && *connection != '\0') {
+		connection += strspn (connection, " \t,");
+		size_t token = strcspn (connection, " \t,");
+		if (token == len && !strncasecmp (connection, name, len))
+			return (1);
+		connection += token;
+	}
+	return (0);
+}
+
+/**
+ * build_request: the request header to send upstream, from the client's
+ * fields (left in place by the parser)
+ * returns: 0 on success, -1 if out of memory
+ */
+static int build_request (struct proxy_call *call, struct request *ctx,
+							char *item) {
+	struct http_parser *p = ctx->fields;
+	char *connection = 0, *forwarded = 0;
+	char address [INET6_ADDRSTRLEN];
+	int idx, host = 0;
+	FILE *fp = open_memstream (&call->request, &call->request_len);
+
+	if (fp == 0)
+		return (-1);
+	fprintf (fp, "%s ", ctx->method);
+	encode_path (fp, item);
+	fprintf (fp, " HTTP/1.1\r\n");
+	for (idx = 0; idx < p->headers; idx ++)
+		if (!strcasecmp (ctx->header + p->name [idx].off, "Connection"))
+			connection = ctx->header + p->value [idx].off;
+	for (idx = 0; idx < p->headers; idx ++) {
+		char *name = ctx->header + p->name [idx].off;
+		char *value = ctx->header + p->value [idx].off;
+		if (is_hop_by_hop (name, connection))
+			continue;
+		if (!strcasecmp (name, "X-Forwarded-For")) {
+			forwarded = value;
+			continue;
+		}
+		host |= !strcasecmp (name, "Host");
+		fprintf (fp, "%s: %s\r\n", name, value);
+	}
+	if (!host)
+		fprintf (fp, "Host: %s\r\n", call->route->upstreams [0]->name);
+	fprintf (fp, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "",
+				forwarded ? ", " : "",
+				client_address (ctx, address) ? address : "unknown");
+	fprintf (fp, "Connection: keep-alive\r\n\r\n");
+	return (fclose (fp) == 0 ? 0 : -1);
+}
+
+/**
+ * proxy_call: starts the request (for the item, as normalized) on its way
+ * to the next upstream of the route: the request header is made, and a
+ * connection taken from the pool or opened. Without PROXY_BLOCKING the
+ * connection is non-blocking, and may not be connected yet: it is writable
+ * once it is.
+ * returns: the call, or NULL if no upstream could be connected to
+ */
+struct proxy_call *proxy_call (struct proxy_route *route, struct request *ctx,
+								char *item, int flags) {
+	struct proxy_call *call = calloc (1, sizeof (struct proxy_call));
+
+	if (call == 0)
+		return (0);
+	call->fd = -1;
+	call->route = route;
+	call->flags = flags;
+	call->head_only = ctx->head;
+	call->dechunk = ctx->version < 11;
+	call->upstream = pick (route);
+	if (build_request (call, ctx, item) == -1 ||
+			connect_call (call, flags & PROXY_FRESH) == -1) {
+		proxy_end (call, 0);
+		return (0);
+	}
+	return (call);
+}
+
+/**
+ * proxy_retry: the call's connection failed before any of the response
+ * came: the request goes out again on a new one, to the same upstream if
+ * the connection was one of the pool (and may only have gone stale), else
+ * to the next upstream
+ * returns: 0 on success, -1 if there is nothing left to try
+ */
+int proxy_retry (struct proxy_call *call) {
+	close (call->fd);
+	call->fd = -1;
+	call->request_off = 0;
+	if (!call->reused) {
+		failed (call->upstream);
+		if (++ call->tries >= call->route->count)
+			return (-1);
+		call->upstream = pick (call->route);
+	}
+	return (connect_call (call, 1));
+}
+
+/**
+ * proxy_send: sends what is left of the request header
+ * returns: 1 once it is all sent, 0 if the (non-blocking) connection has
+ * no room for it yet, -1 if the connection failed
+ */
+int proxy_send (struct proxy_call *call) {
+	while (call->request_off < call->request_len) {
+		ssize_t n = send (call->fd, call->request + call->request_off,
+							call->request_len - call->request_off,
+							MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return (errno == EAGAIN && !(call->flags & PROXY_BLOCKING) ?
+						0 : -1);
+		call->request_off += n;
+	}
+	return (1);
+}
+
+/**
+ * respond_header: the response header for the client, from the
+ * upstream's (the first length bytes of head), and the framing of the body
+ * to follow; an interim (1xx) response is dropped, and the final one
+ * waited for
+ * returns: 0 on success, -1 if the upstream's header is not HTTP
+ */
+static int respond_header (struct proxy_call *call, struct request *ctx,
+							FILE *out, int length) {
+	int major, minor, status, at = 0, chunked = 0, closing = 0, keeping = 0;
+	long long content_length = -1;
+	char *save, *line;
+
+	call->head [length] = '\0';
+	call->head_len = 0;
+	line = strtok_r (call->head, "\r\n", &save);
+	if (line == 0 || sscanf (line, "HTTP/%d.%d %3d%n", &major, &minor,
+								&status, &at) != 3 || status < 100)
+		return (-1);
+	if (status < 200)
+		return (0);
+	fprintf (out, "HTTP/1.1 %d %s\r\n", status, line + at + strspn (line + at,
+																		" "));
+	while ((line = strtok_r (0, "\r\n", &save)) != 0) {
+		char *value = strchr (line, ':');
+		if (value == 0)
+			continue;
+		*value ++ = '\0';
+		value += strspn (value, " \t");
+		if (!strcasecmp (line, "Content-Length"))
+			content_length = atoll (value);
+		else if (!strcasecmp (line, "Transfer-Encoding"))
+			chunked = strcasestr (value, "chunked") != 0;
+		else if (!strcasecmp (line, "Connection")) {
+			closing = strcasestr (value, "close") != 0;
+			keeping = strcasestr (value, "keep-alive") != 0;
+		}
+		if (!is_hop_by_hop (line, 0) ||
+				(!strcasecmp (line, "Transfer-Encoding") && !call->dechunk))
+			fprintf (out, "%s: %s\r\n", line, value);
+	}
+
+	call->keep = !closing && (major * 10 + minor >= 11 || keeping);
+	call->dechunk = call->dechunk && chunked;
+	if (call->head_only || status == 204 || status == 304)
+		call->state = REPLY_DONE;
+	else if (chunked)
+		call->state = REPLY_CHUNK_SIZE;
+	else if (content_length >= 0) {
+		call->state = content_length > 0 ? REPLY_LENGTH : REPLY_DONE;
+		call->left = content_length;
+	} else
+		call->state = REPLY_EOF;
+	if (call->dechunk || call->state == REPLY_EOF)
+		ctx->keep_alive = 0; // the end of the body is the end of it all
+	if (call->state == REPLY_EOF)
+		call->keep = 0;
+	fprintf (out, "Connection: %s\r\n\r\n",
+				ctx->keep_alive ? "keep-alive" : "close");
+
+	stats_status (status);
+	ctx->status = status;
+	ctx->sent_length = call->state == REPLY_LENGTH ? content_length : -1;
+	return (0);
+}
+
+/**
+ * take_header: adds what there is of the response header to the call's;
+ * once it is all in, the client's is made from it
+ * returns: how much of the data the header took, -1 if it is too long or
+ * not HTTP
+ */
+static int take_header (struct proxy_call *call, struct request *ctx,
+						char *data, size_t len, FILE *out) {
+	int room = PROXY_HEAD_LEN - 1 - call->head_len;
+	int take = len < (size_t) room ? (int) len : room;
+	int idx = call->head_len > 2 ? call->head_len - 2 : 0;
+
+	memcpy (call->head + call->head_len, data, take);
+	call->head_len += take;
+	for (; idx < call->head_len; idx ++)
+		if (call->head [idx] == '\n' && ((idx >= 1 &&
+				call->head [idx - 1] == '\n') || (idx >= 2 &&
+				call->head [idx - 1] == '\r' && call->head [idx - 2] == '\n')))
+			break;
+	if (idx == call->head_len)
+		return (call->head_len == PROXY_HEAD_LEN - 1 ? -1 : take);
+	int used = take - (call->head_len - idx - 1);
+	if (respond_header (call, ctx, out, idx + 1) == -1)
+		return (-1);
+	return (used);
+}
+
+/**
+ * take_line: adds the data up to a line end to the framing line being
+ * collected
+ * returns: how much of the data it took; complete tells whether the line
+ * has ended
+ */
+static size_t take_line (struct proxy_call *call, char *data, size_t len,
+							int *complete) {
+	size_t used = 0;
+
+	*complete = 0;
+	while (used < len && !*complete) {
+		char c = data [used ++];
+		if (c == '\n')
+			*complete = 1;
+		else if (call->line_len < PROXY_LINE_LEN - 1)
+			call->line [call->line_len ++] = c;
+		else
+			call->line_len = PROXY_LINE_LEN; // too long: taken as malformed
+	}
+	return (used);
+}
+
+/**
+ * framing: acts upon a complete line of the chunked framing
+ * returns: 0 on success, -1 if it is not what the framing allows
+ */
+static int framing (struct proxy_call *call) {
+	int len = call->line_len;
+	char *end;
+
+	call->line_len = 0;
+	if (len == PROXY_LINE_LEN)
+		return (-1);
+	if (len > 0 && call->line [len - 1] == '\r')
+		len --;
+	call->line [len] = '\0';
+	switch (call->state) {
+		case REPLY_CHUNK_SIZE:
+			call->left = strtoll (call->line, &end, 16);
+			if (end == call->line || call->left < 0 || (*end != '\0' &&
+					*end != ';' && *end != ' ' && *end != '\t'))
+				return (-1);
+			call->state = call->left > 0 ? REPLY_CHUNK_DATA : REPLY_TRAILER;
+		break;
+
+		case REPLY_CHUNK_END:
+			if (len > 0)
+				return (-1);
+			call->state = REPLY_CHUNK_SIZE;
+		break;
+
+		default: // REPLY_TRAILER
+			if (len == 0)
+				call->state = REPLY_DONE;
+		break;
+	}
+	return (0);
+}
+
+/**
+ * proxy_relay: passes the next len bytes of the upstream's response on to
+ * the client's stream, as the framing goes: the header made over, the
+ * body as it is (or the data only of its chunks, for a client that cannot
+ * take them). No data (len 0) is the end of the connection, which ends a
+ * body that goes up to it. What the upstream sends beyond the response
+ * is not passed on, and the connection is not used again.
+ * returns: 1 once the response is complete, 0 while more of it is to come,
+ * -1 if it is broken (ended early, or not HTTP)
+ */
+int proxy_relay (struct proxy_call *call, struct request *ctx, char *data,
+					size_t len, FILE *out) {
+	int complete;
+
+	if (len == 0) {
+		call->keep = 0;
+		if (call->state == REPLY_EOF)
+			call->state = REPLY_DONE;
+		return (call->state == REPLY_DONE ? 1 : -1);
+	}
+	call->received += len;
+	while (len > 0 && call->state != REPLY_DONE) {
+		size_t used;
+		if (call->state == REPLY_HEADER) {
+			int taken = take_header (call, ctx, data, len, out);
+			if (taken == -1)
+				return (-1);
+			used = taken;
+		} else if (call->state == REPLY_LENGTH ||
+				call->state == REPLY_CHUNK_DATA || call->state == REPLY_EOF) {
+			used = call->state == REPLY_EOF || (long long) len < call->left ?
+						len : (size_t) call->left;
+			fwrite (data, 1, used, out);
+			if (call->state != REPLY_EOF && (call->left -= used) == 0)
+				call->state = call->state == REPLY_LENGTH ? REPLY_DONE :
+								REPLY_CHUNK_END;
+		} else {
+			used = take_line (call, data, len, &complete);
+			if (!call->dechunk)
+				fwrite (data, 1, used, out);
+			if (complete && framing (call) == -1)
+				return (-1);
+		}
+		data += used;
+		len -= used;
+	}
+	if (len > 0)
+		call->keep = 0;
+	return (call->state == REPLY_DONE ? 1 : 0);
+}
+
+/**
+ * proxy_end: the call is over: its connection goes back to the pool if
+ * the response was done with and the upstream keeps it open (and the pool
+ * has room), else it is closed
+ */
+void proxy_end (struct proxy_call *call, int done) {
+	struct upstream *u = call->upstream;
+
+	if (call->fd != -1) {
+		if (done && call->keep && call->state == REPLY_DONE &&
+				u->num_idle < installed->pool)
+			u->idle [u->num_idle ++] = call->fd;
+		else
+			close (call->fd);
+	}
+	free (call->request);
+	free (call);
+}
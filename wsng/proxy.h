@@ -0,0 +1,88 @@
+/*
+ * proxy.h
+ *
+ *  The reverse proxy. A "proxy" line hands the requests under a path
+ *  prefix to one or more upstream servers, taken in turn. Each serving
+ *  process keeps the connections to an upstream open once a response is
+ *  done with, in a pool of its own, for the next request to go out on; the
+ *  response comes back through the process as it arrives, with its own
+ *  framing followed so that the end of it is known without closing. Which
+ *  upstreams are down is shared by all the processes, in memory mapped
+ *  before they fork: a failed connect marks one down, and a checker
+ *  process probes them all periodically and brings them back.
+ */
+
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "wsng.h"
+
+#define	PROXY_HEAD_LEN	8192	/* longest upstream response header taken */
+#define	PROXY_LINE_LEN	256		/* longest chunk size or trailer line */
+
+struct request;
+struct proxy_route;
+struct upstream;
+
+/*
+ * where the response is: its header being collected, or its body, by the
+ * framing the header gave it
+ */
+enum reply_state {
+	REPLY_HEADER,
+	REPLY_LENGTH,		/* so many bytes */
+	REPLY_CHUNK_SIZE,	/* the line of a chunk's size, */
+	REPLY_CHUNK_DATA,	/* its data, */
+	REPLY_CHUNK_END,	/* and the line end after it */
+	REPLY_TRAILER,		/* the lines after the last chunk */
+	REPLY_EOF,			/* up to the end of the connection */
+	REPLY_DONE
+};
+
+/*
+ * a request on its way to an upstream, and the response coming back
+ */
+struct proxy_call {
+	int fd;				/* the connection to the upstream */
+	struct upstream *upstream;
+	struct proxy_route *route;
+	int flags;			/* PROXY_ flags it was made with */
+	int reused;			/* the connection came from the pool */
+	int tries;			/* upstreams (or connections) tried so far */
+	char *request;		/* the request header to send, */
+	size_t request_len;
+	size_t request_off;	/* and how much of it is sent */
+	long long received;	/* bytes of the response so far */
+	enum reply_state state;
+	char head [PROXY_HEAD_LEN];	/* the response header, as it comes */
+	int head_len;
+	char line [PROXY_LINE_LEN];	/* a line of the chunked framing */
+	int line_len;
+	long long left;		/* of the chunk, or of the body */
+	int head_only;		/* a HEAD request: no body comes */
+	int dechunk;		/* the client cannot take chunks: the data only */
+	int keep;			/* the connection can go back to the pool */
+};
+
+#define	PROXY_BLOCKING	1	/* connect, send and receive blocking */
+#define	PROXY_FRESH		2	/* on a new connection, not one of the pool */
+
+struct proxy_table *proxy_new (void);
+void proxy_free (struct proxy_table *table);
+int proxy_add (struct proxy_table *table, char *prefix, char *upstream);
+int proxy_prepare (struct proxy_table *table, struct server *config);
+void proxy_install (struct proxy_table *table);
+void proxy_stop (void);
+struct proxy_route *proxy_match (char *item);
+struct proxy_call *proxy_call (struct proxy_route *route, struct request *ctx,
+								char *item, int flags);
+int proxy_retry (struct proxy_call *call);
+int proxy_send (struct proxy_call *call);
+int proxy_relay (struct proxy_call *call, struct request *ctx, char *data,
+					size_t len, FILE *out);
+void proxy_end (struct proxy_call *call, int done);
+
+#endif /* PROXY_H_ */
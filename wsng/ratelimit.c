@@ -0,0 +1,256 @@
+/*
+ * ratelimit.c
+ *
+ *  The rate limits (see ratelimit.h). The buckets are kept in a table of a
+ *  fixed number of sets of a few buckets each, indexed by a hash of the
+ *  rule and the address; a bucket that is not in its set takes the place of
+ *  the one there that was used the longest ago, which, idle that long, has
+ *  mostly filled up again anyway. Each set has a lock that is taken for the
+ *  few instructions of a check and only ever spun on a little: a request
+ *  that finds its set still locked after that goes through uncharged.
+ *
+ *  A bucket is refilled when it is used, not by a timer: it holds its
+ *  tokens as the nanoseconds of requests they are worth at the rule's rate
+ *  and the time it was last used, and the time since is added to it, up to
+ *  the burst, before a token is taken. The time is the request's clock,
+ *  which has just been read for the statistics, so a check costs no system
+ *  call; only a rule per client needs the client's address.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ratelimit.h"
+#include "stats.h"
+
+#define	SET_BITS		12
+#define	NUM_SETS		(1 << SET_BITS)
+#define	SET_SIZE		4			/* buckets of a set */
+#define	LOCK_SPINS		64
+#define	NSEC			1000000000LL
+
+struct bucket {
+	unsigned int rule;		/* its number, from 1; 0: the bucket is free */
+	unsigned char addr [16];	/* the client's (IPv4 mapped), zeros: all */
+	long long tokens;		/* nanoseconds of requests in hand */
+	long long used;			/* monotonic nanoseconds when last used */
+};
+
+struct bucket_set {
+	int lock;
+	struct bucket buckets [SET_SIZE];
+};
+
+struct rate_rule {
+	char *prefix;		/* of the items it takes, without the '/'s around */
+	size_t len;
+	unsigned int number;
+	long long interval;	/* nanoseconds a token takes to come back */
+	long long full;		/* nanoseconds worth of a full bucket */
+	int all;			/* one bucket for all clients */
+	struct rate_rule *next;
+};
+
+struct rate_table {
+	struct rate_rule *rules;	/* in the order of the file */
+	struct rate_rule **last;
+	unsigned int num_rules;
+	struct bucket_set *sets;	/* shared; mapped with the first rule */
+};
+
+static struct rate_table *installed = 0;	// the one requests are checked by
+
+/**
+ * ratelimit_new: a table with no rules
+ * returns: the table, or NULL if out of memory
+ */
+struct rate_table *ratelimit_new (void) {
+	struct rate_table *table = calloc (1, sizeof (struct rate_table));
+
+	if (table != 0)
+		table->last = &table->rules;
+	return (table);
+}
+
+void ratelimit_free (struct rate_table *table) {
+	if (table == 0)
+		return;
+	while (table->rules != 0) {
+		struct rate_rule *rule = table->rules;
+		table->rules = rule->next;
+		free (rule->prefix);
+		free (rule);
+	}
+	if (table->sets != 0)
+		munmap (table->sets, NUM_SETS * sizeof (struct bucket_set));
+	free (table);
+}
+
+/**
+ * ratelimit_add: a rule of so many requests a second, with a burst of so
+ * many, for the items under the prefix, per client or for all of them
+ * returns: 0 on success, -1 if out of memory
+ */
+int ratelimit_add (struct rate_table *table, char *prefix, double rate,
+					int burst, int all) {
+	struct rate_rule *rule = calloc (1, sizeof (struct rate_rule));
+	size_t len;
+
+	while (*prefix == '/')
+		prefix ++;
+	for (len = strlen (prefix); len > 0 && prefix [len - 1] == '/'; len --)
+		;
+	if (rule == 0 || (rule->prefix = strndup (prefix, len)) == 0) {
+		free (rule);
+		return (-1);
+	}
+	if (table->sets == 0) {
+		void *region = mmap (0, NUM_SETS * sizeof (struct bucket_set),
+								PROT_READ | PROT_WRITE,
+								MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED) {
+			free (rule->prefix);
+			free (rule);
+			return (-1);
+		}
+		table->sets = region;
+	}
+	rule->len = len;
+	rule->number = ++ table->num_rules;
+	rule->interval = NSEC / rate;
+	rule->full = rule->interval * burst;
+	rule->all = all;
+	*table->last = rule;
+	table->last = &rule->next;
+	return (0);
+}
+
+/**
+ * ratelimit_install: makes the table (NULL: none) the one requests are
+ * checked by; the one in effect before is released
+ */
+void ratelimit_install (struct rate_table *table) {
+	ratelimit_free (installed);
+	installed = table;
+}
+
+/**
+ * client_key: the client's address as a bucket key, IPv4 mapped into
+ * IPv6; from the address the relay gave, if there is one, else from the
+ * socket's peer
+ * returns: 0 on success, -1 if there is no address
+ */
+static int client_key (char *client, int sock, unsigned char *addr) {
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof (peer);
+
+	memset (addr, 0, 16);
+	if (client != 0) {
+		if (inet_pton (AF_INET6, client, addr) == 1)
+			return (0);
+		addr [10] = addr [11] = 0xff;
+		return (inet_pton (AF_INET, client, addr + 12) == 1 ? 0 : -1);
+	}
+	if (getpeername (sock, (struct sockaddr *) &peer, &len) == -1)
+		return (-1);
+	if (peer.ss_family == AF_INET6) {
+		memcpy (addr, &((struct sockaddr_in6 *) &peer)->sin6_addr, 16);
+		return (0);
+	}
+	if (peer.ss_family != AF_INET)
+		return (-1);
+	addr [10] = addr [11] = 0xff;
+	memcpy (addr + 12, &((struct sockaddr_in *) &peer)->sin_addr, 4);
+	return (0);
+}
+
+/**
+ * take: takes a token from the rule's bucket for the address, refilling
+ * it first for the time since it was last used
+ * returns: 0 if there was one, else the nanoseconds until there is
+ */
+static long long take (struct rate_rule *rule, unsigned char *addr,
+						long long now) {
+	unsigned int hash = rule->number * 2654435761u, idx;
+	struct bucket_set *set;
+	struct bucket *b = 0;
+	long long wait = 0;
+
+	for (idx = 0; idx < 16; idx += 4) {
+		unsigned int word;
+		memcpy (&word, addr + idx, 4);
+		hash = (hash ^ word) * 16777619u;
+	}
+	set = installed->sets + (hash >> (32 - SET_BITS));
+	for (idx = 0; __atomic_exchange_n (&set->lock, 1, __ATOMIC_ACQUIRE); )
+		if (++ idx == LOCK_SPINS)
+			return (0);
+
+	for (idx = 0; idx < SET_SIZE && b == 0; idx ++)
+		if (set->buckets [idx].rule == rule->number &&
+				!memcmp (set->buckets [idx].addr, addr, 16))
+			b = set->buckets + idx;
+	if (b == 0) { // a new one, full, in place of the least recently used
+		b = set->buckets;
+		for (idx = 1; idx < SET_SIZE; idx ++)
+			if (set->buckets [idx].used < b->used)
+				b = set->buckets + idx;
+		b->rule = rule->number;
+		memcpy (b->addr, addr, 16);
+		b->tokens = rule->full;
+	} else if (now > b->used) {
+		b->tokens += now - b->used;
+		if (b->tokens > rule->full)
+			b->tokens = rule->full;
+	}
+	if (now > b->used)
+		b->used = now;
+	if (b->tokens >= rule->interval)
+		b->tokens -= rule->interval;
+	else
+		wait = rule->interval - b->tokens;
+	__atomic_store_n (&set->lock, 0, __ATOMIC_RELEASE);
+	return (wait);
+}
+
+/**
+ * ratelimit_check: charges a request for the item (the normalized path)
+ * to every rule it falls under, in the order of the file, up to the first
+ * one that has no token for it; the client is the address the relay gave,
+ * or NULL for the socket's peer, and now the request's monotonic clock
+ * returns: 0 if the request may go on, else the seconds until it may be
+ * tried again
+ */
+int ratelimit_check (char *item, char *client, int sock,
+						struct timespec *now) {
+	static const unsigned char everyone [16];
+	unsigned char addr [16];
+	int have_addr = 0;
+	struct rate_rule *rule;
+
+	if (installed == 0)
+		return (0);
+	for (rule = installed->rules; rule != 0; rule = rule->next) {
+		if (rule->len > 0 && (strncmp (item, rule->prefix, rule->len) ||
+				(item [rule->len] != '\0' && item [rule->len] != '/' &&
+				item [rule->len] != '?')))
+			continue;
+		if (!rule->all && have_addr == 0)
+			have_addr = client_key (client, sock, addr) == 0 ? 1 : -1;
+		if (!rule->all && have_addr == -1)
+			continue; // no address to tell clients apart by
+		long long wait = take (rule, rule->all ? (unsigned char *) everyone :
+							addr, now->tv_sec * NSEC + now->tv_nsec);
+		if (wait > 0) {
+			stats_count (rule->all ? STAT_RATE_PATH : STAT_RATE_CLIENT, 1);
+			return ((wait + NSEC - 1) / NSEC);
+		}
+	}
+	return (0);
+}
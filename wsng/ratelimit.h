@@ -0,0 +1,28 @@
+/*
+ * ratelimit.h
+ *
+ *  Rate limits. A "rate_limit" line gives the requests under a path prefix
+ *  a token bucket for every client address, or one for all clients
+ *  together: a request takes a token, and the tokens come back at the rate
+ *  of the line up to its burst. A request that finds no token is answered
+ *  with a 429 and when to try again. The buckets are in memory mapped
+ *  before the serving processes fork, so a client has the same buckets
+ *  whichever process serves it.
+ */
+
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include <time.h>
+
+struct rate_table;
+
+struct rate_table *ratelimit_new (void);
+void ratelimit_free (struct rate_table *table);
+int ratelimit_add (struct rate_table *table, char *prefix, double rate,
+					int burst, int all);
+void ratelimit_install (struct rate_table *table);
+int ratelimit_check (char *item, char *client, int sock,
+						struct timespec *now);
+
+#endif /* RATELIMIT_H_ */
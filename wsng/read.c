@@ -1,10 +1,20 @@
+#define _GNU_SOURCE // strcasestr, strptime, timegm
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <netdb.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/param.h>
 #include "read.h"
+#include "compress.h"
+#include "stats.h"
+
+#define	SEEN_LENGTH		1	/* the framing fields a request had so far */
+#define	SEEN_TRANSFER	2
 
 /*
  * readline -- read in a line from fp, stop at \n
@@ -55,21 +65,238 @@ full_hostname ()
 	return fullname; /* and return it	*/
 }
 
-void read_til_crnl (FILE *fp) {
-	char buf[MAX_RQ_LEN];
-	while (readline (buf, MAX_RQ_LEN, fp) != NULL && strcmp (buf, "\r\n") != 0)
-		;
+/*
+ * parse_http_date -- the time in any of the three formats of RFC 2616
+ *    3.3.1, or -1 if it is none of them
+ */
+time_t parse_http_date (char *value) {
+	static const char *formats [] = {
+		"%a, %d %b %Y %H:%M:%S GMT",	// RFC 1123
+		"%A, %d-%b-%y %H:%M:%S GMT",	// RFC 850
+		"%a %b %d %H:%M:%S %Y",			// asctime
+		0
+	};
+	int idx;
+
+	for (idx = 0; formats [idx] != 0; idx ++) {
+		struct tm tm;
+		memset (&tm, 0, sizeof (tm));
+		char *end = strptime (value, formats [idx], &tm);
+		if (end != NULL && *end == '\0')
+			return timegm (&tm);
+	}
+	return -1;
+}
+
+/*
+ * copy_value -- keeps a header value for later; one too long to keep is
+ *    dropped as if it had not been sent
+ */
+static void copy_value (char *to, char *value) {
+	if (strlen (value) < COND_LEN)
+		strcpy (to, value);
+	else
+		to [0] = '\0';
+}
+
+/*
+ * accepted_encodings -- the encodings the server has (gzip, br) that the
+ *    Accept-Encoding value admits; q=0 refuses one
+ *    note: modifies the value
+ */
+static int accepted_encodings (char *value) {
+	int accepted = 0;
+	char *save, *token;
+
+	for (token = strtok_r (value, ",", &save); token != NULL;
+						token = strtok_r (NULL, ",", &save)) {
+		token += strspn (token, " \t");
+		size_t len = strcspn (token, " \t;");
+		char *q = strstr (token, "q=");
+		int bits = 0;
+		if (len == 4 && !strncasecmp (token, "gzip", len))
+			bits = ACCEPT_GZIP;
+		else if (len == 6 && !strncasecmp (token, "x-gzip", len))
+			bits = ACCEPT_GZIP;
+		else if (len == 2 && !strncasecmp (token, "br", len))
+			bits = ACCEPT_BR;
+		else if (len == 1 && *token == '*')
+			bits = ACCEPT_GZIP | ACCEPT_BR;
+		if (q != NULL && atof (q + 2) == 0)
+			accepted &= ~bits;
+		else
+			accepted |= bits;
+	}
+	return accepted;
 }
 
 /*
- * read the http request into rq not to exceed rqlen
- * return -1 for error, 0 for success
+ * parse_length -- reads a Content-Length value: decimal digits only, no
+ *    sign, and no more than a long long holds
+ *    rets: the length, or -1 if the value is not one
  */
-int read_request (FILE *fp, char rq[], int rqlen) {
-	/* null means EOF or error. Either way there is no request */
-	if (readline (rq, rqlen, fp) == NULL)
+static long long parse_length (char *value) {
+	long long length = 0;
+
+	if (*value < '0' || *value > '9')
 		return -1;
-	read_til_crnl (fp);
+	for (; *value >= '0' && *value <= '9'; value ++) {
+		if (length > (LLONG_MAX - (*value - '0')) / 10)
+			return -1;
+		length = 10 * length + (*value - '0');
+	}
+	return *value == '\0' ? length : -1;
+}
+
+/*
+ * parse_header_field -- acts upon one field of the request header if it is
+ *    one of those the server cares about; everything else is ignored. The
+ *    fields that frame the body are noted in *seen: a Content-Length that
+ *    disagrees with an earlier one, or comes with a Transfer-Encoding (in
+ *    either order), leaves where the body ends in doubt (RFC 7230 3.3.3)
+ *    rets: -1 if the field is malformed, so the request is, 0 otherwise
+ */
+static int parse_header_field (char *name, char *value, struct request *ctx,
+								int *seen) {
+	if (!strcasecmp (name, "Connection")) {
+		if (strcasestr (value, "close"))
+			ctx->keep_alive = 0;
+		else if (strcasestr (value, "keep-alive"))
+			ctx->keep_alive = 1;
+	} else if (!strcasecmp (name, "Content-Length")) {
+		long long length = parse_length (value);
+		if (length == -1 || (*seen & SEEN_TRANSFER) ||
+				((*seen & SEEN_LENGTH) && length != ctx->content_length))
+			return -1;
+		ctx->content_length = length;
+		*seen |= SEEN_LENGTH;
+	} else if (!strcasecmp (name, "Transfer-Encoding")) {
+		if (*seen & SEEN_LENGTH)
+			return -1;
+		ctx->chunked = strcasestr (value, "chunked") != NULL;
+		*seen |= SEEN_TRANSFER;
+	} else if (!strcasecmp (name, "Host"))
+		copy_value (ctx->host, value);
+	else if (!strcasecmp (name, "Content-Type"))
+		copy_value (ctx->content_type, value);
+	else if (!strcasecmp (name, "Expect"))
+		ctx->expect_continue = !strcasecmp (value, "100-continue");
+	else if (!strcasecmp (name, "Range"))
+		copy_value (ctx->range, value);
+	else if (!strcasecmp (name, "If-Range"))
+		copy_value (ctx->if_range, value);
+	else if (!strcasecmp (name, "If-None-Match"))
+		copy_value (ctx->if_none_match, value);
+	else if (!strcasecmp (name, "If-Modified-Since"))
+		ctx->if_modified_since = parse_http_date (value);
+	else if (!strcasecmp (name, "Accept-Encoding"))
+		ctx->accept_encoding = accepted_encodings (value);
+	else if (!strcasecmp (name, "Referer"))
+		snprintf (ctx->referer, COND_LEN, "%s", value); // logged, cut short
+	else if (!strcasecmp (name, "User-Agent"))
+		snprintf (ctx->user_agent, COND_LEN, "%s", value);
 	return 0;
 }
 
+/*
+ * keep_request_line -- keeps the first line of the len bytes received in
+ *    buf, for the access log; it is kept for a malformed request too
+ */
+void keep_request_line (char *buf, int len, struct request *ctx) {
+	int start = 0, end;
+
+	while (start < len && (buf [start] == '\r' || buf [start] == '\n'))
+		start ++;
+	for (end = start; end < len && buf [end] != '\r' && buf [end] != '\n';)
+		end ++;
+	snprintf (ctx->request_line, REQUEST_LINE_LEN, "%.*s", end - start,
+				buf + start);
+}
+
+/*
+ * request_from_header -- fills the request context from a complete header
+ *    the parser went through in buf: the method and the target are left
+ *    where they are (as strings, in place, valid as long as the buffer is),
+ *    and so are the fields, which the context refers to with the parser,
+ *    the request line is kept for the access log, and the version sets the
+ *    per-request defaults: HTTP/1.1 connections are persistent unless told
+ *    otherwise, anything older is not. A malformed field (or framing fields
+ *    that contradict each other) leaves the context without a method, to
+ *    be answered with a 400, and the connection is closed after it, since
+ *    where its body ends is not known
+ */
+void request_from_header (struct http_parser *p, char *buf,
+							struct request *ctx) {
+	int idx, seen = 0;
+
+	keep_request_line (buf, p->length, ctx);
+	parser_terminate (p, buf);
+	ctx->fields = p;
+	ctx->header = buf;
+	ctx->method = buf + p->method.off;
+	ctx->target = buf + p->target.off;
+	ctx->version = 10 * p->major + p->minor;
+	ctx->keep_alive = ctx->version >= 11;
+
+	for (idx = 0; idx < p->headers; idx ++)
+		if (parse_header_field (buf + p->name [idx].off,
+								buf + p->value [idx].off, ctx, &seen) == -1) {
+			ctx->method = NULL;
+			ctx->content_length = 0;
+			ctx->keep_alive = 0;
+			return;
+		}
+}
+
+/*
+ * read the http request header into rq, not to exceed rqlen, a line at a
+ * time, and have the parser go on through each line as it comes; the
+ * context's clock starts when the first line is in, so that the parse phase
+ * does not include waiting for the client. A request that is malformed or
+ * too long leaves the context without a method, to be answered with a 400.
+ * The parser is kept until the next request, as the context refers to it.
+ * return -1 if the connection ended before a request, 0 otherwise
+ */
+int read_request (FILE *fp, char rq[], int rqlen, struct request *ctx) {
+	static struct http_parser parser;
+	int len = 0;
+
+	parser_init (&parser);
+	while (len < rqlen - 1 && fgets (rq + len, rqlen - len, fp) != NULL) {
+		if (len == 0)
+			stats_clock (&ctx->clock);
+		len += strlen (rq + len);
+		switch (parse_request (&parser, rq, len)) {
+			case PARSE_DONE:
+				request_from_header (&parser, rq, ctx);
+				return 0;
+			case PARSE_ERROR:
+				keep_request_line (rq, len, ctx);
+				return 0;
+			case PARSE_MORE:
+			break;
+		}
+	}
+	/* EOF or error in the middle of a header is no request either */
+	if (len < rqlen - 1)
+		return -1;
+	keep_request_line (rq, len, ctx);
+	return 0;
+}
+
+/*
+ * discard_body -- skips the body of a request the server has no use for,
+ *    so that the next request on the connection can be read
+ * return -1 if the connection ended first, 0 for success
+ */
+int discard_body (FILE *fp, long long len) {
+	char buf[LINELEN];
+
+	while (len > 0) {
+		size_t got = fread (buf, 1, len < LINELEN ? len : LINELEN, fp);
+		if (got == 0)
+			return -1;
+		len -= got;
+	}
+	return 0;
+}
@@ -8,12 +8,19 @@
 #ifndef READ_H_
 #define READ_H_
 #include <stdio.h>
+#include "process.h"
+#include "parser.h"
 
 #define	MAX_RQ_LEN	4096
 #define	LINELEN		1024
 
 char * full_hostname ();
-int read_request (FILE *fp, char rq[], int rqlen);
+int read_request (FILE *fp, char rq[], int rqlen, struct request *ctx);
+void keep_request_line (char *buf, int len, struct request *ctx);
+void request_from_header (struct http_parser *p, char *buf,
+							struct request *ctx);
+int discard_body (FILE *fp, long long len);
+time_t parse_http_date (char *value);
 char *readline (char *buf, int len, FILE *fp);
 
 #endif /* READ_H_ */
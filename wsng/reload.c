@@ -0,0 +1,206 @@
+/*
+ * reload.c
+ *
+ *  The hand-over to a successor (see reload.h). The successor is forked
+ *  twice and exec'ed, so that it is not the server's child, which a master
+ *  finishing up would wait for; what it inherits is listed in its
+ *  environment: the listening sockets, whose ports it finds out for itself,
+ *  and the write end of a pipe on which it sends a byte once it is serving.
+ *  Sockets of ports the new configuration no longer has are closed then,
+ *  and a port that is new gets a socket of its own.
+ *
+ *  The server waits for that byte, up to a timeout. A successor that fails
+ *  closes the pipe as it exits, and so do the processes it has forked by
+ *  then (the logger, the workers and the proxy's checker), as they end
+ *  with it.
+ */
+
+#define _GNU_SOURCE // pipe2
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "reload.h"
+#include "socklib.h"
+
+#define	SOCKETS_VAR		"WSNG_LISTEN_FDS"
+#define	READY_VAR		"WSNG_READY_FD"
+#define	MAX_INHERITED	2			/* the HTTP and HTTPS sockets */
+#define	READY_TIMEOUT_MS	10000	/* for the successor to start serving */
+
+static char program [PATH_MAX];
+static char config_path [PATH_MAX];
+static char start_dir [PATH_MAX];
+static int inherited [MAX_INHERITED];
+static int num_inherited = -1;	// not looked at yet
+static int ready_fd = -1;
+
+/**
+ * reload_init: remembers the program and the configuration file that a
+ * successor is to be started with, and the directory to start it in, where
+ * the server was started, for the relative paths of the configuration; the
+ * program is made absolute, as the server changes into its root
+ */
+void reload_init (char *name, char *configfile) {
+	if (strchr (name, '/') == 0 || realpath (name, program) == 0)
+		snprintf (program, PATH_MAX, "%s", name); // found on the PATH
+	snprintf (config_path, PATH_MAX, "%s", configfile);
+	if (getcwd (start_dir, PATH_MAX) == 0)
+		start_dir [0] = '\0';
+}
+
+/**
+ * reload_start_dir: the directory the server was started from, as
+ * reload_init found it ("" if it could not), which relative paths of the
+ * configuration are taken from
+ */
+char *reload_start_dir (void) {
+	return (start_dir);
+}
+
+/**
+ * take_inheritance: the descriptors the server this one replaces handed
+ * down, out of the environment (which the cgi programs need not see)
+ */
+static void take_inheritance (void) {
+	char *list = getenv (SOCKETS_VAR), *ready = getenv (READY_VAR);
+
+	num_inherited = 0;
+	while (list != 0 && *list != '\0' && num_inherited < MAX_INHERITED) {
+		char *end;
+		inherited [num_inherited ++] = strtol (list, &end, 10);
+		list = *end == ',' ? end + 1 : end;
+	}
+	if (ready != 0)
+		ready_fd = atoi (ready);
+	unsetenv (SOCKETS_VAR);
+	unsetenv (READY_VAR);
+}
+
+/**
+ * reload_socket: the listening socket for the port that the server this
+ * one replaces handed down, with its backlog set anew
+ * returns: the socket, or -1 if there is none for the port
+ */
+int reload_socket (int port, int backlog) {
+	int idx;
+
+	if (num_inherited == -1)
+		take_inheritance ();
+	for (idx = 0; idx < num_inherited; idx ++)
+		if (inherited [idx] != -1 && socket_port (inherited [idx]) == port) {
+			int fd = inherited [idx];
+			inherited [idx] = -1;
+			listen (fd, backlog);
+			return (fd);
+		}
+	return (-1);
+}
+
+/**
+ * reload_ready: tells the server this one replaces that it is serving, and
+ * closes the sockets handed down that it has no use for; nothing, if it
+ * replaces none
+ */
+void reload_ready (void) {
+	int idx;
+
+	if (num_inherited == -1)
+		take_inheritance ();
+	for (idx = 0; idx < num_inherited; idx ++)
+		if (inherited [idx] != -1)
+			close (inherited [idx]);
+	num_inherited = 0;
+	if (ready_fd != -1) {
+		if (write (ready_fd, "", 1) != 1)
+			perror ("reload");
+		close (ready_fd);
+		ready_fd = -1;
+	}
+}
+
+/**
+ * start_successor: in the child: execs the program in the directory the
+ * server was started in, with the listening sockets and the write end of
+ * the pipe left open across the exec, and the signal mask and dispositions
+ * as a server starts with
+ */
+static void start_successor (struct server *config, int ready) {
+	char sockets [32] = "", ready_var [16];
+	char *argv [] = {program, "-c", config_path, 0};
+	sigset_t none;
+
+	sigemptyset (&none);
+	sigprocmask (SIG_SETMASK, &none, 0);
+	signal (SIGPIPE, SIG_DFL);
+	if (start_dir [0] != '\0' && chdir (start_dir) == -1)
+		perror (start_dir); // relative paths are taken from the root then
+	if (config->socket != -1) {
+		fcntl (config->socket, F_SETFD, 0);
+		snprintf (sockets, sizeof (sockets), "%d", config->socket);
+	}
+	if (config->tls_socket != -1) {
+		fcntl (config->tls_socket, F_SETFD, 0);
+		snprintf (sockets + strlen (sockets),
+					sizeof (sockets) - strlen (sockets), "%s%d",
+					sockets [0] ? "," : "", config->tls_socket);
+	}
+	fcntl (ready, F_SETFD, 0);
+	snprintf (ready_var, sizeof (ready_var), "%d", ready);
+	setenv (SOCKETS_VAR, sockets, 1);
+	setenv (READY_VAR, ready_var, 1);
+	execvp (program, argv);
+	perror (program);
+	_exit (1);
+}
+
+/**
+ * reload_start: starts the successor and waits for it to be serving
+ * returns: 0 once it is, when this server is to stop accepting and finish
+ * up; -1 (reported) if it could not start, and this one serves on
+ */
+int reload_start (struct server *config) {
+	struct pollfd pfd;
+	int ready [2];
+	char byte;
+	pid_t pid;
+
+	if (pipe2 (ready, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror ("reload");
+		return (-1);
+	}
+	switch (pid = fork ()) {
+		case -1:
+			perror ("fork");
+			close (ready [0]);
+			close (ready [1]);
+			return (-1);
+
+		case 0:
+			if (fork () == 0)
+				start_successor (config, ready [1]);
+			_exit (0);
+	}
+	close (ready [1]);
+	waitpid (pid, 0, 0);
+
+	pfd = (struct pollfd) {ready [0], POLLIN, 0};
+	while (poll (&pfd, 1, READY_TIMEOUT_MS) == -1 && errno == EINTR) {
+	}
+	int started = read (ready [0], &byte, 1) == 1;
+	close (ready [0]);
+	if (!started) {
+		fprintf (stderr, "The new server did not start, serving on\n");
+		return (-1);
+	}
+	return (0);
+}
@@ -0,0 +1,25 @@
+/*
+ * reload.h
+ *
+ *  Replacing a running server without dropping its connections. The server
+ *  starts its successor from the program file (which may be a new binary
+ *  by now) with its configuration file, and hands it the listening sockets
+ *  through the exec; the successor reads the file afresh, takes over the
+ *  sockets of the ports it keeps and tells the server when it is serving.
+ *  Only then does the server stop accepting, and it exits once it has
+ *  answered what it has, on the configuration it had. A successor that
+ *  cannot start leaves the server serving as before.
+ */
+
+#ifndef RELOAD_H_
+#define RELOAD_H_
+
+#include "wsng.h"
+
+void reload_init (char *name, char *configfile);
+char *reload_start_dir (void);
+int reload_socket (int port, int backlog);
+void reload_ready (void);
+int reload_start (struct server *config);
+
+#endif /* RELOAD_H_ */
@@ -3,29 +3,51 @@
 #include	<sys/types.h>
 #include	<sys/socket.h>
 #include	<netinet/in.h>
+#include	<arpa/inet.h>
 #include	<netdb.h>
 #include	<unistd.h>
 #include	<string.h>
+#include	<errno.h>
 
 /*
  *	socklib.c
  *
  *	This file contains functions used lots when writing internet
- *	client/server programs.  The two main functions here are:
+ *	client/server programs.  The main functions here are:
  *
- *	make_server_socket( portnum )	returns a server socket
+ *	make_server_socket( portnum, backlog )	returns a server socket
  *					or -1 if error
  *
+ *	make_reuseport_server_socket( portnum, backlog )
+ *					same, but the port can be shared
+ *					by several such sockets (SO_REUSEPORT)
+ *
  *	connect_to_server(char *hostname, int portnum)
  *					returns a connected socket
  *					or -1 if error
  *
+ *	resolve_server(char *hostname, int portnum, struct sockaddr_in *addr)
+ *	connect_to_address(struct sockaddr_in *addr, int nonblocking)
+ *					the two steps of connect_to_server,
+ *					for callers that connect often
+ *
+ *	peer_address(int sock, char *buf)
+ *					the numeric address of the peer, into
+ *					buf (INET6_ADDRSTRLEN bytes); NULL if none
+ *
+ *	socket_port(int sock)	the port the socket is bound to, or -1
+ *
+ *	history: 2018-06-18 added socket_port for the sockets handed down
+ *	history: 2018-06-11 added peer_address for the TLS relay's clients
+ *	history: 2018-06-04 split connect_to_server for the proxy's upstreams
+ *	history: 2018-05-09 the listen backlog is the caller's to choose
+ *	history: 2018-05-02 added make_reuseport_server_socket for workers
  *	history: 2010-04-16 replaced bcopy/bzero with memcpy/memset
  *	history: 2005-05-09 added SO_REUSEADDR to make_server_socket
  */ 
 
-int
-make_server_socket( int portnum )
+static int
+bind_server_socket( int portnum, int reuseport, int backlog )
 {
         struct  sockaddr_in   saddr;   /* build our address here */
 	int	sock_id;	       /* line id, file desc     */
@@ -51,44 +73,120 @@ make_server_socket( int portnum )
 	if ( sock_id == -1 ) return -1;
 	if ( setsockopt(sock_id,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on)) == -1 )
 		return -1;
+	if ( reuseport &&
+	     setsockopt(sock_id,SOL_SOCKET,SO_REUSEPORT,&on,sizeof(on)) == -1 )
+		return -1;
 	if ( bind(sock_id,(struct sockaddr*)&saddr, sizeof(saddr)) ==  -1 )
 	       return -1;
 
 	/*
 	 *      step 3: tell kernel we want to listen for calls
 	 */
-	if ( listen(sock_id, 1) != 0 ) return -1;
+	if ( listen(sock_id, backlog) != 0 ) return -1;
 	return sock_id;
 }
 
+int
+make_server_socket( int portnum, int backlog )
+{
+	return bind_server_socket( portnum, 0, backlog );
+}
 
+/*
+ * every worker process binds its own socket to the same port; the kernel
+ * then spreads the incoming connections between them
+ */
 int
-connect_to_server( char *hostname, int portnum )
+make_reuseport_server_socket( int portnum, int backlog )
 {
-	struct sockaddr_in  servadd;        /* the number to call */
-	struct hostent      *hp;            /* used to get number */
-	int    sock_id;			    /* returned to caller */
+	return bind_server_socket( portnum, 1, backlog );
+}
 
-        /*
-         *  build the network address of where we want to call
-         */
 
-       memset( &servadd, 0, sizeof( servadd ) );   /* 0. zero the address   */
-       servadd.sin_family = AF_INET ;              /* 1. fill in addr type  */
+/*
+ * the address to call, looked up once: a proxy resolves its upstreams
+ * when the configuration is read, not for every connection
+ */
+int
+resolve_server( char *hostname, int portnum, struct sockaddr_in *servadd )
+{
+	struct hostent      *hp;            /* used to get number */
+
+       memset( servadd, 0, sizeof( *servadd ) );   /* 0. zero the address   */
+       servadd->sin_family = AF_INET ;             /* 1. fill in addr type  */
 
        hp = gethostbyname( hostname );		   /* 2. and host addr      */
        if ( hp == NULL ) return -1;
-       memcpy( &servadd.sin_addr, hp->h_addr, hp->h_length);
-       servadd.sin_port = htons(portnum);          /* 3. and port number    */
+       memcpy( &servadd->sin_addr, hp->h_addr, hp->h_length);
+       servadd->sin_port = htons(portnum);         /* 3. and port number    */
+       return 0;
+}
 
-       /*
-        *        make the connection
-        */
+/*
+ * a close-on-exec socket connected (or, if nonblocking, being connected:
+ * it is writable once it is) to the address
+ */
+int
+connect_to_address( struct sockaddr_in *servadd, int nonblocking )
+{
+	int    sock_id;			    /* returned to caller */
 
-       sock_id = socket( PF_INET, SOCK_STREAM, 0 );    /* get a line   */
+       sock_id = socket( PF_INET, SOCK_STREAM | SOCK_CLOEXEC |
+                         ( nonblocking ? SOCK_NONBLOCK : 0 ), 0 );
        if ( sock_id == -1 ) return -1;                 /* or fail      */
                                                        /* now dial     */
-       if ( connect(sock_id,(struct sockaddr*)&servadd, sizeof(servadd)) !=0 )  
+       if ( connect(sock_id,(struct sockaddr*)servadd, sizeof(*servadd)) !=0
+            && !( nonblocking && errno == EINPROGRESS ) ) {
+               close( sock_id );
                return -1;
+       }
        return sock_id;
 }
+
+int
+connect_to_server( char *hostname, int portnum )
+{
+	struct sockaddr_in  servadd;        /* the number to call */
+
+       if ( resolve_server( hostname, portnum, &servadd ) == -1 )
+               return -1;
+       return connect_to_address( &servadd, 0 );
+}
+
+/*
+ * the numeric address of the socket's peer, for logs and forwarded headers
+ */
+char *
+peer_address( int sock, char *buf )
+{
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof( peer );
+
+	if ( getpeername( sock, (struct sockaddr *) &peer, &len ) == -1 )
+		return NULL;
+	if ( peer.ss_family == AF_INET )
+		return (char *) inet_ntop( AF_INET,
+				&((struct sockaddr_in *) &peer)->sin_addr,
+				buf, INET6_ADDRSTRLEN );
+	if ( peer.ss_family == AF_INET6 )
+		return (char *) inet_ntop( AF_INET6,
+				&((struct sockaddr_in6 *) &peer)->sin6_addr,
+				buf, INET6_ADDRSTRLEN );
+	return NULL;
+}
+
+/*
+ * the port the socket is bound to, for a server taking over sockets that
+ * another one made
+ */
+int
+socket_port( int sock )
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof( addr );
+
+	if ( getsockname( sock, (struct sockaddr *) &addr, &len ) == -1 ||
+	     addr.sin_family != AF_INET )
+		return -1;
+	return ntohs( addr.sin_port );
+}
@@ -2,15 +2,35 @@
  *	socklib.h
  *
  *	This file contains functions used lots when writing internet
- *	client/server programs.  The two main functions here are:
+ *	client/server programs.  The main functions here are:
  *
- *	make_server_socket( portnum )	returns a server socket
+ *	make_server_socket( portnum, backlog )	returns a server socket
  *					or -1 if error
  *
+ *	make_reuseport_server_socket( portnum, backlog )
+ *					same, but the port can be shared
+ *
  *	connect_to_server(char *hostname, int portnum)
  *					returns a connected socket
  *					or -1 if error
+ *
+ *	resolve_server(char *hostname, int portnum, struct sockaddr_in *addr)
+ *	connect_to_address(struct sockaddr_in *addr, int nonblocking)
+ *					the two steps of connect_to_server
+ *
+ *	peer_address(int sock, char *buf)
+ *					the numeric address of the peer, into
+ *					buf (INET6_ADDRSTRLEN bytes); NULL if none
+ *
+ *	socket_port(int sock)	the port the socket is bound to, or -1
  */ 
 
-int make_server_socket( int );
+int make_server_socket( int, int );
+int make_reuseport_server_socket( int, int );
 int connect_to_server( char *, int );
+
+struct sockaddr_in;
+int resolve_server( char *, int, struct sockaddr_in * );
+int connect_to_address( struct sockaddr_in *, int );
+char *peer_address( int, char * );
+int socket_port( int );
@@ -0,0 +1,260 @@
+/*
+ * stats.c
+ *
+ *  The shared statistics of the serving processes. The region is mapped
+ *  shared and anonymous by the first process, so every process forked from
+ *  it, however indirectly, sees the same slots. A process adds to the slot
+ *  it is attached to: the fork mode server's connection children all add
+ *  to their parent's, which is why the adds are atomic rather than plain
+ *  (relaxed ones: the numbers only have to add up, not to be ordered).
+ *
+ *  The phases are timed with the monotonic clock and kept as histograms of
+ *  power of two buckets of microseconds, from which the report estimates
+ *  the percentiles (as the upper bound of the bucket they fall into).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>	// the glibc one lacks tcpi_bytes_sent
+
+#include "stats.h"
+
+#define	MIN_STATUS	100
+#define	MAX_STATUS	600
+
+struct stats_slot {
+	pid_t pid;				/* the process that attached to it last */
+	long counters [NUM_COUNTERS];
+	long status [MAX_STATUS - MIN_STATUS];
+	long hist [NUM_PHASES][STATS_BUCKETS];
+	long usec [NUM_PHASES];	/* summed up, for the mean */
+};
+
+static const char *phase_names [NUM_PHASES] = {
+	"parse", "normalize", "dispatch", "send", "total"
+};
+
+static struct stats_slot *slots = 0;	// 0 if the region could not be had
+static struct stats_slot *mine = 0;
+static int endpoint = 0;				// whether /server-status is served
+static time_t started;
+
+#define	ADD(field, n)	__atomic_fetch_add (&(field), (n), __ATOMIC_RELAXED)
+#define	GET(field)		__atomic_load_n (&(field), __ATOMIC_RELAXED)
+
+/**
+ * stats_init: maps the region shared by this process and all those forked
+ * from it later, and attaches this process to the first slot
+ * returns: 0 on success, -1 if there will be no statistics
+ */
+int stats_init (void) {
+	void *region = mmap (0, STATS_SLOTS * sizeof (struct stats_slot),
+						PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+						-1, 0);
+	if (region == MAP_FAILED)
+		return (-1);
+	slots = region;
+	started = time (0);
+	stats_attach (0);
+	return (0);
+}
+
+/**
+ * stats_attach: makes this process add to the given slot (a worker, to
+ * the one of its index)
+ */
+void stats_attach (int slot) {
+	if (slots == 0)
+		return;
+	mine = slots + slot % STATS_SLOTS;
+	mine->pid = getpid ();
+}
+
+/**
+ * stats_setup: whether the configuration asks for /server-status
+ */
+void stats_setup (int enabled) {
+	endpoint = enabled && slots != 0;
+}
+
+int stats_endpoint (void) {
+	return (endpoint);
+}
+
+void stats_clock (struct timespec *t) {
+	clock_gettime (CLOCK_MONOTONIC, t);
+}
+
+/**
+ * stats_phase: records the time since *since as a sample of the phase,
+ * and moves *since on to now, where the next phase begins
+ */
+void stats_phase (enum stats_phase phase, struct timespec *since) {
+	struct timespec now;
+
+	stats_clock (&now);
+	if (mine != 0) {
+		long usec = (now.tv_sec - since->tv_sec) * 1000000L +
+						(now.tv_nsec - since->tv_nsec) / 1000;
+		int bucket = usec > 0 ? 64 - __builtin_clzl (usec) : 0;
+		if (bucket >= STATS_BUCKETS)
+			bucket = STATS_BUCKETS - 1;
+		ADD (mine->hist [phase][bucket], 1);
+		ADD (mine->usec [phase], usec);
+	}
+	*since = now;
+}
+
+void stats_count (enum stats_counter counter, long n) {
+	if (mine != 0)
+		ADD (mine->counters [counter], n);
+}
+
+void stats_status (int code) {
+	if (mine != 0 && code >= MIN_STATUS && code < MAX_STATUS)
+		ADD (mine->status [code - MIN_STATUS], 1);
+}
+
+/**
+ * stats_socket_sent: counts what went out on a connection whose writes
+ * are not counted one by one (the fork mode writes through stdio, and
+ * sendfile), as the kernel counted it; *counted is how much of that was
+ * counted before
+ */
+void stats_socket_sent (int sock, long *counted) {
+	struct tcp_info info;
+	socklen_t len = sizeof (info);
+
+	memset (&info, 0, sizeof (info));
+	if (getsockopt (sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+		long sent = info.tcpi_bytes_sent - info.tcpi_bytes_retrans;
+		stats_count (STAT_BYTES_SENT, sent - *counted);
+		*counted = sent;
+	}
+}
+
+/**
+ * percentile: the upper bound of the bucket the given fraction of the
+ * samples falls into, in microseconds
+ */
+static long percentile (long *hist, long count, double fraction) {
+	long want = (long) (fraction * count), seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < STATS_BUCKETS - 1; bucket ++)
+		if ((seen += hist [bucket]) > want)
+			break;
+	return (1L << bucket);
+}
+
+/**
+ * stats_report: all the slots summed up, with the requests and open
+ * connections of each serving process, as plain text or as JSON
+ */
+void stats_report (FILE *fp, int json) {
+	struct stats_slot sum;
+	int slot, idx, phase, bucket, first = 1;
+
+	memset (&sum, 0, sizeof (sum));
+	for (slot = 0; slot < STATS_SLOTS; slot ++) {
+		struct stats_slot *s = slots + slot;
+		for (idx = 0; idx < NUM_COUNTERS; idx ++)
+			sum.counters [idx] += GET (s->counters [idx]);
+		for (idx = 0; idx < MAX_STATUS - MIN_STATUS; idx ++)
+			sum.status [idx] += GET (s->status [idx]);
+		for (phase = 0; phase < NUM_PHASES; phase ++) {
+			sum.usec [phase] += GET (s->usec [phase]);
+			for (bucket = 0; bucket < STATS_BUCKETS; bucket ++)
+				sum.hist [phase][bucket] += GET (s->hist [phase][bucket]);
+		}
+	}
+
+	fprintf (fp, json ? "{\"uptime\": %ld, \"connections\": %ld, "
+					"\"active_connections\": %ld, \"requests\": %ld, "
+					"\"bytes_sent\": %ld, \"cache_hits\": %ld, "
+					"\"cache_misses\": %ld, \"log_dropped\": %ld, "
+					"\"shed\": %ld, \"pack_hits\": %ld,\n"
+					" \"timeouts\": {\"idle\": %ld, \"header\": %ld, "
+					"\"body\": %ld, \"send\": %ld, \"upstream\": %ld},\n"
+					" \"tls\": {\"handshakes\": %ld, \"resumed\": %ld, "
+					"\"failed\": %ld, \"ktls\": %ld},\n"
+					" \"rate_limited\": {\"client\": %ld, \"path\": %ld},\n"
+					" \"status\": {" :
+				"uptime: %ld s\nconnections: %ld\nactive connections: %ld\n"
+				"requests: %ld\nbytes sent: %ld\ncache hits: %ld\n"
+				"cache misses: %ld\nlog lines dropped: %ld\n"
+				"connections shed: %ld\npack hits: %ld\n"
+				"timeouts: idle %ld, header %ld, body %ld, send %ld, "
+				"upstream %ld\n"
+				"tls: handshakes %ld, resumed %ld, failed %ld, ktls %ld\n"
+				"rate limited: client %ld, path %ld\n",
+			(long) (time (0) - started), sum.counters [STAT_CONNECTIONS],
+			sum.counters [STAT_ACTIVE], sum.counters [STAT_REQUESTS],
+			sum.counters [STAT_BYTES_SENT], sum.counters [STAT_CACHE_HITS],
+			sum.counters [STAT_CACHE_MISSES], sum.counters [STAT_LOG_DROPPED],
+			sum.counters [STAT_SHED], sum.counters [STAT_PACK_HITS],
+			sum.counters [STAT_TIMEOUT_IDLE], sum.counters [STAT_TIMEOUT_HEADER],
+			sum.counters [STAT_TIMEOUT_BODY], sum.counters [STAT_TIMEOUT_SEND],
+			sum.counters [STAT_TIMEOUT_UPSTREAM],
+			sum.counters [STAT_TLS_HANDSHAKES], sum.counters [STAT_TLS_RESUMED],
+			sum.counters [STAT_TLS_FAILED], sum.counters [STAT_TLS_KTLS],
+			sum.counters [STAT_RATE_CLIENT], sum.counters [STAT_RATE_PATH]);
+	for (idx = 0; idx < MAX_STATUS - MIN_STATUS; idx ++) {
+		if (sum.status [idx] == 0)
+			continue;
+		fprintf (fp, json ? "%s\"%d\": %ld" : "%sstatus %d: %ld\n",
+				json ? (first ? "" : ", ") : "", idx + MIN_STATUS,
+				sum.status [idx]);
+		first = 0;
+	}
+
+	fprintf (fp, json ? "},\n \"phases\": {" :
+			"phase       count   mean us    p50 us    p99 us   p999 us\n");
+	for (phase = 0; phase < NUM_PHASES; phase ++) {
+		long count = 0, *hist = sum.hist [phase];
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket ++)
+			count += hist [bucket];
+		long mean = count ? sum.usec [phase] / count : 0;
+		fprintf (fp, json ? "%s\n  \"%s\": {\"count\": %ld, "
+						"\"mean_us\": %ld, \"p50_us\": %ld, \"p99_us\": %ld, "
+						"\"p999_us\": %ld, \"buckets\": [" :
+					"%s%-9s %7ld %9ld %9ld %9ld %9ld\n",
+				json ? (phase ? "," : "") : "", phase_names [phase], count,
+				mean, percentile (hist, count, 0.5),
+				percentile (hist, count, 0.99),
+				percentile (hist, count, 0.999));
+		if (json) {
+			for (bucket = 0; bucket < STATS_BUCKETS; bucket ++)
+				fprintf (fp, "%s%ld", bucket ? ", " : "", hist [bucket]);
+			fprintf (fp, "]}");
+		}
+	}
+
+	for (phase = 0; !json && phase < NUM_PHASES; phase ++) {
+		fprintf (fp, "%s buckets (n: below 2^n us):", phase_names [phase]);
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket ++)
+			fprintf (fp, " %ld", sum.hist [phase][bucket]);
+		fprintf (fp, "\n");
+	}
+
+	if (json)
+		fprintf (fp, "},\n \"workers\": [");
+	for (slot = 0, first = 1; slot < STATS_SLOTS; slot ++) {
+		struct stats_slot *s = slots + slot;
+		if (s->pid == 0)
+			continue;
+		fprintf (fp, json ? "%s\n  {\"pid\": %d, \"requests\": %ld, "
+						"\"active_connections\": %ld}" :
+					"%sworker %d: %ld requests, %ld active connections\n",
+				json && !first ? "," : "", (int) s->pid,
+				GET (s->counters [STAT_REQUESTS]),
+				GET (s->counters [STAT_ACTIVE]));
+		first = 0;
+	}
+	if (json)
+		fprintf (fp, "\n ]\n}\n");
+}
@@ -0,0 +1,66 @@
+/*
+ * stats.h
+ *
+ *  Timing and counters of the serving processes, for /server-status. Each
+ *  serving process (the fork mode server with its per-connection children,
+ *  the event loop, or one worker) has a slot in a shared memory region
+ *  mapped before anything forks; the slots are only ever updated with
+ *  atomic adds, so no process takes a lock, and any of them can sum them
+ *  all up for the report.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#define	STATS_SLOTS		64	/* workers beyond this share slots */
+#define	STATS_BUCKETS	32	/* histogram bucket n: below 2^n microseconds */
+
+/*
+ * the timed phases of a request: reading its header, normalizing its path
+ * (normalize_target), running its handler, and sending what the handler left
+ * to be sent; and the whole of it
+ */
+enum stats_phase {
+	PHASE_PARSE, PHASE_NORMALIZE, PHASE_DISPATCH, PHASE_SEND, PHASE_TOTAL,
+	NUM_PHASES
+};
+
+enum stats_counter {
+	STAT_CONNECTIONS,		/* accepted */
+	STAT_ACTIVE,			/* open right now */
+	STAT_REQUESTS,
+	STAT_BYTES_SENT,
+	STAT_CACHE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_LOG_DROPPED,		/* access log lines the logger had no room for */
+	STAT_SHED,				/* connections turned away with a 503 */
+	STAT_PACK_HITS,			/* files answered from the file pack */
+	STAT_TIMEOUT_IDLE,		/* connections closed for a timeout: between */
+	STAT_TIMEOUT_HEADER,	/* requests, in the request header, */
+	STAT_TIMEOUT_BODY,		/* in its body, */
+	STAT_TIMEOUT_SEND,		/* sending the response, */
+	STAT_TIMEOUT_UPSTREAM,	/* or waiting for a proxy's upstream */
+	STAT_TLS_HANDSHAKES,	/* completed, */
+	STAT_TLS_RESUMED,		/* of those resuming a session, */
+	STAT_TLS_FAILED,		/* and failed */
+	STAT_TLS_KTLS,			/* connections the kernel encrypts */
+	STAT_RATE_CLIENT,		/* requests refused for a client's rate */
+	STAT_RATE_PATH,			/* or for a path's, all clients together */
+	NUM_COUNTERS
+};
+
+int stats_init (void);
+void stats_attach (int slot);
+void stats_setup (int endpoint);
+int stats_endpoint (void);
+void stats_clock (struct timespec *t);
+void stats_phase (enum stats_phase phase, struct timespec *since);
+void stats_count (enum stats_counter counter, long n);
+void stats_status (int code);
+void stats_socket_sent (int sock, long *counted);
+void stats_report (FILE *fp, int json);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,121 @@
+/*
+ * timer.c
+ *
+ *  The timer wheel. Level 0 has a slot for each of the next 64 ticks; each
+ *  level above has slots 64 times as wide, for timers further ahead. A
+ *  timer goes into the level its distance calls for, in the slot of its
+ *  due tick at that level's width, and stays there until the wheel comes
+ *  round to that slot: then the slot is cascaded, its timers placed again
+ *  one level (or more) down, until they reach level 0 and fire in their
+ *  own tick. Setting and cancelling a timer are a few pointer moves; every
+ *  timer is cascaded at most once per level on its way down.
+ *
+ *  Timers due further ahead than the wheel reaches are held in its last
+ *  slot, and fire early, which for the loop's timeouts does not happen.
+ */
+
+#include <string.h>
+
+#include "timer.h"
+
+#define	WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define	WHEEL_SPAN	(1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+void timer_init (struct timer_wheel *w, unsigned long now) {
+	memset (w, 0, sizeof (*w));
+	w->now = now;
+}
+
+static void link_timer (struct timer **slot, struct timer *t) {
+	t->next = *slot;
+	if (t->next != 0)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+/**
+ * place: links the timer into its slot, as seen from the wheel's current
+ * tick; one that is already due goes into that tick's
+ */
+static void place (struct timer_wheel *w, struct timer *t) {
+	int level = 0;
+
+	if ((long) (t->expires - w->now) < 0)
+		t->expires = w->now;
+	if (t->expires - w->now >= WHEEL_SPAN)
+		t->expires = w->now + WHEEL_SPAN - 1;
+	while (level + 1 < WHEEL_LEVELS &&
+			t->expires - w->now >= 1UL << (WHEEL_BITS * (level + 1)))
+		level ++;
+	link_timer (&w->slots [level][(t->expires >> (WHEEL_BITS * level)) &
+									WHEEL_MASK], t);
+}
+
+/**
+ * timer_set: sets the timer to fire at the tick, whether or not it is set
+ * already
+ */
+void timer_set (struct timer_wheel *w, struct timer *t, unsigned long expires) {
+	timer_cancel (t);
+	t->expires = expires;
+	place (w, t);
+}
+
+void timer_cancel (struct timer *t) {
+	if (t->pprev == 0)
+		return;
+	*t->pprev = t->next;
+	if (t->next != 0)
+		t->next->pprev = t->pprev;
+	t->next = 0;
+	t->pprev = 0;
+}
+
+/**
+ * cascade: places the timers of a slot of an upper level again, now that
+ * the wheel has come round to it
+ * returns: the slot's index, so that 0 (the level has wrapped round too)
+ * tells the caller to go on with the level above
+ */
+static int cascade (struct timer_wheel *w, int level, int idx) {
+	struct timer *t = w->slots [level][idx];
+
+	w->slots [level][idx] = 0;
+	while (t != 0) {
+		struct timer *next = t->next;
+		t->pprev = 0;
+		place (w, t);
+		t = next;
+	}
+	return (idx);
+}
+
+/**
+ * timer_advance: goes through the ticks up to and including now, firing
+ * the timers that are due. A fired timer is no longer set; the function it
+ * is fired with may set it again, or set and cancel any other.
+ */
+void timer_advance (struct timer_wheel *w, unsigned long now,
+					void (*fire) (struct timer *t)) {
+	while ((long) (now - w->now) >= 0) {
+		int idx = w->now & WHEEL_MASK, level;
+		struct timer *due;
+
+		for (level = 1; idx == 0 && level < WHEEL_LEVELS; level ++)
+			if (cascade (w, level, (w->now >> (WHEEL_BITS * level)) &
+									WHEEL_MASK) != 0)
+				break;
+
+		due = w->slots [0][idx]; // taken off the wheel as a list of its own,
+		w->slots [0][idx] = 0; // so that what is set while firing waits
+		if (due != 0)
+			due->pprev = &due;
+		w->now ++;
+		while (due != 0) {
+			struct timer *t = due;
+			timer_cancel (t);
+			fire (t);
+		}
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * timer.h
+ *
+ *  A hierarchical timer wheel, for the deadlines of the event loop's
+ *  connections: a timer is set, moved and cancelled in constant time,
+ *  however many there are, and the wheel is advanced to the current tick,
+ *  firing the timers that have come due. A timer lives in whatever it is
+ *  for; the wheel only links it into its slots.
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#define	WHEEL_BITS		6
+#define	WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define	WHEEL_LEVELS	4		/* 2^24 ticks ahead at most */
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;	/* what points at it, 0 if it is not set */
+	unsigned long expires;	/* the tick it is due at */
+};
+
+struct timer_wheel {
+	unsigned long now;		/* the next tick to go through */
+	struct timer *slots [WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void timer_init (struct timer_wheel *w, unsigned long now);
+void timer_set (struct timer_wheel *w, struct timer *t, unsigned long expires);
+void timer_cancel (struct timer *t);
+void timer_advance (struct timer_wheel *w, unsigned long now,
+					void (*fire) (struct timer *t));
+
+#endif /* TIMER_H_ */
@@ -0,0 +1,509 @@
+/*
+ * tls.c
+ *
+ *  TLS termination (see tls.h), with OpenSSL. The context is made when the
+ *  configuration is loaded, so every serving process inherits it, and its
+ *  ticket keys with it: a ticket one process issued is good in any other,
+ *  across the fork mode's children and the workers of a generation. For
+ *  clients that resume by session id instead (and TLS 1.3 ones when
+ *  tickets are off, whose tickets then name cached sessions), the sessions
+ *  go into a table of fixed slots in shared memory, indexed by the id;
+ *  each slot has a lock that is only ever tried, so a process finding it
+ *  taken just misses the cache.
+ *
+ *  After the handshake, a connection the kernel encrypts both ways (the
+ *  "ktls" setting, if the kernel and the library have it) is served on its
+ *  socket like any other. Otherwise the event loop keeps the session and
+ *  reads and writes through it, non-blocking, with tls_read and tls_write.
+ *  The fork mode (and the event loop, for a request whose body a forked
+ *  child is to read from the socket) forks a relay process instead, which
+ *  holds the session and passes the data between the socket and a socket
+ *  pair, the server's end of which is then served in the socket's place.
+ *  The server knows the client's address from the relay's pair no more, so
+ *  it is handed along.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "process.h"
+#include "socklib.h"
+#include "stats.h"
+
+#define	RELAY_LEN		16384	/* a record's worth */
+#define	SESSION_LEN		2048	/* longest encoded session cached */
+#define	SESSION_ID_CONTEXT	"wsng"
+
+/*
+ * a slot of the session cache
+ */
+struct cached_session {
+	int lock;
+	unsigned int id_len;	/* 0: empty */
+	unsigned char id [SSL_MAX_SSL_SESSION_ID_LENGTH];
+	int len;
+	unsigned char data [SESSION_LEN];	/* the session, DER encoded */
+};
+
+struct tls_context {
+	SSL_CTX *ctx;
+	struct cached_session *cache;	/* shared; NULL: no session cache */
+	int cache_size;
+	int timeout;		/* seconds the relay waits for the rest of a record */
+};
+
+struct tls_session {
+	SSL *ssl;
+	int fd;
+};
+
+static struct tls_context *installed = 0;	// the one connections get
+
+/**
+ * report: the reason of an OpenSSL failure, after what failed
+ */
+static void report (char *what, char *name) {
+	char reason [256];
+
+	ERR_error_string_n (ERR_get_error (), reason, sizeof (reason));
+	fprintf (stderr, "%s %s: %s\n", what, name, reason);
+}
+
+/**
+ * cache_slot: the slot of the session id, locked
+ * returns: the slot, or NULL if another process has it
+ */
+static struct cached_session *cache_slot (struct tls_context *tls,
+							const unsigned char *id, unsigned int len) {
+	unsigned int hash = 0, idx;
+	struct cached_session *slot;
+
+	for (idx = 0; idx < len; idx ++) // ids are random, but not all of them
+		hash = hash * 31 + id [idx];
+	slot = tls->cache + hash % tls->cache_size;
+	if (__atomic_exchange_n (&slot->lock, 1, __ATOMIC_ACQUIRE))
+		return (0);
+	return (slot);
+}
+
+static void cache_unlock (struct cached_session *slot) {
+	__atomic_store_n (&slot->lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct tls_context *context_of (SSL_CTX *ctx) {
+	return (SSL_CTX_get_app_data (ctx));
+}
+
+/**
+ * cache_new: the session cache callback for a new session: it goes into
+ * its slot, in place of whatever was there
+ * returns: 0, as the session is not kept referenced
+ */
+static int cache_new (SSL *ssl, SSL_SESSION *session) {
+	struct tls_context *tls = context_of (SSL_get_SSL_CTX (ssl));
+	unsigned int id_len;
+	const unsigned char *id = SSL_SESSION_get_id (session, &id_len);
+	int len = i2d_SSL_SESSION (session, 0);
+	struct cached_session *slot;
+
+	if (len <= 0 || len > SESSION_LEN ||
+			(slot = cache_slot (tls, id, id_len)) == 0)
+		return (0);
+	unsigned char *data = slot->data;
+	slot->len = i2d_SSL_SESSION (session, &data);
+	memcpy (slot->id, id, id_len);
+	slot->id_len = id_len;
+	cache_unlock (slot);
+	return (0);
+}
+
+/**
+ * cache_get: the session cache callback for a client resuming by id
+ * returns: the session (which OpenSSL checks for expiry), or NULL
+ */
+static SSL_SESSION *cache_get (SSL *ssl, const unsigned char *id, int len,
+								int *copy) {
+	struct tls_context *tls = context_of (SSL_get_SSL_CTX (ssl));
+	struct cached_session *slot = cache_slot (tls, id, len);
+	SSL_SESSION *session = 0;
+
+	*copy = 0;
+	if (slot == 0)
+		return (0);
+	if (slot->id_len == len && !memcmp (slot->id, id, len)) {
+		const unsigned char *data = slot->data;
+		session = d2i_SSL_SESSION (0, &data, slot->len);
+	}
+	cache_unlock (slot);
+	return (session);
+}
+
+/**
+ * cache_remove: the session cache callback for a session that is not to
+ * be resumed any longer
+ */
+static void cache_remove (SSL_CTX *ctx, SSL_SESSION *session) {
+	unsigned int id_len;
+	const unsigned char *id = SSL_SESSION_get_id (session, &id_len);
+	struct cached_session *slot = cache_slot (context_of (ctx), id, id_len);
+
+	if (slot == 0)
+		return;
+	if (slot->id_len == id_len && !memcmp (slot->id, id, id_len))
+		slot->id_len = 0;
+	cache_unlock (slot);
+}
+
+/**
+ * tls_new: a context with the certificate and key of the configuration,
+ * and its session resumption settings
+ * returns: the context, or NULL if the certificate or key cannot be used
+ * (reported)
+ */
+struct tls_context *tls_new (struct server *config) {
+	struct tls_context *tls = calloc (1, sizeof (struct tls_context));
+	char *key = config->tls_key [0] ? config->tls_key :
+									config->tls_certificate;
+
+	if (tls == 0 || (tls->ctx = SSL_CTX_new (TLS_server_method ())) == 0) {
+		perror ("tls");
+		free (tls);
+		return (0);
+	}
+	tls->timeout = config->header_timeout;
+	SSL_CTX_set_app_data (tls->ctx, tls);
+	SSL_CTX_set_min_proto_version (tls->ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode (tls->ctx, SSL_MODE_RELEASE_BUFFERS);
+	if (SSL_CTX_use_certificate_chain_file (tls->ctx,
+									config->tls_certificate) != 1) {
+		report ("Cannot use certificate", config->tls_certificate);
+		tls_free (tls);
+		return (0);
+	}
+	if (SSL_CTX_use_PrivateKey_file (tls->ctx, key, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key (tls->ctx) != 1) {
+		report ("Cannot use key", key);
+		tls_free (tls);
+		return (0);
+	}
+	if (!config->tls_tickets)
+		SSL_CTX_set_options (tls->ctx, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// clients mostly hang up without a close_notify; their sessions are
+	// no less good for it, and are not to be dropped from the cache
+	SSL_CTX_set_options (tls->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	if (config->ktls)
+		SSL_CTX_set_options (tls->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	SSL_CTX_set_session_id_context (tls->ctx,
+			(unsigned char *) SESSION_ID_CONTEXT, strlen (SESSION_ID_CONTEXT));
+	if (config->tls_session_cache == 0) {
+		SSL_CTX_set_session_cache_mode (tls->ctx, SSL_SESS_CACHE_OFF);
+		return (tls);
+	}
+	tls->cache_size = config->tls_session_cache;
+	tls->cache = mmap (0, tls->cache_size * sizeof (struct cached_session),
+						PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+						-1, 0);
+	if (tls->cache == MAP_FAILED) {
+		perror ("tls session cache");
+		tls->cache = 0;
+		tls_free (tls);
+		return (0);
+	}
+	SSL_CTX_set_session_cache_mode (tls->ctx, SSL_SESS_CACHE_SERVER |
+										SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb (tls->ctx, cache_new);
+	SSL_CTX_sess_set_get_cb (tls->ctx, cache_get);
+	SSL_CTX_sess_set_remove_cb (tls->ctx, cache_remove);
+	return (tls);
+}
+
+void tls_free (struct tls_context *tls) {
+	if (tls == 0)
+		return;
+	SSL_CTX_free (tls->ctx);
+	if (tls->cache != 0)
+		munmap (tls->cache, tls->cache_size * sizeof (struct cached_session));
+	free (tls);
+}
+
+/**
+ * tls_install: makes the context (NULL: none) the one connections get;
+ * the one in effect before is released
+ */
+void tls_install (struct tls_context *tls) {
+	tls_free (installed);
+	installed = tls;
+}
+
+/**
+ * tls_open: starts the server side of a connection accepted on the TLS
+ * port
+ * returns: the session, or NULL if there is no context or no memory
+ */
+struct tls_session *tls_open (int fd) {
+	struct tls_session *session;
+
+	if (installed == 0 ||
+			(session = calloc (1, sizeof (struct tls_session))) == 0)
+		return (0);
+	if ((session->ssl = SSL_new (installed->ctx)) == 0 ||
+			SSL_set_fd (session->ssl, fd) != 1) {
+		tls_close (session);
+		return (0);
+	}
+	session->fd = fd;
+	SSL_set_accept_state (session->ssl);
+	SSL_set_mode (session->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+					SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	return (session);
+}
+
+/**
+ * tls_handshake: goes on with the handshake as far as the socket lets it;
+ * on a blocking socket, to the end
+ * returns: 1 when it is done, 0 if it waits for the socket, -1 if it
+ * failed
+ */
+int tls_handshake (struct tls_session *session) {
+	int ret = SSL_do_handshake (session->ssl);
+
+	if (ret == 1) {
+		stats_count (STAT_TLS_HANDSHAKES, 1);
+		if (SSL_session_reused (session->ssl))
+			stats_count (STAT_TLS_RESUMED, 1);
+		return (1);
+	}
+	switch (SSL_get_error (session->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return (0);
+		default:
+			stats_count (STAT_TLS_FAILED, 1);
+			ERR_clear_error ();
+			return (-1);
+	}
+}
+
+/**
+ * write_all: the whole buffer into a blocking descriptor
+ * returns: 0, or -1 if it cannot be written
+ */
+static int write_all (int fd, char *buf, int len) {
+	while (len > 0) {
+		ssize_t n = write (fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		buf += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/**
+ * relay: the relay process's loop: what comes from the client is decrypted
+ * into the pair, and what the server writes into the pair is encrypted to
+ * the client, until the server closes its end. The client closing its side
+ * closes the pair's writing side, for the server to see the end of the
+ * requests; the responses still go out. A record that has only partly come
+ * waits up to the timeout; a client taking longer than that to read ends it.
+ */
+static void relay (SSL *ssl, int sock, int end, int timeout) {
+	struct pollfd pfd [2] = {{sock, POLLIN, 0}, {end, POLLIN, 0}};
+	struct timeval stalled = {timeout, 0};
+	char buf [RELAY_LEN];
+
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) & ~O_NONBLOCK);
+	setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &stalled, sizeof (stalled));
+	setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &stalled, sizeof (stalled));
+	for (;;) {
+		int pending = pfd [0].fd != -1 && SSL_pending (ssl) > 0;
+		pfd [0].revents = pfd [1].revents = 0;
+		if (!pending && poll (pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pending || pfd [0].revents != 0) {
+			int n = SSL_read (ssl, buf, sizeof (buf));
+			if (n > 0) {
+				if (write_all (end, buf, n) == -1)
+					break;
+			} else if (SSL_get_error (ssl, n) != SSL_ERROR_WANT_READ) {
+				shutdown (end, SHUT_WR);
+				pfd [0].fd = -1;
+			}
+		}
+		if (pfd [1].revents != 0) {
+			ssize_t n = read (end, buf, sizeof (buf));
+			if (n <= 0 || SSL_write (ssl, buf, n) <= 0)
+				break;
+		}
+	}
+	SSL_shutdown (ssl);
+}
+
+/**
+ * kernel_encrypts: whether the kernel has taken the session over, both ways
+ */
+static int kernel_encrypts (SSL *ssl) {
+#ifdef BIO_get_ktls_send
+	return (BIO_get_ktls_send (SSL_get_wbio (ssl)) &&
+			BIO_get_ktls_recv (SSL_get_rbio (ssl)));
+#else
+	return (0);
+#endif
+}
+
+/**
+ * tls_kernel: whether the kernel has taken the encryption of the
+ * connection over, both ways, once its handshake is done; tls_serve then
+ * leaves it on its socket
+ */
+int tls_kernel (struct tls_session *session) {
+	return (kernel_encrypts (session->ssl));
+}
+
+/**
+ * io_result: what a failed SSL_read or SSL_write comes to, the way read
+ * and write report it
+ * returns: -1 with errno EAGAIN if it waits for the socket, 0 if the
+ * client has closed the connection, -1 with errno EPIPE if it broke
+ */
+static ssize_t io_result (struct tls_session *session, int ret) {
+	switch (SSL_get_error (session->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return (-1);
+		case SSL_ERROR_ZERO_RETURN:
+			return (0);
+		default:
+			ERR_clear_error ();
+			errno = EPIPE;
+			return (-1);
+	}
+}
+
+/**
+ * tls_read: reads from the connection through its session, as read does
+ * on a non-blocking socket; what the session has decrypted already comes
+ * first, so the caller reads until EAGAIN
+ * returns: the bytes read, 0 at the end, -1 with errno (EAGAIN: try again
+ * once the socket is ready)
+ */
+ssize_t tls_read (struct tls_session *session, char *buf, size_t len) {
+	int n = SSL_read (session->ssl, buf, len > INT_MAX ? INT_MAX : len);
+
+	return (n > 0 ? n : io_result (session, n));
+}
+
+/**
+ * tls_write: writes to the connection through its session, as write does
+ * on a non-blocking socket, a record or more at a time; after an EAGAIN
+ * the bytes that were not taken have to be offered again, first (they may
+ * have moved)
+ * returns: the bytes written, -1 with errno (EAGAIN: try again once the
+ * socket is ready)
+ */
+ssize_t tls_write (struct tls_session *session, char *buf, size_t len) {
+	int n = SSL_write (session->ssl, buf, len > INT_MAX ? INT_MAX : len);
+
+	if (n > 0)
+		return (n);
+	n = io_result (session, n);
+	if (n == 0)
+		errno = EPIPE;
+	return (-1);
+}
+
+/**
+ * handed_over: releases the session of a connection that goes on without
+ * it, as one that was shut down: released otherwise, OpenSSL would take
+ * it for a broken one and drop it from the cache
+ */
+static void handed_over (struct tls_session *session) {
+	SSL_set_shutdown (session->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	tls_close (session);
+}
+
+/**
+ * tls_serve: the descriptor the connection is to be served on once its
+ * handshake is done: its socket, if the kernel encrypts it (client is left
+ * empty then), or the server's end of the pair of a relay forked for it
+ * (client gets the client's address, INET6_ADDRSTRLEN bytes, and the
+ * socket is closed, left to the relay). The descriptor is close-on-exec.
+ * The session is released either way.
+ * returns: the descriptor, or -1 if the relay cannot be started
+ */
+int tls_serve (struct tls_session *session, char *client) {
+	int sock = session->fd, pair [2];
+
+	client [0] = '\0';
+	if (kernel_encrypts (session->ssl)) {
+		stats_count (STAT_TLS_KTLS, 1);
+		handed_over (session);
+		return (sock);
+	}
+
+	if (peer_address (sock, client) == 0)
+		client [0] = '\0';
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+		tls_close (session);
+		return (-1);
+	}
+	switch (fork ()) {
+		case -1:
+			close (pair [0]);
+			close (pair [1]);
+			tls_close (session);
+			return (-1);
+
+		case 0:
+			fcntl (sock, F_SETFD, 0); // all the rest of the server's goes
+			fcntl (pair [1], F_SETFD, 0);
+			close (pair [0]);
+			close_inherited (-1);
+			relay (session->ssl, sock, pair [1], installed->timeout);
+			_exit (0);
+
+		default:
+			close (pair [1]);
+			close (sock);
+			handed_over (session);
+			return (pair [0]);
+	}
+}
+
+/**
+ * tls_close: releases the session; its socket is the caller's. One that
+ * was served is shut down first (without waiting for the client's side),
+ * which also keeps it for resumption.
+ */
+void tls_close (struct tls_session *session) {
+	if (session == 0)
+		return;
+	if (SSL_is_init_finished (session->ssl))
+		SSL_shutdown (session->ssl);
+	ERR_clear_error ();
+	SSL_free (session->ssl);
+	free (session);
+}
@@ -0,0 +1,37 @@
+/*
+ * tls.h
+ *
+ *  HTTPS on a second port. The connections accepted there go through a TLS
+ *  handshake before anything else. When the kernel has taken the
+ *  encryption over (kTLS, both ways), the connection is then served on its
+ *  socket like any other, so that file bodies still go out with sendfile.
+ *  Otherwise the event loop reads and writes it through the session
+ *  itself, and the fork mode gets the server's end of a socket pair whose
+ *  other end a relay process, forked for the connection, decrypts and
+ *  encrypts through. Sessions are resumed with tickets, whose
+ *  keys every process shares as it forks from the one that made them, and
+ *  with a session cache in memory mapped before the forks.
+ */
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <sys/types.h>
+
+#include "wsng.h"
+
+struct tls_context;
+struct tls_session;
+
+struct tls_context *tls_new (struct server *config);
+void tls_free (struct tls_context *tls);
+void tls_install (struct tls_context *tls);
+struct tls_session *tls_open (int fd);
+int tls_handshake (struct tls_session *session);
+int tls_kernel (struct tls_session *session);
+int tls_serve (struct tls_session *session, char *client);
+ssize_t tls_read (struct tls_session *session, char *buf, size_t len);
+ssize_t tls_write (struct tls_session *session, char *buf, size_t len);
+void tls_close (struct tls_session *session);
+
+#endif /* TLS_H_ */
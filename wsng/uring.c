@@ -0,0 +1,381 @@
+/*
+ * uring.c
+ *
+ *  The io_uring layer. The rings are mapped from the ring's descriptor as
+ *  the kernel lays them out (one mapping for both rings, another for the
+ *  submission entries); the submission array is set up once to map every
+ *  slot to the entry of the same index. Entries are filled in as the loop
+ *  goes and only submitted, all at once, when it waits for completions (or
+ *  when the ring is full), so a round of events costs one system call.
+ *
+ *  Received data goes into buffers the kernel picks from a ring of
+ *  provided buffers; the loop copies it out and gives the buffer back
+ *  right away, so a connection holds no buffer while it is idle.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define	BUFFER_GROUP	0
+
+struct uring {
+	int fd;
+	void *rings;			/* both rings, in one mapping */
+	size_t rings_len;
+	struct io_uring_sqe *sqes;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail;
+	unsigned int sq_mask;
+	unsigned int tail;		/* of the entries filled in, not yet submitted */
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;	/* the provided buffers */
+	int buf_count;
+	int buf_size;
+	char *bufs;
+	unsigned short buf_tail;
+};
+
+/**
+ * uring_open: sets a ring up with room for entries submissions
+ * returns: the ring, or NULL (errno set) if there is no io_uring, or not
+ * one with the features the loop needs
+ */
+struct uring *uring_open (unsigned int entries) {
+	struct io_uring_params p;
+	struct uring *r = calloc (1, sizeof (struct uring));
+	unsigned int idx;
+
+	if (r == 0)
+		return (0);
+	memset (&p, 0, sizeof (p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * entries; // multishot operations complete many times
+	r->fd = syscall (__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1) {
+		free (r);
+		return (0);
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_EXT_ARG)) {
+		close (r->fd);
+		free (r);
+		errno = ENOSYS;
+		return (0);
+	}
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	size_t cq_len = p.cq_off.cqes +
+					p.cq_entries * sizeof (struct io_uring_cqe);
+	r->rings_len = sq_len > cq_len ? sq_len : cq_len;
+	r->rings = mmap (0, r->rings_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap (0, p.sq_entries * sizeof (struct io_uring_sqe),
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+					IORING_OFF_SQES);
+	if (r->rings == MAP_FAILED || r->sqes == MAP_FAILED) {
+		int saved = errno;
+		if (r->rings != MAP_FAILED)
+			munmap (r->rings, r->rings_len);
+		close (r->fd);
+		free (r);
+		errno = saved;
+		return (0);
+	}
+
+	char *base = r->rings;
+	r->entries = p.sq_entries;
+	r->sq_head = (unsigned int *) (base + p.sq_off.head);
+	r->sq_tail = (unsigned int *) (base + p.sq_off.tail);
+	r->sq_mask = *(unsigned int *) (base + p.sq_off.ring_mask);
+	unsigned int *array = (unsigned int *) (base + p.sq_off.array);
+	for (idx = 0; idx < p.sq_entries; idx ++)
+		array [idx] = idx;
+	r->tail = *r->sq_tail;
+	r->cq_head = (unsigned int *) (base + p.cq_off.head);
+	r->cq_tail = (unsigned int *) (base + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *) (base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+	return (r);
+}
+
+void uring_close (struct uring *r) {
+	if (r->buf_ring != 0)
+		munmap (r->buf_ring, r->buf_count * sizeof (struct io_uring_buf));
+	free (r->bufs);
+	munmap (r->sqes, r->entries * sizeof (struct io_uring_sqe));
+	munmap (r->rings, r->rings_len);
+	close (r->fd);
+	free (r);
+}
+
+/**
+ * enter: submits the entries filled in so far, and with wait, waits up to
+ * timeout_ms for at least one completion
+ * returns: 0, or -1 with errno set (ETIME if nothing completed in time)
+ */
+static int enter (struct uring *r, int wait, int timeout_ms) {
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned int submit = r->tail - *r->sq_head;
+
+	__atomic_store_n (r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	if (!wait)
+		return (syscall (__NR_io_uring_enter, r->fd, submit, 0, 0, 0, 0) ==
+					-1 ? -1 : 0);
+	memset (&arg, 0, sizeof (arg));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	arg.ts = (unsigned long long) (unsigned long) &ts;
+	return (syscall (__NR_io_uring_enter, r->fd, submit, 1,
+					IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+					&arg, sizeof (arg)) == -1 ? -1 : 0);
+}
+
+int uring_wait (struct uring *r, int timeout_ms) {
+	return (enter (r, 1, timeout_ms));
+}
+
+/**
+ * uring_cqe: the next completion, if there is one; it stays at the front
+ * of the ring until uring_cqe_seen
+ */
+struct io_uring_cqe *uring_cqe (struct uring *r) {
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+		return (0);
+	return (r->cqes + (head & r->cq_mask));
+}
+
+void uring_cqe_seen (struct uring *r) {
+	__atomic_store_n (r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * uring_cqe_at: the completion n places behind the front of the ring, to
+ * look at ahead of its turn; it is still seen in its turn
+ * returns: the completion, or NULL if there are not that many
+ */
+struct io_uring_cqe *uring_cqe_at (struct uring *r, unsigned int n) {
+	unsigned int head = *r->cq_head;
+
+	if (__atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE) - head <= n)
+		return (0);
+	return (r->cqes + ((head + n) & r->cq_mask));
+}
+
+/**
+ * get_sqe: a cleared submission entry; if the ring is full, what is in it
+ * is submitted first
+ * returns: the entry, or NULL if the ring stays full
+ */
+static struct io_uring_sqe *get_sqe (struct uring *r) {
+	if (r->tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) ==
+					r->entries && enter (r, 0, 0) == -1)
+		return (0);
+	if (r->tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) ==
+					r->entries)
+		return (0);
+	struct io_uring_sqe *sqe = r->sqes + (r->tail & r->sq_mask);
+	memset (sqe, 0, sizeof (struct io_uring_sqe));
+	r->tail ++;
+	return (sqe);
+}
+
+/**
+ * uring_buffers: registers a ring of count (a power of two) provided
+ * buffers of size bytes each for receiving
+ * returns: 0, or -1 with errno set
+ */
+int uring_buffers (struct uring *r, int count, int size) {
+	struct io_uring_buf_reg reg;
+	int idx;
+
+	r->buf_ring = mmap (0, count * sizeof (struct io_uring_buf),
+					PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->buf_ring == MAP_FAILED) {
+		r->buf_ring = 0;
+		return (-1);
+	}
+	r->buf_count = count;
+	r->buf_size = size;
+	if ((r->bufs = malloc ((size_t) count * size)) == 0)
+		return (-1);
+
+	memset (&reg, 0, sizeof (reg));
+	reg.ring_addr = (unsigned long) r->buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = BUFFER_GROUP;
+	if (syscall (__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+					&reg, 1) == -1)
+		return (-1);
+	for (idx = 0; idx < count; idx ++)
+		uring_buffer_return (r, idx);
+	return (0);
+}
+
+char *uring_buffer (struct uring *r, int bid) {
+	return (r->bufs + (size_t) bid * r->buf_size);
+}
+
+/**
+ * uring_buffer_return: gives a provided buffer back to the kernel. The
+ * fields are set one by one: the ring's tail shares its first entry.
+ */
+void uring_buffer_return (struct uring *r, int bid) {
+	struct io_uring_buf *buf =
+				r->buf_ring->bufs + (r->buf_tail & (r->buf_count - 1));
+
+	buf->addr = (unsigned long) uring_buffer (r, bid);
+	buf->len = r->buf_size;
+	buf->bid = bid;
+	r->buf_tail ++;
+	__atomic_store_n (&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * uring_accept: a multishot accept on the listening socket: one completion
+ * per connection, the new socket in its result
+ */
+int uring_accept (struct uring *r, int fd, unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = data;
+	return (0);
+}
+
+/**
+ * uring_recv: a multishot receive into the provided buffers: one
+ * completion per chunk received, naming the buffer it went into
+ */
+int uring_recv (struct uring *r, int fd, unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->user_data = data;
+	return (0);
+}
+
+int uring_sendmsg (struct uring *r, int fd, struct msghdr *msg, int flags,
+					unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+	return (0);
+}
+
+int uring_send (struct uring *r, int fd, void *buf, size_t len, int flags,
+					unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+	return (0);
+}
+
+/**
+ * uring_splice: moves len bytes from in (at off_in, or from its current
+ * position if that is -1, as for a pipe) to out
+ */
+int uring_splice (struct uring *r, int in, long long off_in, int out,
+					size_t len, int flags, unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->splice_fd_in = in;
+	sqe->splice_off_in = (unsigned long long) off_in;
+	sqe->fd = out;
+	sqe->off = (unsigned long long) -1;
+	sqe->len = len;
+	sqe->splice_flags = flags;
+	sqe->user_data = data;
+	return (0);
+}
+
+/**
+ * uring_poll: a multishot poll for the descriptor becoming readable
+ */
+int uring_poll (struct uring *r, int fd, unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+	return (0);
+}
+
+/**
+ * uring_cancel: cancels the operation submitted with the target data
+ */
+int uring_cancel (struct uring *r, unsigned long long target,
+					unsigned long long data) {
+	struct io_uring_sqe *sqe = get_sqe (r);
+
+	if (sqe == 0)
+		return (-1);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+	return (0);
+}
+
+/**
+ * uring_cancel_now: cancels the operation there and then, instead of
+ * through the ring; what it completed before is in the completion ring
+ * when this returns, followed by its last completion
+ * returns: 0 on success, -1 (errno set) if there was no such operation
+ */
+int uring_cancel_now (struct uring *r, unsigned long long target) {
+	struct io_uring_sync_cancel_reg reg;
+
+	memset (&reg, 0, sizeof (reg));
+	reg.addr = target;
+	reg.fd = -1;
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	return (syscall (__NR_io_uring_register, r->fd,
+					IORING_REGISTER_SYNC_CANCEL, &reg, 1) == -1 ? -1 : 0);
+}
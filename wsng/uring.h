@@ -0,0 +1,42 @@
+/*
+ * uring.h
+ *
+ *  A thin layer over the io_uring system calls, for the event loop: the
+ *  submission and completion rings, a ring of provided receive buffers,
+ *  and the few operations the loop submits. There is no library behind it,
+ *  only the kernel's own header.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring;
+
+struct uring *uring_open (unsigned int entries);
+void uring_close (struct uring *r);
+int uring_wait (struct uring *r, int timeout_ms);
+struct io_uring_cqe *uring_cqe (struct uring *r);
+void uring_cqe_seen (struct uring *r);
+struct io_uring_cqe *uring_cqe_at (struct uring *r, unsigned int n);
+
+int uring_buffers (struct uring *r, int count, int size);
+char *uring_buffer (struct uring *r, int bid);
+void uring_buffer_return (struct uring *r, int bid);
+
+int uring_accept (struct uring *r, int fd, unsigned long long data);
+int uring_recv (struct uring *r, int fd, unsigned long long data);
+int uring_sendmsg (struct uring *r, int fd, struct msghdr *msg, int flags,
+					unsigned long long data);
+int uring_send (struct uring *r, int fd, void *buf, size_t len, int flags,
+					unsigned long long data);
+int uring_splice (struct uring *r, int in, long long off_in, int out,
+					size_t len, int flags, unsigned long long data);
+int uring_poll (struct uring *r, int fd, unsigned long long data);
+int uring_cancel (struct uring *r, unsigned long long target,
+					unsigned long long data);
+int uring_cancel_now (struct uring *r, unsigned long long target);
+
+#endif /* URING_H_ */
@@ -0,0 +1,204 @@
+/*
+ * vhost.c
+ *
+ *  The virtual hosts. A host may go by several names; each name has its
+ *  slot in the table, pointing at the host. The name of a request is taken
+ *  from its Host header (or the authority of an absolute target) and
+ *  brought into the form the table keeps: lower case, without the port and
+ *  without a trailing dot; the lookup hashes it and probes linearly, and
+ *  never allocates.
+ *
+ *  A host's own content types are a table of their own with no default
+ *  type: an extension it does not map gets the global type.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "vhost.h"
+
+#define	INITIAL_SLOTS	16	// a power of 2
+#define	NAME_LEN	256		/* longest host name looked up */
+
+/**
+ * hash_name: FNV-1a over the (already lower-cased) name
+ */
+static unsigned int hash_name (char *name) {
+	unsigned int h = 2166136261u;
+	while (*name)
+		h = (h ^ (unsigned char) *name ++) * 16777619u;
+	return (h);
+}
+
+/**
+ * find_slot: the slot holding the name, or the free slot where it would go
+ */
+static struct vhost_name *find_slot (struct vhost_table *table, char *name) {
+	unsigned int idx = hash_name (name) & table->mask;
+
+	while (table->slots [idx].name != 0 && strcmp (table->slots [idx].name,
+													name))
+		idx = (idx + 1) & table->mask;
+	return (table->slots + idx);
+}
+
+/**
+ * grow: doubles the number of slots, re-inserting every name
+ * returns: 0 on success, -1 if out of memory (the table is unchanged)
+ */
+static int grow (struct vhost_table *table) {
+	struct vhost_table bigger = *table;
+	unsigned int idx;
+
+	bigger.mask = table->mask * 2 + 1;
+	bigger.slots = calloc (bigger.mask + 1, sizeof (struct vhost_name));
+	if (bigger.slots == 0)
+		return (-1);
+	for (idx = 0; idx <= table->mask; idx ++)
+		if (table->slots [idx].name != 0)
+			*find_slot (&bigger, table->slots [idx].name) =
+												table->slots [idx];
+	free (table->slots);
+	*table = bigger;
+	return (0);
+}
+
+/**
+ * canonical_name: the name as the table keeps it, into buf
+ * returns: buf, or NULL if the name is empty or too long
+ */
+static char *canonical_name (char *name, char *buf) {
+	int len = 0;
+
+	if (*name == '[') { // an IPv6 literal keeps its colons
+		while (name [len] != '\0' && name [len] != ']')
+			len ++;
+		if (name [len] == ']')
+			len ++;
+	} else
+		while (name [len] != '\0' && name [len] != ':')
+			len ++;
+	while (len > 0 && name [len - 1] == '.')
+		len --;
+	if (len == 0 || len >= NAME_LEN)
+		return (0);
+	for (buf [len] = '\0'; len > 0; len --)
+		buf [len - 1] = tolower ((unsigned char) name [len - 1]);
+	return (buf);
+}
+
+/**
+ * vhost_new: a table with no hosts
+ * returns: the table, or NULL if out of memory
+ */
+struct vhost_table *vhost_new (void) {
+	struct vhost_table *table = calloc (1, sizeof (struct vhost_table));
+	if (table == 0)
+		return (0);
+	table->mask = INITIAL_SLOTS - 1;
+	table->slots = calloc (INITIAL_SLOTS, sizeof (struct vhost_name));
+	if (table->slots == 0) {
+		free (table);
+		return (0);
+	}
+	return (table);
+}
+
+/**
+ * vhost_free: releases the table, its hosts and all the strings in it
+ */
+void vhost_free (struct vhost_table *table) {
+	unsigned int idx;
+
+	if (table == 0)
+		return;
+	for (idx = 0; idx <= table->mask; idx ++)
+		free (table->slots [idx].name);
+	while (table->hosts != 0) {
+		struct vhost *host = table->hosts;
+		table->hosts = host->next;
+		free (host->root);
+		mime_free (host->types);
+		free (host);
+	}
+	free (table->slots);
+	free (table);
+}
+
+/**
+ * vhost_add: a new host with the document root, as yet without a name
+ * returns: the host, or NULL if out of memory
+ */
+struct vhost *vhost_add (struct vhost_table *table, char *root) {
+	struct vhost *host = calloc (1, sizeof (struct vhost));
+	if (host == 0 || (host->root = strdup (root)) == 0) {
+		free (host);
+		return (0);
+	}
+	size_t len = strlen (host->root);
+	while (len > 1 && host->root [len - 1] == '/')
+		host->root [-- len] = '\0';
+	host->next = table->hosts;
+	table->hosts = host;
+	return (host);
+}
+
+/**
+ * vhost_name: gives the host a name to answer to (a name can only be had
+ * by one host). The table is kept at most half full.
+ * returns: 0 on success, -1 if the name is not acceptable or taken, or
+ * memory runs out
+ */
+int vhost_name (struct vhost_table *table, char *name, struct vhost *host) {
+	char buf [NAME_LEN];
+
+	if (canonical_name (name, buf) == 0)
+		return (-1);
+	if ((table->used + 1) * 2 > table->mask + 1 && grow (table) == -1)
+		return (-1);
+	struct vhost_name *slot = find_slot (table, buf);
+	if (slot->name != 0 || (slot->name = strdup (buf)) == 0)
+		return (-1);
+	slot->host = host;
+	table->used ++;
+	return (0);
+}
+
+/**
+ * vhost_set_type: maps the extension to the type for this host only;
+ * DEFAULT sets the type for the extensions it maps to nothing else
+ * returns: 0 on success, -1 if out of memory
+ */
+int vhost_set_type (struct vhost *host, char *ext, char *type) {
+	if (host->types == 0) {
+		if ((host->types = mime_new ()) == 0)
+			return (-1);
+		free (host->types->default_type); // the global one applies
+		host->types->default_type = 0;
+	}
+	if (!strcmp (ext, "DEFAULT"))
+		return (mime_set_default (host->types, type));
+	return (mime_set (host->types, ext, type));
+}
+
+/**
+ * vhost_lookup: the host going by the name (as a Host header gives it)
+ * returns: the host, or NULL if it is none of the table's
+ */
+struct vhost *vhost_lookup (struct vhost_table *table, char *name) {
+	char buf [NAME_LEN];
+
+	if (table == 0 || table->used == 0 || canonical_name (name, buf) == 0)
+		return (0);
+	return (find_slot (table, buf)->host);
+}
+
+/**
+ * vhost_content_type: the host's own type for the extension
+ * returns: the type, or NULL if the global one applies
+ */
+char *vhost_content_type (struct vhost *host, char *ext) {
+	return (host->types != 0 ? mime_lookup (host->types, ext) : 0);
+}
@@ -0,0 +1,43 @@
+/*
+ * vhost.h
+ *
+ *  Virtual hosts: names the server answers to with a document root of
+ *  their own, and content types of their own over the global ones. The
+ *  names are kept in an open-addressing hash table, filled while the
+ *  configuration is read and only looked up afterwards, so finding the
+ *  host of a request costs the same however many there are. Requests for
+ *  any other name are served from the server root.
+ */
+
+#ifndef VHOST_H_
+#define VHOST_H_
+
+#include "mimetypes.h"
+
+struct vhost {
+	char *root;			/* its document root, without a trailing '/' */
+	struct mime_table *types;	/* its own content types, or NULL */
+	struct vhost *next;			/* all the hosts of the table */
+};
+
+struct vhost_name {
+	char *name;			/* lower-case, without a port; NULL: free slot */
+	struct vhost *host;
+};
+
+struct vhost_table {
+	struct vhost_name *slots;
+	unsigned int mask;		/* number of slots - 1; a power of 2 */
+	unsigned int used;
+	struct vhost *hosts;
+};
+
+struct vhost_table *vhost_new (void);
+void vhost_free (struct vhost_table *table);
+struct vhost *vhost_add (struct vhost_table *table, char *root);
+int vhost_name (struct vhost_table *table, char *name, struct vhost *host);
+int vhost_set_type (struct vhost *host, char *ext, char *type);
+struct vhost *vhost_lookup (struct vhost_table *table, char *host);
+char *vhost_content_type (struct vhost *host, char *ext);
+
+#endif /* VHOST_H_ */
@@ -0,0 +1,301 @@
+/*
+ * workers.c
+ *
+ *  The pre-forked worker mode. The master process does not serve anything
+ *  itself: it starts the configured number of workers, each of which binds
+ *  its own listening socket (and HTTPS one) to the port with SO_REUSEPORT
+ *  (so the kernel balances the accepts between them) and then runs either
+ *  the fork or the event loop. The master replaces workers that die, and
+ *  on SIGHUP or when the config file changes re-reads it, starts a new
+ *  generation of workers and asks the old one to finish its connections and
+ *  exit. SIGUSR1 has it rebuild the file pack and hand it to a new
+ *  generation the same way. On SIGUSR2 it starts a new master from the
+ *  program file (see reload.h), a new binary perhaps, and once that has
+ *  its workers going, stops its own as on SIGTERM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "workers.h"
+#include "event.h"
+#include "socklib.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "pack.h"
+#include "proxy.h"
+#include "reload.h"
+
+#define	RELOAD_CHECK_SEC	1
+
+static pid_t *workers = 0;	// current generation; 0 marks an empty slot
+static int num_workers = 0;
+static pid_t *reserved = 0;	// the slots of the generation a reload starts
+
+/**
+ * start_worker: forks a worker process. The worker opens its own
+ * listening socket and serves in the configured mode until it is told to
+ * stop with SIGTERM (which the master also sends it if the master dies).
+ * Its statistics go into the slot of its index.
+ * returns: the pid of the worker in the master, -1 if fork failed
+ */
+static pid_t start_worker (struct server *config, int slot) {
+	pid_t master = getpid ();
+	pid_t pid = fork ();
+	if (pid != 0)
+		return (pid);
+
+	sigset_t none;
+	sigemptyset (&none);
+	sigprocmask (SIG_SETMASK, &none, 0); // the master blocks its signals
+
+	struct sigaction sa;
+	sigemptyset (&sa.sa_mask);
+	sa.sa_handler = &handle_stop;
+	sa.sa_flags = 0; // interrupt the blocking calls to notice the flag
+	sigaction (SIGTERM, &sa, 0);
+	sa.sa_handler = &handle_repack;
+	sigaction (SIGUSR1, &sa, 0);
+	prctl (PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid () != master) // master died before prctl took effect
+		exit (0);
+	stats_attach (slot);
+
+	config->socket = make_reuseport_server_socket (config->port,
+										config->listen_backlog);
+	if (config->socket != -1 && config->tls_port > 0)
+		config->tls_socket = make_reuseport_server_socket (config->tls_port,
+										config->listen_backlog);
+	if (config->socket == -1 || (config->tls_port > 0 &&
+									config->tls_socket == -1)) {
+		perror ("socket");
+		exit (1);
+	}
+
+	if (config->mode == MODE_EVENT)
+		exit (event_loop (config));
+	serve_forking (config);
+	exit (0);
+}
+
+/**
+ * refill_workers: starts a worker in every empty slot of the current
+ * generation
+ */
+static void refill_workers (struct server *config) {
+	int idx;
+	for (idx = 0; idx < num_workers; idx ++)
+		if (workers [idx] == 0) {
+			pid_t pid = start_worker (config, idx);
+			if (pid == -1)
+				perror ("fork");
+			else
+				workers [idx] = pid;
+		}
+}
+
+/**
+ * stop_workers: asks every worker of the current generation to stop; each
+ * finishes the connections it already has before exiting
+ */
+static void stop_workers (void) {
+	int idx;
+	for (idx = 0; idx < num_workers; idx ++)
+		if (workers [idx] != 0)
+			kill (workers [idx], SIGTERM);
+}
+
+/**
+ * reap_workers: collects exited children, freeing the slots of current
+ * workers (to be refilled); old-generation workers just go away
+ */
+static void reap_workers (void) {
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+		int idx;
+		for (idx = 0; idx < num_workers; idx ++)
+			if (workers [idx] == pid) {
+				if (WIFSIGNALED (status))
+					fprintf (stderr, "worker %d killed by signal %d\n",
+										pid, WTERMSIG (status));
+				else
+					fprintf (stderr, "worker %d exited with status %d\n",
+										pid, WEXITSTATUS (status));
+				workers [idx] = 0;
+			}
+	}
+}
+
+/**
+ * config_changed: checks whether the config file was modified since the
+ * last time this was called; the first call only records the time
+ */
+static int config_changed (char *configfile) {
+	static struct timespec last;
+	struct stat info;
+
+	if (stat (configfile, &info) == -1)
+		return (0); // being replaced; pick it up when it is back
+
+	int changed = info.st_mtim.tv_sec != last.tv_sec ||
+						info.st_mtim.tv_nsec != last.tv_nsec;
+	last = info.st_mtim;
+	return (changed);
+}
+
+/**
+ * new_generation: starts the configured number of new workers in the
+ * slots given (allocated for them, zeroed), and only then retires the
+ * current ones gracefully, so that the port always has workers listening
+ * on it
+ */
+static void new_generation (struct server *config, pid_t *fresh_workers) {
+	pid_t *old_workers = workers;
+	int num_old = num_workers;
+
+	workers = fresh_workers;
+	num_workers = config->workers;
+	refill_workers (config);
+
+	workers = old_workers;
+	num_workers = num_old;
+	stop_workers ();
+	free (old_workers);
+	workers = fresh_workers;
+	num_workers = config->workers;
+}
+
+/**
+ * check_reload: load_config's check of a re-read file, before it sets
+ * anything up: it has to keep the worker mode, and the slots of the new
+ * generation are allocated now, so that nothing is left to fail once the
+ * file has taken effect
+ * returns: 0 if the reload can go on, -1 if not
+ */
+static int check_reload (struct server *fresh) {
+	if (fresh->workers == 0) {
+		fprintf (stderr, "Cannot leave the worker mode without a restart\n");
+		return (-1);
+	}
+	if ((reserved = calloc (fresh->workers, sizeof (pid_t))) == 0) {
+		perror ("calloc");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * reload_workers: re-reads the config file; if it is valid, starts a new
+ * generation of workers with it and retires the old one gracefully. A new
+ * access log file gets a logger of its own, which the new workers write
+ * to, while the old ones finish into the file before.
+ * An invalid file is reported and otherwise ignored.
+ */
+static void reload_workers (char *configfile, struct server *config) {
+	struct server fresh;
+
+	default_config (&fresh);
+	if (load_config (configfile, &fresh, check_reload) == -1) {
+		fprintf (stderr, "Reload of %s failed, keeping the old workers\n",
+							configfile);
+		free (reserved);
+		reserved = 0;
+		return;
+	}
+	if (strcmp (fresh.access_log, config->access_log) &&
+			access_log_restart (&fresh) == -1) {
+		fprintf (stderr, "Keeping the access log %s\n",
+							config->access_log [0] ? config->access_log :
+							"off");
+		strcpy (fresh.access_log, config->access_log);
+	}
+	new_generation (&fresh, reserved);
+	reserved = 0;
+	*config = fresh;
+}
+
+/**
+ * supervise_workers: the master loop. Signals are taken synchronously with
+ * sigtimedwait; the timeout doubles as the interval for checking the config
+ * file and restarting dead workers (so a worker that cannot start is not
+ * respawned in a tight loop).
+ * returns: the exit code for the master once it has been told to stop
+ */
+int supervise_workers (char *configfile, struct server *config) {
+	sigset_t signals;
+	sigemptyset (&signals);
+	sigaddset (&signals, SIGCHLD);
+	sigaddset (&signals, SIGHUP);
+	sigaddset (&signals, SIGUSR1);
+	sigaddset (&signals, SIGUSR2);
+	sigaddset (&signals, SIGTERM);
+	sigaddset (&signals, SIGINT);
+	sigprocmask (SIG_BLOCK, &signals, 0);
+
+	workers = calloc (config->workers, sizeof (pid_t));
+	if (workers == 0) {
+		perror ("calloc");
+		return (1);
+	}
+	num_workers = config->workers;
+	config_changed (configfile);
+	refill_workers (config);
+	reload_ready ();
+
+	for (;;) {
+		struct timespec tick = {RELOAD_CHECK_SEC, 0};
+		pid_t *fresh_workers;
+
+		switch (sigtimedwait (&signals, 0, &tick)) {
+			case SIGCHLD:
+				reap_workers ();
+			break;
+
+			case SIGHUP:
+				config_changed (configfile);
+				reload_workers (configfile, config);
+				access_log_rotate ();
+			break;
+
+			case SIGUSR1:
+				if ((fresh_workers = calloc (config->workers,
+											sizeof (pid_t))) == 0) {
+					perror ("calloc");
+					break;
+				}
+				pack_build (config);
+				new_generation (config, fresh_workers);
+			break;
+
+			case SIGUSR2:
+				if (reload_start (config) == -1)
+					break;
+				// the new master's workers serve from here on
+			case SIGTERM:
+			case SIGINT:
+				stop_workers ();
+				proxy_stop ();
+				access_log_stop (); // the logger exits after the workers
+				while (wait (0) > 0 || errno == EINTR) {
+				}
+				return (0);
+
+			default: // timeout
+				if (config_changed (configfile))
+					reload_workers (configfile, config);
+				refill_workers (config);
+			break;
+		}
+	}
+}
@@ -0,0 +1,15 @@
+/*
+ * workers.h
+ *
+ *  Pre-forked worker processes, each accepting on its own SO_REUSEPORT
+ *  socket, supervised and reloaded by the master process
+ */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include "wsng.h"
+
+int supervise_workers (char *configfile, struct server *config);
+
+#endif /* WORKERS_H_ */
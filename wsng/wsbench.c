@@ -0,0 +1,479 @@
+/*
+ * wsbench.c
+ *
+ *  A load generator for wsng. It keeps a number of connections to the
+ *  server busy, each with one request outstanding at a time (a closed loop:
+ *  a connection sends its next request when the previous answer is in),
+ *  picks every request from a weighted mix of targets, and times it from
+ *  the moment it is sent (or the connection is opened, without keep-alive)
+ *  until the last byte of the answer. At the end it reports the requests per
+ *  second and the latency percentiles, overall and per target.
+ *
+ *	usage: wsbench [-h host] [-p port] [-c connections] [-d seconds]
+ *					[-n requests] [-k] [-t] [-m mix]
+ *
+ *	-k	keeps the connections open between requests (HTTP/1.1 keep-alive)
+ *	-t	prints only one line: req/s, p50, p99, p999 (in usec) and errors
+ *	-m	the mix: comma separated weight:METHOD:path entries, by default
+ *		DEFAULT_MIX, which fits the fixture tree in bench/docroot
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "socklib.h"
+
+#define	DEFAULT_MIX	"60:GET:/small.html,10:GET:/page.html,10:HEAD:/page.html," \
+					"10:GET:/files,5:GET:/hello.cgi,5:GET:/missing.html"
+#define	MAX_TARGETS	16
+#define	PATH_LEN	256
+#define	REQ_LEN		(PATH_LEN + 128)
+#define	BUF_LEN		65536
+#define	MAX_EVENTS	64
+#define	CHUNK_LINE	64		/* of a chunk size or trailer line, kept */
+
+struct samples {
+	unsigned *usec;		/* the latencies, in the order they were taken */
+	long count;
+	long max;
+};
+
+struct target {
+	int weight;
+	char method [8];
+	char path [PATH_LEN];
+	struct samples latency;
+};
+
+enum client_state {
+	SENDING, HEADER, BODY, CHUNKED, UNTIL_EOF
+};
+
+struct client {
+	int fd;
+	enum client_state state;
+	struct target *target;
+	char req [REQ_LEN];
+	int req_len;
+	int req_off;
+	char buf [BUF_LEN];	/* the answer's header as received so far */
+	int buf_len;
+	long long body_left;
+	int chunked;		/* the body comes in chunks: */
+	long long chunk_left;	/* of the chunk's data and its CRLF */
+	char line [CHUNK_LINE];	/* or the size or trailer line so far */
+	int line_len;
+	int trailer;		/* the last chunk is in */
+	int close_after;	/* the server says it closes the connection */
+	struct timespec start;
+};
+
+static struct target targets [MAX_TARGETS];
+static int num_targets = 0;
+static int total_weight = 0;
+static char *host = "localhost";
+static int port = 15043;
+static int keep_alive = 0;
+static long completed = 0, errors = 0;
+static long status_class [6];	// by the first digit of the status
+
+/**
+ * parse_mix: fills the targets from the weight:METHOD:path list
+ * returns: 0 on success, -1 if the list is malformed
+ */
+static int parse_mix (char *mix) {
+	char *copy = strdup (mix), *save = 0, *entry;
+
+	for (entry = strtok_r (copy, ",", &save); entry != 0;
+			entry = strtok_r (0, ",", &save)) {
+		struct target *t = targets + num_targets;
+		if (num_targets == MAX_TARGETS ||
+				sscanf (entry, "%d:%7[A-Z]:%255s", &t->weight, t->method,
+						t->path) != 3 || t->weight <= 0) {
+			fprintf (stderr, "wsbench: bad mix entry \"%s\"\n", entry);
+			free (copy);
+			return (-1);
+		}
+		total_weight += t->weight;
+		num_targets ++;
+	}
+	free (copy);
+	return (num_targets > 0 ? 0 : -1);
+}
+
+static struct target *pick_target (void) {
+	int roll = random () % total_weight, idx;
+
+	for (idx = 0; roll >= targets [idx].weight; idx ++)
+		roll -= targets [idx].weight;
+	return (targets + idx);
+}
+
+static long elapsed_usec (struct timespec *from, struct timespec *to) {
+	return ((to->tv_sec - from->tv_sec) * 1000000L +
+				(to->tv_nsec - from->tv_nsec) / 1000);
+}
+
+static void add_sample (struct samples *s, long usec) {
+	if (s->count == s->max) {
+		long more = s->max ? 2 * s->max : 4096;
+		unsigned *grown = realloc (s->usec, more * sizeof (unsigned));
+		if (grown == 0)
+			return; // the sample is lost, the run goes on
+		s->usec = grown;
+		s->max = more;
+	}
+	s->usec [s->count ++] = usec;
+}
+
+static int compare_usec (const void *a, const void *b) {
+	unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+	return (x < y ? -1 : x > y);
+}
+
+/**
+ * percentile: the latency below which the given fraction of the sorted
+ * samples fall
+ */
+static unsigned percentile (struct samples *s, double fraction) {
+	if (s->count == 0)
+		return (0);
+	long idx = (long) (fraction * s->count);
+	return (s->usec [idx < s->count ? idx : s->count - 1]);
+}
+
+/**
+ * open_client: connects (unless the connection is still open) and sets up
+ * the next request
+ * returns: 0 on success, -1 if the server could not be reached
+ */
+static int open_client (struct client *c, int epfd) {
+	struct epoll_event ev;
+	int on = 1;
+
+	c->target = pick_target ();
+	clock_gettime (CLOCK_MONOTONIC, &c->start);
+	if (c->fd == -1) {
+		if ((c->fd = connect_to_server (host, port)) == -1)
+			return (-1);
+		fcntl (c->fd, F_SETFL, O_NONBLOCK);
+		setsockopt (c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+		ev.events = EPOLLOUT;
+		ev.data.ptr = c;
+		epoll_ctl (epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	} else {
+		ev.events = EPOLLOUT;
+		ev.data.ptr = c;
+		epoll_ctl (epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+	c->req_len = snprintf (c->req, REQ_LEN,
+			"%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+			c->target->method, c->target->path, host,
+			keep_alive ? "keep-alive" : "close");
+	c->req_off = 0;
+	c->buf_len = 0;
+	c->close_after = !keep_alive;
+	c->state = SENDING;
+	return (0);
+}
+
+static void close_client (struct client *c) {
+	if (c->fd != -1)
+		close (c->fd); // this also takes it out of the epoll set
+	c->fd = -1;
+}
+
+/**
+ * finish: records the answer just completed
+ */
+static void finish (struct client *c) {
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	add_sample (&c->target->latency, elapsed_usec (&c->start, &now));
+	completed ++;
+	if (c->close_after)
+		close_client (c);
+}
+
+/**
+ * header_end: finds the empty line ending the answer's header; cgi output
+ * may end its lines with a bare "\n"
+ * returns: the first byte of the body, or NULL if the header is incomplete
+ */
+static char *header_end (char *buf) {
+	char *line;
+
+	for (line = strchr (buf, '\n'); line != 0;
+			line = strchr (line + 1, '\n')) {
+		if (line [1] == '\n')
+			return (line + 2);
+		if (line [1] == '\r' && line [2] == '\n')
+			return (line + 3);
+	}
+	return (0);
+}
+
+/**
+ * parse_header: takes the status and the body length from a complete
+ * answer header
+ */
+static void parse_header (struct client *c, char *end) {
+	int status = 0;
+	char *line;
+
+	sscanf (c->buf, "HTTP/%*d.%*d %d", &status);
+	status_class [status / 100 < 6 ? status / 100 : 0] ++;
+	c->body_left = -1;
+	c->chunked = c->trailer = 0;
+	c->chunk_left = c->line_len = 0;
+	for (line = strchr (c->buf, '\n'); line != 0 && line + 1 < end;
+			line = strchr (line + 1, '\n')) {
+		if (!strncasecmp (line + 1, "Content-Length:", 15))
+			c->body_left = atoll (line + 16);
+		else if (!strncasecmp (line + 1, "Transfer-Encoding: chunked", 26))
+			c->chunked = 1;
+		else if (!strncasecmp (line + 1, "Connection: close", 17))
+			c->close_after = 1;
+	}
+	if (!strcmp (c->target->method, "HEAD") || status == 304 ||
+			status == 204 || status / 100 == 1)
+		c->body_left = c->chunked = 0;
+}
+
+/**
+ * chunks: goes through a chunked body as it comes, keeping only where it
+ * is: in a chunk, or in a size or trailer line
+ * returns: 1 once the last chunk and the trailer are in, 0 if more is to
+ * come, -1 if the framing is wrong
+ */
+static int chunks (struct client *c, char *data, size_t len) {
+	while (len > 0) {
+		if (c->chunk_left > 0) {
+			size_t n = len < c->chunk_left ? len : c->chunk_left;
+			data += n;
+			len -= n;
+			c->chunk_left -= n;
+			continue;
+		}
+		char ch = *data ++;
+		len --;
+		if (ch != '\n') {
+			if (ch != '\r' && c->line_len < CHUNK_LINE - 1)
+				c->line [c->line_len ++] = ch;
+			continue;
+		}
+		c->line [c->line_len] = '\0';
+		if (c->trailer && c->line_len == 0)
+			return (1);
+		if (!c->trailer) {
+			char *end;
+			c->chunk_left = strtoll (c->line, &end, 16);
+			if (end == c->line)
+				return (-1);
+			if (c->chunk_left == 0)
+				c->trailer = 1;
+			else
+				c->chunk_left += 2; // the CRLF after the data
+		}
+		c->line_len = 0;
+	}
+	return (0);
+}
+
+/**
+ * on_readable: consumes what the server sent
+ * returns: 1 if the answer is complete, 0 if more is to come, -1 on error
+ */
+static int on_readable (struct client *c) {
+	char discard [BUF_LEN];
+	ssize_t got;
+
+	for (;;) {
+		if (c->state == HEADER) {
+			got = read (c->fd, c->buf + c->buf_len, BUF_LEN - 1 - c->buf_len);
+			if (got <= 0)
+				break;
+			c->buf_len += got;
+			c->buf [c->buf_len] = '\0';
+			char *end = header_end (c->buf);
+			if (end == 0) {
+				if (c->buf_len == BUF_LEN - 1)
+					return (-1);
+				continue;
+			}
+			parse_header (c, end);
+			long long extra = c->buf_len - (end - c->buf);
+			if (c->chunked) {
+				c->state = CHUNKED;
+				int done = chunks (c, end, extra);
+				if (done != 0)
+					return (done);
+				continue;
+			}
+			if (c->body_left == -1) {
+				c->state = UNTIL_EOF;
+				c->close_after = 1;
+				continue;
+			}
+			if (extra >= c->body_left)
+				return (1); // anything beyond is not asked for
+			c->body_left -= extra;
+			c->state = BODY;
+		} else {
+			got = read (c->fd, discard, sizeof (discard));
+			if (got <= 0)
+				break;
+			if (c->state == BODY && (c->body_left -= got) <= 0)
+				return (1);
+			if (c->state == CHUNKED) {
+				int done = chunks (c, discard, got);
+				if (done != 0)
+					return (done);
+			}
+		}
+	}
+	if (got == 0)
+		return (c->state == UNTIL_EOF ? 1 : -1);
+	return (errno == EAGAIN ? 0 : -1);
+}
+
+/**
+ * on_writable: sends what is left of the request
+ * returns: 0 if it is sent or the socket is full, -1 on error
+ */
+static int on_writable (struct client *c, int epfd) {
+	while (c->req_off < c->req_len) {
+		ssize_t sent = write (c->fd, c->req + c->req_off,
+								c->req_len - c->req_off);
+		if (sent == -1)
+			return (errno == EAGAIN ? 0 : -1);
+		c->req_off += sent;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	epoll_ctl (epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->state = HEADER;
+	return (0);
+}
+
+/**
+ * report: sorts the samples and prints the results of the run
+ */
+static void report (double seconds, int terse) {
+	struct samples all = {0, 0, 0};
+	int idx;
+
+	for (idx = 0; idx < num_targets; idx ++) {
+		struct samples *s = &targets [idx].latency;
+		qsort (s->usec, s->count, sizeof (unsigned), compare_usec);
+		long from;
+		for (from = 0; from < s->count; from ++)
+			add_sample (&all, s->usec [from]);
+	}
+	qsort (all.usec, all.count, sizeof (unsigned), compare_usec);
+
+	if (terse) {
+		printf ("%.1f %u %u %u %ld\n", completed / seconds,
+				percentile (&all, 0.5), percentile (&all, 0.99),
+				percentile (&all, 0.999), errors);
+		return;
+	}
+	printf ("requests  %ld in %.2f s, %.1f/s, %ld errors\n",
+			completed, seconds, completed / seconds, errors);
+	printf ("status    2xx %ld  3xx %ld  4xx %ld  5xx %ld  other %ld\n",
+			status_class [2], status_class [3], status_class [4],
+			status_class [5], status_class [0] + status_class [1]);
+	printf ("latency   p50 %u us  p99 %u us  p999 %u us  max %u us\n",
+			percentile (&all, 0.5), percentile (&all, 0.99),
+			percentile (&all, 0.999), percentile (&all, 1.0));
+	for (idx = 0; idx < num_targets; idx ++) {
+		struct samples *s = &targets [idx].latency;
+		printf ("  %-5s %-24s %8ld  p50 %6u  p99 %6u  p999 %6u\n",
+				targets [idx].method, targets [idx].path, s->count,
+				percentile (s, 0.5), percentile (s, 0.99),
+				percentile (s, 0.999));
+	}
+	free (all.usec);
+}
+
+int main (int argc, char *argv []) {
+	int concurrency = 8, seconds = 10, terse = 0, option_flag, idx;
+	long limit = 0;
+	char *mix = DEFAULT_MIX;
+
+	while ((option_flag = getopt (argc, argv, "h:p:c:d:n:ktm:")) > 0) {
+		switch (option_flag) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi (optarg); break;
+		case 'c': concurrency = atoi (optarg); break;
+		case 'd': seconds = atoi (optarg); break;
+		case 'n': limit = atol (optarg); break;
+		case 'k': keep_alive = 1; break;
+		case 't': terse = 1; break;
+		case 'm': mix = optarg; break;
+		default:
+			fprintf (stderr, "usage: %s [-h host] [-p port] [-c connections] "
+					"[-d seconds] [-n requests] [-k] [-t] [-m mix]\n", argv [0]);
+			exit (1);
+		}
+	}
+	if (concurrency <= 0 || seconds <= 0 || parse_mix (mix) == -1)
+		exit (1);
+	signal (SIGPIPE, SIG_IGN);
+	srandom (1); // the same sequence of targets for every run
+
+	struct client *clients = calloc (concurrency, sizeof (struct client));
+	int epfd = epoll_create1 (0);
+	if (clients == 0 || epfd == -1) {
+		perror ("wsbench");
+		exit (1);
+	}
+	for (idx = 0; idx < concurrency; idx ++) {
+		clients [idx].fd = -1;
+		if (open_client (clients + idx, epfd) == -1) {
+			fprintf (stderr, "wsbench: cannot connect to %s:%d\n", host, port);
+			exit (1);
+		}
+	}
+
+	struct timespec begin, now;
+	struct epoll_event events [MAX_EVENTS];
+	clock_gettime (CLOCK_MONOTONIC, &begin);
+	now = begin;
+	while (elapsed_usec (&begin, &now) < seconds * 1000000L &&
+			(limit == 0 || completed + errors < limit)) {
+		int ready = epoll_wait (epfd, events, MAX_EVENTS, 100);
+		for (idx = 0; idx < ready; idx ++) {
+			struct client *c = events [idx].data.ptr;
+			int done = c->state == SENDING ? on_writable (c, epfd) :
+												on_readable (c);
+			if (done == 0)
+				continue;
+			if (done == 1)
+				finish (c);
+			else {
+				errors ++;
+				close_client (c);
+			}
+			if (open_client (c, epfd) == -1)
+				errors ++; // and the connection is lost for the run
+		}
+		clock_gettime (CLOCK_MONOTONIC, &now);
+	}
+
+	report (elapsed_usec (&begin, &now) / 1e6, terse);
+	exit (errors > 0 && completed == 0);
+}
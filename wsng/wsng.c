@@ -1,191 +1,648 @@
 #include	<stdio.h>
 #include	<stdlib.h>
+#include	<limits.h>
 #include	<strings.h>
 #include	<string.h>
 #include	<netdb.h>
 #include	<errno.h>
 #include	<unistd.h>
+#include	<fcntl.h>
 #include	<sys/types.h>
 #include	<sys/wait.h>
 #include	<sys/stat.h>
 #include	<sys/param.h>
+#include	<sys/socket.h>
+#include	<netinet/in.h>
+#include	<sys/time.h>
 #include	<signal.h>
+#include	<poll.h>
 #include	"socklib.h"
 
 #include	"read.h"
 #include	"process.h"
+#include	"wsng.h"
+#include	"event.h"
+#include	"workers.h"
+#include	"mimetypes.h"
+#include	"compress.h"
+#include	"cgipool.h"
+#include	"stats.h"
+#include	"accesslog.h"
+#include	"admission.h"
+#include	"pack.h"
+#include	"vhost.h"
+#include	"proxy.h"
+#include	"tls.h"
+#include	"reload.h"
+#include	"ratelimit.h"
 
 #define	PARAM_LEN	128
-#define	VALUE_LEN	512
 #define	PORTNUM	80
 #define	SERVER_ROOT	"."
 #define	CONFIG_FILE	"wsng.conf"
+#define	KEEPALIVE_TIMEOUT	5
+#define	KEEPALIVE_REQUESTS	100
+#define	HEADER_TIMEOUT	20
+#define	BODY_TIMEOUT	60
+#define	SEND_TIMEOUT	60
+#define	PROXY_POOL	16
+#define	PROXY_TIMEOUT	60
+#define	CGI_TIMEOUT	60
+#define	PROXY_CHECK_INTERVAL	5
+#define	TLS_SESSION_CACHE	1024
+#define	LISTEN_BACKLOG	511
+#define	MAX_CONNECTIONS	1024
+#define	RETRY_AFTER	1
+#define	FILE_PACK_MAX_FILE	32768
+#define	FILE_PACK_SIZE	(64L << 20)
+#define	CACHE_ENTRIES	1024
+#define	CACHE_MAX_FILE	65536
+#define	CACHE_REVALIDATE	2
+#define	COMPRESS_MIN_SIZE	1024
+#define	COMPRESS_TYPES	"text/html text/plain text/css application/javascript"
 
-struct server {
-	int port;
-	char host [VALUE_LEN];
-	int socket;
-	char root [VALUE_LEN];
-};
-
-#define TYPENAME_LEN 20
-#define CONTENTTYPE_LEN 40
-
-struct content_return_type {
-	char type_name [TYPENAME_LEN];
-	char return_type [CONTENTTYPE_LEN];
-};
-
-static struct content_return_type *content_type_arr = 0;
-static int num_content_types = 0;
+static struct mime_table *content_types = 0;
+static struct vhost_table *vhosts = 0;
 
 #define DEFAULT_CONTENTTYPE "DEFAULT"
 /**
- * setup_content_types - initializes the mapping of file extensions to
+ * setup_content_types - creates the mapping of file extensions to
  * return content types with the known types, and sets the default
  * type to be text/plain. This mappings can be augmented/redefined in
  * a config file
+ * returns: the new table, or NULL if out of memory
  */
-static void setup_content_types () {
-	num_content_types = 6;
-	content_type_arr = (struct content_return_type *) calloc (
-				num_content_types, sizeof (struct content_return_type));
-
-	int idx = 0;
-	content_type_arr[idx ++] =
-			(struct content_return_type) {DEFAULT_CONTENTTYPE, "text/plain"};
-	content_type_arr[idx ++] =
-			(struct content_return_type) {"text", "text/plain"};
-	content_type_arr[idx ++] =
-			(struct content_return_type) {"html", "text/html"};
-	content_type_arr[idx ++] =
-			(struct content_return_type) {"jpg", "image/jpeg"};
-	content_type_arr[idx ++] =
-			(struct content_return_type) {"jpeg", "image/jpeg"};
-	content_type_arr[idx ++] =
-			(struct content_return_type) {"gif", "image/gif"};
-}
+static struct mime_table *setup_content_types () {
+	struct mime_table *types = mime_new ();
 
-/**
- * find_content_type_idx - given the file extension, looks up if a mapping
- * exists describing the content type for this file type. If there isn't,
- * expands the array by 1 record and returns its index
- */
-int find_content_type_idx (char *type_name) {
-	int idx;
-
-	for (idx = 0; idx < num_content_types; idx ++)
-		if (!strcmp (type_name, content_type_arr[idx].type_name))
-				return (idx);
-
-	struct content_return_type *new_arr = (struct content_return_type *)
-					calloc (++num_content_types,
-							sizeof (struct content_return_type));
-	memcpy (new_arr, content_type_arr,
-			idx * sizeof (struct content_return_type));
-	memset (new_arr + idx, 0, sizeof (struct content_return_type));
-	free (content_type_arr);
-	content_type_arr = new_arr;
-
-	return (idx);
+	if (types == 0 ||
+			mime_set (types, "text", "text/plain") == -1 ||
+			mime_set (types, "html", "text/html") == -1 ||
+			mime_set (types, "jpg", "image/jpeg") == -1 ||
+			mime_set (types, "jpeg", "image/jpeg") == -1 ||
+			mime_set (types, "gif", "image/gif") == -1) {
+		mime_free (types);
+		return (0);
+	}
+	return (types);
 }
 
 /**
  * find_content_type - given the file extension, returns the content type
- * mapped to this file type, or the default type as defined by the
- * DEFAULT entry in the table (it's always the first one there)
+ * mapped to this file type (regardless of case), or the default type as
+ * defined by the DEFAULT entry
  */
 char *find_content_type (char *type_name) {
-	int idx = find_content_type_idx (type_name);
-	if (idx >= 0 && content_type_arr [idx].type_name[0] != 0)
-		return (content_type_arr [idx].return_type);
+	return (mime_lookup (content_types, type_name));
+}
 
-	return (content_type_arr [0].return_type);
+/**
+ * find_vhost: the virtual host going by the name a request gives
+ * returns: the host, or NULL if it is to be served from the server root
+ */
+struct vhost *find_vhost (char *name) {
+	return (vhost_lookup (vhosts, name));
 }
 
 /**
- * set_return_type: for the incoming file extension, either finds an entry
- * in the mapping table or creates a new one (if there is space in the table),
- * and sets the return type for this file type to the specified string
+ * set_return_type: for the incoming file extension, either replaces the
+ * mapping in the table or adds one, setting the return type for this file
+ * type to the specified string. DEFAULT sets the type for everything else.
+ * returns: 0 on success, -1 if out of memory
  */
-void set_return_type (char *type_name, char *return_type) {
-	int at_idx = find_content_type_idx (type_name);
-
-	if (at_idx >= 0) {
-		strncpy (content_type_arr [at_idx].type_name,
-						type_name, TYPENAME_LEN);
-		strncpy (content_type_arr [at_idx].return_type,
-						return_type, CONTENTTYPE_LEN);
-	}
+static int set_return_type (struct mime_table *types, char *type_name,
+							char *return_type) {
+	if (!strcmp (DEFAULT_CONTENTTYPE, type_name))
+		return (mime_set_default (types, return_type));
+	return (mime_set (types, type_name, return_type));
 }
 
 #define CONFIG_LINE_LEN 4096
 
+/**
+ * absolute_path: the path of a file the configuration names, made absolute
+ * from the directory the server was started from (see reload_init), as the
+ * server changes into its root later (and a reload reads the file from
+ * there), into to (VALUE_LEN bytes)
+ * returns: 0 on success, -1 if there is no path, it is too long, or it is
+ * relative to a start directory that is not known
+ */
+static int absolute_path (char *to, char *path) {
+	char *start_dir = reload_start_dir ();
+
+	if (path == 0 || (*path != '/' && start_dir [0] == '\0') ||
+			snprintf (to, VALUE_LEN, "%s%s%s", *path == '/' ? "" : start_dir,
+						*path == '/' ? "" : "/", path) >= VALUE_LEN)
+		return (-1);
+	return (0);
+}
+
 /**
  * process_config_file: reads a file describing the server configuration
- * Recognizes the entries for the port, the root directory, and multiple
+ * Recognizes the entries for the port, the root directory, the serving mode
+ * ("fork" or "event"), the number of worker processes, the keep-alive
+ * timeout (seconds, 0 turns keep-alive off) and the number of requests a
+ * connection may carry, the timeouts for a request header to come in, and
+ * for a request body and a response to stall (seconds, 0: none), the
+ * connection limits (the listen backlog, the connections open at once and
+ * from one address, and the Retry-After of the 503 for those over the
+ * limits), the size of the file cache (entries, the largest body kept, the
+ * revalidation interval in seconds), the content encoding settings (whether
+ * to send precompressed siblings, whether to gzip generated bodies, of which
+ * minimum size and of which types), the scripts to be run by pools of
+ * persistent workers and their sizes, whether to answer /server-status, the
+ * access log (file, format, and the sampling when the logger falls behind),
+ * the virtual hosts (a document root and the names that are served from it,
+ * and content types for one of them only), the path prefixes proxied to
+ * upstream servers and the proxy settings (idle connections kept for each
+ * upstream, the timeout, the interval and path of the health checks), the
+ * rate limits (a path prefix, requests a second and the burst, per client or
+ * for all clients together), the HTTPS port with its certificate and key
+ * files and its session resumption and kernel TLS settings, and multiple
  * lines describing the mappings between file extensions and HTTP content
- * type strings. Any string starting with # (probably after some whitespace)
- * is ignored. Unknown options cause an error.
- *
+ * type strings, either one by one or by naming a mime.types style file;
+ * later mappings override earlier ones. Any string starting with #
+ * (probably after some whitespace) is ignored. Unknown options cause an
+ * error.
+ * returns: 0 if the file was read successfully, -1 otherwise
  */
-void process_config_file (char *conf_file, struct server *server) {
+int process_config_file (char *conf_file, struct server *server,
+						struct mime_table *types, struct vhost_table *hosts,
+						struct proxy_table *proxies,
+						struct rate_table *limits) {
 	FILE *fp = fopen (conf_file, "r");
 	if (fp == NULL) {
-		fprintf (stderr, "Cannot open config file %s", conf_file);
-		exit (1);
+		fprintf (stderr, "Cannot open config file %s\n", conf_file);
+		return (-1);
 	}
 	char line [CONFIG_LINE_LEN];
 	int default_type_defined = 0;
+	int ret = 0;
 	char *readline (char *buf, int len, FILE *fp);
-	while (readline (line, CONFIG_LINE_LEN, fp) != NULL) {
+	while (ret == 0 && readline (line, CONFIG_LINE_LEN, fp) != NULL) {
 		char *param = strtok (line, " \t\r\n");
 		if (param == 0 || *param == 0 || *param == '#') { } // comment
 		else if (strcasecmp (param, "server_root") == 0)
 			strcpy (server->root, strtok (0, " \t\r\n"));
 		else if (strcasecmp (param, "port") == 0)
 			server->port = atoi (strtok (0, " \t\r\n"));
+		else if (strcasecmp (param, "mode") == 0) {
+			char *mode = strtok (0, " \t\r\n");
+			if (mode != 0 && !strcasecmp (mode, "event"))
+				server->mode = MODE_EVENT;
+			else if (mode != 0 && !strcasecmp (mode, "fork"))
+				server->mode = MODE_FORK;
+			else {
+				fprintf (stderr, "Unknown serving mode %s\n",
+								mode ? mode : "");
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "keepalive_timeout") == 0) {
+			char *timeout = strtok (0, " \t\r\n");
+			server->keepalive_timeout = timeout ? atoi (timeout) : -1;
+			if (server->keepalive_timeout < 0) {
+				fprintf (stderr, "Invalid keep-alive timeout\n");
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "header_timeout") == 0 ||
+				strcasecmp (param, "body_timeout") == 0 ||
+				strcasecmp (param, "send_timeout") == 0 ||
+				strcasecmp (param, "cgi_timeout") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			int seconds = value ? atoi (value) : -1;
+			if (seconds < 0) {
+				fprintf (stderr, "Invalid value for %s\n", param);
+				ret = -1;
+			} else if (!strcasecmp (param, "header_timeout"))
+				server->header_timeout = seconds;
+			else if (!strcasecmp (param, "body_timeout"))
+				server->body_timeout = seconds;
+			else if (!strcasecmp (param, "cgi_timeout"))
+				server->cgi_timeout = seconds;
+			else
+				server->send_timeout = seconds;
+		}
+		else if (strcasecmp (param, "proxy_pool") == 0 ||
+				strcasecmp (param, "proxy_timeout") == 0 ||
+				strcasecmp (param, "tls_port") == 0 ||
+				strcasecmp (param, "tls_session_cache") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			int number = value ? atoi (value) : -1;
+			if (number < 0) {
+				fprintf (stderr, "Invalid value for %s\n", param);
+				ret = -1;
+			} else if (!strcasecmp (param, "proxy_pool"))
+				server->proxy_pool = number;
+			else if (!strcasecmp (param, "proxy_timeout"))
+				server->proxy_timeout = number;
+			else if (!strcasecmp (param, "tls_port"))
+				server->tls_port = number;
+			else
+				server->tls_session_cache = number;
+		}
+		else if (strcasecmp (param, "tls_certificate") == 0 ||
+				strcasecmp (param, "tls_key") == 0) {
+			char *path = strtok (0, " \t\r\n");
+			if (absolute_path (!strcasecmp (param, "tls_key") ?
+						server->tls_key : server->tls_certificate, path) == -1) {
+				fprintf (stderr, "Invalid file for %s\n", param);
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "proxy_check") == 0) {
+			char *interval = strtok (0, " \t\r\n");
+			char *path = strtok (0, " \t\r\n");
+			server->proxy_check_interval = interval ? atoi (interval) : -1;
+			if (path != 0 && *path == '#')
+				path = 0;
+			if (server->proxy_check_interval < 0 || (path != 0 &&
+					(*path != '/' || strlen (path) >= VALUE_LEN))) {
+				fprintf (stderr, "proxy_check needs an interval, and a path "
+								"if any\n");
+				ret = -1;
+			} else
+				strcpy (server->proxy_check_path, path ? path : "");
+		}
+		else if (strcasecmp (param, "keepalive_requests") == 0) {
+			char *requests = strtok (0, " \t\r\n");
+			server->keepalive_requests = requests ? atoi (requests) : 0;
+			if (server->keepalive_requests < 1) {
+				fprintf (stderr, "Invalid keep-alive request limit\n");
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "listen_backlog") == 0 ||
+				strcasecmp (param, "max_connections") == 0 ||
+				strcasecmp (param, "max_connections_per_ip") == 0 ||
+				strcasecmp (param, "retry_after") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			int number = value ? atoi (value) : -1;
+			if (number < 0 || (number == 0 &&
+						strcasecmp (param, "max_connections_per_ip"))) {
+				fprintf (stderr, "Invalid value for %s\n", param);
+				ret = -1;
+			} else if (!strcasecmp (param, "listen_backlog"))
+				server->listen_backlog = number;
+			else if (!strcasecmp (param, "max_connections"))
+				server->max_connections = number;
+			else if (!strcasecmp (param, "max_connections_per_ip"))
+				server->max_connections_per_ip = number;
+			else
+				server->retry_after = number;
+		}
+		else if (strcasecmp (param, "cache_entries") == 0 ||
+				strcasecmp (param, "cache_max_file") == 0 ||
+				strcasecmp (param, "cache_revalidate") == 0 ||
+				strcasecmp (param, "file_pack_max_file") == 0 ||
+				strcasecmp (param, "file_pack_size") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			long number = value ? atol (value) : -1;
+			if (number < 0) {
+				fprintf (stderr, "Invalid value for %s\n", param);
+				ret = -1;
+			} else if (!strcasecmp (param, "cache_entries"))
+				server->cache_entries = number;
+			else if (!strcasecmp (param, "cache_max_file"))
+				server->cache_max_file = number;
+			else if (!strcasecmp (param, "file_pack_max_file"))
+				server->file_pack_max_file = number;
+			else if (!strcasecmp (param, "file_pack_size"))
+				server->file_pack_size = number;
+			else
+				server->cache_revalidate = number;
+		}
+		else if (!strcasecmp (param, "precompressed") ||
+				!strcasecmp (param, "compress") ||
+				!strcasecmp (param, "server_status") ||
+				!strcasecmp (param, "file_pack") ||
+				!strcasecmp (param, "io_uring") ||
+				!strcasecmp (param, "tls_tickets") ||
+				!strcasecmp (param, "ktls")) {
+			char *value = strtok (0, " \t\r\n");
+			int on = value == 0 ? -1 : !strcasecmp (value, "on") ? 1 :
+										!strcasecmp (value, "off") ? 0 : -1;
+			if (on == -1) {
+				fprintf (stderr, "%s must be on or off\n", param);
+				ret = -1;
+			} else if (!strcasecmp (param, "precompressed"))
+				server->precompressed = on;
+			else if (!strcasecmp (param, "compress"))
+				server->compress = on;
+			else if (!strcasecmp (param, "file_pack"))
+				server->file_pack = on;
+			else if (!strcasecmp (param, "io_uring"))
+				server->io_uring = on;
+			else if (!strcasecmp (param, "tls_tickets"))
+				server->tls_tickets = on;
+			else if (!strcasecmp (param, "ktls"))
+				server->ktls = on;
+			else
+				server->server_status = on;
+		}
+		else if (strcasecmp (param, "compress_min_size") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			server->compress_min_size = value ? atol (value) : -1;
+			if (server->compress_min_size < 0) {
+				fprintf (stderr, "Invalid value for %s\n", param);
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "compress_types") == 0) {
+			char *type;
+			server->compress_types [0] = 0;
+			while ((type = strtok (0, " \t\r\n")) != 0 && *type != '#')
+				if (strlen (server->compress_types) + strlen (type) + 2 >
+															VALUE_LEN) {
+					fprintf (stderr, "Too many compress_types\n");
+					ret = -1;
+					break;
+				} else {
+					strcat (server->compress_types, " ");
+					strcat (server->compress_types, type);
+				}
+		}
+		else if (strcasecmp (param, "cgi_pool") == 0) {
+			char *path = strtok (0, " \t\r\n");
+			char *size = strtok (0, " \t\r\n");
+			struct cgi_pool_conf *pool =
+						server->cgi_pools + server->num_cgi_pools;
+			if (path != 0 && *path == '/')
+				path ++; // requests name it relative to the root
+			if (path == 0 || size == 0 || atoi (size) < 1 ||
+					strlen (path) >= VALUE_LEN) {
+				fprintf (stderr, "cgi_pool needs a script and a size\n");
+				ret = -1;
+			} else if (server->num_cgi_pools == MAX_CGI_POOLS) {
+				fprintf (stderr, "Too many cgi pools\n");
+				ret = -1;
+			} else {
+				strcpy (pool->path, path);
+				pool->size = atoi (size);
+				server->num_cgi_pools ++;
+			}
+		}
+		else if (strcasecmp (param, "access_log") == 0) {
+			char *path = strtok (0, " \t\r\n");
+			if (absolute_path (server->access_log, path) == -1) {
+				fprintf (stderr, "Invalid access log file\n");
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "log_format") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			if (value != 0 && !strcasecmp (value, "combined"))
+				server->log_format = LOG_COMBINED;
+			else if (value != 0 && !strcasecmp (value, "common"))
+				server->log_format = LOG_COMMON;
+			else {
+				fprintf (stderr, "log_format must be combined or common\n");
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "log_overload") == 0) {
+			char *value = strtok (0, " \t\r\n");
+			server->log_overload = value ? atoi (value) : -1;
+			if (server->log_overload < 0) {
+				fprintf (stderr, "Invalid log_overload sampling\n");
+				ret = -1;
+			}
+		}
+		else if (strcasecmp (param, "workers") == 0) {
+			char *workers = strtok (0, " \t\r\n");
+			server->workers = workers ? atoi (workers) : -1;
+			if (server->workers < 0) {
+				fprintf (stderr, "Invalid number of workers\n");
+				ret = -1;
+			}
+		}
 		else if (!strcasecmp (param, "type")) {
 			char *type = strtok (0, " \t\r\n");
 			char *typeval = strtok (0, " \t\r\n");
 			if (type != 0 && typeval != 0) {
 				if (!strcmp (DEFAULT_CONTENTTYPE, type))
 					default_type_defined = 1;
-				set_return_type (type, typeval);
+				if (set_return_type (types, type, typeval) == -1) {
+					perror ("type");
+					ret = -1;
+				}
+			}
+		}
+		else if (!strcasecmp (param, "vhost")) {
+			char *root = strtok (0, " \t\r\n");
+			char *name = strtok (0, " \t\r\n");
+			struct vhost *host = root && name ? vhost_add (hosts, root) : 0;
+			if (host == 0) {
+				fprintf (stderr, "vhost needs a root and a name\n");
+				ret = -1;
+			}
+			for (; ret == 0 && name != 0 && *name != '#';
+					name = strtok (0, " \t\r\n"))
+				if (vhost_name (hosts, name, host) == -1) {
+					fprintf (stderr, "Cannot add vhost name %s\n", name);
+					ret = -1;
+				}
+		}
+		else if (!strcasecmp (param, "vhost_type")) {
+			char *name = strtok (0, " \t\r\n");
+			char *type = strtok (0, " \t\r\n");
+			char *typeval = strtok (0, " \t\r\n");
+			struct vhost *host = name ? vhost_lookup (hosts, name) : 0;
+			if (host == 0 || type == 0 || typeval == 0) {
+				fprintf (stderr, "vhost_type needs a vhost, a file type "
+								"and a content type\n");
+				ret = -1;
+			} else if (vhost_set_type (host, type, typeval) == -1) {
+				perror ("vhost_type");
+				ret = -1;
+			}
+		}
+		else if (!strcasecmp (param, "proxy")) {
+			char *prefix = strtok (0, " \t\r\n");
+			char *upstream = strtok (0, " \t\r\n");
+			if (prefix == 0 || *prefix != '/' || upstream == 0) {
+				fprintf (stderr, "proxy needs a path prefix and an "
+								"upstream\n");
+				ret = -1;
+			}
+			for (; ret == 0 && upstream != 0 && *upstream != '#';
+					upstream = strtok (0, " \t\r\n"))
+				if (proxy_add (proxies, prefix, upstream) == -1) {
+					fprintf (stderr, "Cannot proxy to %s\n", upstream);
+					ret = -1;
+				}
+		}
+		else if (!strcasecmp (param, "rate_limit")) {
+			char *prefix = strtok (0, " \t\r\n");
+			char *rate = strtok (0, " \t\r\n");
+			char *burst = strtok (0, " \t\r\n");
+			char *scope = strtok (0, " \t\r\n");
+			double per_second = rate ? atof (rate) : 0;
+			int all = scope != 0 && !strcasecmp (scope, "all");
+			if (prefix == 0 || *prefix != '/' || per_second <= 0 ||
+					burst == 0 || atoi (burst) < 1 ||
+					(scope != 0 && !all && *scope != '#')) {
+				fprintf (stderr, "rate_limit needs a path prefix, requests "
+								"a second and a burst, then \"all\" if "
+								"shared by all clients\n");
+				ret = -1;
+			} else if (ratelimit_add (limits, prefix, per_second,
+										atoi (burst), all) == -1) {
+				perror ("rate_limit");
+				ret = -1;
+			}
+		}
+		else if (!strcasecmp (param, "mime_types")) {
+			char *file = strtok (0, " \t\r\n");
+			if (file == 0 || mime_load_file (types, file) == -1) {
+				fprintf (stderr, "Cannot load mime types from %s\n",
+								file ? file : "");
+				ret = -1;
 			}
 		} else {
 			fprintf (stderr, "Unknown config parameter %s\n", param);
-			exit (1);
+			ret = -1;
 		}
 	}
 	fclose (fp);
-	if (!default_type_defined) {
+	if (ret == 0 && !default_type_defined) {
 		fprintf (stderr, "Default content type not defined\n");
-		exit (1);
+		ret = -1;
+	}
+	return (ret);
+}
+
+/**
+ * header_timed_out: SIGALRM in a responder: the request header has taken
+ * longer than the header timeout to come in, and the connection is given up
+ */
+static void header_timed_out (int sig) {
+	stats_count (STAT_TIMEOUT_HEADER, 1);
+	stats_count (STAT_ACTIVE, -1);
+	_exit (0);
+}
+
+/**
+ * set_timeout: the longest a single read (or write) on the socket may wait
+ */
+static void set_timeout (int fd, int option, int seconds) {
+	struct timeval tv = {seconds, 0};
+	setsockopt (fd, SOL_SOCKET, option, &tv, sizeof (tv));
+}
+
+/**
+ * accept_tls: the responder's side of the TLS handshake, which has the
+ * header timeout to be done in, like a request header
+ * returns: the descriptor to serve the connection on (see tls_serve), or
+ * -1 if the handshake failed
+ */
+static int accept_tls (int fd, char *client, struct server *config) {
+	struct tls_session *session = tls_open (fd);
+
+	set_timeout (fd, SO_RCVTIMEO, config->header_timeout);
+	alarm (config->header_timeout);
+	if (session == 0 || tls_handshake (session) != 1) {
+		tls_close (session);
+		return (-1);
 	}
+	alarm (0);
+	return (tls_serve (session, client));
 }
 
 /**
- * respond: forks an executor which reads the request from the incoming socket,
- * calls the processing function, flushes the writing end of the socket and
- * exits. Does not wait for the child process to finish; the collection of
- * zombies is handled by catching SIGCHLD.
+ * respond: forks an executor which reads requests from the incoming socket,
+ * calls the processing function for each, flushes the writing end of the
+ * socket and exits when the connection is not to be kept open any longer
+ * (the client or the response said so, it has been idle for too long, or
+ * served its maximum number of requests). Pipelined requests simply wait in
+ * the input stream until their turn. A request header has to be in within
+ * the header timeout from its first byte (from the connection, for the
+ * first one), which an alarm enforces however slowly the bytes trickle in;
+ * the body and the response may stall for the body and send timeouts on
+ * each read and write. A connection to the HTTPS port has its TLS
+ * handshake done first, and is then served on what that leaves.
+ * Does not wait for the child process
+ * to finish; the collection of zombies is handled by catching SIGCHLD.
+ * returns: the pid of the child, -1 if the fork failed
  */
-void respond (int fd) {
+pid_t respond (int fd, int tls, struct server *config) {
 
-	FILE *in_out;
+	FILE *in, *out;
 	char request[MAX_RQ_LEN];
+	char client[INET6_ADDRSTRLEN] = "";
+	struct request ctx;
+	int served, c;
+	long sent = 0;
+	sigset_t none;
+	pid_t pid;
 
-	switch (fork ()) {
+	switch (pid = fork ()) {
 		case 0: // child
-			in_out = fdopen (fd, "r+");
-			if (in_out == 0)
-				exit (1);
-			if (read_request (in_out, request, MAX_RQ_LEN) < 0)
+			sigemptyset (&none); // the server blocks SIGCHLD around the fork
+			sigprocmask (SIG_SETMASK, &none, 0);
+			signal (SIGALRM, header_timed_out);
+			stats_count (STAT_CONNECTIONS, 1);
+			stats_count (STAT_ACTIVE, 1);
+			if (tls && (fd = accept_tls (fd, client, config)) == -1) {
+				stats_count (STAT_ACTIVE, -1);
+				exit (0);
+			}
+			in = fdopen (fd, "r"); // separate streams, so that reading
+			out = fdopen (dup (fd), "w"); // never disturbs the writing
+			if (in == 0 || out == 0)
 				exit (1);
+			set_timeout (fd, SO_SNDTIMEO, config->send_timeout);
 
-			process_request (request, in_out);
-			fflush (in_out);
+			for (served = 0; served < config->keepalive_requests; served ++) {
+				if (served > 0) { // waiting for the first byte of the next
+					set_timeout (fd, SO_RCVTIMEO, config->keepalive_timeout);
+					errno = 0;
+					if ((c = getc (in)) == EOF) {
+						if (errno == EAGAIN)
+							stats_count (STAT_TIMEOUT_IDLE, 1);
+						break; // closed by the client, or idle for too long
+					}
+					ungetc (c, in);
+				}
+				set_timeout (fd, SO_RCVTIMEO, config->header_timeout);
+				alarm (config->header_timeout);
+				init_request (&ctx, fd, 0);
+				ctx.in = in;
+				ctx.client = client [0] ? client : 0;
+				errno = 0;
+				c = read_request (in, request, MAX_RQ_LEN, &ctx);
+				alarm (0);
+				if (c < 0) {
+					if (errno == EAGAIN)
+						stats_count (STAT_TIMEOUT_HEADER, 1);
+					break; // closed by the client, or too slow
+				}
+				set_timeout (fd, SO_RCVTIMEO, config->body_timeout);
+				if (config->keepalive_timeout == 0 ||
+						served + 1 == config->keepalive_requests)
+					ctx.keep_alive = 0;
+				struct timespec started = ctx.clock;
+				stats_phase (PHASE_PARSE, &ctx.clock);
+
+				process_request (out, &ctx);
+				errno = 0;
+				if (fflush (out) == EOF && errno == EAGAIN)
+					stats_count (STAT_TIMEOUT_SEND, 1);
+				stats_phase (PHASE_SEND, &ctx.clock);
+				stats_phase (PHASE_TOTAL, &started);
+				stats_socket_sent (fd, &sent);
+				access_log_flush ();
+				if (!ctx.keep_alive)
+					break;
+				errno = 0;
+				if (discard_body (in, ctx.content_length) == -1) {
+					if (errno == EAGAIN)
+						stats_count (STAT_TIMEOUT_BODY, 1);
+					break;
+				}
+			}
+			stats_count (STAT_ACTIVE, -1);
 			exit (0);
 		break;
 
@@ -197,48 +654,278 @@ void respond (int fd) {
 			// not waiting - handle_sigchld will pick up exited children
 		break;
 	}
+	return (pid);
 }
 
 /**
  * handle_sigchld: a handler for the SIGCHLD signal, waiting on it to finish
+ * and releasing the connection the child served from the limits.
  * Does not need to be surrounded by errno saving/resetting brackets, because
  * SA_RESTART does not allow an intervening system call to reset it.
  */
 void handle_sigchld (int sig) {
-	while (waitpid (-1, 0, WNOHANG) > 0) {
+	pid_t pid;
+
+	while ((pid = waitpid (-1, 0, WNOHANG)) > 0)
+		admission_reaped (pid);
+}
+
+/**
+ * handle_sighup: outside the worker mode, where the master reloads the
+ * configuration in place, SIGHUP has the server hand over to a successor
+ * that reads the file afresh (see reload.h); the access log is reopened,
+ * should that fail
+ */
+void handle_sighup (int sig) {
+	access_log_rotate ();
+	reload_server = 1;
+}
+
+/**
+ * handle_upgrade: a handler for SIGUSR2 in a server outside the worker
+ * mode: the same hand-over, for a new binary
+ */
+void handle_upgrade (int sig) {
+	reload_server = 1;
+}
+
+volatile sig_atomic_t stop_serving = 0;
+volatile sig_atomic_t repack_files = 0;
+volatile sig_atomic_t reload_server = 0;
+
+/**
+ * handle_stop: a handler for SIGTERM in the serving processes; the accept
+ * loops notice the flag and stop taking new connections
+ */
+void handle_stop (int sig) {
+	stop_serving = 1;
+}
+
+/**
+ * handle_repack: a handler for SIGUSR1 in the serving processes; the
+ * accept loops notice the flag and rebuild the file pack
+ */
+void handle_repack (int sig) {
+	repack_files = 1;
+}
+
+#define STOP_CHECK_MS 1000
+
+/**
+ * fork_responder: accepts a connection on the listening socket and forks
+ * its responder, if it is within the limits. SIGCHLD is held off from the
+ * count until the child is
+ * tracked, so that a child quick to exit is not reaped before it is known.
+ * returns: -1 if there was nothing to accept (errno tells why), else 0
+ */
+static int fork_responder (struct server *config, int listen_fd) {
+	sigset_t chld, old;
+	int sock_fd, slot;
+
+	sigemptyset (&chld);
+	sigaddset (&chld, SIGCHLD);
+	sigprocmask (SIG_BLOCK, &chld, &old);
+	if ((sock_fd = admission_accept (listen_fd, 0)) >= 0 &&
+			(slot = admission_admit (sock_fd)) >= 0) {
+		admission_track (respond (sock_fd, listen_fd == config->tls_socket,
+									config), slot);
+		close (sock_fd);
 	}
+	sigprocmask (SIG_SETMASK, &old, 0);
+	return (sock_fd >= 0 || errno == ECONNABORTED ? 0 : -1);
 }
 
 /**
- * setup: reads the configuration from the supplied file name and
- * initializes the pointer to the struct server general options. Also
- * sets up the zombie child process reaping.
+ * serve_forking: the fork-per-connection accept loop, on the listening
+ * socket and the HTTPS one, if there is one. Runs until asked to
+ * stop, or until a successor has taken over on SIGHUP, then answers
+ * whatever is still queued on the listening sockets.
+ * They are non-blocking, so the poll/accept pair can be
+ * interrupted for the stop check without ever hanging in accept.
  */
-void setup (char *configfile, struct server *config) {
-	setup_content_types (); // initialize content type mappings
+void serve_forking (struct server *config) {
+	struct pollfd pfd [2] = {{config->socket, POLLIN, 0},
+							{config->tls_socket, POLLIN, 0}};
+	int idx;
 
-	process_config_file (configfile, config);
+	for (idx = 0; idx < 2; idx ++)
+		if (pfd [idx].fd != -1)
+			fcntl (pfd [idx].fd, F_SETFL,
+					fcntl (pfd [idx].fd, F_GETFL) | O_NONBLOCK);
+	if (admission_init (config) == -1) {
+		perror ("connection limits");
+		exit (1);
+	}
+	if (cgi_pools_start (config) == -1)
+		exit (1);
 
-	strcpy (config->host, full_hostname ()); // full localhost name
+	while (!stop_serving) {
+		cgi_pools_check ();
+		if (repack_files) {
+			repack_files = 0;
+			pack_build (config);
+		}
+		if (reload_server) {
+			reload_server = 0;
+			if (reload_start (config) == 0) {
+				stop_serving = 1; // the successor takes the new ones
+				continue;
+			}
+		}
+		if (poll (pfd, 2, STOP_CHECK_MS) <= 0)
+			continue; // timeout, or interrupted by a signal
+		for (idx = 0; idx < 2; idx ++)
+			if ((pfd [idx].revents & POLLIN) &&
+					fork_responder (config, pfd [idx].fd) == -1 &&
+					errno != EAGAIN && errno != EINTR)
+				perror ("accept");
+	}
 
-	if (chdir (config->root) == -1) {
+	for (idx = 0; idx < 2; idx ++)
+		if (pfd [idx].fd != -1) {
+			while (fork_responder (config, pfd [idx].fd) == 0) {
+			}
+			close (pfd [idx].fd);
+		}
+	cgi_pools_stop ();
+}
+
+/**
+ * check_vhost_roots: every virtual host's root (relative ones are taken
+ * from the server root, which is not changed into yet) has to be a
+ * directory
+ * returns: 0 if they all are, -1 otherwise
+ */
+static int check_vhost_roots (struct vhost_table *hosts, char *root) {
+	char path [PATH_MAX];
+	struct vhost *host;
+	struct stat info;
+
+	for (host = hosts->hosts; host != 0; host = host->next)
+		if (snprintf (path, PATH_MAX, "%s%s%s", host->root [0] == '/' ? "" :
+						root, host->root [0] == '/' ? "" : "/",
+						host->root) >= PATH_MAX ||
+				stat (path, &info) == -1 || !S_ISDIR (info.st_mode)) {
+			fprintf (stderr, "vhost root %s is not a directory\n",
+							host->root);
+			return (-1);
+		}
+	return (0);
+}
+
+/**
+ * load_config: builds new tables of content type mappings, virtual hosts,
+ * proxy routes and rate limits and reads the configuration from the
+ * supplied file into them and the server structure, resolves the server
+ * root (a relative one from the directory the server was started from),
+ * makes the TLS context, if there is an HTTPS port, and readies the proxy
+ * table. Only if all of this, and the change into the root, succeeds do
+ * the new tables replace the ones in effect, so that a bad file does not
+ * disturb a running server. The caller's own check (if not NULL) vets the
+ * settings as soon as they are read, before any of this.
+ * returns: 0 on success, -1 on failure
+ */
+int load_config (char *configfile, struct server *config,
+					int (*check) (struct server *)) {
+	struct mime_table *types = setup_content_types (); // initialize content
+	struct vhost_table *hosts = vhost_new ();			// type mappings
+	struct proxy_table *proxies = proxy_new ();
+	struct rate_table *limits = ratelimit_new ();
+	struct tls_context *tls = 0;
+	if (types == 0 || hosts == 0 || proxies == 0 || limits == 0) {
+		perror ("content types");
+		mime_free (types);
+		vhost_free (hosts);
+		proxy_free (proxies);
+		ratelimit_free (limits);
+		return (-1);
+	}
+
+	char path [VALUE_LEN], root [PATH_MAX];
+	int ret = process_config_file (configfile, config, types, hosts,
+									proxies, limits);
+	if (ret == 0 && check != 0)
+		ret = check (config);
+	if (ret == 0 && (config->root [0] == '\0' ||
+			absolute_path (path, config->root) == -1 ||
+			realpath (path, root) == 0 || strlen (root) >= VALUE_LEN)) {
+		perror ("cannot find rootdir");
+		ret = -1;
+	}
+	if (ret == 0)
+		ret = check_vhost_roots (hosts, root);
+	if (ret == 0 && config->tls_port > 0 && (tls = tls_new (config)) == 0)
+		ret = -1;
+	if (ret == 0)
+		ret = proxy_prepare (proxies, config);
+	if (ret == 0 && chdir (root) == -1) {
 		perror ("cannot change to rootdir");
-		exit (1);
+		ret = -1;
+	}
+	if (ret == -1) {
+		mime_free (types);
+		vhost_free (hosts);
+		proxy_free (proxies);
+		ratelimit_free (limits);
+		tls_free (tls);
+		return (-1);
 	}
+	strcpy (config->root, root);
+	proxy_install (proxies);
+	tls_install (tls);
+	ratelimit_install (limits);
+	mime_free (content_types);
+	content_types = types;
+	vhost_free (vhosts);
+	vhosts = hosts;
+	compress_setup (config->precompressed, config->compress,
+					config->compress_min_size, config->compress_types);
+	stats_setup (config->server_status);
+	access_log_setup (config->log_format, config->log_overload);
+	pack_build (config); // a pack that cannot be built is only reported
 
-	config->socket = make_server_socket (config->port);
-	if (config->socket == -1) {
-		perror ("socket");
+	strcpy (config->host, full_hostname ()); // full localhost name
+	return (0);
+}
+
+/**
+ * setup: reads the configuration from the supplied file name and
+ * initializes the pointer to the struct server general options. Also
+ * sets up the zombie child process reaping, and opens the listening
+ * sockets (the HTTPS one too, if there is a port for it), or takes them
+ * over from the server this one replaces. With workers configured, the
+ * listening sockets are left to the workers.
+ */
+void setup (char *configfile, struct server *config) {
+	if (load_config (configfile, config, 0) == -1)
 		exit (1);
-	}
 
 	struct sigaction sa;
+	sigemptyset (&sa.sa_mask);
 	sa.sa_handler = &handle_sigchld;
 	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;  // to prevent race conditions
 	if (sigaction (SIGCHLD, &sa, 0) == -1) {
 		perror ("sigaction");
 		exit (1);
 	}
+
+	if (config->workers > 0)
+		return;
+
+	config->socket = reload_socket (config->port, config->listen_backlog);
+	if (config->socket == -1)
+		config->socket = make_server_socket (config->port,
+										config->listen_backlog);
+	if (config->socket != -1 && config->tls_port > 0 &&
+			(config->tls_socket = reload_socket (config->tls_port,
+										config->listen_backlog)) == -1)
+		config->tls_socket = make_server_socket (config->tls_port,
+										config->listen_backlog);
+	if (config->socket == -1 || (config->tls_port > 0 &&
+									config->tls_socket == -1)) {
+		perror ("socket");
+		exit (1);
+	}
 }
 
 /**
@@ -283,27 +970,79 @@ int parse_options (char **config_file, int argc, char * argv[]) {
 	return (return_code);
 }
 
+/**
+ * default_config: the settings in effect for anything the config file
+ * does not mention
+ */
+void default_config (struct server *config) {
+	*config = (struct server) {PORTNUM, "localhost", -1, SERVER_ROOT,
+					MODE_FORK, 0, KEEPALIVE_TIMEOUT, KEEPALIVE_REQUESTS,
+					CACHE_ENTRIES, CACHE_MAX_FILE, CACHE_REVALIDATE,
+					0, 0, COMPRESS_MIN_SIZE, COMPRESS_TYPES};
+	config->header_timeout = HEADER_TIMEOUT;
+	config->body_timeout = BODY_TIMEOUT;
+	config->send_timeout = SEND_TIMEOUT;
+	config->proxy_pool = PROXY_POOL;
+	config->proxy_timeout = PROXY_TIMEOUT;
+	config->proxy_check_interval = PROXY_CHECK_INTERVAL;
+	config->cgi_timeout = CGI_TIMEOUT;
+	config->tls_socket = -1;
+	config->tls_tickets = 1;
+	config->tls_session_cache = TLS_SESSION_CACHE;
+	config->ktls = 1;
+	config->listen_backlog = LISTEN_BACKLOG;
+	config->max_connections = MAX_CONNECTIONS;
+	config->retry_after = RETRY_AFTER;
+	config->file_pack_max_file = FILE_PACK_MAX_FILE;
+	config->file_pack_size = FILE_PACK_SIZE;
+}
+
 /**
  * main: reads a config file, prints out info message, then loops indefinitely
- * on the socket, processing the messages
+ * on the socket, processing the messages - either forking a responder per
+ * connection, or handing the socket over to the event loop. With workers
+ * configured, this process only supervises the workers doing either.
  */
 int main (int argc, char *argv[]) {
-	struct server ws_config = {PORTNUM, "localhost", -1, "."};
+	struct server ws_config;
 	char *config_file;
 
+	default_config (&ws_config);
 	if (parse_options (&config_file, argc, argv))
 		exit (1);
+	if (stats_init () == -1)
+		perror ("statistics");
+	char config_path [PATH_MAX]; // setup leaves us in the server root,
+	if (realpath (config_file, config_path) != 0) // but reloads need the file
+		config_file = config_path;
+	reload_init (argv [0], config_file);
 
 	setup (config_file, &ws_config);
+	if (access_log_start (&ws_config) == -1)
+		exit (1);
 
 	fprintf (stdout, "Server %s started on host %s, port %d\n",
 					argv [0], ws_config.host, ws_config.port);
+	fflush (stdout); // or every child would repeat the banner on exit
 
-	for (;;) {
-		int sock_fd = accept (ws_config.socket, NULL, NULL);
-		sock_fd >= 0 ? respond (sock_fd) : perror ("accept");
-		close (sock_fd);
-	}
+	if (ws_config.workers > 0)
+		exit (supervise_workers (config_file, &ws_config));
+
+	struct sigaction sa;
+	sigemptyset (&sa.sa_mask);
+	sa.sa_handler = &handle_sighup;
+	sa.sa_flags = SA_RESTART;
+	sigaction (SIGHUP, &sa, 0);
+	sa.sa_handler = &handle_repack;
+	sigaction (SIGUSR1, &sa, 0);
+	sa.sa_handler = &handle_upgrade;
+	sigaction (SIGUSR2, &sa, 0);
+	reload_ready ();
+	if (ws_config.mode == MODE_EVENT)
+		exit (event_loop (&ws_config));
+
+	serve_forking (&ws_config);
+	exit (0);
 }
 
 
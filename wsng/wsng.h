@@ -0,0 +1,97 @@
+/*
+ * wsng.h
+ *
+ *  Server-wide configuration shared between the main loop and the
+ *  connection drivers
+ */
+
+#ifndef WSNG_H_
+#define WSNG_H_
+
+#include <signal.h>
+#include <sys/types.h>
+
+#define	VALUE_LEN	512
+
+/*
+ * how accepted connections are served: a forked child per connection,
+ * or a single process multiplexing all of them through epoll
+ */
+enum serve_mode {
+	MODE_FORK,
+	MODE_EVENT
+};
+
+#define	MAX_CGI_POOLS	16
+
+/*
+ * a script served by a pool of persistent workers
+ */
+struct cgi_pool_conf {
+	char path [VALUE_LEN];	/* as requests name it, relative to the root */
+	int size;				/* number of worker processes */
+};
+
+struct server {
+	int port;
+	char host [VALUE_LEN];
+	int socket;
+	char root [VALUE_LEN];
+	enum serve_mode mode;
+	int workers;	/* 0: serve from this process, N: from N workers */
+	int keepalive_timeout;	/* seconds an idle connection is kept open */
+	int keepalive_requests;	/* most requests served on one connection */
+	int cache_entries;		/* size of the event loop's file cache, 0: off */
+	long cache_max_file;	/* largest file whose body is cached */
+	int cache_revalidate;	/* seconds before an unwatched entry is rechecked */
+	int precompressed;		/* send .br/.gz siblings to clients taking them */
+	int compress;			/* gzip generated bodies (listings) on the fly */
+	long compress_min_size;	/* shortest body compressed on the fly */
+	char compress_types [VALUE_LEN];	/* content types compressed on the fly */
+	struct cgi_pool_conf cgi_pools [MAX_CGI_POOLS];
+	int num_cgi_pools;
+	int cgi_timeout;		/* seconds a pooled cgi may take; 0: no limit */
+	int server_status;		/* answer /server-status with the statistics */
+	char access_log [VALUE_LEN];	/* the file, "" for no access log */
+	int log_format;			/* enum log_format */
+	int log_overload;		/* log every n-th request while the logger lags */
+	int listen_backlog;		/* connections the kernel queues for accept */
+	int max_connections;	/* open at once, per serving process */
+	int max_connections_per_ip;	/* of those from one address, 0: no limit */
+	int retry_after;		/* seconds, in the 503 of a shed connection */
+	int file_pack;			/* serve small files from a packed mapping */
+	long file_pack_max_file;	/* largest file packed */
+	long file_pack_size;	/* most bytes packed in all */
+	int io_uring;			/* the event loop runs on io_uring, if it can */
+	int header_timeout;		/* seconds a request header may take to come, */
+	int body_timeout;		/* a request body may stall, */
+	int send_timeout;		/* and a response may stall; 0: no limit */
+	int proxy_pool;			/* idle connections kept for each upstream */
+	int proxy_timeout;		/* seconds an upstream may take; 0: no limit */
+	int proxy_check_interval;	/* seconds between health checks, 0: none */
+	char proxy_check_path [VALUE_LEN];	/* they request, "": connect only */
+	int tls_port;			/* for HTTPS, 0: none */
+	int tls_socket;			/* listening on it, or -1 */
+	char tls_certificate [VALUE_LEN];	/* PEM file of the certificate chain */
+	char tls_key [VALUE_LEN];	/* and of its key, "": in the same file */
+	int tls_tickets;		/* resume sessions by tickets */
+	int tls_session_cache;	/* sessions kept for resumption by id, 0: none */
+	int ktls;				/* have the kernel encrypt, if it can */
+};
+
+extern volatile sig_atomic_t stop_serving; // set by SIGTERM in the servers
+extern volatile sig_atomic_t repack_files; // set by SIGUSR1
+extern volatile sig_atomic_t reload_server; // set by SIGHUP and SIGUSR2
+
+void handle_sigchld (int sig);
+void handle_stop (int sig);
+void handle_sighup (int sig);
+void handle_upgrade (int sig);
+void handle_repack (int sig);
+void default_config (struct server *config);
+int load_config (char *configfile, struct server *config,
+					int (*check) (struct server *));
+void serve_forking (struct server *config);
+pid_t respond (int fd, int tls, struct server *config);
+
+#endif /* WSNG_H_ */